@@ -0,0 +1,28 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(location = 0) out vec4 outColor;
+
+layout(location = 0) in vec3 color;
+layout(location = 1) in vec2 uv;
+layout(location = 2) in vec4 lightSpacePos;
+layout(location = 3) flat in uint textureIndex;
+
+layout(set = 2, binding = 0) uniform sampler2D shadowMap;
+layout(set = 4, binding = 0) uniform sampler2D textures[];
+
+void main()
+{
+	vec3 projCoords = lightSpacePos.xyz / lightSpacePos.w;
+	projCoords.xy = projCoords.xy * 0.5 + 0.5;
+	projCoords.y = 1.0 - projCoords.y;		// Flip the y because Vulkan is top left instead of bottom left like OpenGL
+	float closestDepth = texture(shadowMap, projCoords.xy).r;
+	float currentDepth = projCoords.z;
+	float shadow = currentDepth - 0.005 > closestDepth  ? 0.05 : 1.0;		// 0.05 to not make black shadows
+	
+	if (projCoords.z > 1.0)
+		shadow = 1.0;
+
+	// Instances of one draw can use different textures
+    outColor = texture(textures[nonuniformEXT(textureIndex)], uv) * shadow;
+}
\ No newline at end of file
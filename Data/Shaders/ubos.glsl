@@ -10,9 +10,16 @@ layout(std140, set = 0, binding = 0) uniform ViewUniforms
 	vec2 nearFarPlane;
 };
 
+// Local to world matrix of every transform, at the transform index
 layout(std140, set = 1, binding = 0) readonly buffer InstanceDataBuffer
 {
-	mat4 instanceData[];
+	mat4 transforms[];
+};
+
+// Indices of every instance. x - transform index, y - bindless texture index
+layout(std430, set = 1, binding = 3) readonly buffer InstanceIndicesBuffer
+{
+	uvec2 instanceIndices[];
 };
 
 layout(std140, set = 1, binding = 1) uniform FrameUniforms
@@ -1,4 +1,9 @@
 mat4 GetModelMatrix(uint startIndex)
 {
-	return instanceData[startIndex + gl_InstanceIndex];
+	return transforms[instanceIndices[startIndex + gl_InstanceIndex].x];
+}
+
+uint GetInstanceTexture(uint startIndex)
+{
+	return instanceIndices[startIndex + gl_InstanceIndex].y;
 }
\ No newline at end of file
@@ -2,32 +2,219 @@
 
 #include "Log.h"
 
+#include <cstdlib>
+#include <cstring>
+
+// Every allocation is aligned to this, which is enough for the SSE types and glm matrices
+static const unsigned int ALLOCATION_ALIGNMENT = 16;
+
+static unsigned int AlignUp(unsigned int value, unsigned int alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void* AlignedMalloc(size_t size)
+{
+#ifdef _MSC_VER
+	return _aligned_malloc(size, ALLOCATION_ALIGNMENT);
+#else
+	return aligned_alloc(ALLOCATION_ALIGNMENT, AlignUp(static_cast<unsigned int>(size), ALLOCATION_ALIGNMENT));
+#endif
+}
+
+static void AlignedFree(void* ptr)
+{
+#ifdef _MSC_VER
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+static const char* memoryTagNames[] = {
+	"General",
+	"Transforms",
+	"Particles",
+	"Rendering"
+};
+
 Allocator::Allocator()
 {
-	usedMemory = 0;
-	numAllocations = 0;
+	memset(stats, 0, sizeof(stats));
 }
 
 Allocator::~Allocator()
 {
 }
 
-void* Allocator::Allocate(unsigned int size)
+void Allocator::TrackAllocation(MemoryTag tag, size_t size)
 {
-	usedMemory += size;
-	numAllocations++;
-	return malloc(size);
+	MemoryStats& s = stats[static_cast<size_t>(tag)];
+	s.liveBytes += size;
+	s.numAllocations++;
+
+	if (s.liveBytes > s.peakBytes)
+		s.peakBytes = s.liveBytes;
 }
 
-void Allocator::Free(void* ptr)
+void Allocator::TrackFree(MemoryTag tag, size_t size)
 {
-	//used
-	numAllocations++;
-	free(ptr);
+	MemoryStats& s = stats[static_cast<size_t>(tag)];
+	s.liveBytes -= size;
+	s.numFrees++;
 }
 
 void Allocator::PrintStats()
 {
-	Log::Print(LogLevel::LEVEL_INFO, "\nTotal allocated memory: %.2f mib\n", (float)usedMemory / 1024.0f / 1024.0f);
-	Log::Print(LogLevel::LEVEL_INFO, "Num allocations: %u\n\n", numAllocations);
+	Log::Print(LogLevel::LEVEL_INFO, "\n");
+
+	for (size_t i = 0; i < static_cast<size_t>(MemoryTag::COUNT); i++)
+	{
+		const MemoryStats& s = stats[i];
+
+		if (s.numAllocations == 0)
+			continue;
+
+		Log::Print(LogLevel::LEVEL_INFO, "%s: live %.2f mib, peak %.2f mib, allocations %u, frees %u\n", memoryTagNames[i], (float)s.liveBytes / 1024.0f / 1024.0f, (float)s.peakBytes / 1024.0f / 1024.0f, s.numAllocations, s.numFrees);
+	}
+
+	Log::Print(LogLevel::LEVEL_INFO, "\n");
+}
+
+// Keeps the memory after the header aligned
+struct AllocationHeader
+{
+	unsigned int size;
+	MemoryTag tag;
+	unsigned char padding[ALLOCATION_ALIGNMENT - sizeof(unsigned int) - sizeof(MemoryTag)];
+};
+
+void* HeapAllocator::Allocate(unsigned int size, MemoryTag tag)
+{
+	AllocationHeader* header = static_cast<AllocationHeader*>(AlignedMalloc(sizeof(AllocationHeader) + size));
+	if (!header)
+	{
+		Log::Print(LogLevel::LEVEL_ERROR, "Failed to allocate %u bytes\n", size);
+		return nullptr;
+	}
+
+	header->size = size;
+	header->tag = tag;
+
+	TrackAllocation(tag, size);
+
+	return header + 1;
+}
+
+void HeapAllocator::Free(void* ptr)
+{
+	if (!ptr)
+		return;
+
+	AllocationHeader* header = static_cast<AllocationHeader*>(ptr) - 1;
+
+	TrackFree(header->tag, header->size);
+
+	AlignedFree(header);
+}
+
+LinearAllocator::LinearAllocator()
+{
+	buffer = nullptr;
+	capacity = 0;
+	offset = 0;
+	overflowBytes = 0;
+}
+
+LinearAllocator::~LinearAllocator()
+{
+	Dispose();
+}
+
+bool LinearAllocator::Init(unsigned int capacity)
+{
+	this->capacity = AlignUp(capacity, ALLOCATION_ALIGNMENT);
+	buffer = static_cast<unsigned char*>(AlignedMalloc(this->capacity));
+
+	if (!buffer)
+	{
+		Log::Print(LogLevel::LEVEL_ERROR, "Failed to allocate linear allocator buffer\n");
+		return false;
+	}
+
+	overflowBlocks.reserve(16);
+
+	return true;
+}
+
+void LinearAllocator::Dispose()
+{
+	if (buffer)
+		AlignedFree(buffer);
+
+	buffer = nullptr;
+	capacity = 0;
+
+	Reset();
+}
+
+void LinearAllocator::Reset()
+{
+	for (size_t i = 0; i < overflowBlocks.size(); i++)
+	{
+		AlignedFree(overflowBlocks[i]);
+	}
+	overflowBlocks.clear();
+
+	// Grow the buffer so the next frames fit without going to the heap
+	if (overflowBytes > 0 && buffer)
+	{
+		unsigned int newCapacity = AlignUp(capacity + overflowBytes + capacity / 2, ALLOCATION_ALIGNMENT);
+
+		Log::Print(LogLevel::LEVEL_INFO, "Linear allocator out of memory. Growing from %u to %u bytes\n", capacity, newCapacity);
+
+		AlignedFree(buffer);
+		buffer = static_cast<unsigned char*>(AlignedMalloc(newCapacity));
+		capacity = buffer ? newCapacity : 0;
+	}
+
+	// Everything is released at once
+	for (size_t i = 0; i < static_cast<size_t>(MemoryTag::COUNT); i++)
+	{
+		stats[i].numFrees = stats[i].numAllocations;
+		stats[i].liveBytes = 0;
+	}
+
+	offset = 0;
+	overflowBytes = 0;
+}
+
+void* LinearAllocator::Allocate(unsigned int size, MemoryTag tag)
+{
+	unsigned int alignedSize = AlignUp(size, ALLOCATION_ALIGNMENT);
+
+	if (offset + alignedSize <= capacity)
+	{
+		void* ptr = buffer + offset;
+		offset += alignedSize;
+		TrackAllocation(tag, alignedSize);
+		return ptr;
+	}
+
+	// The frame shouldn't need the heap, warn once per frame so the capacity passed to Init can be raised
+	if (overflowBytes == 0)
+		Log::Print(LogLevel::LEVEL_WARNING, "Linear allocator of %u bytes is full, %u bytes go to the heap this frame\n", capacity, alignedSize);
+
+	void* ptr = AlignedMalloc(alignedSize);
+	if (!ptr)
+	{
+		Log::Print(LogLevel::LEVEL_ERROR, "Failed to allocate %u bytes\n", size);
+		return nullptr;
+	}
+
+	overflowBlocks.push_back(ptr);
+	overflowBytes += alignedSize;
+	TrackAllocation(tag, alignedSize);
+
+	return ptr;
 }
@@ -1,17 +1,80 @@
 #pragma once
 
+#include <cstddef>
+#include <vector>
+
+// Used to see how much memory each part of the engine is using
+enum class MemoryTag
+{
+	GENERAL,
+	TRANSFORMS,
+	PARTICLES,
+	RENDERING,
+	COUNT
+};
+
+struct MemoryStats
+{
+	size_t liveBytes;
+	size_t peakBytes;
+	unsigned int numAllocations;
+	unsigned int numFrees;
+};
+
 class Allocator
 {
 public:
 	Allocator();
-	~Allocator();
+	virtual ~Allocator();
 
-	void* Allocate(unsigned int size);
-	void Free(void* ptr);
+	virtual void* Allocate(unsigned int size, MemoryTag tag = MemoryTag::GENERAL) = 0;
+	virtual void Free(void* ptr) = 0;
 
+	const MemoryStats& GetStats(MemoryTag tag) const { return stats[static_cast<size_t>(tag)]; }
 	void PrintStats();
 
+protected:
+	void TrackAllocation(MemoryTag tag, size_t size);
+	void TrackFree(MemoryTag tag, size_t size);
+
+protected:
+	MemoryStats stats[static_cast<size_t>(MemoryTag::COUNT)];
+};
+
+// General purpose allocator. Each allocation stores its size and tag in a small header so Free can update the stats
+class HeapAllocator : public Allocator
+{
+public:
+	void* Allocate(unsigned int size, MemoryTag tag = MemoryTag::GENERAL) override;
+	void Free(void* ptr) override;
+};
+
+// Allocations just bump an offset and are all released at once with Reset. Free does nothing
+// Used for data that only lives for one frame. If the buffer runs out the allocations go to the heap, with a warning, and the buffer is grown on the next Reset. Returns nullptr if the heap allocation fails
+class LinearAllocator : public Allocator
+{
+public:
+	LinearAllocator();
+	~LinearAllocator();
+
+	bool Init(unsigned int capacity);
+	void Dispose();
+	void Reset();
+
+	void* Allocate(unsigned int size, MemoryTag tag = MemoryTag::GENERAL) override;
+	void Free(void* ptr) override {}
+
+	// Helper to allocate an array of objects that don't need to be constructed
+	template<typename T>
+	T* AllocateArray(unsigned int count, MemoryTag tag = MemoryTag::GENERAL) { return static_cast<T*>(Allocate(count * sizeof(T), tag)); }
+
+	unsigned int GetCapacity() const { return capacity; }
+	unsigned int GetUsedBytes() const { return offset; }
+
 private:
-	unsigned int usedMemory;
-	unsigned int numAllocations;
+	unsigned char* buffer;
+	unsigned int capacity;
+	unsigned int offset;
+	unsigned int overflowBytes;
+	std::vector<void*> overflowBlocks;
 };
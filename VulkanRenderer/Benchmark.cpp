@@ -0,0 +1,503 @@
+#include "Benchmark.h"
+
+#include "TransformManager.h"
+#include "SparseSet.h"
+#include "ParticleData.h"
+#include "Frustum.h"
+#include "EntityManager.h"
+#include "Allocator.h"
+#include "JobSystem.h"
+#include "Log.h"
+
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+
+namespace
+{
+	const unsigned int THREAD_COUNTS[] = { 1, 2, 4, 8 };
+
+	double GetTimeMs()
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	}
+
+	// Roots, then the children of every root in chains of depth transforms
+	void BuildHierarchy(EntityManager& entityManager, TransformManager& transformManager, std::vector<Entity>& roots, unsigned int numTransforms, unsigned int depth)
+	{
+		std::vector<Entity> chain(depth);
+
+		for (unsigned int i = 0; i < numTransforms / depth; i++)
+		{
+			for (unsigned int d = 0; d < depth; d++)
+			{
+				chain[d] = entityManager.Create();
+				transformManager.AddTransform(chain[d]);
+			}
+
+			// Parent from the bottom so SetParent never finds a dirty parent and doesn't have to update the whole hierarchy
+			for (unsigned int d = depth - 1; d > 0; d--)
+			{
+				transformManager.SetParent(chain[d], chain[d - 1]);
+			}
+
+			for (unsigned int d = 1; d < depth; d++)
+			{
+				transformManager.SetLocalPosition(chain[d], glm::vec3(1.0f, 0.0f, 0.0f));
+			}
+
+			roots.push_back(chain[0]);
+		}
+
+		transformManager.UpdateWorldMatrices();
+		transformManager.ClearModifiedTransforms();
+	}
+
+	// Component the size of a transform
+	struct BenchComponent
+	{
+		glm::mat4 m;
+	};
+
+	// The map based path the managers used before the sparse sets: a packed vector and a map from entity id to index
+	class MapComponentArray
+	{
+	public:
+		void Add(Entity e, const BenchComponent& c)
+		{
+			if (map.find(e.id) != map.end())
+				return;
+
+			map[e.id] = static_cast<unsigned int>(components.size());
+			components.push_back(c);
+			entities.push_back(e);
+		}
+
+		void Remove(Entity e)
+		{
+			auto it = map.find(e.id);
+			if (it == map.end())
+				return;
+
+			unsigned int index = it->second;
+			components[index] = components.back();
+			entities[index] = entities.back();
+			map[entities[index].id] = index;
+
+			components.pop_back();
+			entities.pop_back();
+			map.erase(e.id);
+		}
+
+		BenchComponent& Get(Entity e) { return components[map.find(e.id)->second]; }
+		unsigned int GetSize() const { return static_cast<unsigned int>(components.size()); }
+		BenchComponent& operator[](unsigned int index) { return components[index]; }
+
+	private:
+		std::unordered_map<unsigned int, unsigned int> map;
+		std::vector<BenchComponent> components;
+		std::vector<Entity> entities;
+	};
+
+	struct ContainerTimes
+	{
+		double add;
+		double lookup;
+		double iterate;
+		double remove;
+		float checksum;		// Keeps the compiler from removing the loops
+	};
+
+	template<typename Container>
+	ContainerTimes TimeContainer(const std::vector<Entity>& entities, const std::vector<Entity>& lookupOrder)
+	{
+		ContainerTimes times = {};
+		Container container;
+		BenchComponent c = { glm::mat4(1.0f) };
+
+		double start = GetTimeMs();
+		for (size_t i = 0; i < entities.size(); i++)
+		{
+			container.Add(entities[i], c);
+		}
+		times.add = GetTimeMs() - start;
+
+		start = GetTimeMs();
+		for (size_t i = 0; i < lookupOrder.size(); i++)
+		{
+			times.checksum += container.Get(lookupOrder[i]).m[3][3];
+		}
+		times.lookup = GetTimeMs() - start;
+
+		start = GetTimeMs();
+		for (unsigned int i = 0; i < container.GetSize(); i++)
+		{
+			times.checksum += container[i].m[0][0];
+		}
+		times.iterate = GetTimeMs() - start;
+
+		// Half of the entities, in random order
+		start = GetTimeMs();
+		for (size_t i = 0; i < lookupOrder.size() / 2; i++)
+		{
+			container.Remove(lookupOrder[i]);
+		}
+		times.remove = GetTimeMs() - start;
+
+		return times;
+	}
+
+	// The particle layout before the SoA: every particle is updated, dead ones are found with a linear scan and the instances are pushed to a vector
+	class AoSParticles
+	{
+	public:
+		void Init(unsigned int maxParticles)
+		{
+			particles.resize(maxParticles);
+			lastUsedParticle = 0;
+		}
+
+		void Update(float dt, float lifeDecrease)
+		{
+			for (size_t i = 0; i < particles.size(); i++)
+			{
+				Particle& p = particles[i];
+				p.life -= lifeDecrease;
+
+				if (p.life > 0.0f)
+					p.pos += p.velocity * dt;
+			}
+		}
+
+		void Spawn(const glm::vec3& pos, const glm::vec3& velocity, float life, const glm::vec4& color)
+		{
+			Particle& p = particles[FirstUnusedParticle()];
+			p.pos = pos;
+			p.velocity = velocity;
+			p.life = life;
+			p.color = color;
+		}
+
+		const std::vector<ParticleInstanceData>& GetInstanceData()
+		{
+			instanceData.clear();
+
+			for (size_t i = 0; i < particles.size(); i++)
+			{
+				const Particle& p = particles[i];
+
+				if (p.life > 0.0f)
+					instanceData.push_back({ glm::vec4(p.pos, 0.0f), p.color });
+			}
+
+			return instanceData;
+		}
+
+	private:
+		unsigned int FirstUnusedParticle()
+		{
+			for (unsigned int i = lastUsedParticle; i < particles.size(); i++)
+			{
+				if (particles[i].life <= 0.0f)
+				{
+					lastUsedParticle = i;
+					return i;
+				}
+			}
+			for (unsigned int i = 0; i < lastUsedParticle; i++)
+			{
+				if (particles[i].life <= 0.0f)
+				{
+					lastUsedParticle = i;
+					return i;
+				}
+			}
+
+			lastUsedParticle = 0;
+			return 0;
+		}
+
+	private:
+		struct Particle
+		{
+			glm::vec3 pos;
+			float life;
+			glm::vec4 color;
+			glm::vec3 velocity;
+		};
+
+		std::vector<Particle> particles;
+		std::vector<ParticleInstanceData> instanceData;
+		unsigned int lastUsedParticle;
+	};
+
+	struct ParticleTimes
+	{
+		double update;
+		double spawn;
+		double instances;
+		unsigned int numInstances;
+	};
+}
+
+int Benchmark::Run(int argc, char* argv[])
+{
+	const char* name = argc > 0 ? argv[0] : nullptr;
+
+	if (!name || strcmp(name, "transforms") == 0)
+		TransformHierarchy();
+	if (!name || strcmp(name, "sparseset") == 0)
+		SparseSetVsMap();
+	if (!name || strcmp(name, "particles") == 0)
+		Particles();
+	if (!name || strcmp(name, "culling") == 0)
+		FrustumCulling();
+
+	return 0;
+}
+
+void Benchmark::TransformHierarchy()
+{
+	const unsigned int numTransforms = 256 * 1024;
+	const unsigned int numFrames = 30;
+
+	struct HierarchyDesc
+	{
+		const char* name;
+		unsigned int depth;
+	};
+
+	// Flat has a single level with every transform, deep has 16 levels
+	const HierarchyDesc hierarchies[] = { { "flat", 1 }, { "deep", 16 } };
+
+	for (const HierarchyDesc& h : hierarchies)
+	{
+		HeapAllocator allocator;
+		EntityManager entityManager;
+		TransformManager transformManager;
+		transformManager.Init(&allocator, numTransforms);
+
+		std::vector<Entity> roots;
+		BuildHierarchy(entityManager, transformManager, roots, numTransforms, h.depth);
+
+		for (unsigned int numThreads : THREAD_COUNTS)
+		{
+			// The thread that waits also runs jobs, so one thread less is enough
+			JobSystem jobSystem;
+			if (numThreads > 1)
+				jobSystem.Init(numThreads - 1);
+
+			JobSystem* js = numThreads > 1 ? &jobSystem : nullptr;
+			double totalMs = 0.0;
+
+			// The first frame is not timed
+			for (unsigned int f = 0; f <= numFrames; f++)
+			{
+				// Moving the roots makes every transform dirty
+				for (size_t i = 0; i < roots.size(); i++)
+				{
+					transformManager.SetLocalPosition(roots[i], glm::vec3(static_cast<float>(f), 0.0f, 0.0f));
+				}
+
+				double start = GetTimeMs();
+				transformManager.UpdateWorldMatrices(js);
+				double end = GetTimeMs();
+
+				transformManager.ClearModifiedTransforms();
+
+				if (f > 0)
+					totalMs += end - start;
+			}
+
+			jobSystem.Dispose();
+
+			Log::Print(LogLevel::LEVEL_INFO, "Transforms %s (%u transforms, depth %u), %u threads: %.3f ms\n", h.name, numTransforms, h.depth, numThreads, totalMs / numFrames);
+		}
+
+		transformManager.Dispose();
+	}
+}
+
+void Benchmark::SparseSetVsMap()
+{
+	const unsigned int entityCounts[] = { 10000, 100000, 1000000 };
+
+	for (unsigned int numEntities : entityCounts)
+	{
+		// Destroy every other entity first so the ids are sparse, like in a scene where entities come and go
+		EntityManager entityManager;
+		std::vector<Entity> entities;
+
+		for (unsigned int i = 0; i < numEntities * 2; i++)
+		{
+			Entity e = entityManager.Create();
+			if (i % 2 == 0)
+				entities.push_back(e);
+			else
+				entityManager.Destroy(e);
+		}
+
+		std::vector<Entity> lookupOrder = entities;
+		std::shuffle(lookupOrder.begin(), lookupOrder.end(), std::mt19937(1234));
+
+		ContainerTimes sparse = TimeContainer<ComponentArray<BenchComponent>>(entities, lookupOrder);
+		ContainerTimes map = TimeContainer<MapComponentArray>(entities, lookupOrder);
+
+		Log::Print(LogLevel::LEVEL_INFO, "Sparse set %u entities: add %.3f ms, lookup %.3f ms, iterate %.3f ms, remove half %.3f ms\n", numEntities, sparse.add, sparse.lookup, sparse.iterate, sparse.remove);
+		Log::Print(LogLevel::LEVEL_INFO, "Map        %u entities: add %.3f ms, lookup %.3f ms, iterate %.3f ms, remove half %.3f ms (checksums %.0f %.0f)\n", numEntities, map.add, map.lookup, map.iterate, map.remove, sparse.checksum, map.checksum);
+	}
+}
+
+void Benchmark::Particles()
+{
+	const unsigned int particleCounts[] = { 10000, 100000, 1000000 };
+	const unsigned int numFrames = 60;
+	const float dt = 1.0f / 60.0f;
+	const float startLifeTime = 1.0f;
+
+	std::mt19937 mt(1234);
+	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+	for (unsigned int numParticles : particleCounts)
+	{
+		// The instances go to a plain buffer the size of the system's slice of the mapped ring buffer
+		std::vector<ParticleInstanceData> instanceBuffer(numParticles);
+
+		ParticleData soa;
+		AoSParticles aos;
+		soa.Init(numParticles);
+		aos.Init(numParticles);
+
+		// Start full with random lives so about 1/60 of the particles die and are spawned again every frame
+		for (unsigned int i = 0; i < numParticles; i++)
+		{
+			glm::vec3 pos = glm::vec3(dist(mt), dist(mt), dist(mt));
+			float life = dist(mt) * startLifeTime;
+			soa.Spawn(pos, glm::vec3(0.0f, 1.0f, 0.0f), life, glm::vec4(1.0f));
+			aos.Spawn(pos, glm::vec3(0.0f, 1.0f, 0.0f), life, glm::vec4(1.0f));
+		}
+
+		ParticleTimes soaTimes = {};
+		ParticleTimes aosTimes = {};
+
+		for (unsigned int f = 0; f < numFrames; f++)
+		{
+			double start = GetTimeMs();
+			soa.Update(dt, dt / startLifeTime);
+			double end = GetTimeMs();
+			soaTimes.update += end - start;
+
+			unsigned int numDead = numParticles - soa.GetNumAlive();
+
+			start = GetTimeMs();
+			for (unsigned int i = 0; i < numDead; i++)
+			{
+				soa.Spawn(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), startLifeTime, glm::vec4(1.0f));
+			}
+			end = GetTimeMs();
+			soaTimes.spawn += end - start;
+
+			start = GetTimeMs();
+			soaTimes.numInstances = soa.WriteInstances(instanceBuffer.data());
+			end = GetTimeMs();
+			soaTimes.instances += end - start;
+
+			// The AoS path spawns the same number of particles so both do the same work
+			start = GetTimeMs();
+			aos.Update(dt, dt / startLifeTime);
+			end = GetTimeMs();
+			aosTimes.update += end - start;
+
+			start = GetTimeMs();
+			for (unsigned int i = 0; i < numDead; i++)
+			{
+				aos.Spawn(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), startLifeTime, glm::vec4(1.0f));
+			}
+			end = GetTimeMs();
+			aosTimes.spawn += end - start;
+
+			start = GetTimeMs();
+			const std::vector<ParticleInstanceData>& aosInstances = aos.GetInstanceData();
+			memcpy(instanceBuffer.data(), aosInstances.data(), aosInstances.size() * sizeof(ParticleInstanceData));
+			end = GetTimeMs();
+			aosTimes.instances += end - start;
+			aosTimes.numInstances = static_cast<unsigned int>(aosInstances.size());
+		}
+
+		Log::Print(LogLevel::LEVEL_INFO, "Particles SoA %u: update %.3f ms, spawn %.3f ms, instances %.3f ms (%u alive)\n", numParticles, soaTimes.update / numFrames, soaTimes.spawn / numFrames, soaTimes.instances / numFrames, soaTimes.numInstances);
+		Log::Print(LogLevel::LEVEL_INFO, "Particles AoS %u: update %.3f ms, spawn %.3f ms, instances %.3f ms (%u alive)\n", numParticles, aosTimes.update / numFrames, aosTimes.spawn / numFrames, aosTimes.instances / numFrames, aosTimes.numInstances);
+	}
+}
+
+void Benchmark::FrustumCulling()
+{
+	// Not a multiple of 4 so the scalar tail after the SSE loop is checked too
+	const unsigned int numBoxes = 1000003;
+	const unsigned int numFrames = 30;
+	const float worldSize = 1000.0f;
+
+	std::mt19937 mt(1234);
+	std::uniform_real_distribution<float> posDist(-worldSize, worldSize);
+	std::uniform_real_distribution<float> sizeDist(0.5f, 5.0f);
+
+	std::vector<float> minX(numBoxes), minY(numBoxes), minZ(numBoxes);
+	std::vector<float> maxX(numBoxes), maxY(numBoxes), maxZ(numBoxes);
+
+	for (unsigned int i = 0; i < numBoxes; i++)
+	{
+		minX[i] = posDist(mt);
+		minY[i] = posDist(mt) * 0.1f;
+		minZ[i] = posDist(mt);
+		maxX[i] = minX[i] + sizeDist(mt);
+		maxY[i] = minY[i] + sizeDist(mt);
+		maxZ[i] = minZ[i] + sizeDist(mt);
+	}
+
+	BoxBounds boxes = { minX.data(), minY.data(), minZ.data(), maxX.data(), maxY.data(), maxZ.data() };
+	std::vector<unsigned int> visibleIndices(numBoxes);
+	std::vector<unsigned int> expectedIndices(numBoxes);
+
+	Frustum frustum;
+	frustum.UpdateProjection(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+
+	double batchTime = 0.0;
+	double perBoxTime = 0.0;
+	unsigned int totalVisible = 0;
+	unsigned int numMismatches = 0;
+
+	for (unsigned int f = 0; f < numFrames; f++)
+	{
+		// Turn the camera a bit every frame like a player looking around
+		float angle = glm::radians(360.0f * f / numFrames);
+		glm::vec3 pos = glm::vec3(0.0f, 10.0f, 0.0f);
+		frustum.Update(pos, pos + glm::vec3(glm::cos(angle), -0.1f, glm::sin(angle)), glm::vec3(0.0f, 1.0f, 0.0f));
+
+		double start = GetTimeMs();
+		unsigned int numVisible = frustum.CullBoxes(boxes, numBoxes, visibleIndices.data());
+		double end = GetTimeMs();
+		batchTime += end - start;
+
+		// Per object test the batch culling replaced, also used as the scalar reference
+		start = GetTimeMs();
+		unsigned int numExpected = 0;
+		for (unsigned int i = 0; i < numBoxes; i++)
+		{
+			if (frustum.BoxInFrustum(glm::vec3(minX[i], minY[i], minZ[i]), glm::vec3(maxX[i], maxY[i], maxZ[i])) != FrustumIntersect::OUTSIDE)
+				expectedIndices[numExpected++] = i;
+		}
+		end = GetTimeMs();
+		perBoxTime += end - start;
+
+		totalVisible += numVisible;
+
+		if (numVisible != numExpected || memcmp(visibleIndices.data(), expectedIndices.data(), numVisible * sizeof(unsigned int)) != 0)
+			numMismatches++;
+	}
+
+	Log::Print(LogLevel::LEVEL_INFO, "Frustum culling %u boxes: CullBoxes %.3f ms, BoxInFrustum %.3f ms, %u visible on average\n", numBoxes, batchTime / numFrames, perBoxTime / numFrames, totalVisible / numFrames);
+
+	if (numMismatches > 0)
+		Log::Print(LogLevel::LEVEL_ERROR, "Frustum culling: CullBoxes and BoxInFrustum disagree in %u of %u frames\n", numMismatches, numFrames);
+}
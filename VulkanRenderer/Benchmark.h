@@ -0,0 +1,14 @@
+#pragma once
+
+// CPU benchmarks that don't need a window or a Vulkan device. Run with --bench [name], without a name every benchmark runs
+class Benchmark
+{
+public:
+	static int Run(int argc, char* argv[]);
+
+private:
+	static void TransformHierarchy();
+	static void SparseSetVsMap();
+	static void Particles();
+	static void FrustumCulling();
+};
@@ -11,20 +11,23 @@ ComputeMaterial::ComputeMaterial()
 
 bool ComputeMaterial::Create(VKRenderer* renderer, const std::string& computePath)
 {
-	VkDevice device = renderer->GetBase().GetDevice();
+	std::vector<VkDescriptorSetLayoutBinding> bindings(1);
+	bindings[0].binding = 0;
+	bindings[0].descriptorCount = 1;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	return Create(renderer, computePath, bindings, 0);
+}
 
-	VkDescriptorSetLayoutBinding computeSetLayoutBinding = {};
-	computeSetLayoutBinding.binding = 0;
-	computeSetLayoutBinding.descriptorCount = 1;
-	computeSetLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-	computeSetLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+bool ComputeMaterial::Create(VKRenderer* renderer, const std::string& computePath, const std::vector<VkDescriptorSetLayoutBinding>& bindings, unsigned int pushConstantsSize)
+{
+	VkDevice device = renderer->GetBase().GetDevice();
 
-	VkDescriptorSetLayoutCreateInfo computeSetLayoutInfo = {};
-	computeSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	computeSetLayoutInfo.bindingCount = 1;
-	computeSetLayoutInfo.pBindings = &computeSetLayoutBinding;
+	// Shared with the other materials that have the same bindings
+	setLayout = renderer->GetSetLayout(bindings);
 
-	if (vkCreateDescriptorSetLayout(device, &computeSetLayoutInfo, nullptr, &setLayout) != VK_SUCCESS)
+	if (setLayout == VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create descriptor set layout\n";
 		return false;
@@ -35,6 +38,17 @@ bool ComputeMaterial::Create(VKRenderer* renderer, const std::string& computePat
 	computePipeLayoutInfo.setLayoutCount = 1;
 	computePipeLayoutInfo.pSetLayouts = &setLayout;
 
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = pushConstantsSize;
+
+	if (pushConstantsSize > 0)
+	{
+		computePipeLayoutInfo.pushConstantRangeCount = 1;
+		computePipeLayoutInfo.pPushConstantRanges = &pushConstantRange;
+	}
+
 	if (vkCreatePipelineLayout(device, &computePipeLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
 	{
 		std::cout << "Failed to create pipeline layout\n";
@@ -54,7 +68,7 @@ bool ComputeMaterial::Create(VKRenderer* renderer, const std::string& computePat
 	computePipeInfo.layout = pipelineLayout;
 	computePipeInfo.stage = computeStageInfo;
 
-	if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &computePipeInfo, nullptr, &pipeline) != VK_SUCCESS)
+	if (!renderer->GetBase().GetPipelineCache().CreateComputePipeline(computePipeInfo, &pipeline))
 	{
 		std::cout << "Failed to create compute pipeline\n";
 		return false;
@@ -71,10 +85,6 @@ void ComputeMaterial::Dispose(VkDevice device)
 	{
 		vkDestroyPipeline(device, pipeline, nullptr);
 	}
-	if (setLayout != VK_NULL_HANDLE)
-	{
-		vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
-	}
 	if (pipelineLayout != VK_NULL_HANDLE)
 	{
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
@@ -3,15 +3,20 @@
 #include "VKRenderer.h"
 #include "VKShader.h"
 
+#include <vector>
+
 class ComputeMaterial
 {
 public:
 	ComputeMaterial();
 
+	// Creates the material with a single storage image at binding 0
 	bool Create(VKRenderer* renderer, const std::string& computePath);
+	bool Create(VKRenderer* renderer, const std::string& computePath, const std::vector<VkDescriptorSetLayoutBinding>& bindings, unsigned int pushConstantsSize);
 	void Dispose(VkDevice device);
 
 	VkPipeline GetPipeline() const { return pipeline; }
+	// Owned by the renderer's layout cache
 	VkDescriptorSetLayout GetSetLayout() const { return setLayout; }
 	VkPipelineLayout GetPipelineLayout() const { return pipelineLayout; }
 
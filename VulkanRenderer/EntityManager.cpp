@@ -1,114 +1,165 @@
 #include "EntityManager.h"
 
-#include <algorithm>
-
 
 EntityManager::EntityManager()
 {
-	nextEntity = {};
+	nextEntityId = 0;
 }
 
 Entity EntityManager::Create()
 {
+	Entity newEntity = {};
+
 	if (freeIndices.size() > 0)
 	{
-		Entity newEntity = { freeIndices.top() };
+		newEntity.id = freeIndices.top();
 		freeIndices.pop();
-		return newEntity;
 	}
 	else
 	{
-		Entity newEntity = nextEntity;
-		nextEntity.id++;
-		return newEntity;
+		newEntity.id = nextEntityId;
+		nextEntityId++;
+
+		generations.push_back(0);
+
+		if (enabledBits.size() * 32 < nextEntityId)
+			enabledBits.push_back(0);
 	}
+
+	newEntity.generation = generations[newEntity.id];
+
+	// New entities start enabled
+	enabledBits[newEntity.id >> 5] |= 1u << (newEntity.id & 31);
+
+	return newEntity;
 }
 
 Entity EntityManager::Duplicate(Entity e)
 {
-	Entity duplicatedEntity = Create();
+	Entity duplicatedEntity = {};
+	Duplicate(&e, &duplicatedEntity, 1);
 
-	for (size_t i = 0; i < duplicateEntityCallbacks.size(); i++)
+	return duplicatedEntity;
+}
+
+void EntityManager::Duplicate(const Entity* entities, Entity* duplicatedEntities, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
 	{
-		duplicateEntityCallbacks[i](e, duplicatedEntity);
+		duplicatedEntities[i] = Create();
 	}
 
-	return duplicatedEntity;
+	for (size_t i = 0; i < duplicateListeners.size(); i++)
+	{
+		duplicateListeners[i].func(duplicateListeners[i].instance, entities, duplicatedEntities, count);
+	}
 }
 
 void EntityManager::SetEnabled(Entity e, bool enable)
 {
-	// Used so we don't call the setEnabled functions to enable an entity when it's already enabled, the same for disabling
-	bool dontRepeat = false;
+	SetEnabled(&e, 1, enable);
+}
 
-	if (enable)
-	{
-		// If we have the entity in the disabled entities list then remove it
-		auto it = std::find(disabledEntities.begin(), disabledEntities.end(), e.id);
-		if (it != disabledEntities.end())
-		{
-			disabledEntities.erase(it);
-		}
-		else
-		{
-			dontRepeat = true;				// If we don't have the entity in the list then it is enabled, so don't call the setEnabled functions
-		}
-	}
-	else
+void EntityManager::SetEnabled(const Entity* entities, unsigned int count, bool enable)
+{
+	changedEntities.clear();
+
+	for (unsigned int i = 0; i < count; i++)
 	{
-		// If we don't have the entity in the disabled entites list then add it
-		if (std::find(disabledEntities.begin(), disabledEntities.end(), e.id) == disabledEntities.end())
-		{
-			disabledEntities.push_back(e.id);
-		}
+		Entity e = entities[i];
+
+		if (!IsAlive(e))
+			continue;
+
+		unsigned int& bits = enabledBits[e.id >> 5];
+		unsigned int mask = 1u << (e.id & 31);
+
+		// Only send the entities whose state changed to the listeners, so we don't enable an entity that's already enabled, the same for disabling
+		if (((bits & mask) != 0) == enable)
+			continue;
+
+		if (enable)
+			bits |= mask;
 		else
-		{
-			dontRepeat = true;				// If we already have the entity in the list then don't call the setEnabled functions again
-		}
+			bits &= ~mask;
+
+		changedEntities.push_back(e);
 	}
 
-	if (!dontRepeat)
+	if (changedEntities.size() == 0)
+		return;
+
+	// Listeners can call SetEnabled or Destroy, which refill changedEntities, so they get a batch of their own
+	std::vector<Entity> batch;
+	batch.swap(changedEntities);
+
+	for (size_t i = 0; i < setEnabledListeners.size(); i++)
 	{
-		for (size_t i = 0; i < setEnabledEntityCallbacks.size(); i++)
-		{
-			setEnabledEntityCallbacks[i](e, enable);
-		}
+		setEnabledListeners[i].func(setEnabledListeners[i].instance, batch.data(), static_cast<unsigned int>(batch.size()), enable);
 	}
+
+	RecycleBatch(batch);
+}
+
+bool EntityManager::IsAlive(Entity e) const
+{
+	return e.IsValid() && e.id < generations.size() && generations[e.id] == e.generation;
 }
 
-bool EntityManager::IsEntityEnabled(Entity e)
+bool EntityManager::IsEntityEnabled(Entity e) const
 {
-	auto it = std::find(disabledEntities.begin(), disabledEntities.end(), e.id);
+	if (!IsAlive(e))
+		return false;
 
-	return it == disabledEntities.end();
+	return (enabledBits[e.id >> 5] & (1u << (e.id & 31))) != 0;
 }
 
 void EntityManager::Destroy(Entity e)
 {
-	if (e.IsValid() == false)
-		return;
+	Destroy(&e, 1);
+}
 
-	freeIndices.push(e.id);
+void EntityManager::Destroy(const Entity* entities, unsigned int count)
+{
+	changedEntities.clear();
 
-	// Call destroy on the component managers using callbacks
-	for (size_t i = 0; i < destroyCallbacks.size(); i++)
+	for (unsigned int i = 0; i < count; i++)
 	{
-		destroyCallbacks[i](e);
+		Entity e = entities[i];
+
+		// Ignore handles to entities that were already destroyed, otherwise we would destroy the entity that reused the id
+		if (!IsAlive(e))
+			continue;
+
+		generations[e.id]++;
+		enabledBits[e.id >> 5] &= ~(1u << (e.id & 31));
+		freeIndices.push(e.id);
+
+		changedEntities.push_back(e);
 	}
-}
 
-void EntityManager::AddComponentDestroyCallback(const std::function<void(Entity)>& callback)
-{
-	destroyCallbacks.push_back(callback);
-}
+	if (changedEntities.size() == 0)
+		return;
 
-void EntityManager::AddComponentDuplicateCallback(const std::function<void(Entity, Entity)>& callback)
-{
-	duplicateEntityCallbacks.push_back(callback);
+	// Same as SetEnabled, the listeners could destroy other entities while we send them this batch
+	std::vector<Entity> batch;
+	batch.swap(changedEntities);
+
+	// Call destroy on the component managers using the listeners
+	for (size_t i = 0; i < destroyListeners.size(); i++)
+	{
+		destroyListeners[i].func(destroyListeners[i].instance, batch.data(), static_cast<unsigned int>(batch.size()));
+	}
+
+	RecycleBatch(batch);
 }
 
-void EntityManager::AddComponentSetEnabledCallback(const std::function<void(Entity, bool)>& callback)
+void EntityManager::RecycleBatch(std::vector<Entity>& batch)
 {
-	setEnabledEntityCallbacks.push_back(callback);
+	// Give the storage back so the next batch doesn't allocate, unless a nested call left a larger buffer
+	if (batch.capacity() > changedEntities.capacity())
+	{
+		batch.clear();
+		changedEntities.swap(batch);
+	}
 }
-
@@ -1,17 +1,30 @@
 #pragma once
 
 #include <limits>
-#include <functional>
+#include <cstddef>
 #include <vector>
 #include <stack>
 
 struct Entity
 {
 	unsigned int id;
+	unsigned int generation;		// Incremented every time the id is reused so old handles to a destroyed entity can be detected
 
 	bool IsValid() const { return id != std::numeric_limits<unsigned int>::max(); }
 };
 
+// Listeners receive every entity of a batch in a single call. The instance is stored as a void pointer and the function is a plain function pointer that casts it back
+typedef void(*EntityDestroyFunc)(void* instance, const Entity* entities, unsigned int count);
+typedef void(*EntityDuplicateFunc)(void* instance, const Entity* entities, const Entity* duplicatedEntities, unsigned int count);
+typedef void(*EntitySetEnabledFunc)(void* instance, const Entity* entities, unsigned int count, bool enable);
+
+template<typename Func>
+struct EntityListener
+{
+	void* instance;
+	Func func;
+};
+
 class EntityManager
 {
 public:
@@ -19,20 +32,42 @@ public:
 
 	Entity Create();
 	Entity Duplicate(Entity e);
+	void Duplicate(const Entity* entities, Entity* duplicatedEntities, unsigned int count);
 	void SetEnabled(Entity e, bool enable);
+	void SetEnabled(const Entity* entities, unsigned int count, bool enable);
 	void Destroy(Entity e);
-	bool IsEntityEnabled(Entity e);
+	void Destroy(const Entity* entities, unsigned int count);
+	bool IsAlive(Entity e) const;
+	bool IsEntityEnabled(Entity e) const;
+
+	template<typename T, void(T::*Method)(const Entity*, unsigned int)>
+	void AddDestroyListener(T* instance)
+	{
+		destroyListeners.push_back({ instance, [](void* inst, const Entity* entities, unsigned int count) { (static_cast<T*>(inst)->*Method)(entities, count); } });
+	}
 
-	void AddComponentDestroyCallback(const std::function<void(Entity)>& callback);
-	void AddComponentDuplicateCallback(const std::function<void(Entity, Entity)>& callback);
-	void AddComponentSetEnabledCallback(const std::function<void(Entity, bool)>& callback);
+	template<typename T, void(T::*Method)(const Entity*, const Entity*, unsigned int)>
+	void AddDuplicateListener(T* instance)
+	{
+		duplicateListeners.push_back({ instance, [](void* inst, const Entity* entities, const Entity* duplicatedEntities, unsigned int count) { (static_cast<T*>(inst)->*Method)(entities, duplicatedEntities, count); } });
+	}
+
+	template<typename T, void(T::*Method)(const Entity*, unsigned int, bool)>
+	void AddSetEnabledListener(T* instance)
+	{
+		setEnabledListeners.push_back({ instance, [](void* inst, const Entity* entities, unsigned int count, bool enable) { (static_cast<T*>(inst)->*Method)(entities, count, enable); } });
+	}
+
+private:
+	void RecycleBatch(std::vector<Entity>& batch);
 
 private:
-	Entity nextEntity;
-	std::vector<std::function<void(Entity)>> destroyCallbacks;
-	std::vector<std::function<void(Entity, Entity)>> duplicateEntityCallbacks;
-	std::vector<std::function<void(Entity, bool)>> setEnabledEntityCallbacks;
+	unsigned int nextEntityId;
+	std::vector<EntityListener<EntityDestroyFunc>> destroyListeners;
+	std::vector<EntityListener<EntityDuplicateFunc>> duplicateListeners;
+	std::vector<EntityListener<EntitySetEnabledFunc>> setEnabledListeners;
 	std::stack<unsigned int> freeIndices;
-	std::vector<unsigned int> disabledEntities;
+	std::vector<unsigned int> generations;
+	std::vector<unsigned int> enabledBits;			// One bit per entity id
+	std::vector<Entity> changedEntities;				// Entities of a batch that actually changed and need to be sent to the listeners
 };
-
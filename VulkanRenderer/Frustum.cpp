@@ -1,5 +1,10 @@
 #include "Frustum.h"
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define FRUSTUM_USE_SSE
+#endif
+
 void Frustum::UpdateProjection(float left, float right, float bottom, float top, float near, float far)
 	{
 		frustumType = FrustumType::ORTHOGRAPHIC;
@@ -31,6 +36,8 @@ void Frustum::UpdateProjection(float left, float right, float bottom, float top,
 	{
 		glm::vec3 nc, fc, X, Y, Z;
 
+		position = pos;
+
 		Z = glm::normalize(pos - center);
 		X = glm::normalize(glm::cross(up, Z));
 		Y = glm::cross(Z, X);
@@ -85,6 +92,141 @@ void Frustum::UpdateProjection(float left, float right, float bottom, float top,
 		return result;
 	}
 
+	unsigned int Frustum::CullSpheres(const SphereBounds& spheres, unsigned int count, unsigned int* visibleIndices) const
+	{
+		unsigned int numVisible = 0;
+		unsigned int i = 0;
+
+#ifdef FRUSTUM_USE_SSE
+		__m128 nx[6], ny[6], nz[6], d[6];
+		for (int p = 0; p < 6; p++)
+		{
+			nx[p] = _mm_set1_ps(planes[p].normal.x);
+			ny[p] = _mm_set1_ps(planes[p].normal.y);
+			nz[p] = _mm_set1_ps(planes[p].normal.z);
+			d[p] = _mm_set1_ps(planes[p].d);
+		}
+
+		const __m128 zero = _mm_setzero_ps();
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(&spheres.x[i]);
+			__m128 y = _mm_loadu_ps(&spheres.y[i]);
+			__m128 z = _mm_loadu_ps(&spheres.z[i]);
+			__m128 negRadius = _mm_sub_ps(zero, _mm_loadu_ps(&spheres.radius[i]));
+			__m128 visible = _mm_cmpeq_ps(zero, zero);
+
+			for (int p = 0; p < 6; p++)
+			{
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), d[p]));
+				visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, negRadius));
+			}
+
+			// Always write the index and only advance if it's visible to avoid branching
+			int mask = _mm_movemask_ps(visible);
+			for (unsigned int j = 0; j < 4; j++)
+			{
+				visibleIndices[numVisible] = i + j;
+				numVisible += (mask >> j) & 1;
+			}
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			glm::vec3 center(spheres.x[i], spheres.y[i], spheres.z[i]);
+			bool visible = true;
+
+			for (int p = 0; p < 6; p++)
+			{
+				if (planes[p].Distance(center) < -spheres.radius[i])
+				{
+					visible = false;
+					break;
+				}
+			}
+
+			if (visible)
+				visibleIndices[numVisible++] = i;
+		}
+
+		return numVisible;
+	}
+
+	unsigned int Frustum::CullBoxes(const BoxBounds& boxes, unsigned int count, unsigned int* visibleIndices) const
+	{
+		// The positive vertex only depends on the plane normal so choose its arrays once per plane instead of once per box
+		const float* positiveX[6];
+		const float* positiveY[6];
+		const float* positiveZ[6];
+
+		for (int p = 0; p < 6; p++)
+		{
+			positiveX[p] = planes[p].normal.x >= 0.0f ? boxes.maxX : boxes.minX;
+			positiveY[p] = planes[p].normal.y >= 0.0f ? boxes.maxY : boxes.minY;
+			positiveZ[p] = planes[p].normal.z >= 0.0f ? boxes.maxZ : boxes.minZ;
+		}
+
+		unsigned int numVisible = 0;
+		unsigned int i = 0;
+
+#ifdef FRUSTUM_USE_SSE
+		__m128 nx[6], ny[6], nz[6], d[6];
+		for (int p = 0; p < 6; p++)
+		{
+			nx[p] = _mm_set1_ps(planes[p].normal.x);
+			ny[p] = _mm_set1_ps(planes[p].normal.y);
+			nz[p] = _mm_set1_ps(planes[p].normal.z);
+			d[p] = _mm_set1_ps(planes[p].d);
+		}
+
+		const __m128 zero = _mm_setzero_ps();
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 visible = _mm_cmpeq_ps(zero, zero);
+
+			for (int p = 0; p < 6; p++)
+			{
+				__m128 x = _mm_loadu_ps(&positiveX[p][i]);
+				__m128 y = _mm_loadu_ps(&positiveY[p][i]);
+				__m128 z = _mm_loadu_ps(&positiveZ[p][i]);
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), d[p]));
+				visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, zero));
+			}
+
+			int mask = _mm_movemask_ps(visible);
+			for (unsigned int j = 0; j < 4; j++)
+			{
+				visibleIndices[numVisible] = i + j;
+				numVisible += (mask >> j) & 1;
+			}
+		}
+#endif
+
+		for (; i < count; i++)
+		{
+			bool visible = true;
+
+			for (int p = 0; p < 6; p++)
+			{
+				glm::vec3 positive(positiveX[p][i], positiveY[p][i], positiveZ[p][i]);
+
+				if (planes[p].Distance(positive) < 0.0f)
+				{
+					visible = false;
+					break;
+				}
+			}
+
+			if (visible)
+				visibleIndices[numVisible++] = i;
+		}
+
+		return numVisible;
+	}
+
 	glm::vec3 Frustum::GetVertexPositive(const glm::vec3& normal, const glm::vec3& min, const glm::vec3& max) const
 	{
 		glm::vec3 minn(min.x, min.y, min.z);
@@ -62,6 +62,25 @@
 		ORTHOGRAPHIC
 	};
 
+	// Bounds of several objects as a structure of arrays so the batch culling can test 4 objects at once
+	struct BoxBounds
+	{
+		const float* minX;
+		const float* minY;
+		const float* minZ;
+		const float* maxX;
+		const float* maxY;
+		const float* maxZ;
+	};
+
+	struct SphereBounds
+	{
+		const float* x;
+		const float* y;
+		const float* z;
+		const float* radius;
+	};
+
 	struct FrustumCorners
 	{
 		glm::vec3 ntl;
@@ -85,9 +104,29 @@
 		FrustumIntersect SphereInFrustum(const glm::vec3& sphereCenter, float radius) const;
 		FrustumIntersect BoxInFrustum(const glm::vec3& min, const glm::vec3& max) const;
 
+		// Batch culling. Writes the indices of the objects that are not completely outside the frustum to visibleIndices, which must fit count indices. Returns the number of visible objects
+		unsigned int CullSpheres(const SphereBounds& spheres, unsigned int count, unsigned int* visibleIndices) const;
+		unsigned int CullBoxes(const BoxBounds& boxes, unsigned int count, unsigned int* visibleIndices) const;
+
 		const FrustumCorners& GetCorners() const { return corners; }
+		// Writes the 6 planes as (normal, d) for the GPU culling
+		void GetPlanes(glm::vec4* outPlanes) const
+		{
+			for (int i = 0; i < 6; i++)
+				outPlanes[i] = glm::vec4(planes[i].normal, planes[i].d);
+		}
 
 		FrustumType GetType() const { return frustumType; }
+		const glm::vec3& GetPosition() const { return position; }
+		float GetNearPlane() const { return nearP; }
+		// Fraction of the view height covered by one world unit at the distance from the frustum's position. Used to pick the LODs from the projected size
+		float GetScreenScale(float distance) const
+		{
+			if (frustumType == FrustumType::ORTHOGRAPHIC)
+				return 0.5f / nh;
+
+			return nearP / (2.0f * nh * glm::max(distance, nearP));
+		}
 
 	private:
 		glm::vec3 GetVertexPositive(const glm::vec3& normal, const glm::vec3& min, const glm::vec3& max) const;
@@ -95,6 +134,7 @@
 
 	private:
 		FrustumType frustumType;
+		glm::vec3 position;
 		Plane planes[6];
 		float nh, nw, fh, fw;
 		float nearP, farP;
@@ -0,0 +1,180 @@
+#include "InstanceBuffer.h"
+
+#include "VKBase.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+InstanceBuffer::InstanceBuffer()
+{
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		frames[i].transforms = nullptr;
+		frames[i].instances = nullptr;
+		frames[i].transformCapacity = 0;
+		frames[i].instanceCapacity = 0;
+		frames[i].generation = 0;
+		frames[i].copyAll = true;
+	}
+
+	numCopiedTransforms = 0;
+}
+
+bool InstanceBuffer::Init(VKBase& base, unsigned int transformCapacity, unsigned int instanceCapacity)
+{
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		if (!CreateTransforms(base, frames[i], transformCapacity))
+			return false;
+		if (!CreateInstances(base, frames[i], instanceCapacity))
+			return false;
+
+		frames[i].generation = 0;
+		frames[i].copyAll = true;
+	}
+
+	return true;
+}
+
+bool InstanceBuffer::CreateTransforms(VKBase& base, FrameBuffers& f, unsigned int capacity)
+{
+	// The frame's fence was waited on so its old buffer is no longer used
+	f.transformsBuffer.Dispose(base.GetDevice());
+	f.transforms = nullptr;
+	f.transformCapacity = 0;
+
+	if (!f.transformsBuffer.Create(&base, capacity * sizeof(glm::mat4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+	{
+		std::cout << "Failed to create instance transforms buffer\n";
+		return false;
+	}
+
+	f.transforms = static_cast<glm::mat4*>(f.transformsBuffer.Map(base.GetDevice(), 0, VK_WHOLE_SIZE));
+	f.transformCapacity = capacity;
+	f.generation++;
+
+	return f.transforms != nullptr;
+}
+
+bool InstanceBuffer::CreateInstances(VKBase& base, FrameBuffers& f, unsigned int capacity)
+{
+	f.instancesBuffer.Dispose(base.GetDevice());
+	f.instances = nullptr;
+	f.instanceCapacity = 0;
+
+	if (!f.instancesBuffer.Create(&base, capacity * sizeof(glm::uvec2), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+	{
+		std::cout << "Failed to create instances buffer\n";
+		return false;
+	}
+
+	f.instances = static_cast<glm::uvec2*>(f.instancesBuffer.Map(base.GetDevice(), 0, VK_WHOLE_SIZE));
+	f.instanceCapacity = capacity;
+	f.generation++;
+
+	return f.instances != nullptr;
+}
+
+bool InstanceBuffer::Update(VKBase& base, unsigned int frame, TransformManager& transformManager, unsigned int numInstances)
+{
+	const std::vector<TransformRange>& ranges = transformManager.GetModifiedRanges();
+	unsigned int numTransforms = transformManager.GetNumTransforms();
+
+	// The other frames copy this frame's modifications the next time they are used
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		FrameBuffers& other = frames[i];
+
+		if (i == frame || other.copyAll || ranges.empty())
+			continue;
+
+		if (other.pendingRanges.size() + ranges.size() > MAX_PENDING_RANGES)
+		{
+			other.pendingRanges.clear();
+			other.copyAll = true;
+		}
+		else
+		{
+			other.pendingRanges.insert(other.pendingRanges.end(), ranges.begin(), ranges.end());
+		}
+	}
+
+	FrameBuffers& f = frames[frame];
+
+	// Grow to at least twice the size so adding models one at a time doesn't recreate the buffers every frame
+	if (numTransforms > f.transformCapacity)
+	{
+		if (!CreateTransforms(base, f, std::max(numTransforms, f.transformCapacity * 2)))
+			return false;
+
+		f.copyAll = true;
+	}
+	if (numInstances > f.instanceCapacity)
+	{
+		if (!CreateInstances(base, f, std::max(numInstances, f.instanceCapacity * 2)))
+			return false;
+	}
+
+	numCopiedTransforms = 0;
+
+	if (f.copyAll)
+	{
+		if (numTransforms > 0)
+		{
+			memcpy(f.transforms, transformManager.GetLocalToWorldMatrices(), numTransforms * sizeof(glm::mat4));
+			f.transformsBuffer.Flush(0, numTransforms * sizeof(glm::mat4));
+		}
+
+		numCopiedTransforms = numTransforms;
+	}
+	else
+	{
+		CopyRanges(f, transformManager, f.pendingRanges);
+		CopyRanges(f, transformManager, ranges);
+	}
+
+	f.pendingRanges.clear();
+	f.copyAll = false;
+
+	return true;
+}
+
+void InstanceBuffer::CopyRanges(FrameBuffers& f, const TransformManager& transformManager, const std::vector<TransformRange>& ranges)
+{
+	const glm::mat4* localToWorld = transformManager.GetLocalToWorldMatrices();
+	unsigned int numTransforms = transformManager.GetNumTransforms();
+
+	// The pending ranges can point past the end if transforms were removed since
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		if (ranges[i].first >= numTransforms)
+			continue;
+
+		unsigned int count = std::min(ranges[i].count, numTransforms - ranges[i].first);
+		memcpy(&f.transforms[ranges[i].first], &localToWorld[ranges[i].first], count * sizeof(glm::mat4));
+		f.transformsBuffer.Flush(ranges[i].first * sizeof(glm::mat4), count * sizeof(glm::mat4));
+		numCopiedTransforms += count;
+	}
+}
+
+void InstanceBuffer::FlushInstances(unsigned int frame, unsigned int numInstances)
+{
+	FrameBuffers& f = frames[frame];
+	f.instancesBuffer.Flush(0, std::min(numInstances, f.instanceCapacity) * sizeof(glm::uvec2));
+}
+
+void InstanceBuffer::Dispose(VkDevice device)
+{
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		frames[i].transformsBuffer.Dispose(device);
+		frames[i].instancesBuffer.Dispose(device);
+		frames[i].transforms = nullptr;
+		frames[i].instances = nullptr;
+		frames[i].transformCapacity = 0;
+		frames[i].instanceCapacity = 0;
+		frames[i].pendingRanges.clear();
+		frames[i].copyAll = true;
+	}
+}
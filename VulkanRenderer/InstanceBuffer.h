@@ -0,0 +1,59 @@
+#pragma once
+
+#include "VKBuffer.h"
+#include "VKRenderer.h"
+#include "TransformManager.h"
+
+#include "glm/glm.hpp"
+
+#include <vector>
+
+// Local to world matrix of every transform at its transform index and the transform and bindless texture index of every instance drawn in the frame
+// Each frame in flight has its own buffers so the CPU never writes to memory the GPU could still be reading. They stay mapped and only the transforms modified since the frame's buffers were last used are copied
+class InstanceBuffer
+{
+public:
+	InstanceBuffer();
+
+	bool Init(VKBase& base, unsigned int transformCapacity, unsigned int instanceCapacity);
+	// Must be called after the frame's fence was waited on, before its commands are recorded and before the modified transforms are cleared
+	// Grows the frame's buffers when there are more transforms or instances than they fit. The generation of the frame changes when they are recreated so the descriptors have to be updated
+	bool Update(VKBase& base, unsigned int frame, TransformManager& transformManager, unsigned int numInstances);
+	// Call after the CPU wrote the indices of the instances
+	void FlushInstances(unsigned int frame, unsigned int numInstances);
+	void Dispose(VkDevice device);
+
+	const VKBuffer& GetTransformsBuffer(unsigned int frame) const { return frames[frame].transformsBuffer; }
+	const VKBuffer& GetInstancesBuffer(unsigned int frame) const { return frames[frame].instancesBuffer; }
+	// x - transform index, y - bindless texture index of every instance. Written by the CPU after the draws are recorded or by the GPU culling
+	glm::uvec2* GetInstances(unsigned int frame) const { return frames[frame].instances; }
+	unsigned int GetInstanceCapacity(unsigned int frame) const { return frames[frame].instanceCapacity; }
+	unsigned int GetGeneration(unsigned int frame) const { return frames[frame].generation; }
+	// Matrices copied by the last Update
+	unsigned int GetNumCopiedTransforms() const { return numCopiedTransforms; }
+
+	// A frame with more ranges waiting copies every transform instead
+	static const unsigned int MAX_PENDING_RANGES = 1024;
+
+private:
+	struct FrameBuffers
+	{
+		VKBuffer transformsBuffer;
+		VKBuffer instancesBuffer;
+		glm::mat4* transforms;
+		glm::uvec2* instances;
+		unsigned int transformCapacity;
+		unsigned int instanceCapacity;
+		unsigned int generation;
+		std::vector<TransformRange> pendingRanges;		// Modified while the other frames were updated
+		bool copyAll;
+	};
+
+	bool CreateTransforms(VKBase& base, FrameBuffers& f, unsigned int capacity);
+	bool CreateInstances(VKBase& base, FrameBuffers& f, unsigned int capacity);
+	void CopyRanges(FrameBuffers& f, const TransformManager& transformManager, const std::vector<TransformRange>& ranges);
+
+private:
+	FrameBuffers frames[VKRenderer::MAX_FRAMES_IN_FLIGHT];
+	unsigned int numCopiedTransforms;
+};
@@ -0,0 +1,154 @@
+#include "JobSystem.h"
+
+#include "Log.h"
+
+#include <algorithm>
+
+JobSystem::JobSystem()
+{
+	pendingJobs = 0;
+	running = false;
+}
+
+bool JobSystem::Init(unsigned int numThreads)
+{
+	if (running)
+		return true;
+
+	if (numThreads == 0)
+	{
+		unsigned int numCores = std::thread::hardware_concurrency();
+		numThreads = numCores > 1 ? numCores - 1 : 1;
+	}
+
+	running = true;
+
+	for (unsigned int i = 0; i < numThreads; i++)
+	{
+		threads.push_back(std::thread(&JobSystem::WorkerLoop, this));
+	}
+
+	Log::Print(LogLevel::LEVEL_INFO, "Job system worker threads: %u\n", numThreads);
+
+	return true;
+}
+
+void JobSystem::Dispose()
+{
+	if (!running)
+		return;
+
+	Wait();
+
+	{
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		running = false;
+	}
+	jobsCondition.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+
+	threads.clear();
+}
+
+void JobSystem::Execute(const std::function<void()>& job, std::atomic<unsigned int>* counter)
+{
+	pendingJobs++;
+
+	if (counter)
+		(*counter)++;
+
+	{
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		jobs.push_back({ job, counter });
+	}
+	jobsCondition.notify_one();
+}
+
+void JobSystem::Dispatch(unsigned int jobCount, unsigned int groupSize, const std::function<void(unsigned int, unsigned int, unsigned int)>& job, std::atomic<unsigned int>* counter)
+{
+	if (jobCount == 0 || groupSize == 0)
+		return;
+
+	unsigned int groupCount = (jobCount + groupSize - 1) / groupSize;
+
+	for (unsigned int i = 0; i < groupCount; i++)
+	{
+		unsigned int start = i * groupSize;
+		unsigned int end = std::min(start + groupSize, jobCount);
+
+		Execute([job, i, start, end]() { job(i, start, end); }, counter);
+	}
+}
+
+void JobSystem::Wait()
+{
+	WaitFor(pendingJobs);
+}
+
+void JobSystem::WaitFor(const std::atomic<unsigned int>& counter)
+{
+	while (counter.load() > 0)
+	{
+		if (!ExecuteNextJob(counter))
+			std::this_thread::yield();
+	}
+}
+
+void JobSystem::WorkerLoop()
+{
+	while (true)
+	{
+		Job job;
+
+		{
+			std::unique_lock<std::mutex> lock(jobsMutex);
+			jobsCondition.wait(lock, [this]() { return !running || !jobs.empty(); });
+
+			if (!running && jobs.empty())
+				return;
+
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		RunJob(job);
+	}
+}
+
+bool JobSystem::ExecuteNextJob(const std::atomic<unsigned int>& counter)
+{
+	Job job;
+
+	{
+		std::lock_guard<std::mutex> lock(jobsMutex);
+
+		// Skip the jobs of other counters, they could take much longer than the ones being waited for
+		auto it = jobs.begin();
+		if (&counter != &pendingJobs)
+			it = std::find_if(jobs.begin(), jobs.end(), [&counter](const Job& j) { return j.counter == &counter; });
+
+		if (it == jobs.end())
+			return false;
+
+		job = std::move(*it);
+		jobs.erase(it);
+	}
+
+	RunJob(job);
+
+	return true;
+}
+
+void JobSystem::RunJob(Job& job)
+{
+	job.func();
+
+	if (job.counter)
+		(*job.counter)--;
+
+	pendingJobs--;
+}
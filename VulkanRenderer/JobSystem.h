@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class JobSystem
+{
+public:
+	JobSystem();
+
+	// numThreads = 0 uses one worker per core, minus the main thread
+	bool Init(unsigned int numThreads = 0);
+	void Dispose();
+
+	// If a counter is passed it's incremented now and decremented once the job finished, so the caller can wait for its own jobs with WaitFor
+	void Execute(const std::function<void()>& job, std::atomic<unsigned int>* counter = nullptr);
+	// Splits jobCount items into groups of groupSize and runs each group as one job. The job receives the group index and the [start, end) item range
+	void Dispatch(unsigned int jobCount, unsigned int groupSize, const std::function<void(unsigned int, unsigned int, unsigned int)>& job, std::atomic<unsigned int>* counter = nullptr);
+	// Blocks until every job has finished. The calling thread helps executing the remaining jobs
+	void Wait();
+	// Blocks until counter reaches zero. The calling thread only helps with the jobs of the counter so it doesn't get stuck in a long unrelated job
+	void WaitFor(const std::atomic<unsigned int>& counter);
+
+	bool IsBusy() const { return pendingJobs.load() > 0; }
+	unsigned int GetNumThreads() const { return static_cast<unsigned int>(threads.size()); }
+
+private:
+	struct Job
+	{
+		std::function<void()> func;
+		std::atomic<unsigned int>* counter;
+	};
+
+	void WorkerLoop();
+	// Only runs a job of the counter unless it's pendingJobs
+	bool ExecuteNextJob(const std::atomic<unsigned int>& counter);
+	void RunJob(Job& job);
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<Job> jobs;
+	std::mutex jobsMutex;
+	std::condition_variable jobsCondition;
+	std::atomic<unsigned int> pendingJobs;
+	bool running;
+};
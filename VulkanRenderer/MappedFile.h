@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+// Read only view of a whole file. The OS loads the pages when they are first read so nothing is copied until the data is used
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::string& path);
+	void Close();
+
+	const unsigned char* GetData() const { return data; }
+	size_t GetSize() const { return size; }
+	bool IsOpen() const { return data != nullptr; }
+
+private:
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+};
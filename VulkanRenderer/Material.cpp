@@ -62,7 +62,7 @@ bool Material::Create(VKRenderer* renderer, const Mesh &mesh, const MaterialFeat
 	pipeInfo.colorBlending.attachmentCount = 1;
 	pipeInfo.colorBlending.pAttachments = &colorBlendAttachment;
 
-	if (!pipeline.Create(device, pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
+	if (!pipeline.Create(renderer->GetBase().GetPipelineCache(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
 		return false;
 
 	return true;
@@ -40,7 +40,7 @@ Mesh MeshDefaults::CreateQuad(VKRenderer* renderer)
 
 	void* mapped = quadVertexStagingBuffer.Map(device, 0, vertexSize);
 	memcpy(mapped, quadVertices, (size_t)vertexSize);
-	quadVertexStagingBuffer.Unmap(device);
+	quadVertexStagingBuffer.Flush(0, vertexSize);
 
 	m.vb.Create(&base, sizeof(quadVertices), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	base.CopyBuffer(quadVertexStagingBuffer, m.vb, vertexSize);
@@ -0,0 +1,600 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace MeshOptimizer
+{
+	// Triangles that use each vertex, as offsets into one list
+	struct Adjacency
+	{
+		std::vector<unsigned int> offsets;
+		std::vector<unsigned int> triangles;
+		std::vector<unsigned int> liveCounts;			// Triangles not emitted yet
+	};
+
+	static void BuildAdjacency(const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount, Adjacency& adjacency)
+	{
+		unsigned int triangleCount = indexCount / 3;
+
+		adjacency.liveCounts.assign(vertexCount, 0);
+		adjacency.offsets.resize(vertexCount + 1);
+		adjacency.triangles.resize(triangleCount * 3);
+
+		for (unsigned int i = 0; i < triangleCount * 3; i++)
+		{
+			adjacency.liveCounts[indices[i]]++;
+		}
+
+		unsigned int offset = 0;
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			adjacency.offsets[v] = offset;
+			offset += adjacency.liveCounts[v];
+		}
+		adjacency.offsets[vertexCount] = offset;
+
+		std::vector<unsigned int> fill(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+
+		for (unsigned int t = 0; t < triangleCount; t++)
+		{
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				adjacency.triangles[fill[indices[t * 3 + k]]++] = t;
+			}
+		}
+	}
+
+	void OptimizeVertexCache(unsigned int* indices, unsigned int indexCount, unsigned int vertexCount, std::vector<unsigned int>& clusters)
+	{
+		unsigned int triangleCount = indexCount / 3;
+
+		clusters.clear();
+
+		if (triangleCount == 0)
+			return;
+
+		Adjacency adjacency;
+		BuildAdjacency(indices, indexCount, vertexCount, adjacency);
+
+		std::vector<unsigned int> cacheTimes(vertexCount, 0);
+		std::vector<bool> emitted(triangleCount, false);
+		std::vector<unsigned int> deadEnds;
+		std::vector<unsigned int> candidates;
+		std::vector<unsigned int> result(triangleCount * 3);
+
+		unsigned int resultCount = 0;
+		unsigned int timestamp = CACHE_SIZE + 1;
+		unsigned int cursor = 0;
+		int fanning = 0;
+
+		// Skip to the first vertex that is used
+		while (cursor < vertexCount && adjacency.liveCounts[cursor] == 0)
+			cursor++;
+
+		fanning = cursor < vertexCount ? static_cast<int>(cursor) : -1;
+		clusters.push_back(0);
+
+		while (fanning >= 0)
+		{
+			candidates.clear();
+
+			// Emit every triangle around the fanning vertex
+			for (unsigned int a = adjacency.offsets[fanning]; a < adjacency.offsets[fanning + 1]; a++)
+			{
+				unsigned int t = adjacency.triangles[a];
+
+				if (emitted[t])
+					continue;
+
+				for (unsigned int k = 0; k < 3; k++)
+				{
+					unsigned int v = indices[t * 3 + k];
+
+					result[resultCount++] = v;
+					deadEnds.push_back(v);
+					candidates.push_back(v);
+					adjacency.liveCounts[v]--;
+
+					if (timestamp - cacheTimes[v] > CACHE_SIZE)
+						cacheTimes[v] = timestamp++;
+				}
+
+				emitted[t] = true;
+			}
+
+			// Pick the candidate that will still be in the cache after its remaining triangles are emitted and that entered the cache earliest
+			int next = -1;
+			int bestPriority = -1;
+
+			for (unsigned int v : candidates)
+			{
+				if (adjacency.liveCounts[v] == 0)
+					continue;
+
+				int priority = 0;
+				if (timestamp - cacheTimes[v] + 2 * adjacency.liveCounts[v] <= CACHE_SIZE)
+					priority = timestamp - cacheTimes[v];
+
+				if (priority > bestPriority)
+				{
+					bestPriority = priority;
+					next = static_cast<int>(v);
+				}
+			}
+
+			// Dead end, continue from the most recently used vertex that still has triangles or from the next one in the index order
+			if (next == -1)
+			{
+				while (!deadEnds.empty())
+				{
+					unsigned int v = deadEnds.back();
+					deadEnds.pop_back();
+
+					if (adjacency.liveCounts[v] > 0)
+					{
+						next = static_cast<int>(v);
+						break;
+					}
+				}
+
+				while (next == -1 && cursor < vertexCount)
+				{
+					if (adjacency.liveCounts[cursor] > 0)
+						next = static_cast<int>(cursor);
+					else
+						cursor++;
+				}
+
+				if (next != -1 && resultCount < triangleCount * 3)
+					clusters.push_back(resultCount / 3);
+			}
+
+			fanning = next;
+		}
+
+		std::copy(result.begin(), result.begin() + resultCount, indices);
+	}
+
+	static unsigned int CountCacheMisses(const unsigned int* indices, unsigned int indexCount, std::vector<unsigned int>& cacheTimes, unsigned int& timestamp)
+	{
+		unsigned int misses = 0;
+
+		for (unsigned int i = 0; i < indexCount; i++)
+		{
+			unsigned int v = indices[i];
+
+			if (timestamp - cacheTimes[v] > CACHE_SIZE)
+			{
+				cacheTimes[v] = timestamp++;
+				misses++;
+			}
+		}
+
+		return misses;
+	}
+
+	void OptimizeOverdraw(unsigned int* indices, unsigned int indexCount, const Vertex* vertices, unsigned int vertexCount, const std::vector<unsigned int>& clusters, float threshold)
+	{
+		unsigned int triangleCount = indexCount / 3;
+
+		if (triangleCount == 0 || clusters.empty())
+			return;
+
+		std::vector<unsigned int> cacheTimes(vertexCount, 0);
+		unsigned int timestamp = CACHE_SIZE + 1;
+		float meshACMR = CountCacheMisses(indices, triangleCount * 3, cacheTimes, timestamp) / static_cast<float>(triangleCount);
+
+		// Start a new cluster once the triangles since the last cluster start are as cache friendly as the mesh, so sorting them can't make the ACMR much worse
+		// The cache is flushed at every cluster start because the cluster can end up anywhere after sorting
+		std::vector<unsigned int> softClusters;
+
+		for (size_t c = 0; c < clusters.size(); c++)
+		{
+			unsigned int start = clusters[c];
+			unsigned int end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+
+			timestamp += CACHE_SIZE + 1;
+
+			unsigned int clusterStart = start;
+			unsigned int clusterMisses = 0;
+
+			softClusters.push_back(start);
+
+			for (unsigned int t = start; t < end; t++)
+			{
+				clusterMisses += CountCacheMisses(indices + t * 3, 3, cacheTimes, timestamp);
+
+				unsigned int clusterTriangles = t + 1 - clusterStart;
+
+				if (t + 1 < end && clusterMisses <= clusterTriangles * meshACMR * threshold)
+				{
+					softClusters.push_back(t + 1);
+					clusterStart = t + 1;
+					clusterMisses = 0;
+					timestamp += CACHE_SIZE + 1;
+				}
+			}
+		}
+
+		// Clusters facing away from the mesh center are more likely to occlude the others, so they are drawn first
+		glm::vec3 meshCentroid = glm::vec3(0.0f);
+
+		for (unsigned int i = 0; i < triangleCount * 3; i++)
+		{
+			meshCentroid += vertices[indices[i]].pos;
+		}
+		meshCentroid /= static_cast<float>(triangleCount * 3);
+
+		size_t clusterCount = softClusters.size();
+		std::vector<float> sortKeys(clusterCount);
+		std::vector<unsigned int> order(clusterCount);
+
+		for (size_t c = 0; c < clusterCount; c++)
+		{
+			unsigned int start = softClusters[c];
+			unsigned int end = c + 1 < clusterCount ? softClusters[c + 1] : triangleCount;
+
+			glm::vec3 centroid = glm::vec3(0.0f);
+			glm::vec3 normal = glm::vec3(0.0f);
+			float area = 0.0f;
+
+			for (unsigned int t = start; t < end; t++)
+			{
+				const glm::vec3& p0 = vertices[indices[t * 3 + 0]].pos;
+				const glm::vec3& p1 = vertices[indices[t * 3 + 1]].pos;
+				const glm::vec3& p2 = vertices[indices[t * 3 + 2]].pos;
+
+				// Area weighted so big triangles count more
+				glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+				float triangleArea = glm::length(n);
+
+				centroid += (p0 + p1 + p2) * (triangleArea / 3.0f);
+				normal += n;
+				area += triangleArea;
+			}
+
+			float normalLength = glm::length(normal);
+
+			if (area > 0.0f && normalLength > 0.0f)
+				sortKeys[c] = glm::dot(centroid / area - meshCentroid, normal / normalLength);
+			else
+				sortKeys[c] = 0.0f;
+
+			order[c] = static_cast<unsigned int>(c);
+		}
+
+		std::stable_sort(order.begin(), order.end(), [&sortKeys](unsigned int a, unsigned int b) { return sortKeys[a] > sortKeys[b]; });
+
+		std::vector<unsigned int> result(indices, indices + triangleCount * 3);
+		unsigned int resultCount = 0;
+
+		for (unsigned int c : order)
+		{
+			unsigned int start = softClusters[c];
+			unsigned int end = c + 1 < clusterCount ? softClusters[c + 1] : triangleCount;
+
+			std::copy(result.begin() + start * 3, result.begin() + end * 3, indices + resultCount);
+			resultCount += (end - start) * 3;
+		}
+	}
+
+	void OptimizeVertexFetch(unsigned int* indices, unsigned int indexCount, Vertex* vertices, unsigned int vertexCount)
+	{
+		const unsigned int UNUSED = ~0u;
+
+		std::vector<unsigned int> remap(vertexCount, UNUSED);
+		unsigned int nextVertex = 0;
+
+		for (unsigned int i = 0; i < indexCount; i++)
+		{
+			unsigned int& newIndex = remap[indices[i]];
+
+			if (newIndex == UNUSED)
+				newIndex = nextVertex++;
+
+			indices[i] = newIndex;
+		}
+
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			if (remap[v] == UNUSED)
+				remap[v] = nextVertex++;
+		}
+
+		std::vector<Vertex> result(vertexCount);
+
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			result[remap[v]] = vertices[v];
+		}
+
+		std::copy(result.begin(), result.end(), vertices);
+	}
+
+	// Sum of squared distances to the planes of the triangles around a vertex. Symmetric 4x4 matrix, weighted by the triangle areas
+	struct Quadric
+	{
+		double a2, ab, ac, ad;
+		double b2, bc, bd;
+		double c2, cd;
+		double d2;
+		double weight;
+	};
+
+	static void AddPlane(Quadric& q, const glm::dvec3& n, double d, double weight)
+	{
+		q.a2 += n.x * n.x * weight;
+		q.ab += n.x * n.y * weight;
+		q.ac += n.x * n.z * weight;
+		q.ad += n.x * d * weight;
+		q.b2 += n.y * n.y * weight;
+		q.bc += n.y * n.z * weight;
+		q.bd += n.y * d * weight;
+		q.c2 += n.z * n.z * weight;
+		q.cd += n.z * d * weight;
+		q.d2 += d * d * weight;
+		q.weight += weight;
+	}
+
+	static void AddQuadric(Quadric& q, const Quadric& other)
+	{
+		q.a2 += other.a2; q.ab += other.ab; q.ac += other.ac; q.ad += other.ad;
+		q.b2 += other.b2; q.bc += other.bc; q.bd += other.bd;
+		q.c2 += other.c2; q.cd += other.cd;
+		q.d2 += other.d2;
+		q.weight += other.weight;
+	}
+
+	// Squared distance, divided by the weight so it doesn't depend on the triangle areas
+	static double QuadricError(const Quadric& q, const glm::vec3& p)
+	{
+		double x = p.x, y = p.y, z = p.z;
+
+		double error = q.a2 * x * x + 2.0 * q.ab * x * y + 2.0 * q.ac * x * z + 2.0 * q.ad * x
+			+ q.b2 * y * y + 2.0 * q.bc * y * z + 2.0 * q.bd * y
+			+ q.c2 * z * z + 2.0 * q.cd * z
+			+ q.d2;
+
+		return q.weight > 0.0 ? std::abs(error) / q.weight : 0.0;
+	}
+
+	struct Collapse
+	{
+		unsigned int from;
+		unsigned int to;
+		double error;
+	};
+
+	// False if moving the vertex to the new position flips or collapses one of its triangles that don't contain the target vertex
+	static bool IsCollapseValid(const unsigned int* indices, const Adjacency& adjacency, const Vertex* vertices, unsigned int from, unsigned int to)
+	{
+		const glm::vec3& newPos = vertices[to].pos;
+
+		for (unsigned int a = adjacency.offsets[from]; a < adjacency.offsets[from + 1]; a++)
+		{
+			const unsigned int* tri = indices + adjacency.triangles[a] * 3;
+
+			if (tri[0] == to || tri[1] == to || tri[2] == to)
+				continue;
+
+			// Rotate so the vertex that moves is first
+			unsigned int k = tri[0] == from ? 0 : (tri[1] == from ? 1 : 2);
+			const glm::vec3& p0 = vertices[tri[k]].pos;
+			const glm::vec3& p1 = vertices[tri[(k + 1) % 3]].pos;
+			const glm::vec3& p2 = vertices[tri[(k + 2) % 3]].pos;
+
+			glm::vec3 oldNormal = glm::cross(p1 - p0, p2 - p0);
+			glm::vec3 newNormal = glm::cross(p1 - newPos, p2 - newPos);
+
+			if (glm::dot(oldNormal, newNormal) <= 0.0f)
+				return false;
+		}
+
+		return true;
+	}
+
+	unsigned int Simplify(unsigned int* destination, const unsigned int* indices, unsigned int indexCount, const Vertex* vertices, unsigned int vertexCount, unsigned int targetIndexCount, float targetError, float& resultError)
+	{
+		resultError = 0.0f;
+
+		unsigned int count = indexCount / 3 * 3;
+		std::copy(indices, indices + count, destination);
+
+		if (count <= targetIndexCount)
+			return count;
+
+		// Quadrics of the planes of the triangles around every vertex
+		std::vector<Quadric> quadrics(vertexCount, Quadric{});
+
+		for (unsigned int i = 0; i < count; i += 3)
+		{
+			glm::dvec3 p0 = vertices[indices[i + 0]].pos;
+			glm::dvec3 p1 = vertices[indices[i + 1]].pos;
+			glm::dvec3 p2 = vertices[indices[i + 2]].pos;
+
+			glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+			double area = glm::length(n);
+
+			if (area <= 0.0)
+				continue;
+
+			n /= area;
+			double d = -glm::dot(n, p0);
+
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				AddPlane(quadrics[indices[i + k]], n, d, area);
+			}
+		}
+
+		// Edges used by a single triangle are on a border. The border vertices are locked
+		std::vector<bool> locked(vertexCount, false);
+		{
+			std::vector<std::pair<unsigned int, unsigned int>> edges;
+			edges.reserve(count);
+
+			for (unsigned int i = 0; i < count; i += 3)
+			{
+				for (unsigned int k = 0; k < 3; k++)
+				{
+					unsigned int a = indices[i + k];
+					unsigned int b = indices[i + (k + 1) % 3];
+					edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+				}
+			}
+
+			std::sort(edges.begin(), edges.end());
+
+			for (size_t e = 0; e < edges.size();)
+			{
+				size_t next = e + 1;
+				while (next < edges.size() && edges[next] == edges[e])
+					next++;
+
+				if (next - e == 1)
+				{
+					locked[edges[e].first] = true;
+					locked[edges[e].second] = true;
+				}
+
+				e = next;
+			}
+		}
+
+		double maxError = (double)targetError * targetError;
+		double currentError = 0.0;
+
+		Adjacency adjacency;
+		std::vector<Collapse> collapses;
+		std::vector<bool> touched(vertexCount);
+		std::vector<unsigned int> remap(vertexCount);
+
+		// Every pass collapses the cheapest edges that don't share vertices, then removes the triangles that became degenerate
+		while (count > targetIndexCount)
+		{
+			BuildAdjacency(destination, count, vertexCount, adjacency);
+
+			collapses.clear();
+
+			for (unsigned int i = 0; i < count; i += 3)
+			{
+				for (unsigned int k = 0; k < 3; k++)
+				{
+					unsigned int a = destination[i + k];
+					unsigned int b = destination[i + (k + 1) % 3];
+
+					// Every edge inside the mesh is in two triangles, only add it once
+					if (a > b && !locked[a] && !locked[b])
+						continue;
+					if (locked[a] && locked[b])
+						continue;
+
+					Quadric q = quadrics[a];
+					AddQuadric(q, quadrics[b]);
+
+					double errorAtA = locked[b] ? std::numeric_limits<double>::max() : QuadricError(q, vertices[a].pos);
+					double errorAtB = locked[a] ? std::numeric_limits<double>::max() : QuadricError(q, vertices[b].pos);
+
+					Collapse c;
+					c.from = errorAtB <= errorAtA ? a : b;
+					c.to = errorAtB <= errorAtA ? b : a;
+					c.error = std::min(errorAtA, errorAtB);
+
+					if (c.error <= maxError)
+						collapses.push_back(c);
+				}
+			}
+
+			if (collapses.empty())
+				break;
+
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+			std::fill(touched.begin(), touched.end(), false);
+
+			for (unsigned int v = 0; v < vertexCount; v++)
+			{
+				remap[v] = v;
+			}
+
+			// Each collapse removes about two triangles. Don't collapse much more than needed to reach the target
+			unsigned int trianglesToRemove = (count - targetIndexCount) / 3;
+			unsigned int maxCollapses = std::max(1u, trianglesToRemove / 2 + 1);
+			unsigned int numCollapses = 0;
+
+			for (const Collapse& c : collapses)
+			{
+				if (numCollapses >= maxCollapses)
+					break;
+
+				if (touched[c.from] || touched[c.to])
+					continue;
+
+				if (!IsCollapseValid(destination, adjacency, vertices, c.from, c.to))
+					continue;
+
+				// The triangles around both vertices change so neither can be used again in this pass
+				for (unsigned int a = adjacency.offsets[c.from]; a < adjacency.offsets[c.from + 1]; a++)
+				{
+					const unsigned int* tri = destination + adjacency.triangles[a] * 3;
+					touched[tri[0]] = true;
+					touched[tri[1]] = true;
+					touched[tri[2]] = true;
+				}
+
+				remap[c.from] = c.to;
+				AddQuadric(quadrics[c.to], quadrics[c.from]);
+				currentError = std::max(currentError, c.error);
+				numCollapses++;
+			}
+
+			if (numCollapses == 0)
+				break;
+
+			unsigned int newCount = 0;
+
+			for (unsigned int i = 0; i < count; i += 3)
+			{
+				unsigned int a = remap[destination[i + 0]];
+				unsigned int b = remap[destination[i + 1]];
+				unsigned int c = remap[destination[i + 2]];
+
+				if (a == b || b == c || a == c)
+					continue;
+
+				destination[newCount++] = a;
+				destination[newCount++] = b;
+				destination[newCount++] = c;
+			}
+
+			count = newCount;
+		}
+
+		resultError = static_cast<float>(std::sqrt(currentError));
+
+		return count;
+	}
+
+	VertexCacheStats AnalyzeVertexCache(const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount)
+	{
+		VertexCacheStats stats = {};
+		stats.triangles = indexCount / 3;
+
+		std::vector<unsigned int> cacheTimes(vertexCount, 0);
+		unsigned int timestamp = CACHE_SIZE + 1;
+		stats.misses = CountCacheMisses(indices, stats.triangles * 3, cacheTimes, timestamp);
+
+		for (unsigned int v = 0; v < vertexCount; v++)
+		{
+			if (cacheTimes[v] > 0)
+				stats.vertices++;
+		}
+
+		stats.acmr = stats.triangles > 0 ? stats.misses / static_cast<float>(stats.triangles) : 0.0f;
+		stats.atvr = stats.vertices > 0 ? stats.misses / static_cast<float>(stats.vertices) : 0.0f;
+
+		return stats;
+	}
+}
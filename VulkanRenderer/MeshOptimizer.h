@@ -0,0 +1,37 @@
+#pragma once
+
+#include "VertexTypes.h"
+
+#include <vector>
+
+struct VertexCacheStats
+{
+	float acmr;					// Average cache miss ratio, transformed vertices per triangle. 0.5 is the best possible for large meshes
+	float atvr;					// Average transformed to vertex ratio. 1.0 means every vertex is only transformed once
+	unsigned int misses;
+	unsigned int triangles;
+	unsigned int vertices;		// Vertices referenced by the indices
+};
+
+// Reorders the triangles and vertices of an indexed triangle list so the GPU transforms less vertices, shades less hidden pixels and fetches the vertices in order
+// The indices are relative to the first vertex. Run them in the order they are declared: the overdraw optimization uses the clusters of the vertex cache optimization and the vertex fetch optimization only changes the vertices
+namespace MeshOptimizer
+{
+	// FIFO cache size used by the optimization and the stats. Close to the post transform cache of current GPUs
+	const unsigned int CACHE_SIZE = 16;
+
+	// Tipsify, from Sander et al. Fast Triangle Reordering for Vertex Locality and Reduced Overdraw. Fills clusters with the first triangle of every run that started at a dead end
+	void OptimizeVertexCache(unsigned int* indices, unsigned int indexCount, unsigned int vertexCount, std::vector<unsigned int>& clusters);
+	// Splits the clusters further where their ACMR is already below threshold times the mesh's and sorts them so the ones facing out of the mesh are drawn first
+	// The triangles inside the clusters keep their order so a threshold of 1.05 keeps the ACMR within about 5% of the cache optimized one
+	void OptimizeOverdraw(unsigned int* indices, unsigned int indexCount, const Vertex* vertices, unsigned int vertexCount, const std::vector<unsigned int>& clusters, float threshold);
+	// Moves the vertices to the order they are first used by the indices and remaps the indices. Unused vertices are moved to the end
+	void OptimizeVertexFetch(unsigned int* indices, unsigned int indexCount, Vertex* vertices, unsigned int vertexCount);
+
+	// Edge collapse simplification with quadric error metrics, from Garland and Heckbert. Only the indices change, the collapsed vertices are replaced by vertices that already exist so every LOD can share the vertices
+	// Writes at most indexCount indices to destination and returns the number written. Stops at targetIndexCount or when the next collapse would move the surface by more than targetError
+	// The error of the result is written to resultError in the same units as the positions. Border vertices are never collapsed so the meshes next to it and UV seams don't get cracks
+	unsigned int Simplify(unsigned int* destination, const unsigned int* indices, unsigned int indexCount, const Vertex* vertices, unsigned int vertexCount, unsigned int targetIndexCount, float targetError, float& resultError);
+
+	VertexCacheStats AnalyzeVertexCache(const unsigned int* indices, unsigned int indexCount, unsigned int vertexCount);
+}
@@ -0,0 +1,228 @@
+#include "MeshPool.h"
+
+#include "VKBase.h"
+
+#include <iostream>
+#include <algorithm>
+
+MeshPool::MeshPool()
+{
+	blockVertices = 0;
+	blockIndices = 0;
+	numVertices = 0;
+	numIndices[0] = 0;
+	numIndices[1] = 0;
+}
+
+bool MeshPool::Init(VKBase& base, unsigned int blockVertices, unsigned int blockIndices)
+{
+	this->blockVertices = blockVertices;
+	this->blockIndices = blockIndices;
+	numVertices = 0;
+	numIndices[0] = 0;
+	numIndices[1] = 0;
+
+	blocks.reserve(MAX_BLOCKS);
+
+	return CreateBlock(base, blockVertices, blockIndices);
+}
+
+bool MeshPool::CreateBlock(VKBase& base, unsigned int maxVertices, unsigned int maxIndices)
+{
+	if (blocks.size() >= MAX_BLOCKS)
+	{
+		std::cout << "Failed to create mesh pool block, too many blocks\n";
+		return false;
+	}
+
+	Block block = {};
+	block.vertices.capacity = maxVertices;
+	block.indices[0].capacity = maxIndices;
+	block.indices[1].capacity = maxIndices;
+
+	VkDevice device = base.GetDevice();
+
+	if (!block.vertexBuffer.Create(&base, maxVertices * sizeof(Vertex), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		std::cout << "Failed to create mesh pool vertex buffer\n";
+		return false;
+	}
+	if (!block.indexBuffers[0].Create(&base, maxIndices * sizeof(unsigned short), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		std::cout << "Failed to create mesh pool 16 bit index buffer\n";
+		block.vertexBuffer.Dispose(device);
+		return false;
+	}
+	if (!block.indexBuffers[1].Create(&base, maxIndices * sizeof(unsigned int), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		std::cout << "Failed to create mesh pool 32 bit index buffer\n";
+		block.vertexBuffer.Dispose(device);
+		block.indexBuffers[0].Dispose(device);
+		return false;
+	}
+
+	blocks.push_back(block);
+
+	return true;
+}
+
+bool MeshPool::Allocate(Block& block, unsigned int vertexCount, unsigned int indexCount, unsigned int indexBufferIndex, MeshRange& range)
+{
+	if (!block.vertices.Allocate(vertexCount, range.vertexOffset))
+		return false;
+
+	if (!block.indices[indexBufferIndex].Allocate(indexCount, range.firstIndex))
+	{
+		block.vertices.Free(range.vertexOffset, vertexCount);
+		return false;
+	}
+
+	return true;
+}
+
+bool MeshPool::Upload(VKBase& base, const Vertex* vertices, unsigned int vertexCount, const void* indices, unsigned int indexCount, VkIndexType indexType, MeshRange& range)
+{
+	unsigned int indexBufferIndex = GetIndexBufferIndex(indexType);
+	unsigned int indexSize = GetIndexSize(indexType);
+
+	range.vertexCount = vertexCount;
+	range.indexCount = indexCount;
+	range.indexType = indexType;
+	range.block = 0;
+
+	while (range.block < blocks.size() && !Allocate(blocks[range.block], vertexCount, indexCount, indexBufferIndex, range))
+		range.block++;
+
+	// Every block is full so a new one is chained, large enough for the mesh
+	if (range.block == blocks.size())
+	{
+		if (!CreateBlock(base, std::max(blockVertices, vertexCount), std::max(blockIndices, indexCount)) || !Allocate(blocks.back(), vertexCount, indexCount, indexBufferIndex, range))
+		{
+			std::cout << "Failed to upload mesh, mesh pool is full\n";
+			return false;
+		}
+	}
+
+	const Block& block = blocks[range.block];
+
+	VKUploadManager& uploadManager = base.GetUploadManager();
+	UploadToken vertexToken = uploadManager.UploadBuffer(vertices, (VkDeviceSize)vertexCount * sizeof(Vertex), block.vertexBuffer.GetBuffer(), (VkDeviceSize)range.vertexOffset * sizeof(Vertex), VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+	UploadToken indexToken = uploadManager.UploadBuffer(indices, (VkDeviceSize)indexCount * indexSize, block.indexBuffers[indexBufferIndex].GetBuffer(), (VkDeviceSize)range.firstIndex * indexSize, VK_ACCESS_INDEX_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+
+	numVertices += vertexCount;
+	numIndices[indexBufferIndex] += indexCount;
+
+	if ((vertexCount > 0 && vertexToken == 0) || (indexCount > 0 && indexToken == 0))
+	{
+		std::cout << "Failed to upload mesh\n";
+		// Nothing draws the mesh so the ranges can be reused right away, a copy that was queued is overwritten by the next upload to them
+		Free(range);
+		return false;
+	}
+
+	range.uploadToken = std::max(vertexToken, indexToken);
+
+	return true;
+}
+
+void MeshPool::Free(const MeshRange& range)
+{
+	unsigned int indexBufferIndex = GetIndexBufferIndex(range.indexType);
+	Block& block = blocks[range.block];
+
+	block.vertices.Free(range.vertexOffset, range.vertexCount);
+	block.indices[indexBufferIndex].Free(range.firstIndex, range.indexCount);
+
+	numVertices -= range.vertexCount;
+	numIndices[indexBufferIndex] -= range.indexCount;
+}
+
+bool MeshPool::RangeAllocator::Allocate(unsigned int count, unsigned int& offset)
+{
+	if (count == 0)
+	{
+		offset = 0;
+		return true;
+	}
+
+	for (size_t i = 0; i < freeRanges.size(); i++)
+	{
+		FreeRange& r = freeRanges[i];
+		if (r.count < count)
+			continue;
+
+		offset = r.offset;
+		r.offset += count;
+		r.count -= count;
+
+		if (r.count == 0)
+			freeRanges.erase(freeRanges.begin() + i);
+
+		return true;
+	}
+
+	if (capacity - end < count)
+		return false;
+
+	offset = end;
+	end += count;
+
+	return true;
+}
+
+void MeshPool::RangeAllocator::Free(unsigned int offset, unsigned int count)
+{
+	if (count == 0)
+		return;
+
+	auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), offset, [](const FreeRange& r, unsigned int o) { return r.offset < o; });
+
+	// Merge with the previous free range
+	if (next != freeRanges.begin() && (next - 1)->offset + (next - 1)->count == offset)
+	{
+		--next;
+		offset = next->offset;
+		count += next->count;
+		next = freeRanges.erase(next);
+	}
+	// Merge with the next free range
+	if (next != freeRanges.end() && offset + count == next->offset)
+	{
+		count += next->count;
+		next = freeRanges.erase(next);
+	}
+
+	// A range at the end goes back to the unallocated space
+	if (offset + count == end)
+		end = offset;
+	else
+		freeRanges.insert(next, { offset, count });
+}
+
+void MeshPool::Bind(VkCommandBuffer cmdBuffer, unsigned int block, VkIndexType indexType) const
+{
+	VkBuffer vertexBuffers[] = { blocks[block].vertexBuffer.GetBuffer() };
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, vertexBuffers, offsets);
+	BindIndices(cmdBuffer, block, indexType);
+}
+
+void MeshPool::BindIndices(VkCommandBuffer cmdBuffer, unsigned int block, VkIndexType indexType) const
+{
+	vkCmdBindIndexBuffer(cmdBuffer, blocks[block].indexBuffers[GetIndexBufferIndex(indexType)].GetBuffer(), 0, indexType);
+}
+
+void MeshPool::Dispose(VkDevice device)
+{
+	for (Block& block : blocks)
+	{
+		block.vertexBuffer.Dispose(device);
+		block.indexBuffers[0].Dispose(device);
+		block.indexBuffers[1].Dispose(device);
+	}
+	blocks.clear();
+
+	numVertices = 0;
+	numIndices[0] = 0;
+	numIndices[1] = 0;
+}
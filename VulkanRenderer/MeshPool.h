@@ -0,0 +1,92 @@
+#pragma once
+
+#include "VKBuffer.h"
+#include "VertexTypes.h"
+#include "VKUploadManager.h"
+
+#include <vector>
+
+class VKBase;
+
+// Location of a mesh inside the pool buffers
+struct MeshRange
+{
+	unsigned int vertexOffset;		// In vertices. Used as the vertex offset of the draw, the indices are relative to it
+	unsigned int vertexCount;
+	unsigned int firstIndex;		// In the index buffer of the index type
+	unsigned int indexCount;
+	VkIndexType indexType;
+	unsigned int block;				// Pool block whose buffers hold the mesh
+	UploadToken uploadToken;		// The mesh can be drawn once the upload manager reports it as ready
+};
+
+// Every mesh is sub-allocated from the vertex buffer and the index buffer of its index type of a pool block, so the buffers are bound once per block and the meshes are selected with the draw's first index and vertex offset
+// Meshes use 16 bit indices when they fit and only meshes with more vertices use the 32 bit index buffers
+// A new block is created when a mesh doesn't fit in the existing ones and freed ranges are reused by the next uploads
+class MeshPool
+{
+public:
+	MeshPool();
+
+	// Every block has room for blockVertices and both of its index buffers for blockIndices, unless a larger mesh needs a larger block
+	bool Init(VKBase& base, unsigned int blockVertices, unsigned int blockIndices);
+	// Queues the copy of the mesh to free ranges of the first block with room on the upload manager. The indices are unsigned short or unsigned int depending on the index type
+	// Returns false if there's no room and no more blocks can be created
+	bool Upload(VKBase& base, const Vertex* vertices, unsigned int vertexCount, const void* indices, unsigned int indexCount, VkIndexType indexType, MeshRange& range);
+	// Returns the ranges of the mesh to the free lists of its block. No frame in flight can still be drawing the mesh
+	void Free(const MeshRange& range);
+	// Binds the vertex buffer and the index buffer of the index type of the block
+	void Bind(VkCommandBuffer cmdBuffer, unsigned int block, VkIndexType indexType) const;
+	// Only switches the index buffer, the vertex buffer of the block stays bound
+	void BindIndices(VkCommandBuffer cmdBuffer, unsigned int block, VkIndexType indexType) const;
+	void Dispose(VkDevice device);
+
+	unsigned int GetNumBlocks() const { return static_cast<unsigned int>(blocks.size()); }
+	unsigned int GetNumVertices() const { return numVertices; }
+	unsigned int GetNumIndices(VkIndexType indexType) const { return numIndices[GetIndexBufferIndex(indexType)]; }
+
+	// Smallest index type that can address the vertices when the draw's vertex offset points to the first one
+	static VkIndexType GetIndexType(unsigned int vertexCount) { return vertexCount > 65536 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16; }
+	static unsigned int GetIndexSize(VkIndexType indexType) { return indexType == VK_INDEX_TYPE_UINT32 ? sizeof(unsigned int) : sizeof(unsigned short); }
+
+	// The block is stored in 7 bits of the draw sort keys
+	static const unsigned int MAX_BLOCKS = 128;
+
+private:
+	struct FreeRange
+	{
+		unsigned int offset;
+		unsigned int count;
+	};
+
+	// First fit sub-allocator of a buffer, in elements. The free ranges are sorted by offset and merged with their neighbours
+	struct RangeAllocator
+	{
+		unsigned int capacity;
+		unsigned int end;						// Everything after it is free
+		std::vector<FreeRange> freeRanges;
+
+		bool Allocate(unsigned int count, unsigned int& offset);
+		void Free(unsigned int offset, unsigned int count);
+	};
+
+	struct Block
+	{
+		VKBuffer vertexBuffer;
+		VKBuffer indexBuffers[2];			// 16 and 32 bit
+		RangeAllocator vertices;
+		RangeAllocator indices[2];
+	};
+
+	bool CreateBlock(VKBase& base, unsigned int maxVertices, unsigned int maxIndices);
+	// Allocates the vertices and the indices from the same block or neither
+	bool Allocate(Block& block, unsigned int vertexCount, unsigned int indexCount, unsigned int indexBufferIndex, MeshRange& range);
+	static unsigned int GetIndexBufferIndex(VkIndexType indexType) { return indexType == VK_INDEX_TYPE_UINT32 ? 1 : 0; }
+
+private:
+	std::vector<Block> blocks;
+	unsigned int blockVertices;
+	unsigned int blockIndices;
+	unsigned int numVertices;				// Allocated in every block
+	unsigned int numIndices[2];
+};
@@ -1,23 +1,90 @@
 #include "Model.h"
-#include "VKBuffer.h"
 #include "VertexTypes.h"
+#include "MeshOptimizer.h"
 
 #include "assimp/scene.h"
 #include "assimp/Importer.hpp"
 #include "assimp/postprocess.h"
 
+#include "Log.h"
+
 #include <vector>
 #include <iostream>
+#include <limits>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <algorithm>
 
 Model::Model()
 {
-	indexCount = 0;
+	range = {};
+	numLods = 1;
+	boundsMin = glm::vec3(0.0f);
+	boundsMax = glm::vec3(0.0f);
+
+	for (unsigned int i = 0; i < MAX_MODEL_LODS; i++)
+	{
+		lodErrors[i] = 0.0f;
+	}
+}
+
+unsigned int Model::SelectLod(float screenScale, float maxScreenError) const
+{
+	unsigned int lod = 0;
+
+	while (lod + 1 < numLods && lodErrors[lod + 1] * screenScale <= maxScreenError)
+		lod++;
+
+	return lod;
 }
 
-bool Model::Load(VKBase& base, const std::string& path)
+bool Model::Load(VKBase& base, MeshPool& meshPool, const std::string& path)
+{
+	ModelData data;
+
+	if (!Import(path, data))
+		return false;
+
+	return Upload(base, meshPool, data);
+}
+
+bool Model::Import(const std::string& path, ModelData& data)
+{
+	std::string cookedPath = GetCookedPath(path);
+
+	// Use the cooked file unless the source was modified after it was cooked
+	std::error_code error;
+	std::filesystem::file_time_type cookedTime = std::filesystem::last_write_time(cookedPath, error);
+	bool cookedUpToDate = !error;
+
+	if (cookedUpToDate)
+	{
+		// Only the cooked file might be available
+		std::filesystem::file_time_type sourceTime = std::filesystem::last_write_time(path, error);
+		cookedUpToDate = error || cookedTime >= sourceTime;
+	}
+
+	if (cookedUpToDate && LoadCooked(cookedPath, data))
+		return true;
+
+	if (!ImportSource(path, data))
+		return false;
+
+	// Loading still works without the cooked file, it just has to import the source again next time
+	if (Cook(data, cookedPath))
+		Log::Print(LogLevel::LEVEL_INFO, "Cooked model %s\n", cookedPath.c_str());
+	else
+		Log::Print(LogLevel::LEVEL_WARNING, "Failed to cook model %s\n", cookedPath.c_str());
+
+	return true;
+}
+
+bool Model::ImportSource(const std::string& path, ModelData& data)
 {
 	Assimp::Importer importer;
-	const aiScene* aiscene = importer.ReadFile(path, aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs); //| aiProcess_GenSmoothNormals); //| aiProcess_CalcTangentSpace);
+	// CAD and scan exports often have polygons and meshes without normals
+	const aiScene* aiscene = importer.ReadFile(path, aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs | aiProcess_Triangulate | aiProcess_GenNormals); //| aiProcess_GenSmoothNormals); //| aiProcess_CalcTangentSpace);
 
 	if (!aiscene || aiscene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !aiscene->mRootNode)
 	{
@@ -25,33 +92,76 @@ bool Model::Load(VKBase& base, const std::string& path)
 		return false;
 	}
 
-	std::vector<unsigned short> indices;
-	std::vector<Vertex> vertices;
+	std::vector<unsigned int>& indices = data.indices32;
+	std::vector<Vertex>& vertices = data.vertices;
+
+	data.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	data.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+
+	unsigned int totalVertices = 0;
+	unsigned int totalIndices = 0;
+	unsigned int maxSubMeshVertices = 0;
 
-	// Load all the model meshes
 	for (unsigned int i = 0; i < aiscene->mNumMeshes; i++)
 	{
 		const aiMesh* aimesh = aiscene->mMeshes[i];
+		totalVertices += aimesh->mNumVertices;
+		maxSubMeshVertices = std::max(maxSubMeshVertices, aimesh->mNumVertices);
 
 		for (unsigned int j = 0; j < aimesh->mNumFaces; j++)
 		{
-			aiFace face = aimesh->mFaces[j];
-
-			for (unsigned int k = 0; k < face.mNumIndices; k++)
-			{
-				indices.push_back(face.mIndices[k]);
-			}
+			// Points and lines are skipped
+			if (aimesh->mFaces[j].mNumIndices == 3)
+				totalIndices += 3;
 		}
+	}
+
+	vertices.resize(totalVertices);
+	indices.resize(totalIndices);
+	data.subMeshes.resize(aiscene->mNumMeshes);
+
+	unsigned int baseVertex = 0;
+	unsigned int numIndices = 0;
+
+	// Load all the model meshes into the same vertices and indices so the model is uploaded as one range
+	// The indices are relative to the sub mesh so the index type only depends on the largest sub mesh
+	for (unsigned int i = 0; i < aiscene->mNumMeshes; i++)
+	{
+		const aiMesh* aimesh = aiscene->mMeshes[i];
+
+		SubMesh& subMesh = data.subMeshes[i];
+		subMesh.lods[0].firstIndex = numIndices;
+		subMesh.vertexOffset = baseVertex;
+		subMesh.vertexCount = aimesh->mNumVertices;
+
+		for (unsigned int j = 0; j < aimesh->mNumFaces; j++)
+		{
+			const aiFace& face = aimesh->mFaces[j];
 
+			if (face.mNumIndices != 3)
+				continue;
 
-		vertices.resize(aimesh->mNumVertices);
+			indices[numIndices++] = face.mIndices[0];
+			indices[numIndices++] = face.mIndices[1];
+			indices[numIndices++] = face.mIndices[2];
+		}
+
+		subMesh.lods[0].indexCount = numIndices - subMesh.lods[0].firstIndex;
 
 		for (unsigned int j = 0; j < aimesh->mNumVertices; j++)
 		{
-			Vertex& v = vertices[j];
+			Vertex& v = vertices[baseVertex + j];
 
 			v.pos = glm::vec3(aimesh->mVertices[j].x, aimesh->mVertices[j].y, aimesh->mVertices[j].z);
-			v.normal = glm::vec3(aimesh->mNormals[j].x, aimesh->mNormals[j].y, aimesh->mNormals[j].z);
+
+			// GenNormals only creates normals for triangles so meshes of points or lines have none. Their vertices aren't drawn but still need a valid normal
+			if (aimesh->mNormals)
+				v.normal = glm::vec3(aimesh->mNormals[j].x, aimesh->mNormals[j].y, aimesh->mNormals[j].z);
+			else
+				v.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+
+			data.boundsMin = glm::min(data.boundsMin, v.pos);
+			data.boundsMax = glm::max(data.boundsMax, v.pos);
 
 			if (aimesh->mTextureCoords[0])
 			{
@@ -65,42 +175,311 @@ bool Model::Load(VKBase& base, const std::string& path)
 			}
 		}
 
-		indexCount = static_cast<unsigned short>(indices.size());
+		baseVertex += aimesh->mNumVertices;
+	}
+
+	OptimizeSubMeshes(path, data);
+	GenerateLods(path, data);
+
+	data.vertexData = vertices.data();
+	data.numVertices = totalVertices;
+	data.numIndices = static_cast<unsigned int>(indices.size());
+	data.indexType = MeshPool::GetIndexType(maxSubMeshVertices);
+
+	if (data.indexType == VK_INDEX_TYPE_UINT16)
+	{
+		data.indices16.assign(indices.begin(), indices.end());
+		data.indexData = data.indices16.data();
+		indices.clear();
+		indices.shrink_to_fit();
+	}
+	else
+	{
+		data.indexData = indices.data();
+	}
+
+	return true;
+}
+
+void Model::OptimizeSubMeshes(const std::string& path, ModelData& data)
+{
+	VertexCacheStats before = {};
+	VertexCacheStats after = {};
+
+	// The indices are relative to the sub mesh so every sub mesh is optimized on its own
+	for (const SubMesh& subMesh : data.subMeshes)
+	{
+		unsigned int* indices = data.indices32.data() + subMesh.lods[0].firstIndex;
+		unsigned int indexCount = subMesh.lods[0].indexCount;
+		Vertex* vertices = data.vertices.data() + subMesh.vertexOffset;
+
+		VertexCacheStats stats = MeshOptimizer::AnalyzeVertexCache(indices, indexCount, subMesh.vertexCount);
+		before.misses += stats.misses;
+		before.triangles += stats.triangles;
+		before.vertices += stats.vertices;
+
+		std::vector<unsigned int> clusters;
+		MeshOptimizer::OptimizeVertexCache(indices, indexCount, subMesh.vertexCount, clusters);
+		MeshOptimizer::OptimizeOverdraw(indices, indexCount, vertices, subMesh.vertexCount, clusters, OVERDRAW_THRESHOLD);
+		MeshOptimizer::OptimizeVertexFetch(indices, indexCount, vertices, subMesh.vertexCount);
+
+		stats = MeshOptimizer::AnalyzeVertexCache(indices, indexCount, subMesh.vertexCount);
+		after.misses += stats.misses;
+		after.triangles += stats.triangles;
+		after.vertices += stats.vertices;
+	}
+
+	if (before.triangles == 0)
+		return;
+
+	Log::Print(LogLevel::LEVEL_INFO, "Optimized %s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", path.c_str(),
+		before.misses / (float)before.triangles, after.misses / (float)after.triangles, before.misses / (float)before.vertices, after.misses / (float)after.vertices);
+}
+
+void Model::GenerateLods(const std::string& path, ModelData& data)
+{
+	std::vector<unsigned int>& indices = data.indices32;
+
+	float maxError = glm::length(data.boundsMax - data.boundsMin) * LOD_MAX_ERROR;
+	unsigned int lod0Triangles = 0;
+
+	for (SubMesh& subMesh : data.subMeshes)
+	{
+		lod0Triangles += subMesh.lods[0].indexCount / 3;
+
+		for (unsigned int lod = 1; lod < MAX_MODEL_LODS; lod++)
+		{
+			subMesh.lods[lod] = subMesh.lods[0];
+		}
+	}
+
+	data.numLods = 1;
+	data.lodErrors[0] = 0.0f;
+
+	std::vector<unsigned int> lodIndices;
+
+	for (unsigned int lod = 1; lod < MAX_MODEL_LODS; lod++)
+	{
+		bool reduced = false;
+		float lodError = data.lodErrors[lod - 1];
+
+		for (SubMesh& subMesh : data.subMeshes)
+		{
+			const LodRange& previous = subMesh.lods[lod - 1];
+			const LodRange& source = subMesh.lods[0];
+			const Vertex* vertices = data.vertices.data() + subMesh.vertexOffset;
+
+			// Simplify from LOD 0 so the error is measured against the imported mesh
+			unsigned int targetIndexCount = static_cast<unsigned int>(previous.indexCount * LOD_REDUCTION) / 3 * 3;
+			float error = 0.0f;
+
+			lodIndices.resize(source.indexCount);
+			unsigned int indexCount = MeshOptimizer::Simplify(lodIndices.data(), indices.data() + source.firstIndex, source.indexCount, vertices, subMesh.vertexCount, targetIndexCount, maxError, error);
+
+			// Keep the previous LOD if this one isn't worth the extra indices
+			if (indexCount == 0 || indexCount > previous.indexCount * LOD_MIN_REDUCTION)
+			{
+				subMesh.lods[lod] = previous;
+				continue;
+			}
+
+			std::vector<unsigned int> clusters;
+			MeshOptimizer::OptimizeVertexCache(lodIndices.data(), indexCount, subMesh.vertexCount, clusters);
+
+			subMesh.lods[lod].firstIndex = static_cast<unsigned int>(indices.size());
+			subMesh.lods[lod].indexCount = indexCount;
+			indices.insert(indices.end(), lodIndices.begin(), lodIndices.begin() + indexCount);
+
+			lodError = std::max(lodError, error);
+			reduced = true;
+		}
+
+		if (!reduced)
+			break;
+
+		data.lodErrors[lod] = lodError;
+		data.numLods = lod + 1;
+
+		unsigned int lodTriangles = 0;
+		for (const SubMesh& subMesh : data.subMeshes)
+		{
+			lodTriangles += subMesh.lods[lod].indexCount / 3;
+		}
+
+		Log::Print(LogLevel::LEVEL_INFO, "%s LOD %u: %u of %u triangles, error %f\n", path.c_str(), lod, lodTriangles, lod0Triangles, lodError);
+	}
+}
+
+namespace
+{
+	const uint32_t COOKED_MAGIC = 0x48534D56;		// VMSH
+	const uint64_t COOKED_ALIGNMENT = 16;
+
+	// The file is the header followed by the sub meshes, the vertices and the indices. Each blob starts at a multiple of COOKED_ALIGNMENT
+	struct CookedHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t vertexSize;			// The file is cooked again if the Vertex struct changed
+		uint32_t indexSize;
+		uint32_t numVertices;
+		uint32_t numIndices;
+		uint32_t numSubMeshes;
+		uint32_t numLods;
+		float boundsMin[3];
+		float boundsMax[3];
+		float lodErrors[MAX_MODEL_LODS];
+		uint64_t subMeshesOffset;
+		uint64_t verticesOffset;
+		uint64_t indicesOffset;
+	};
+
+	uint64_t AlignOffset(uint64_t offset)
+	{
+		return (offset + COOKED_ALIGNMENT - 1) & ~(COOKED_ALIGNMENT - 1);
+	}
+}
+
+std::string Model::GetCookedPath(const std::string& path)
+{
+	return std::filesystem::path(path).replace_extension(".mesh").string();
+}
+
+bool Model::Cook(const ModelData& data, const std::string& cookedPath)
+{
+	CookedHeader header = {};
+	header.magic = COOKED_MAGIC;
+	header.version = COOKED_VERSION;
+	header.vertexSize = sizeof(Vertex);
+	header.indexSize = MeshPool::GetIndexSize(data.indexType);
+	header.numVertices = data.numVertices;
+	header.numIndices = data.numIndices;
+	header.numSubMeshes = static_cast<uint32_t>(data.subMeshes.size());
+	header.boundsMin[0] = data.boundsMin.x;
+	header.boundsMin[1] = data.boundsMin.y;
+	header.boundsMin[2] = data.boundsMin.z;
+	header.boundsMax[0] = data.boundsMax.x;
+	header.boundsMax[1] = data.boundsMax.y;
+	header.boundsMax[2] = data.boundsMax.z;
+	header.numLods = data.numLods;
+	memcpy(header.lodErrors, data.lodErrors, sizeof(header.lodErrors));
+	header.subMeshesOffset = AlignOffset(sizeof(CookedHeader));
+	header.verticesOffset = AlignOffset(header.subMeshesOffset + header.numSubMeshes * sizeof(SubMesh));
+	header.indicesOffset = AlignOffset(header.verticesOffset + (uint64_t)header.numVertices * sizeof(Vertex));
 
-		VKBuffer vertexStagingBuffer, indexStagingBuffer;
+	// Write to a temporary file first so a failed write never leaves a truncated cooked file behind
+	std::string tempPath = cookedPath + ".tmp";
+	std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
 
-		VkDevice device = base.GetDevice();
+	if (!file.is_open())
+		return false;
 
-		vertexStagingBuffer.Create(&base, vertices.size() * sizeof(Vertex), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		indexStagingBuffer.Create(&base, indices.size() * sizeof(unsigned short), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	const char zeros[COOKED_ALIGNMENT] = {};
 
-		unsigned int vertexSize = vertexStagingBuffer.GetSize();
+	auto writeBlob = [&file, &zeros](uint64_t offset, const void* blob, uint64_t size)
+	{
+		uint64_t position = static_cast<uint64_t>(file.tellp());
+		file.write(zeros, static_cast<std::streamsize>(offset - position));
+		file.write(static_cast<const char*>(blob), static_cast<std::streamsize>(size));
+	};
 
-		void* data;
-		vkMapMemory(device, vertexStagingBuffer.GetBufferMemory(), 0, vertexSize, 0, &data);
-		memcpy(data, vertices.data(), (size_t)vertexSize);
-		vkUnmapMemory(device, vertexStagingBuffer.GetBufferMemory());
+	file.write(reinterpret_cast<const char*>(&header), sizeof(CookedHeader));
+	writeBlob(header.subMeshesOffset, data.subMeshes.data(), header.numSubMeshes * sizeof(SubMesh));
+	writeBlob(header.verticesOffset, data.vertexData, (uint64_t)header.numVertices * sizeof(Vertex));
+	writeBlob(header.indicesOffset, data.indexData, (uint64_t)header.numIndices * header.indexSize);
 
-		unsigned int indexSize = indexStagingBuffer.GetSize();
-		vkMapMemory(device, indexStagingBuffer.GetBufferMemory(), 0, indexSize, 0, &data);
-		memcpy(data, indices.data(), (size_t)indexSize);
-		vkUnmapMemory(device, indexStagingBuffer.GetBufferMemory());
+	bool written = file.good();
+	file.close();
 
-		vertexBuffer.Create(&base, vertices.size() * sizeof(Vertex), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		indexBuffer.Create(&base, indices.size() * sizeof(unsigned short), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	std::error_code error;
 
-		base.CopyBuffer(vertexStagingBuffer, vertexBuffer, vertexSize);
-		base.CopyBuffer(indexStagingBuffer, indexBuffer, indexSize);
+	if (!written)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
 
-		vertexStagingBuffer.Dispose(device);
-		indexStagingBuffer.Dispose(device);
+	std::filesystem::rename(tempPath, cookedPath, error);
+
+	return !error;
+}
+
+bool Model::LoadCooked(const std::string& cookedPath, ModelData& data)
+{
+	if (!data.cookedFile.Open(cookedPath))
+		return false;
+
+	const unsigned char* fileData = data.cookedFile.GetData();
+	uint64_t fileSize = data.cookedFile.GetSize();
+
+	if (fileSize < sizeof(CookedHeader))
+	{
+		data.cookedFile.Close();
+		return false;
 	}
 
+	CookedHeader header;
+	memcpy(&header, fileData, sizeof(CookedHeader));
+
+	// Old or broken files are cooked again
+	bool valid = header.magic == COOKED_MAGIC && header.version == COOKED_VERSION && header.vertexSize == sizeof(Vertex) &&
+		(header.indexSize == sizeof(unsigned short) || header.indexSize == sizeof(unsigned int)) &&
+		header.subMeshesOffset % COOKED_ALIGNMENT == 0 && header.verticesOffset % COOKED_ALIGNMENT == 0 && header.indicesOffset % COOKED_ALIGNMENT == 0 &&
+		header.subMeshesOffset + (uint64_t)header.numSubMeshes * sizeof(SubMesh) <= fileSize &&
+		header.verticesOffset + (uint64_t)header.numVertices * sizeof(Vertex) <= fileSize &&
+		header.indicesOffset + (uint64_t)header.numIndices * header.indexSize <= fileSize &&
+		header.numLods >= 1 && header.numLods <= MAX_MODEL_LODS;
+
+	if (!valid)
+	{
+		Log::Print(LogLevel::LEVEL_WARNING, "Cooked model %s is out of date or invalid\n", cookedPath.c_str());
+		data.cookedFile.Close();
+		return false;
+	}
+
+	const SubMesh* subMeshes = reinterpret_cast<const SubMesh*>(fileData + header.subMeshesOffset);
+	data.subMeshes.assign(subMeshes, subMeshes + header.numSubMeshes);
+
+	// The draws would read outside of the model
+	for (const SubMesh& subMesh : data.subMeshes)
+	{
+		bool lodsValid = true;
+		for (unsigned int lod = 0; lod < MAX_MODEL_LODS; lod++)
+		{
+			lodsValid = lodsValid && (uint64_t)subMesh.lods[lod].firstIndex + subMesh.lods[lod].indexCount <= header.numIndices;
+		}
+
+		if (!lodsValid || (uint64_t)subMesh.vertexOffset + subMesh.vertexCount > header.numVertices)
+		{
+			Log::Print(LogLevel::LEVEL_WARNING, "Cooked model %s is out of date or invalid\n", cookedPath.c_str());
+			data.cookedFile.Close();
+			data.subMeshes.clear();
+			return false;
+		}
+	}
+
+	// The vertices and indices stay in the mapped file and are copied from it straight to the staging memory
+	data.vertexData = reinterpret_cast<const Vertex*>(fileData + header.verticesOffset);
+	data.indexData = fileData + header.indicesOffset;
+	data.indexType = header.indexSize == sizeof(unsigned int) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16;
+	data.numVertices = header.numVertices;
+	data.numIndices = header.numIndices;
+	data.boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+	data.boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+	data.numLods = header.numLods;
+	memcpy(data.lodErrors, header.lodErrors, sizeof(data.lodErrors));
+
 	return true;
 }
 
-void Model::Dispose(VkDevice device)
+bool Model::Upload(VKBase& base, MeshPool& meshPool, const ModelData& data)
 {
-	vertexBuffer.Dispose(device);
-	indexBuffer.Dispose(device);
+	boundsMin = data.boundsMin;
+	boundsMax = data.boundsMax;
+
+	subMeshes = data.subMeshes;
+	numLods = data.numLods;
+	memcpy(lodErrors, data.lodErrors, sizeof(lodErrors));
+
+	return meshPool.Upload(base, data.vertexData, data.numVertices, data.indexData, data.numIndices, data.indexType, range);
 }
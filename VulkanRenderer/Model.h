@@ -1,23 +1,106 @@
 #pragma once
 
-#include "VKBase.h"
+#include "MeshPool.h"
+#include "MappedFile.h"
+
+#include "glm/glm.hpp"
 
 #include <string>
+#include <vector>
+
+// LOD 0 is the imported mesh and every other LOD is simplified from it
+static const unsigned int MAX_MODEL_LODS = 4;
+
+struct LodRange
+{
+	unsigned int firstIndex;
+	unsigned int indexCount;
+};
+
+// Part of a model that came from one mesh of the source file. The offsets are relative to the model and the indices are relative to the sub mesh's first vertex
+// Every LOD uses the same vertices, only the indices change. Sub meshes that can't be simplified further repeat their last LOD
+struct SubMesh
+{
+	LodRange lods[MAX_MODEL_LODS];
+	unsigned int vertexOffset;
+	unsigned int vertexCount;
+};
+
+// CPU side of a model. The vertex and index data point to the vectors when imported from the source file or into the mapped file when cooked
+struct ModelData
+{
+	std::vector<Vertex> vertices;
+	std::vector<unsigned short> indices16;
+	std::vector<unsigned int> indices32;
+	MappedFile cookedFile;
+	const Vertex* vertexData = nullptr;
+	const void* indexData = nullptr;			// unsigned short or unsigned int depending on the index type
+	unsigned int numVertices = 0;
+	unsigned int numIndices = 0;
+	VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+	std::vector<SubMesh> subMeshes;
+	unsigned int numLods = 1;
+	float lodErrors[MAX_MODEL_LODS] = {};
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+};
 
 class Model
 {
 public:
 	Model();
-	bool Load(VKBase& base, const std::string &path);
-	void Dispose(VkDevice device);
+	// The vertices and indices are uploaded to the mesh pool, the model only keeps their location
+	bool Load(VKBase& base, MeshPool& meshPool, const std::string &path);
+	// Only reads the file and doesn't use Vulkan, so it can be called from a worker thread
+	// The cooked file next to the source is mapped if it's up to date, otherwise the source is imported with Assimp and cooked for the next run
+	static bool Import(const std::string& path, ModelData& data);
+	bool Upload(VKBase& base, MeshPool& meshPool, const ModelData& data);
+
+	// Writes the model to a binary file that can be mapped and copied straight to the GPU
+	static bool Cook(const ModelData& data, const std::string& cookedPath);
+	static std::string GetCookedPath(const std::string& path);
 
-	unsigned int GetIndexCount() const { return indexCount; }
-	const VKBuffer& GetVertexBuffer() const { return vertexBuffer; }
-	const VKBuffer& GetIndexBuffer() const { return indexBuffer; }
+	// Every sub mesh is drawn on its own with these parameters. The index buffer of the model's index type has to be bound
+	unsigned int GetNumSubMeshes() const { return static_cast<unsigned int>(subMeshes.size()); }
+	unsigned int GetIndexCount(unsigned int subMesh, unsigned int lod) const { return subMeshes[subMesh].lods[lod].indexCount; }
+	unsigned int GetFirstIndex(unsigned int subMesh, unsigned int lod) const { return range.firstIndex + subMeshes[subMesh].lods[lod].firstIndex; }
+	int GetVertexOffset(unsigned int subMesh) const { return static_cast<int>(range.vertexOffset + subMeshes[subMesh].vertexOffset); }
+	VkIndexType GetIndexType() const { return range.indexType; }
+	const MeshRange& GetRange() const { return range; }
+	// Local space bounding box
+	const glm::vec3& GetBoundsMin() const { return boundsMin; }
+	const glm::vec3& GetBoundsMax() const { return boundsMax; }
+	const std::vector<SubMesh>& GetSubMeshes() const { return subMeshes; }
+	unsigned int GetNumLods() const { return numLods; }
+	// How far the surface of the LOD can be from the imported mesh, in model space
+	float GetLodError(unsigned int lod) const { return lodErrors[lod]; }
+	// Coarsest LOD whose error covers at most maxScreenError of the view. screenScale is the fraction of the view covered by one model space unit
+	unsigned int SelectLod(float screenScale, float maxScreenError) const;
+
+	// Increase when the cooked layout or the Vertex struct changes so the old files are cooked again
+	static const unsigned int COOKED_VERSION = 4;
+	// How much worse than the vertex cache optimized order the ACMR can get to reduce overdraw
+	static constexpr float OVERDRAW_THRESHOLD = 1.05f;
+	// Every LOD targets this fraction of the triangles of the previous one
+	static constexpr float LOD_REDUCTION = 0.5f;
+	// LODs stop when the error would be bigger than this fraction of the bounding box diagonal or when they don't remove enough triangles
+	static constexpr float LOD_MAX_ERROR = 0.05f;
+	static constexpr float LOD_MIN_REDUCTION = 0.8f;
 
 private:
-	unsigned int indexCount;
-	VKBuffer vertexBuffer;
-	VKBuffer indexBuffer;
+	static bool ImportSource(const std::string& path, ModelData& data);
+	// Reorders the triangles and vertices of every sub mesh for the vertex cache, overdraw and vertex fetch. Done before cooking so it only runs on the first import
+	static void OptimizeSubMeshes(const std::string& path, ModelData& data);
+	// Simplifies every sub mesh into the LOD chain and adds the indices of the LODs after the imported ones
+	static void GenerateLods(const std::string& path, ModelData& data);
+	static bool LoadCooked(const std::string& cookedPath, ModelData& data);
+
+private:
+	MeshRange range;
+	std::vector<SubMesh> subMeshes;
+	unsigned int numLods;
+	float lodErrors[MAX_MODEL_LODS];
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
 };
 
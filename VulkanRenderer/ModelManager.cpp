@@ -1,15 +1,52 @@
 #include "ModelManager.h"
 #include "VertexTypes.h"
+#include "TransformManager.h"
+#include "JobSystem.h"
+#include "InstanceBuffer.h"
+#include "Log.h"
 
 #include <iostream>
+#include <algorithm>
+#include <limits>
 
 ModelManager::ModelManager()
 {
-	instanceDataOffset = 0;
+	numVisibleModels = 0;
+	instanceCapacity = 0;
+	instancesBuffer = VK_NULL_HANDLE;
+	renderer = nullptr;
+	uploadManager = nullptr;
+	jobSystem = nullptr;
+	numLoadedSinceIdle = 0;
+	pendingDecodes = 0;
+	stats = {};
+	lastFrameStats = {};
+
+	gpuDriven = false;
+	batchesDirty = true;
+	culledThisFrame = false;
+	multiDrawIndirect = false;
+	culledFrame = 0;
+	numDraws = 0;
+	numViewInstances = 0;
+	bindless = false;
+	bindlessTexturesSet = VK_NULL_HANDLE;
+
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		cullFrames[i].mappedUpload = nullptr;
+		cullFrames[i].commandsOffset = 0;
+		cullFrames[i].objectCapacity = 0;
+		cullFrames[i].drawCapacity = 0;
+		cullFrames[i].viewSize = 0;
+		cullFrames[i].copyAll = true;
+	}
 }
 
-bool ModelManager::Init(VKRenderer* renderer, VkRenderPass renderPass)
+bool ModelManager::Init(VKRenderer* renderer, VkRenderPass renderPass, JobSystem* jobSystem)
 {
+	this->jobSystem = jobSystem;
+
 	// Create the pipeline
 
 	VkVertexInputBindingDescription bindingDesc = {};
@@ -68,80 +105,1027 @@ bool ModelManager::Init(VKRenderer* renderer, VkRenderPass renderPass)
 	pipeInfo.dynamicState.pDynamicStates = dynamicStates;
 
 
-	vertexShader.LoadShader(device, "shader", VK_SHADER_STAGE_VERTEX_BIT);
-	fragmentShader.LoadShader(device, "shader", VK_SHADER_STAGE_FRAGMENT_BIT);
+	// The bindless shaders index the texture array with the texture of the instance
+	bindless = renderer->IsBindless();
+	bindlessTexturesSet = renderer->GetBindlessTexturesSet();
+	const char* shaderName = bindless ? "shader_bindless" : "shader";
+
+	vertexShader.LoadShader(device, shaderName, VK_SHADER_STAGE_VERTEX_BIT);
+	fragmentShader.LoadShader(device, shaderName, VK_SHADER_STAGE_FRAGMENT_BIT);
 
-	if (!pipeline.Create(device, pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
+	if (!pipeline.Create(renderer->GetBase().GetPipelineCache(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
 	{
 		std::cout << "Failed to create model pipeline\n";
 		return false;
 	}
 
+	if (!meshPool.Init(base, POOL_BLOCK_VERTICES, POOL_BLOCK_INDICES))
+		return false;
+
+	uploadManager = &base.GetUploadManager();
+
+	if (!CreatePlaceholders(renderer))
+	{
+		std::cout << "Failed to create placeholder model\n";
+		return false;
+	}
+
 	return true;
 }
 
+bool ModelManager::EnableGPUDriven(VKRenderer* renderer)
+{
+	VKBase& base = renderer->GetBase();
+
+	// Objects, draw commands and instance indices
+	std::vector<VkDescriptorSetLayoutBinding> cullBindings(3);
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		cullBindings[i].binding = i;
+		cullBindings[i].descriptorCount = 1;
+		cullBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		cullBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+
+	if (!cullMat.Create(renderer, "model_cull", cullBindings, sizeof(unsigned int) * 2))
+	{
+		std::cout << "Failed to create model culling compute material\n";
+		return false;
+	}
+
+	this->renderer = renderer;
+
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		if (!CreateCullBuffers(i, INITIAL_GPU_OBJECTS, INITIAL_GPU_DRAWS))
+			return false;
+	}
+
+	multiDrawIndirect = base.GetEnabledFeatures().multiDrawIndirect == VK_TRUE;
+	gpuDriven = true;
+	batchesDirty = true;
+
+	return true;
+}
+
+bool ModelManager::CreateCullBuffers(unsigned int frame, unsigned int objectCapacity, unsigned int drawCapacity)
+{
+	VKBase& base = renderer->GetBase();
+	VkDevice device = base.GetDevice();
+	CullFrame& f = cullFrames[frame];
+
+	// The frame's fence was waited on so its old buffers are no longer used
+	f.uploadBuffer.Dispose(device);
+	f.drawCommandsBuffer.Dispose(device);
+	f.mappedUpload = nullptr;
+	f.objectCapacity = 0;
+	f.drawCapacity = 0;
+
+	VkDeviceSize objectsSize = NUM_CULL_HEADER_VECTORS * sizeof(glm::vec4) + objectCapacity * sizeof(GPUObject);
+	VkDeviceSize commandsSize = NUM_CULL_VIEWS * drawCapacity * sizeof(VkDrawIndexedIndirectCommand);
+
+	// The draw commands to reset to are after the objects
+	f.commandsOffset = objectsSize;
+
+	if (!f.uploadBuffer.Create(&base, static_cast<unsigned int>(objectsSize + commandsSize), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+	{
+		std::cout << "Failed to create model culling upload buffer\n";
+		return false;
+	}
+
+	f.mappedUpload = static_cast<unsigned char*>(f.uploadBuffer.Map(device, 0, VK_WHOLE_SIZE));
+	if (!f.mappedUpload)
+		return false;
+
+	if (!f.drawCommandsBuffer.Create(&base, static_cast<unsigned int>(commandsSize), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		std::cout << "Failed to create model culling draw commands buffer\n";
+		return false;
+	}
+
+	f.objectCapacity = objectCapacity;
+	f.drawCapacity = drawCapacity;
+	f.copyAll = true;
+
+	return true;
+}
+
+void ModelManager::UpdateInstanceBuffer(const InstanceBuffer& instanceBuffer, unsigned int frame)
+{
+	instanceCapacity = instanceBuffer.GetInstanceCapacity(frame);
+	instancesBuffer = instanceBuffer.GetInstancesBuffer(frame).GetBuffer();
+}
+
 bool ModelManager::AddModel(VKRenderer* renderer, Entity e, const std::string& path, const std::string& texturePath)
 {
 	// Return the model and don't add a new entry if this entity already has a model
-	if (map.find(e.id) != map.end())
+	if (models.Has(e) || disabledModels.Has(e))
 	{
 		//return GetModel(e);
 		return true;
 	}
 
-	VKBase& base = renderer->GetBase();
-
+	// Reuse the mesh and texture if they were already loaded by another model
 	RenderModel renderModel = {};
+	renderModel.mesh = RequestMesh(path, false);
+	renderModel.texture = RequestTexture(texturePath, false);
 
-	if (renderModel.model.Load(base, path) == false)
+	if (!UploadMesh(renderer->GetBase(), renderModel.mesh))
 	{
 		std::cout << "Failed to load model: " << path << '\n';
 		return false;
 	}
+	if (!UploadTexture(renderer, renderModel.texture))
+	{
+		std::cout << "Failed to load texture: " << texturePath << '\n';
+		return false;
+	}
+
+	models.Add(e, renderModel);
+	batchesDirty = true;
+
+	return true;
+}
+
+ModelLoadHandle ModelManager::AddModelAsync(Entity e, const std::string& path, const std::string& texturePath)
+{
+	if (models.Has(e) || disabledModels.Has(e))
+	{
+		const RenderModel& rm = GetRenderModel(e);
+		return { rm.mesh, rm.texture };
+	}
+
+	RenderModel renderModel = {};
+	renderModel.mesh = RequestMesh(path, true);
+	renderModel.texture = RequestTexture(texturePath, true);
+
+	models.Add(e, renderModel);
+	batchesDirty = true;
+
+	return { renderModel.mesh, renderModel.texture };
+}
+
+void ModelManager::RemoveModel(Entity e)
+{
+	disabledModels.Remove(e);
+
+	if (!models.Has(e))
+		return;
+
+	// The bounds have the same order as the models, so the last model's bounds move with it. Models added after the last bounds update don't have any yet
+	unsigned int index = models.GetIndex(e);
+	unsigned int lastIndex = models.GetSize() - 1;
+	unsigned int numBounds = static_cast<unsigned int>(boundsMinX.size());
+
+	if (index < numBounds)
+	{
+		std::vector<float>* arrays[] = { &boundsMinX, &boundsMinY, &boundsMinZ, &boundsMaxX, &boundsMaxY, &boundsMaxZ, &worldScales };
+
+		for (std::vector<float>* a : arrays)
+		{
+			if (lastIndex < numBounds)
+			{
+				(*a)[index] = (*a)[lastIndex];
+				a->pop_back();
+			}
+			else
+			{
+				a->resize(index);
+			}
+		}
+	}
+
+	// The batches are rebuilt so every object is written again anyway
+	objectDirtyFrames.resize(boundsMinX.size());
+
+	models.Remove(e);
+	batchesDirty = true;
+}
+
+void ModelManager::OnEntitiesDestroyed(const Entity* entities, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		RemoveModel(entities[i]);
+	}
+}
+
+void ModelManager::OnEntitiesSetEnabled(const Entity* entities, unsigned int count, bool enable)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Entity e = entities[i];
+
+		if (enable && disabledModels.Has(e))
+		{
+			models.Add(e, disabledModels.Get(e));
+			disabledModels.Remove(e);
+			batchesDirty = true;
+		}
+		else if (!enable && models.Has(e))
+		{
+			RenderModel renderModel = models.Get(e);
+			RemoveModel(e);
+			disabledModels.Add(e, renderModel);
+		}
+	}
+}
+
+unsigned int ModelManager::RequestMesh(const std::string& path, bool async)
+{
+	auto it = meshIndices.find(path);
+	if (it != meshIndices.end())
+		return it->second;
+
+	unsigned int mesh = static_cast<unsigned int>(meshes.size());
+	meshes.push_back(Model());
+	meshIndices[path] = mesh;
+
+	meshLoads.emplace_back();
+	AssetLoad& load = meshLoads.back();
+	InitLoad(load, path);
+	pendingMeshes.push_back(mesh);
+
+	AssetLoad* loadPtr = &load;
+	auto decode = [loadPtr]()
+	{
+		loadPtr->decodeStartTime = std::chrono::steady_clock::now();
+		bool imported = Model::Import(loadPtr->path, loadPtr->meshData);
+		loadPtr->decodeEndTime = std::chrono::steady_clock::now();
+		loadPtr->state = imported ? AssetState::DECODED : AssetState::FAILED;
+	};
+
+	if (async && jobSystem)
+		jobSystem->Execute(decode, &pendingDecodes);
+	else
+		decode();
+
+	return mesh;
+}
+
+unsigned int ModelManager::RequestTexture(const std::string& path, bool async)
+{
+	auto it = textureIndices.find(path);
+	if (it != textureIndices.end())
+		return it->second;
+
+	unsigned int texture = static_cast<unsigned int>(textures.size());
+	textures.push_back(ModelTexture());
+	textureIndices[path] = texture;
+
+	textureLoads.emplace_back();
+	AssetLoad& load = textureLoads.back();
+	InitLoad(load, path);
+	pendingTextures.push_back(texture);
+
+	AssetLoad* loadPtr = &load;
+	auto decode = [loadPtr]()
+	{
+		loadPtr->decodeStartTime = std::chrono::steady_clock::now();
+		loadPtr->pixels = VKTexture2D::DecodeFile(loadPtr->path, loadPtr->width, loadPtr->height);
+		loadPtr->decodeEndTime = std::chrono::steady_clock::now();
+		loadPtr->state = loadPtr->pixels ? AssetState::DECODED : AssetState::FAILED;
+	};
+
+	if (async && jobSystem)
+		jobSystem->Execute(decode, &pendingDecodes);
+	else
+		decode();
+
+	return texture;
+}
+
+bool ModelManager::UploadMesh(VKBase& base, unsigned int mesh)
+{
+	AssetLoad& load = meshLoads[mesh];
+
+	// Already uploaded or still decoding
+	if (load.state != AssetState::DECODED)
+		return load.state != AssetState::FAILED;
+
+	load.uploadTime = std::chrono::steady_clock::now();
+
+	bool uploaded = meshes[mesh].Upload(base, meshPool, load.meshData);
+	load.state = uploaded ? AssetState::UPLOADING : AssetState::FAILED;
+	load.meshData = ModelData();
+
+	return uploaded;
+}
+
+bool ModelManager::UploadTexture(VKRenderer* renderer, unsigned int texture)
+{
+	AssetLoad& load = textureLoads[texture];
+
+	if (load.state != AssetState::DECODED)
+		return load.state != AssetState::FAILED;
+
+	load.uploadTime = std::chrono::steady_clock::now();
+
+	VKBase& base = renderer->GetBase();
+	ModelTexture& modelTexture = textures[texture];
 
 	TextureParams textureParams = {};
 	textureParams.format = VK_FORMAT_R8G8B8A8_SRGB;
 	textureParams.addressMode = VK_SAMPLER_ADDRESS_MODE_REPEAT;
 	textureParams.filter = VK_FILTER_LINEAR;
 
-	if (renderModel.texture.LoadFromFile(base, texturePath, textureParams) == false)
+	bool uploaded = modelTexture.texture.LoadFromPixels(base, load.pixels, load.width, load.height, textureParams);
+
+	VKTexture2D::FreePixels(load.pixels);
+	load.pixels = nullptr;
+
+	if (!uploaded || !CreateTextureSet(renderer, modelTexture))
 	{
-		std::cout << "Failed to load texture: " << texturePath << '\n';
+		load.state = AssetState::FAILED;
 		return false;
 	}
 
-	VkDevice device = base.GetDevice();
+	load.state = AssetState::UPLOADING;
 
-	renderModel.set = renderer->AllocateUserTextureDescriptorSet();
+	return true;
+}
+
+bool ModelManager::CreateTextureSet(VKRenderer* renderer, ModelTexture& modelTexture)
+{
+	if (bindless)
+	{
+		modelTexture.set = VK_NULL_HANDLE;
+		modelTexture.bindlessIndex = renderer->AddBindlessTexture(modelTexture.texture);
+
+		return modelTexture.bindlessIndex != VKRenderer::INVALID_BINDLESS_TEXTURE;
+	}
+
+	modelTexture.set = renderer->AllocateUserTextureDescriptorSet();
+
+	if (modelTexture.set == VK_NULL_HANDLE)
+		return false;
 
 	VkDescriptorImageInfo imageInfo = {};
 	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	imageInfo.imageView = renderModel.texture.GetImageView();
-	imageInfo.sampler = renderModel.texture.GetSampler();
+	imageInfo.imageView = modelTexture.texture.GetImageView();
+	imageInfo.sampler = modelTexture.texture.GetSampler();
 
 	VkWriteDescriptorSet descriptorWrites = {};
 	descriptorWrites.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	descriptorWrites.dstSet = renderModel.set;
+	descriptorWrites.dstSet = modelTexture.set;
 	descriptorWrites.dstBinding = 0;
 	descriptorWrites.dstArrayElement = 0;
 	descriptorWrites.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	descriptorWrites.descriptorCount = 1;
 	descriptorWrites.pImageInfo = &imageInfo;
 
-	vkUpdateDescriptorSets(device, 1, &descriptorWrites, 0, nullptr);
+	vkUpdateDescriptorSets(renderer->GetBase().GetDevice(), 1, &descriptorWrites, 0, nullptr);
+
+	return true;
+}
+
+void ModelManager::InitLoad(AssetLoad& load, const std::string& path)
+{
+	load.path = path;
+	load.state = AssetState::DECODING;
+	load.pixels = nullptr;
+	load.width = 0;
+	load.height = 0;
+	load.requestTime = std::chrono::steady_clock::now();
+	load.decodeStartTime = load.requestTime;
+	load.decodeEndTime = load.requestTime;
+	load.uploadTime = load.requestTime;
+
+	// Start timing a new group of loads
+	if (pendingMeshes.empty() && pendingTextures.empty())
+	{
+		firstPendingRequestTime = load.requestTime;
+		numLoadedSinceIdle = 0;
+	}
+}
+
+static double GetElapsedMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void ModelManager::UpdateLoads(VKRenderer* renderer, VkCommandBuffer cmdBuffer)
+{
+	if (pendingMeshes.empty() && pendingTextures.empty())
+		return;
+
+	VKBase& base = renderer->GetBase();
+	VkDeviceSize uploadedBytes = 0;
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	// Upload what the workers finished decoding, up to the frame budget. Only the main thread uses the mesh pool and the descriptor pool
+	for (size_t i = 0; i < pendingMeshes.size(); i++)
+	{
+		AssetLoad& load = meshLoads[pendingMeshes[i]];
+
+		if (load.state == AssetState::DECODED && uploadedBytes < MAX_LOAD_BYTES_PER_FRAME)
+		{
+			uploadedBytes += load.meshData.numVertices * sizeof(Vertex) + load.meshData.numIndices * MeshPool::GetIndexSize(load.meshData.indexType);
+			UploadMesh(base, pendingMeshes[i]);
+		}
+	}
+	for (size_t i = 0; i < pendingTextures.size(); i++)
+	{
+		AssetLoad& load = textureLoads[pendingTextures[i]];
+
+		if (load.state == AssetState::DECODED && uploadedBytes < MAX_LOAD_BYTES_PER_FRAME)
+		{
+			uploadedBytes += load.width * load.height * 4;
+			UploadTexture(renderer, pendingTextures[i]);
+		}
+	}
+
+	// Start the copies now instead of at the next frame
+	if (uploadedBytes > 0)
+		uploadManager->Flush();
+
+	// Switch to the assets whose upload finished. The upload manager already recorded their acquire barriers in this command buffer
+	auto finishLoad = [&](AssetLoad& load, const char* type)
+	{
+		if (load.state == AssetState::FAILED)
+		{
+			Log::Print(LogLevel::LEVEL_ERROR, "Failed to load %s %s\n", type, load.path.c_str());
+			return;
+		}
+
+		load.state = AssetState::READY;
+		numLoadedSinceIdle++;
+
+		Log::Print(LogLevel::LEVEL_INFO, "Loaded %s %s in %.2f ms (queued %.2f ms, decode %.2f ms, upload %.2f ms)\n", type, load.path.c_str(),
+			GetElapsedMs(load.requestTime, now), GetElapsedMs(load.requestTime, load.decodeStartTime), GetElapsedMs(load.decodeStartTime, load.decodeEndTime), GetElapsedMs(load.uploadTime, now));
+	};
+
+	auto meshIt = std::remove_if(pendingMeshes.begin(), pendingMeshes.end(), [&](unsigned int mesh)
+	{
+		AssetLoad& load = meshLoads[mesh];
+
+		if (load.state == AssetState::FAILED || (load.state == AssetState::UPLOADING && uploadManager->IsReady(meshes[mesh].GetRange().uploadToken)))
+		{
+			finishLoad(load, "mesh");
+
+			// The batches have one draw per sub mesh of the drawn mesh
+			batchesDirty = true;
+			return true;
+		}
+
+		return false;
+	});
+	pendingMeshes.erase(meshIt, pendingMeshes.end());
+
+	auto textureIt = std::remove_if(pendingTextures.begin(), pendingTextures.end(), [&](unsigned int texture)
+	{
+		AssetLoad& load = textureLoads[texture];
+		const VKTexture2D& t = textures[texture].texture;
+
+		if (load.state == AssetState::FAILED || (load.state == AssetState::UPLOADING && uploadManager->IsReady(t.GetUploadToken())))
+		{
+			if (load.state == AssetState::UPLOADING && t.GetNumMipLevels() > 1)
+				renderer->CreateMipMaps(cmdBuffer, t);
+
+			finishLoad(load, "texture");
+
+			// The objects and draws of its models don't use the placeholder anymore
+			InvalidateCulling();
+			return true;
+		}
 
-	ModelInstance mi = {};
-	mi.e = e;
-	mi.renderModel = renderModel;
+		return false;
+	});
+	pendingTextures.erase(textureIt, pendingTextures.end());
+
+	if (pendingMeshes.empty() && pendingTextures.empty())
+		Log::Print(LogLevel::LEVEL_INFO, "Loaded %u assets in %.2f ms\n", numLoadedSinceIdle, GetElapsedMs(firstPendingRequestTime, now));
+}
+
+bool ModelManager::CreatePlaceholders(VKRenderer* renderer)
+{
+	// Unit cube, four vertices per face so every face has its own normal
+	ModelData cube;
+	cube.boundsMin = glm::vec3(-0.5f);
+	cube.boundsMax = glm::vec3(0.5f);
+
+	const glm::vec3 normals[] = { glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f) };
+	const glm::vec2 uvs[] = { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(1.0f, 1.0f), glm::vec2(0.0f, 1.0f) };
+
+	for (unsigned int f = 0; f < 6; f++)
+	{
+		glm::vec3 n = normals[f];
+		glm::vec3 up = std::abs(n.y) > 0.5f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::vec3 right = glm::cross(up, n);
+		unsigned short baseVertex = static_cast<unsigned short>(cube.vertices.size());
+
+		for (unsigned int v = 0; v < 4; v++)
+		{
+			Vertex vertex = {};
+			vertex.pos = (n + right * (uvs[v].x * 2.0f - 1.0f) + up * (uvs[v].y * 2.0f - 1.0f)) * 0.5f;
+			vertex.uv = uvs[v];
+			vertex.normal = n;
+			cube.vertices.push_back(vertex);
+		}
+
+		const unsigned short faceIndices[] = { 0, 1, 2, 2, 3, 0 };
+		for (unsigned int i = 0; i < 6; i++)
+		{
+			cube.indices16.push_back(static_cast<unsigned short>(baseVertex + faceIndices[i]));
+		}
+	}
+
+	cube.vertexData = cube.vertices.data();
+	cube.indexData = cube.indices16.data();
+	cube.numVertices = static_cast<unsigned int>(cube.vertices.size());
+	cube.numIndices = static_cast<unsigned int>(cube.indices16.size());
+	cube.indexType = VK_INDEX_TYPE_UINT16;
+
+	SubMesh subMesh = {};
+	for (unsigned int l = 0; l < MAX_MODEL_LODS; l++)
+	{
+		subMesh.lods[l] = { 0, cube.numIndices };
+	}
+	subMesh.vertexCount = cube.numVertices;
+	cube.subMeshes.push_back(subMesh);
+
+	// The placeholders go through the same loads as the other assets, so they are ready after the first UpdateLoads that sees their uploads finished
+	meshes.push_back(Model());
+	meshLoads.emplace_back();
+	InitLoad(meshLoads.back(), "placeholder");
+	pendingMeshes.push_back(PLACEHOLDER_MESH);
+
+	if (!meshes[PLACEHOLDER_MESH].Upload(renderer->GetBase(), meshPool, cube))
+		return false;
+
+	meshLoads.back().state = AssetState::UPLOADING;
+
+	// Grey texture
+	const unsigned char pixels[] = { 128, 128, 128, 255, 128, 128, 128, 255, 128, 128, 128, 255, 128, 128, 128, 255 };
+
+	TextureParams textureParams = {};
+	textureParams.format = VK_FORMAT_R8G8B8A8_SRGB;
+	textureParams.addressMode = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	textureParams.filter = VK_FILTER_NEAREST;
+	textureParams.dontCreateMipMaps = true;
 
-	InsertModelInstance(mi);
+	textures.push_back(ModelTexture());
+	textureLoads.emplace_back();
+	InitLoad(textureLoads.back(), "placeholder");
+	pendingTextures.push_back(PLACEHOLDER_TEXTURE);
+
+	if (!textures[PLACEHOLDER_TEXTURE].texture.LoadFromPixels(renderer->GetBase(), pixels, 2, 2, textureParams))
+		return false;
+	if (!CreateTextureSet(renderer, textures[PLACEHOLDER_TEXTURE]))
+		return false;
+
+	textureLoads.back().state = AssetState::UPLOADING;
 
 	return true;
 }
 
-void ModelManager::Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, VkPipeline shadowMapPipeline)
+void ModelManager::UpdateBounds(const TransformManager& transformManager)
+{
+	unsigned int numModels = models.GetSize();
+
+	boundsMinX.resize(numModels);
+	boundsMinY.resize(numModels);
+	boundsMinZ.resize(numModels);
+	boundsMaxX.resize(numModels);
+	boundsMaxY.resize(numModels);
+	boundsMaxZ.resize(numModels);
+	worldScales.resize(numModels);
+	visibleModels.resize(numModels);
+	// New models have to be written to the culling buffers of every frame
+	objectDirtyFrames.resize(numModels, ALL_FRAMES_DIRTY);
+
+	for (unsigned int i = 0; i < numModels; i++)
+	{
+		const Model& m = meshes[GetDrawnMesh(models[i].mesh)];
+		Entity e = models.GetEntity(i);
+		const glm::mat4& localToWorld = transformManager.GetLocalToWorld(e);
+
+		// Moved transforms and the ones whose index changed count as modified, the other objects are still the same in the culling buffers
+		if (transformManager.IsModified(e))
+			objectDirtyFrames[i] = ALL_FRAMES_DIRTY;
+
+		// Transform the center and project the extents on the world axes so the box still encloses the rotated model
+		glm::vec3 center = (m.GetBoundsMin() + m.GetBoundsMax()) * 0.5f;
+		glm::vec3 extents = (m.GetBoundsMax() - m.GetBoundsMin()) * 0.5f;
+
+		glm::vec3 worldCenter = glm::vec3(localToWorld * glm::vec4(center, 1.0f));
+		glm::vec3 worldExtents = glm::abs(glm::vec3(localToWorld[0])) * extents.x + glm::abs(glm::vec3(localToWorld[1])) * extents.y + glm::abs(glm::vec3(localToWorld[2])) * extents.z;
+
+		boundsMinX[i] = worldCenter.x - worldExtents.x;
+		boundsMinY[i] = worldCenter.y - worldExtents.y;
+		boundsMinZ[i] = worldCenter.z - worldExtents.z;
+		boundsMaxX[i] = worldCenter.x + worldExtents.x;
+		boundsMaxY[i] = worldCenter.y + worldExtents.y;
+		boundsMaxZ[i] = worldCenter.z + worldExtents.z;
+
+		worldScales[i] = glm::max(glm::length(glm::vec3(localToWorld[0])), glm::max(glm::length(glm::vec3(localToWorld[1])), glm::length(glm::vec3(localToWorld[2]))));
+	}
+}
+
+float ModelManager::GetLodScreenScale(unsigned int model, const Frustum& lodFrustum) const
+{
+	// Distance to the bounding sphere of the world bounds so big models don't switch while the camera is inside them
+	glm::vec3 boundsMin = glm::vec3(boundsMinX[model], boundsMinY[model], boundsMinZ[model]);
+	glm::vec3 boundsMax = glm::vec3(boundsMaxX[model], boundsMaxY[model], boundsMaxZ[model]);
+	float radius = glm::length(boundsMax - boundsMin) * 0.5f;
+	float distance = glm::max(glm::length((boundsMin + boundsMax) * 0.5f - lodFrustum.GetPosition()) - radius, 0.0f);
+
+	return lodFrustum.GetScreenScale(distance) * worldScales[model];
+}
+
+unsigned int ModelManager::GetMaxInstances() const
+{
+	if (!gpuDriven)
+		return 2 * models.GetSize();
+
+	// Models added since the batches were built might need every LOD
+	unsigned int numBatchedModels = static_cast<unsigned int>(modelBatches.size());
+	unsigned int numNewModels = models.GetSize() > numBatchedModels ? models.GetSize() - numBatchedModels : 0;
+
+	return NUM_CULL_VIEWS * (numViewInstances + numNewModels * MAX_MODEL_LODS);
+}
+
+BoxBounds ModelManager::GetWorldBounds() const
+{
+	BoxBounds bounds = {};
+	bounds.minX = boundsMinX.data();
+	bounds.minY = boundsMinY.data();
+	bounds.minZ = boundsMinZ.data();
+	bounds.maxX = boundsMaxX.data();
+	bounds.maxY = boundsMaxY.data();
+	bounds.maxZ = boundsMaxZ.data();
+
+	return bounds;
+}
+
+void ModelManager::RebuildBatches()
+{
+	unsigned int numObjects = models.GetSize();
+
+	drawQueue.resize(numObjects);
+
+	// Batches with the same pool block and index type are kept together so they can share a multi draw
+	for (unsigned int i = 0; i < numObjects; i++)
+	{
+		drawQueue[i].key = GetPoolKey(GetDrawnMesh(models[i].mesh)) | models[i].mesh;
+		drawQueue[i].model = i;
+
+		// The instances carry the texture when bindless so the models with the same mesh share a batch
+		if (!bindless)
+			drawQueue[i].key |= (uint64_t)models[i].texture << 32;
+	}
+
+	std::sort(drawQueue.begin(), drawQueue.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+
+	batches.clear();
+	modelBatches.resize(numObjects);
+	numDraws = 0;
+
+	for (unsigned int i = 0; i < numObjects; i++)
+	{
+		if (i == 0 || drawQueue[i].key != drawQueue[i - 1].key)
+		{
+			const RenderModel& rm = models[drawQueue[i].model];
+
+			DrawBatch batch = {};
+			batch.mesh = rm.mesh;
+			batch.drawnMesh = GetDrawnMesh(rm.mesh);
+			batch.texture = rm.texture;
+			batch.firstDraw = numDraws;
+			batch.numDraws = meshes[batch.drawnMesh].GetNumSubMeshes() * meshes[batch.drawnMesh].GetNumLods();
+			numDraws += batch.numDraws;
+			batches.push_back(batch);
+		}
+
+		batches.back().numInstances++;
+		modelBatches[drawQueue[i].model] = static_cast<unsigned int>(batches.size() - 1);
+	}
+
+	// In the instances of a view every batch has a region per LOD of its mesh. Batches that are still loading keep every LOD so switching to the loaded mesh doesn't need more than the instance buffer was sized for
+	numViewInstances = 0;
+
+	for (size_t b = 0; b < batches.size(); b++)
+	{
+		DrawBatch& batch = batches[b];
+		batch.numLodRegions = batch.drawnMesh == batch.mesh ? meshes[batch.mesh].GetNumLods() : MAX_MODEL_LODS;
+		batch.firstInstance = numViewInstances;
+		numViewInstances += batch.numInstances * batch.numLodRegions;
+	}
+
+	// The batches and draws of the objects changed
+	InvalidateCulling();
+	batchesDirty = false;
+}
+
+void ModelManager::RecordCulling(VkCommandBuffer cmdBuffer, unsigned int frameIndex, const TransformManager& transformManager, const Frustum& cameraFrustum, const Frustum& lightFrustum)
+{
+	if (!gpuDriven)
+		return;
+
+	if (batchesDirty)
+		RebuildBatches();
+
+	// Only the models that already have bounds can be culled
+	unsigned int numObjects = std::min(static_cast<unsigned int>(modelBatches.size()), static_cast<unsigned int>(boundsMinX.size()));
+	unsigned int numBatches = static_cast<unsigned int>(batches.size());
+
+	if (numObjects == 0 || numDraws == 0)
+		return;
+
+	CullFrame& f = cullFrames[frameIndex];
+
+	// Grow to at least twice the size so adding models one at a time doesn't recreate the buffers every frame
+	if (numObjects > f.objectCapacity || numDraws > f.drawCapacity)
+	{
+		unsigned int objectCapacity = numObjects > f.objectCapacity ? std::max(numObjects, f.objectCapacity * 2) : f.objectCapacity;
+		unsigned int drawCapacity = numDraws > f.drawCapacity ? std::max(numDraws, f.drawCapacity * 2) : f.drawCapacity;
+
+		if (!CreateCullBuffers(frameIndex, objectCapacity, drawCapacity))
+			return;
+	}
+
+	// Models added after the instance buffer was sized for this frame might not fit until the next one, so the batches past the capacity are skipped
+	unsigned int viewSize = std::min(numViewInstances, instanceCapacity / NUM_CULL_VIEWS);
+
+	// Objects, draw commands and instances of this frame. The set is only valid until the frame's fence is waited on again, then the renderer resets its pools
+	VkDescriptorSet cullSet = renderer->AllocateTransientSet(cullMat.GetSetLayout());
+	if (cullSet == VK_NULL_HANDLE)
+		return;
+
+	VkDescriptorBufferInfo bufferInfos[3] = {};
+	bufferInfos[0].buffer = f.uploadBuffer.GetBuffer();
+	bufferInfos[0].offset = 0;
+	bufferInfos[0].range = f.commandsOffset;
+	bufferInfos[1].buffer = f.drawCommandsBuffer.GetBuffer();
+	bufferInfos[1].offset = 0;
+	bufferInfos[1].range = VK_WHOLE_SIZE;
+	bufferInfos[2].buffer = instancesBuffer;
+	bufferInfos[2].offset = 0;
+	bufferInfos[2].range = VK_WHOLE_SIZE;
+
+	VkWriteDescriptorSet descriptorWrite = {};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = cullSet;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.dstArrayElement = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorWrite.descriptorCount = 3;
+	descriptorWrite.pBufferInfo = bufferInfos;
+
+	vkUpdateDescriptorSets(renderer->GetBase().GetDevice(), 1, &descriptorWrite, 0, nullptr);
+
+	// The frame fence has been waited on so this frame's buffers are no longer used by the GPU
+	unsigned char* region = f.mappedUpload;
+
+	glm::vec4* header = reinterpret_cast<glm::vec4*>(region);
+	cameraFrustum.GetPlanes(header);
+	lightFrustum.GetPlanes(header + 6);
+
+	// The shader uses the same screen scale as GetLodScreenScale. It's constant for orthographic frustums and scaled by the near plane distance over the distance for perspective ones
+	bool orthographic = cameraFrustum.GetType() == FrustumType::ORTHOGRAPHIC;
+	float nearPlane = cameraFrustum.GetNearPlane();
+	float screenScale = orthographic ? cameraFrustum.GetScreenScale(0.0f) : cameraFrustum.GetScreenScale(nearPlane) * nearPlane;
+	header[NUM_CULL_VIEWS * 6] = glm::vec4(cameraFrustum.GetPosition(), nearPlane);
+	header[NUM_CULL_VIEWS * 6 + 1] = glm::vec4(screenScale, orthographic ? 1.0f : 0.0f, LOD_MAX_SCREEN_ERROR, SHADOW_LOD_BIAS);
+
+	// The batches that fit in the instance buffer changed
+	if (viewSize != f.viewSize)
+	{
+		f.viewSize = viewSize;
+		f.copyAll = true;
+	}
+
+	// The frame's buffers keep the objects from the last time the frame was culled, so only the ones modified since then are written
+	GPUObject* objects = reinterpret_cast<GPUObject*>(region + NUM_CULL_HEADER_VECTORS * sizeof(glm::vec4));
+	unsigned char frameBit = 1 << frameIndex;
+
+	for (unsigned int i = 0; i < numObjects; i++)
+	{
+		if (!f.copyAll && (objectDirtyFrames[i] & frameBit) == 0)
+			continue;
+
+		objectDirtyFrames[i] &= ~frameBit;
+
+		GPUObject& o = objects[i];
+		o.boundsMin = glm::vec4(boundsMinX[i], boundsMinY[i], boundsMinZ[i], 0.0f);
+		o.boundsMax = glm::vec4(boundsMaxX[i], boundsMaxY[i], boundsMaxZ[i], 0.0f);
+
+		const DrawBatch& batch = batches[modelBatches[i]];
+		const Model& m = meshes[batch.drawnMesh];
+
+		for (unsigned int l = 0; l < MAX_MODEL_LODS; l++)
+		{
+			o.lodErrors[l] = l < m.GetNumLods() ? m.GetLodError(l) * worldScales[i] : 0.0f;
+		}
+
+		// Batches whose instances don't fit have no sub meshes so the shader skips them
+		bool fits = batch.firstInstance + batch.numInstances * batch.numLodRegions <= viewSize;
+		o.info = glm::uvec4(batch.firstDraw, fits ? m.GetNumSubMeshes() : 0, m.GetNumLods(), transformManager.GetTransformIndex(models.GetEntity(i)));
+		o.material = glm::uvec4(GetInstanceTexture(i), 0, 0, 0);
+	}
+
+	// Every view has one command per LOD and sub mesh of every batch, with the sub meshes of a LOD next to each other. The shader fills in the instance count
+	// They only change with the batches, the instance buffer size and the loads, the copy resets the instance counts every frame
+	VkDrawIndexedIndirectCommand* commands = reinterpret_cast<VkDrawIndexedIndirectCommand*>(region + f.commandsOffset);
+
+	for (unsigned int v = 0; v < NUM_CULL_VIEWS && f.copyAll; v++)
+	{
+		for (unsigned int b = 0; b < numBatches; b++)
+		{
+			// Batches that are still loading are drawn with the placeholder mesh
+			const DrawBatch& batch = batches[b];
+			const Model& m = meshes[batch.drawnMesh];
+			bool drawable = IsDrawable(batch.mesh, batch.texture);
+			unsigned int numSubMeshes = m.GetNumSubMeshes();
+
+			for (unsigned int d = 0; d < batch.numDraws; d++)
+			{
+				unsigned int lod = d / numSubMeshes;
+				unsigned int s = d % numSubMeshes;
+
+				// Every view and LOD has its own part of the instance data
+				VkDrawIndexedIndirectCommand& cmd = commands[v * numDraws + batch.firstDraw + d];
+				cmd.indexCount = drawable ? m.GetIndexCount(s, lod) : 0;
+				cmd.instanceCount = 0;
+				cmd.firstIndex = m.GetFirstIndex(s, lod);
+				cmd.vertexOffset = m.GetVertexOffset(s);
+				cmd.firstInstance = v * viewSize + batch.firstInstance + lod * batch.numInstances;
+			}
+		}
+	}
+
+	f.uploadBuffer.Flush(0, f.commandsOffset + NUM_CULL_VIEWS * numDraws * sizeof(VkDrawIndexedIndirectCommand));
+	f.copyAll = false;
+
+	// The previous frame has to be done drawing before the commands and instances are written again
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	VkBufferCopy copyRegion = {};
+	copyRegion.srcOffset = f.commandsOffset;
+	copyRegion.dstOffset = 0;
+	copyRegion.size = NUM_CULL_VIEWS * numDraws * sizeof(VkDrawIndexedIndirectCommand);
+	vkCmdCopyBuffer(cmdBuffer, f.uploadBuffer.GetBuffer(), f.drawCommandsBuffer.GetBuffer(), 1, &copyRegion);
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	unsigned int pushConstants[2] = { numObjects, numDraws };
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullMat.GetPipeline());
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullMat.GetPipelineLayout(), 0, 1, &cullSet, 0, nullptr);
+	vkCmdPushConstants(cmdBuffer, cullMat.GetPipelineLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), pushConstants);
+	vkCmdDispatch(cmdBuffer, (numObjects + 63) / 64, 1, 1);
+
+	// Make the commands and instances visible to the draws
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	culledFrame = frameIndex;
+	culledThisFrame = true;
+}
+
+void ModelManager::RenderIndirect(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, bool shadowPass)
 {
-	if (shadowMapPipeline != VK_NULL_HANDLE)
+	// The commands are only valid for the frame they were culled in
+	if (!culledThisFrame)
+		return;
+
+	unsigned int view = shadowPass ? 1 : 0;
+	unsigned int numBatches = static_cast<unsigned int>(batches.size());
+	const VKBuffer& drawCommandsBuffer = cullFrames[culledFrame].drawCommandsBuffer;
+
+	// The commands are not compacted. Every LOD and sub mesh of every batch keeps its command and the ones no instance picked have an instance count of 0, which the GPU skips without drawing
+	// Compacting them would need a second pass and vkCmdDrawIndexedIndirectCount, which is Vulkan 1.2 or VK_KHR_draw_indirect_count, with a count per multi draw since they are split by pool block, index type and texture
+	// The number of commands grows with the meshes and their LODs, not with the models, so the empty commands cost less than the extra pass
+
+	// The commands' first instance already points to the instances
+	unsigned int startIndex = 0;
+	vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(unsigned int), &startIndex);
+
+	unsigned int boundTexture = std::numeric_limits<unsigned int>::max();
+	unsigned int boundBlock = std::numeric_limits<unsigned int>::max();
+	VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+	unsigned int b = 0;
+
+	while (b < numBatches)
+	{
+		if (batches[b].numDraws == 0)
+		{
+			b++;
+			continue;
+		}
+
+		unsigned int texture = GetDrawnTexture(batches[b].texture);
+		const MeshRange& range = meshes[batches[b].drawnMesh].GetRange();
+
+		// Every mesh is in the pool so the buffers are bound once per block and index type and the commands select the meshes
+		if (range.block != boundBlock)
+		{
+			meshPool.Bind(cmdBuffer, range.block, range.indexType);
+			stats.meshBinds++;
+		}
+		else if (range.indexType != boundIndexType)
+		{
+			meshPool.BindIndices(cmdBuffer, range.block, range.indexType);
+			stats.meshBinds++;
+		}
+		boundBlock = range.block;
+		boundIndexType = range.indexType;
+
+		if (!shadowPass)
+			BindTexture(cmdBuffer, pipelineLayout, texture, boundTexture);
+
+		// Batches are sorted by pool block, index type and texture so consecutive batches with the same texture are drawn together. The shadow pass and bindless textures don't need it so every batch with the same block and index type is drawn at once
+		// The draws of a batch are consecutive so its sub meshes are always drawn together
+		unsigned int batchCount = 1;
+		unsigned int drawCount = batches[b].numDraws;
+		if (multiDrawIndirect)
+		{
+			while (b + batchCount < numBatches && meshes[batches[b + batchCount].drawnMesh].GetRange().block == range.block && meshes[batches[b + batchCount].drawnMesh].GetIndexType() == range.indexType && (shadowPass || bindless || GetDrawnTexture(batches[b + batchCount].texture) == texture))
+			{
+				drawCount += batches[b + batchCount].numDraws;
+				batchCount++;
+			}
+		}
+
+		VkDeviceSize commandOffset = (VkDeviceSize)(view * numDraws + batches[b].firstDraw) * sizeof(VkDrawIndexedIndirectCommand);
+
+		if (multiDrawIndirect)
+		{
+			vkCmdDrawIndexedIndirect(cmdBuffer, drawCommandsBuffer.GetBuffer(), commandOffset, drawCount, sizeof(VkDrawIndexedIndirectCommand));
+			stats.draws++;
+		}
+		else
+		{
+			for (unsigned int d = 0; d < drawCount; d++)
+			{
+				vkCmdDrawIndexedIndirect(cmdBuffer, drawCommandsBuffer.GetBuffer(), commandOffset + d * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+				stats.draws++;
+			}
+		}
+
+		b += batchCount;
+	}
+}
+
+void ModelManager::Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, VkPipeline shadowMapPipeline, const Frustum& frustum, const Frustum& lodFrustum)
+{
+	if (gpuDriven)
+	{
+		if (shadowMapPipeline != VK_NULL_HANDLE)
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowMapPipeline);
+		else
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.GetPipeline());
+		stats.pipelineBinds++;
+
+		RenderIndirect(cmdBuffer, pipelineLayout, shadowMapPipeline != VK_NULL_HANDLE);
+		return;
+	}
+
+	// Models added after the last bounds update are not culled until the next one
+	unsigned int numCulledModels = static_cast<unsigned int>(boundsMinX.size());
+	numVisibleModels = frustum.CullBoxes(GetWorldBounds(), numCulledModels, visibleModels.data());
+
+	// Sort by texture first so its set is bound once. The shadow pass doesn't sample the textures and the bindless instances carry theirs, so then only the mesh is needed to batch the models
+	bool shadowPass = shadowMapPipeline != VK_NULL_HANDLE;
+	float maxScreenError = shadowPass ? LOD_MAX_SCREEN_ERROR * SHADOW_LOD_BIAS : LOD_MAX_SCREEN_ERROR;
+
+	drawQueue.clear();
+
+	// Models that are still loading are sorted with the placeholders they are drawn with
+	for (unsigned int v = 0; v < numVisibleModels; v++)
+	{
+		const RenderModel& rm = models[visibleModels[v]];
+
+		if (!IsDrawable(rm.mesh, rm.texture))
+			continue;
+
+		// The LOD is in the lowest bits so the models that picked the same LOD of a mesh are drawn together
+		unsigned int drawnMesh = GetDrawnMesh(rm.mesh);
+		unsigned int lod = meshes[drawnMesh].SelectLod(GetLodScreenScale(visibleModels[v], lodFrustum), maxScreenError);
+
+		DrawItem item;
+		item.key = GetPoolKey(drawnMesh) | ((uint64_t)drawnMesh << 2) | lod;
+		item.model = visibleModels[v];
+
+		if (!shadowPass && !bindless)
+			item.key |= (uint64_t)GetDrawnTexture(rm.texture) << 32;
+
+		drawQueue.push_back(item);
+	}
+
+	unsigned int numDrawItems = static_cast<unsigned int>(drawQueue.size());
+
+	std::sort(drawQueue.begin(), drawQueue.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+
+	if (shadowPass)
 	{
 		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowMapPipeline);
 	}
@@ -149,35 +1133,142 @@ void ModelManager::Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLa
 	{
 		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.GetPipeline());
 	}
+	stats.pipelineBinds++;
 
-	VkBuffer vertexBuffers[] = { VK_NULL_HANDLE };
-	VkDeviceSize offsets[] = { 0 };
+	unsigned int boundTexture = std::numeric_limits<unsigned int>::max();
+	unsigned int boundBlock = std::numeric_limits<unsigned int>::max();
+	VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+	unsigned int first = 0;
 
-	for (size_t i = 0; i < models.size(); i++)
+	while (first < numDrawItems)
 	{
-		const Model& m = models[i].renderModel.model;
+		// Every item with the same key is drawn by the same instanced draw
+		unsigned int last = first + 1;
+		while (last < numDrawItems && drawQueue[last].key == drawQueue[first].key)
+			last++;
+
+		unsigned int startIndex = static_cast<unsigned int>(instanceModels.size());
+		unsigned int instanceCount = std::min(last - first, instanceCapacity - startIndex);
+
+		if (instanceCount == 0)
+			break;
+
+		for (unsigned int i = 0; i < instanceCount; i++)
+		{
+			instanceModels.push_back(drawQueue[first + i].model);
+		}
+
+		const RenderModel& rm = models[drawQueue[first].model];
+		const Model& m = meshes[GetDrawnMesh(rm.mesh)];
+		unsigned int texture = GetDrawnTexture(rm.texture);
+		unsigned int lod = static_cast<unsigned int>(drawQueue[first].key & (MAX_MODEL_LODS - 1));
+
+		// The items are sorted by pool block and index type first so the buffers are switched at most once per block and index type
+		const MeshRange& range = m.GetRange();
+		if (range.block != boundBlock)
+		{
+			meshPool.Bind(cmdBuffer, range.block, range.indexType);
+			stats.meshBinds++;
+		}
+		else if (range.indexType != boundIndexType)
+		{
+			meshPool.BindIndices(cmdBuffer, range.block, range.indexType);
+			stats.meshBinds++;
+		}
+		boundBlock = range.block;
+		boundIndexType = range.indexType;
+
+		if (!shadowPass)
+			BindTexture(cmdBuffer, pipelineLayout, texture, boundTexture);
+
+		vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(unsigned int), &startIndex);
+
+		for (unsigned int s = 0; s < m.GetNumSubMeshes(); s++)
+		{
+			vkCmdDrawIndexed(cmdBuffer, m.GetIndexCount(s, lod), instanceCount, m.GetFirstIndex(s, lod), m.GetVertexOffset(s), 0);
+			stats.draws++;
+		}
+
+		stats.instances += instanceCount;
+		stats.lodInstances[lod] += instanceCount;
+
+		first = last;
+	}
+}
 
-		vertexBuffers[0] = m.GetVertexBuffer().GetBuffer();
-		vkCmdBindVertexBuffers(cmdBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(cmdBuffer, m.GetIndexBuffer().GetBuffer(), 0, VK_INDEX_TYPE_UINT16);
-		vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(unsigned int), &instanceDataOffset);
-		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, USER_TEXTURES_SET_BINDING, 1, &models[i].renderModel.set, 0, nullptr);
-		vkCmdDrawIndexed(cmdBuffer, static_cast<uint32_t>(m.GetIndexCount()), 1, 0, 0, 0);
+void ModelManager::BindTexture(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, unsigned int texture, unsigned int& boundTexture)
+{
+	if (bindless)
+	{
+		if (boundTexture == std::numeric_limits<unsigned int>::max())
+		{
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, BINDLESS_TEXTURES_SET_BINDING, 1, &bindlessTexturesSet, 0, nullptr);
+			boundTexture = 0;
+			stats.setBinds++;
+		}
+		return;
+	}
 
-		instanceDataOffset += 1;
+	if (texture != boundTexture)
+	{
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, USER_TEXTURES_SET_BINDING, 1, &textures[texture].set, 0, nullptr);
+		boundTexture = texture;
+		stats.setBinds++;
 	}
+}
 
-	instanceDataOffset = 0;
+bool ModelManager::IsDrawable(unsigned int mesh, unsigned int texture) const
+{
+	return meshLoads[GetDrawnMesh(mesh)].state.load() == AssetState::READY && textureLoads[GetDrawnTexture(texture)].state.load() == AssetState::READY;
+}
+
+void ModelManager::EndFrame()
+{
+	lastFrameStats = stats;
+	stats = {};
+	instanceModels.clear();
+	culledThisFrame = false;
 }
 
 void ModelManager::Dispose(VkDevice device)
 {
-	for (size_t i = 0; i < models.size(); i++)
+	// The workers write to the loads so they have to finish first. Other jobs of the job system don't need to
+	if (jobSystem)
+		jobSystem->WaitFor(pendingDecodes);
+
+	for (size_t i = 0; i < textureLoads.size(); i++)
 	{
-		models[i].renderModel.model.Dispose(device);
-		models[i].renderModel.texture.Dispose(device);
+		if (textureLoads[i].pixels)
+			VKTexture2D::FreePixels(textureLoads[i].pixels);
 	}
 
+	meshLoads.clear();
+	textureLoads.clear();
+	pendingMeshes.clear();
+	pendingTextures.clear();
+
+	meshPool.Dispose(device);
+
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		textures[i].texture.Dispose(device);
+	}
+
+	models.Clear();
+	disabledModels.Clear();
+	meshes.clear();
+	textures.clear();
+	meshIndices.clear();
+	textureIndices.clear();
+
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		cullFrames[i].mappedUpload = nullptr;
+		cullFrames[i].uploadBuffer.Dispose(device);
+		cullFrames[i].drawCommandsBuffer.Dispose(device);
+	}
+	cullMat.Dispose(device);
+
 	vertexShader.Dispose(device);
 	fragmentShader.Dispose(device);
 	pipeline.Dispose(device);
@@ -185,11 +1276,5 @@ void ModelManager::Dispose(VkDevice device)
 
 const RenderModel& ModelManager::GetRenderModel(Entity e) const
 {
-	return models[map.at(e.id)].renderModel;
-}
-
-void ModelManager::InsertModelInstance(const ModelInstance& mi)
-{
-	models.push_back(mi);
-	map[mi.e.id] = models.size() - 1;
+	return models.Has(e) ? models.Get(e) : disabledModels.Get(e);
 }
@@ -5,22 +5,71 @@
 #include "VKPipeline.h"
 #include "VKRenderer.h"
 #include "EntityManager.h"
+#include "SparseSet.h"
+#include "Frustum.h"
+#include "ComputeMaterial.h"
 
 #include "glm/glm.hpp"
 
 #include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <chrono>
 
-struct RenderModel
+class TransformManager;
+class JobSystem;
+class InstanceBuffer;
+
+struct ModelTexture
 {
-	Model model;
 	VKTexture2D texture;
-	VkDescriptorSet set;
+	VkDescriptorSet set;				// Only without bindless textures
+	unsigned int bindlessIndex;			// Index in the renderer's bindless texture array, passed to the shader with the instance
+};
+
+// Models loaded from the same files share the mesh and texture so they can be drawn with one instanced draw
+struct RenderModel
+{
+	unsigned int mesh;
+	unsigned int texture;
+};
+
+// Objects as read by the GPU culling shader
+struct GPUObject
+{
+	glm::vec4 boundsMin;
+	glm::vec4 boundsMax;
+	glm::vec4 lodErrors;		// World space error of every LOD
+	glm::uvec4 info;			// x - first draw of the batch, y - number of sub meshes, z - number of LODs, w - transform index
+	glm::uvec4 material;		// x - bindless texture index
 };
 
-struct ModelInstance
+static_assert(MAX_MODEL_LODS == 4, "GPUObject stores the LOD errors in a vec4");
+
+enum class AssetState
 {
-	Entity e;
-	RenderModel renderModel;
+	DECODING,			// Queued or running on a worker
+	DECODED,			// Waiting for UpdateLoads to upload it
+	UPLOADING,
+	READY,
+	FAILED
+};
+
+// Returned right away by AddModelAsync. Meshes and textures already requested by other models are shared
+struct ModelLoadHandle
+{
+	unsigned int mesh;
+	unsigned int texture;
+};
+
+struct ModelRenderStats
+{
+	unsigned int draws;
+	unsigned int instances;
+	unsigned int pipelineBinds;
+	unsigned int meshBinds;			// Mesh pool binds, one per pass that draws models and one more when it switches index type
+	unsigned int setBinds;
+	unsigned int lodInstances[MAX_MODEL_LODS];		// Instances drawn with each LOD. Only counted when rendering on the CPU
 };
 
 class ModelManager
@@ -28,27 +77,223 @@ class ModelManager
 public:
 	ModelManager();
 
-	bool Init(VKRenderer* renderer, VkRenderPass renderPass);
+	// The job system is used to decode the meshes and textures of the async loads
+	bool Init(VKRenderer* renderer, VkRenderPass renderPass, JobSystem* jobSystem);
+	// Culls the models and builds the draw commands in a compute shader instead of on the CPU. The transform indices of the culled instances are written to the instance buffer
+	// Optional, the models keep being culled on the CPU if it fails
+	bool EnableGPUDriven(VKRenderer* renderer);
 	bool AddModel(VKRenderer* renderer, Entity e, const std::string &path, const std::string &texturePath);
-	void Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, VkPipeline shadowMapPipeline);
+	// Decodes the mesh and texture on the job system and returns right away. The model is drawn with the placeholder mesh and texture until they are ready
+	ModelLoadHandle AddModelAsync(Entity e, const std::string& path, const std::string& texturePath);
+	// The mesh and texture stay loaded for the other models that use them
+	void RemoveModel(Entity e);
+	// Entity manager listeners. Destroyed entities lose their model and the models of disabled entities are kept aside until they are enabled again so they are not culled or drawn
+	void OnEntitiesDestroyed(const Entity* entities, unsigned int count);
+	void OnEntitiesSetEnabled(const Entity* entities, unsigned int count, bool enable);
+	// Uploads the decoded assets and switches the models to them once the upload finished. Must be called every frame outside a render pass before the models are culled
+	void UpdateLoads(VKRenderer* renderer, VkCommandBuffer cmdBuffer);
+	// Recalculates the world space bounds of every model. Should be called after the world matrices are updated
+	void UpdateBounds(const TransformManager& transformManager);
+	// Records the GPU culling against the camera and light frustums. Only used when GPU driven, must be recorded outside a render pass and before Render
+	// The LODs are picked from the camera frustum in both views so the shadows match the drawn models
+	// Only the objects whose transform was modified since the frame was last culled are written to the frame's buffers
+	void RecordCulling(VkCommandBuffer cmdBuffer, unsigned int frameIndex, const TransformManager& transformManager, const Frustum& cameraFrustum, const Frustum& lightFrustum);
+	// Only the models that are inside the frustum are drawn. They are sorted by texture, mesh and LOD and the models that share them are drawn with one instanced draw
+	// With bindless textures the texture comes from the instance so the models are only sorted by mesh and LOD, and the texture set is bound once per pass
+	// The LOD of every model is picked from its projected size in lodFrustum, which is the camera frustum in the shadow pass too
+	// When GPU driven the frustums are ignored and the draws use the commands built by RecordCulling. Batches with the same texture, or every batch when bindless, are drawn with one multi draw if supported
+	void Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, VkPipeline shadowMapPipeline, const Frustum& frustum, const Frustum& lodFrustum);
+	// Clears the instances used this frame. Should be called after the instance buffer has been updated
+	void EndFrame();
 	void Dispose(VkDevice device);
 
 	const RenderModel& GetRenderModel(Entity e) const;
+	AssetState GetMeshState(unsigned int mesh) const { return meshLoads[mesh].state.load(); }
+	AssetState GetTextureState(unsigned int texture) const { return textureLoads[texture].state.load(); }
+	bool IsLoaded(const ModelLoadHandle& handle) const { return GetMeshState(handle.mesh) == AssetState::READY && GetTextureState(handle.texture) == AssetState::READY; }
+	bool IsLoading() const { return !pendingMeshes.empty() || !pendingTextures.empty(); }
 
-	unsigned int GetNumModels() const { return static_cast<unsigned int>(models.size()); }
-	const std::vector<ModelInstance>& GetModelInstances() const { return models; }
+	unsigned int GetNumModels() const { return models.GetSize(); }
+	const ComponentArray<RenderModel>& GetModels() const { return models; }
+	const Model& GetMesh(unsigned int mesh) const { return meshes[mesh]; }
+	const MeshPool& GetMeshPool() const { return meshPool; }
+	const std::vector<ModelTexture>& GetTextures() const { return textures; }
+	// Index of the model drawn by each instance this frame. Instance i uses the transform index at index i of the instance buffer
+	const std::vector<unsigned int>& GetInstanceModels() const { return instanceModels; }
+	// Bindless index of the texture the model is drawn with. 0 when not bindless
+	unsigned int GetInstanceTexture(unsigned int model) const { return bindless ? textures[GetDrawnTexture(models[model].texture)].bindlessIndex : 0; }
+	bool IsBindless() const { return bindless; }
+	// Instances the instance buffer needs for the models. On the CPU every model can be drawn once by the shadow pass and once by the HDR pass
+	// The GPU culling needs a slot per view and LOD of every model, sized from the batches so meshes with fewer LODs take less
+	unsigned int GetMaxInstances() const;
+	// Must be called once the instance buffer was updated for the frame and before the models are culled. Instances past its capacity are not drawn
+	void UpdateInstanceBuffer(const InstanceBuffer& instanceBuffer, unsigned int frame);
+	// Draws and binds of the last finished frame. The instances are only counted when rendering on the CPU
+	const ModelRenderStats& GetStats() const { return lastFrameStats; }
+	bool IsGPUDriven() const { return gpuDriven; }
+	// World space bounds in the same order as the models
+	BoxBounds GetWorldBounds() const;
+	// Number of models that passed the culling in the last Render
+	unsigned int GetNumVisibleModels() const { return numVisibleModels; }
+
+	// Initial size of the GPU culling buffers of each frame. They grow when there are more models or draw commands. Every LOD of every sub mesh of a batch has its own command per view
+	static const unsigned int INITIAL_GPU_OBJECTS = 1024;
+	static const unsigned int INITIAL_GPU_DRAWS = 1024;
+	// Largest error of the drawn LODs as a fraction of the view height, about a pixel at 1080p
+	static constexpr float LOD_MAX_SCREEN_ERROR = 1.0f / 1080.0f;
+	// The shadow map is lower resolution and filtered so it accepts more error
+	static constexpr float SHADOW_LOD_BIAS = 4.0f;
+	// Size of each block of the mesh pool shared by every model
+	static const unsigned int POOL_BLOCK_VERTICES = 2 * 1024 * 1024;
+	static const unsigned int POOL_BLOCK_INDICES = 4 * 1024 * 1024;
+	// Decoded data uploaded by UpdateLoads per frame. At least one asset is uploaded every frame
+	static const unsigned int MAX_LOAD_BYTES_PER_FRAME = 32 * 1024 * 1024;
+	// Drawn while the real mesh and texture are loading
+	static const unsigned int PLACEHOLDER_MESH = 0;
+	static const unsigned int PLACEHOLDER_TEXTURE = 0;
 
 private:
-	void InsertModelInstance(const ModelInstance &instance);
+	struct AssetLoad;
+
+	void RebuildBatches();
+	void RenderIndirect(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, bool shadowPass);
+	unsigned int RequestMesh(const std::string& path, bool async);
+	unsigned int RequestTexture(const std::string& path, bool async);
+	bool UploadMesh(VKBase& base, unsigned int mesh);
+	bool UploadTexture(VKRenderer* renderer, unsigned int texture);
+	// Adds the texture to the bindless array if supported, otherwise allocates its own set
+	bool CreateTextureSet(VKRenderer* renderer, ModelTexture& modelTexture);
+	// Binds the texture set of a draw unless it's already bound. With bindless textures the array is bound once per pass
+	void BindTexture(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout, unsigned int texture, unsigned int& boundTexture);
+	bool CreatePlaceholders(VKRenderer* renderer);
+	void InitLoad(AssetLoad& load, const std::string& path);
+	// Models whose mesh or texture isn't ready use the placeholder
+	unsigned int GetDrawnMesh(unsigned int mesh) const { return meshLoads[mesh].state.load() == AssetState::READY ? mesh : PLACEHOLDER_MESH; }
+	unsigned int GetDrawnTexture(unsigned int texture) const { return textureLoads[texture].state.load() == AssetState::READY ? texture : PLACEHOLDER_TEXTURE; }
+	// False until the placeholders are ready
+	bool IsDrawable(unsigned int mesh, unsigned int texture) const;
+	// Top bits of the sort keys, so the meshes are drawn grouped by pool block and the ones with 32 bit indices after the ones with 16 bit
+	uint64_t GetPoolKey(unsigned int mesh) const { return ((uint64_t)meshes[mesh].GetRange().block << 57) | (meshes[mesh].GetIndexType() == VK_INDEX_TYPE_UINT32 ? (1ull << 56) : 0); }
+	// Fraction of the view covered by one model space unit of the model, at the distance from the frustum's position to its bounds
+	float GetLodScreenScale(unsigned int model, const Frustum& lodFrustum) const;
+	// Recreates the frame's upload and draw commands buffers. The frame's fence must have been waited on
+	bool CreateCullBuffers(unsigned int frame, unsigned int objectCapacity, unsigned int drawCapacity);
+	// Every frame writes all the objects and draw commands the next time it's culled
+	void InvalidateCulling() { for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++) cullFrames[i].copyAll = true; }
 
 private:
-	std::vector<ModelInstance> models;
-	std::unordered_map<unsigned int, unsigned int> map;
+	struct DrawItem
+	{
+		uint64_t key;
+		unsigned int model;
+	};
+
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	// Decoding of one mesh or texture file. The worker only writes the data and the decode times before setting the state to DECODED
+	struct AssetLoad
+	{
+		std::string path;
+		std::atomic<AssetState> state;
+		ModelData meshData;
+		unsigned char* pixels;
+		unsigned int width;
+		unsigned int height;
+		TimePoint requestTime;
+		TimePoint decodeStartTime;
+		TimePoint decodeEndTime;
+		TimePoint uploadTime;
+	};
+
+	// Models with the same mesh and texture. Their instances are consecutive in the instance data
+	// Each LOD of each sub mesh of the drawn mesh has a draw command and the commands of a LOD draw the instances that picked it
+	struct DrawBatch
+	{
+		unsigned int mesh;
+		unsigned int drawnMesh;
+		unsigned int texture;
+		unsigned int firstInstance;
+		unsigned int numInstances;
+		unsigned int numLodRegions;			// Regions of numInstances slots in each view when GPU driven, one per LOD
+		unsigned int firstDraw;
+		unsigned int numDraws;
+	};
 
-	unsigned int instanceDataOffset;
+	ComponentArray<RenderModel> models;
+	ComponentArray<RenderModel> disabledModels;
+	VKRenderer* renderer;
+	VKUploadManager* uploadManager;
+	MeshPool meshPool;
+	std::vector<Model> meshes;
+	std::vector<ModelTexture> textures;
+	std::unordered_map<std::string, unsigned int> meshIndices;
+	std::unordered_map<std::string, unsigned int> textureIndices;
+
+	// Async loading. The loads have the same index as the meshes and textures and the deques keep them in place while the workers write to them
+	JobSystem* jobSystem;
+	std::deque<AssetLoad> meshLoads;
+	std::deque<AssetLoad> textureLoads;
+	std::vector<unsigned int> pendingMeshes;
+	std::vector<unsigned int> pendingTextures;
+	std::atomic<unsigned int> pendingDecodes;			// Decode jobs queued or running on the job system
+	TimePoint firstPendingRequestTime;
+	unsigned int numLoadedSinceIdle;
+
+	std::vector<DrawItem> drawQueue;
+	std::vector<unsigned int> instanceModels;
+	unsigned int instanceCapacity;
+	VkBuffer instancesBuffer;				// Instance buffer of the current frame, written by the GPU culling
+	ModelRenderStats stats;
+	ModelRenderStats lastFrameStats;
+
+	// World space bounding boxes as a structure of arrays for the batch culling
+	std::vector<float> boundsMinX;
+	std::vector<float> boundsMinY;
+	std::vector<float> boundsMinZ;
+	std::vector<float> boundsMaxX;
+	std::vector<float> boundsMaxY;
+	std::vector<float> boundsMaxZ;
+	std::vector<float> worldScales;			// Largest scale axis of the models' matrices, to convert the LOD errors to world space
+	std::vector<unsigned int> visibleModels;
+	unsigned int numVisibleModels;
 
 	VKShader vertexShader;
 	VKShader fragmentShader;
 	VKPipeline pipeline;
+	bool bindless;
+	VkDescriptorSet bindlessTexturesSet;
+
+	// GPU driven rendering
+	static const unsigned int NUM_CULL_VIEWS = 2;
+	// The frustum planes of every view, the LOD camera and the LOD parameters are before the objects
+	static const unsigned int NUM_CULL_HEADER_VECTORS = NUM_CULL_VIEWS * 6 + 2;
+	bool gpuDriven;
+	bool batchesDirty;
+	bool culledThisFrame;
+	bool multiDrawIndirect;
+	ComputeMaterial cullMat;
+
+	// Each frame in flight has its own buffers so they can be recreated once the frame's fence was waited on. The set pointing to them is a transient set allocated every frame
+	struct CullFrame
+	{
+		VKBuffer uploadBuffer;				// Cull header, objects and the draw commands to reset to
+		VKBuffer drawCommandsBuffer;
+		unsigned char* mappedUpload;
+		VkDeviceSize commandsOffset;
+		unsigned int objectCapacity;
+		unsigned int drawCapacity;
+		unsigned int viewSize;				// Instances of a view when the objects were written
+		bool copyAll;						// The objects and commands in the buffer are out of date, not only the dirty objects
+	};
+
+	CullFrame cullFrames[VKRenderer::MAX_FRAMES_IN_FLIGHT];
+	unsigned int culledFrame;				// Frame whose commands are drawn by RenderIndirect
+	std::vector<DrawBatch> batches;
+	std::vector<unsigned int> modelBatches;
+	// One bit per frame in flight whose culling buffers don't have the latest data of the object
+	std::vector<unsigned char> objectDirtyFrames;
+	static constexpr unsigned char ALL_FRAMES_DIRTY = (1 << VKRenderer::MAX_FRAMES_IN_FLIGHT) - 1;
+	unsigned int numDraws;
+	unsigned int numViewInstances;			// Instance slots of every batch and LOD in one view
 };
 
@@ -0,0 +1,147 @@
+#include "ParticleData.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define PARTICLE_DATA_USE_SSE
+#endif
+
+ParticleData::ParticleData()
+{
+	maxParticles = 0;
+	numAlive = 0;
+}
+
+void ParticleData::Init(unsigned int maxParticles)
+{
+	this->maxParticles = maxParticles;
+	numAlive = 0;
+
+	posX.resize(maxParticles);
+	posY.resize(maxParticles);
+	posZ.resize(maxParticles);
+	velX.resize(maxParticles);
+	velY.resize(maxParticles);
+	velZ.resize(maxParticles);
+	life.resize(maxParticles);
+	color.resize(maxParticles);
+}
+
+void ParticleData::Update(float dt, float lifeDecrease)
+{
+	float* posX = this->posX.data();
+	float* posY = this->posY.data();
+	float* posZ = this->posZ.data();
+	const float* velX = this->velX.data();
+	const float* velY = this->velY.data();
+	const float* velZ = this->velZ.data();
+	float* life = this->life.data();
+
+	unsigned int i = 0;
+
+#ifdef PARTICLE_DATA_USE_SSE
+	const __m128 dt4 = _mm_set1_ps(dt);
+	const __m128 lifeDecrease4 = _mm_set1_ps(lifeDecrease);
+
+	for (; i + 4 <= numAlive; i += 4)
+	{
+		_mm_storeu_ps(&life[i], _mm_sub_ps(_mm_loadu_ps(&life[i]), lifeDecrease4));
+		_mm_storeu_ps(&posX[i], _mm_add_ps(_mm_loadu_ps(&posX[i]), _mm_mul_ps(_mm_loadu_ps(&velX[i]), dt4)));
+		_mm_storeu_ps(&posY[i], _mm_add_ps(_mm_loadu_ps(&posY[i]), _mm_mul_ps(_mm_loadu_ps(&velY[i]), dt4)));
+		_mm_storeu_ps(&posZ[i], _mm_add_ps(_mm_loadu_ps(&posZ[i]), _mm_mul_ps(_mm_loadu_ps(&velZ[i]), dt4)));
+	}
+#endif
+
+	for (; i < numAlive; i++)
+	{
+		life[i] -= lifeDecrease;
+		posX[i] += velX[i] * dt;
+		posY[i] += velY[i] * dt;
+		posZ[i] += velZ[i] * dt;
+	}
+
+	// Remove the dead particles. Don't increment the index after killing because the last particle was moved into it
+	i = 0;
+	while (i < numAlive)
+	{
+		if (life[i] <= 0.0f)
+			Kill(i);
+		else
+			i++;
+	}
+}
+
+bool ParticleData::Spawn(const glm::vec3& pos, const glm::vec3& velocity, float life, const glm::vec4& color)
+{
+	if (numAlive >= maxParticles)
+		return false;
+
+	unsigned int i = numAlive;
+
+	posX[i] = pos.x;
+	posY[i] = pos.y;
+	posZ[i] = pos.z;
+	velX[i] = velocity.x;
+	velY[i] = velocity.y;
+	velZ[i] = velocity.z;
+	this->life[i] = life;
+	this->color[i] = color;
+
+	numAlive++;
+
+	return true;
+}
+
+void ParticleData::Kill(unsigned int index)
+{
+	unsigned int last = numAlive - 1;
+
+	posX[index] = posX[last];
+	posY[index] = posY[last];
+	posZ[index] = posZ[last];
+	velX[index] = velX[last];
+	velY[index] = velY[last];
+	velZ[index] = velZ[last];
+	life[index] = life[last];
+	color[index] = color[last];
+
+	numAlive--;
+}
+
+unsigned int ParticleData::WriteInstances(ParticleInstanceData* instanceData) const
+{
+	const float* posX = this->posX.data();
+	const float* posY = this->posY.data();
+	const float* posZ = this->posZ.data();
+	const glm::vec4* color = this->color.data();
+
+	unsigned int i = 0;
+
+#ifdef PARTICLE_DATA_USE_SSE
+	// Transpose 4 particles at a time from SoA to the vec4 positions the shader expects
+	for (; i + 4 <= numAlive; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&posX[i]);
+		__m128 y = _mm_loadu_ps(&posY[i]);
+		__m128 z = _mm_loadu_ps(&posZ[i]);
+		__m128 w = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+
+		_mm_storeu_ps(&instanceData[i + 0].pos.x, x);
+		_mm_storeu_ps(&instanceData[i + 0].color.x, _mm_loadu_ps(&color[i + 0].x));
+		_mm_storeu_ps(&instanceData[i + 1].pos.x, y);
+		_mm_storeu_ps(&instanceData[i + 1].color.x, _mm_loadu_ps(&color[i + 1].x));
+		_mm_storeu_ps(&instanceData[i + 2].pos.x, z);
+		_mm_storeu_ps(&instanceData[i + 2].color.x, _mm_loadu_ps(&color[i + 2].x));
+		_mm_storeu_ps(&instanceData[i + 3].pos.x, w);
+		_mm_storeu_ps(&instanceData[i + 3].color.x, _mm_loadu_ps(&color[i + 3].x));
+	}
+#endif
+
+	for (; i < numAlive; i++)
+	{
+		instanceData[i].pos = glm::vec4(posX[i], posY[i], posZ[i], 0.0f);
+		instanceData[i].color = color[i];
+	}
+
+	return numAlive;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <vector>
+
+struct ParticleInstanceData
+{
+	glm::vec4 pos;
+	glm::vec4 color;
+};
+
+// Particles are stored as a structure of arrays so the update can process several particles at once
+// The alive particles are always packed in [0, numAlive) so spawning and killing a particle is O(1)
+class ParticleData
+{
+public:
+	ParticleData();
+
+	void Init(unsigned int maxParticles);
+	// Integrates the alive particles and kills the ones whose life ran out
+	void Update(float dt, float lifeDecrease);
+	// Returns false if every particle is already alive
+	bool Spawn(const glm::vec3& pos, const glm::vec3& velocity, float life, const glm::vec4& color);
+	// Moves the last alive particle into the slot of the dead one
+	void Kill(unsigned int index);
+	// Writes the instance data of the alive particles to instanceData, which must fit maxParticles. Returns the number of alive particles
+	unsigned int WriteInstances(ParticleInstanceData* instanceData) const;
+
+	unsigned int GetNumAlive() const { return numAlive; }
+	unsigned int GetMaxParticles() const { return maxParticles; }
+
+private:
+	std::vector<float> posX;
+	std::vector<float> posY;
+	std::vector<float> posZ;
+	std::vector<float> velX;
+	std::vector<float> velY;
+	std::vector<float> velZ;
+	std::vector<float> life;
+	std::vector<glm::vec4> color;
+	unsigned int maxParticles;
+	unsigned int numAlive;
+};
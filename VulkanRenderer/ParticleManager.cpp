@@ -4,10 +4,17 @@
 
 ParticleManager::ParticleManager()
 {
+	renderer = nullptr;
+	numGPUSystems = 0;
+	maxInstances = 0;
+	numInstances = 0;
 }
 
-bool ParticleManager::Init(VKRenderer* renderer, VkRenderPass renderPass)
+bool ParticleManager::Init(VKRenderer* renderer, VkRenderPass renderPass, unsigned int maxInstances)
 {
+	this->renderer = renderer;
+	this->maxInstances = maxInstances;
+
 	VKBase& base = renderer->GetBase();
 	// Create the particle system pipeline
 
@@ -78,51 +85,147 @@ bool ParticleManager::Init(VKRenderer* renderer, VkRenderPass renderPass)
 	vertexShader.LoadShader(base.GetDevice(), "particle", VK_SHADER_STAGE_VERTEX_BIT);
 	fragmentShader.LoadShader(base.GetDevice(), "particle", VK_SHADER_STAGE_FRAGMENT_BIT);
 
-	if (!pipeline.Create(base.GetDevice(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
+	if (!pipeline.Create(base.GetPipelineCache(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
 	{
 		std::cout << "Failed to create particle system pipeline\n";
 		return false;
 	}
 
+	unsigned int ringBufferSize = maxInstances * sizeof(ParticleInstanceData) * VKRenderer::MAX_FRAMES_IN_FLIGHT;
+
+	if (!instanceRingBuffer.Create(&base, ringBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+	{
+		std::cout << "Failed to create particle instance ring buffer\n";
+		return false;
+	}
+
 	return true;
 }
 
-bool ParticleManager::AddParticleSystem(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles)
+bool ParticleManager::AddParticleSystem(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles, ParticleSimulation simulation)
 {
+	if (simulation == ParticleSimulation::CPU && numInstances + maxParticles > maxInstances)
+	{
+		std::cout << "Not enough space in the particle instance ring buffer for " << maxParticles << " particles\n";
+		return false;
+	}
+
+	// The simulation shader is only compiled once a GPU system is added
+	if (simulation == ParticleSimulation::GPU && numGPUSystems == 0 && !CreateSimulationMaterial())
+		return false;
+
 	ParticleSystem particleSystem;
-	if (!particleSystem.Init(renderer, texturePath, maxParticles))
+	if (!particleSystem.Init(renderer, texturePath, maxParticles, simulation, simulationMat.GetSetLayout()))
 		return false;
 
 	particleSystems.push_back(particleSystem);
 
+	if (simulation == ParticleSimulation::GPU)
+	{
+		instanceOffsets.push_back(0);
+		numGPUSystems++;
+	}
+	else
+	{
+		instanceOffsets.push_back(numInstances);
+		numInstances += maxParticles;
+	}
+
+	return true;
+}
+
+bool ParticleManager::CreateSimulationMaterial()
+{
+	// Particles, instances and draw args
+	std::vector<VkDescriptorSetLayoutBinding> simulationBindings(3);
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		simulationBindings[i].binding = i;
+		simulationBindings[i].descriptorCount = 1;
+		simulationBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		simulationBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+
+	if (!simulationMat.Create(renderer, "particle_sim", simulationBindings, sizeof(ParticleSimulationPushConstants)))
+	{
+		std::cout << "Failed to create particle simulation compute material\n";
+		return false;
+	}
+
 	return true;
 }
 
+void ParticleManager::RecordSimulation(VkCommandBuffer cmdBuffer)
+{
+	if (numGPUSystems == 0)
+		return;
+
+	// The previous frame must be done drawing and simulating before the draw args are reset and the particles are simulated again
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	for (size_t i = 0; i < particleSystems.size(); i++)
+	{
+		if (particleSystems[i].GetSimulation() == ParticleSimulation::GPU)
+			particleSystems[i].RecordResetDrawArgs(cmdBuffer);
+	}
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, simulationMat.GetPipeline());
+
+	for (size_t i = 0; i < particleSystems.size(); i++)
+	{
+		if (particleSystems[i].GetSimulation() == ParticleSimulation::GPU)
+			particleSystems[i].RecordSimulation(cmdBuffer, simulationMat.GetPipelineLayout());
+	}
+
+	// Make the instances and the alive count visible to the draws
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
 void ParticleManager::Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout)
 {
+	VkDeviceSize frameOffset = (VkDeviceSize)renderer->GetCurrentFrame() * maxInstances * sizeof(ParticleInstanceData);
+
 	for (size_t i = 0; i < particleSystems.size(); i++)
 	{
-		particleSystems[i].Render(cmdBuffer, pipeline.GetPipeline(), pipelineLayout);
+		VkDeviceSize instanceOffset = frameOffset + (VkDeviceSize)instanceOffsets[i] * sizeof(ParticleInstanceData);
+		particleSystems[i].Render(cmdBuffer, pipeline.GetPipeline(), pipelineLayout, instanceRingBuffer.GetBuffer(), instanceOffset);
 	}
 }
 
-void ParticleManager::Update(VkDevice device, float dt)
+void ParticleManager::Update(float dt)
 {
-	// TODO: Use one big buffer and offset into it
+	// Write to the region of the current frame. The frame fence has already been waited on so the GPU is no longer reading it
+	VkDeviceSize frameOffset = (VkDeviceSize)renderer->GetCurrentFrame() * maxInstances * sizeof(ParticleInstanceData);
+	MappedSpan<ParticleInstanceData> frameInstances = instanceRingBuffer.GetSpan<ParticleInstanceData>(frameOffset, maxInstances);
+
+	if (frameInstances.IsEmpty())
+		return;
 
 	for (size_t i = 0; i < particleSystems.size(); i++)
 	{
 		ParticleSystem &p = particleSystems[i];
 		p.Update(dt);
 
-		const std::vector<ParticleInstanceData>& psData = p.GetInstanceData();
+		// GPU systems write their instances in the simulation shader
+		if (p.GetSimulation() == ParticleSimulation::GPU)
+			continue;
 
-		VKBuffer& instancingBuffer = p.GetInstancingBuffer();
-
-		void* mapped = instancingBuffer.Map(device, 0, VK_WHOLE_SIZE);
-		memcpy(mapped, psData.data(), psData.size() * sizeof(ParticleInstanceData));
-		instancingBuffer.Unmap(device);
+		// Pack the particles straight into the buffer instead of going through a temporary array
+		p.GetInstanceData(frameInstances.GetData() + instanceOffsets[i]);
 	}
+
+	// The CPU systems are packed at the start of the frame's region
+	instanceRingBuffer.Flush(frameOffset, (VkDeviceSize)numInstances * sizeof(ParticleInstanceData));
 }
 
 void ParticleManager::Dispose(VkDevice device)
@@ -132,7 +235,10 @@ void ParticleManager::Dispose(VkDevice device)
 		particleSystems[i].Dispose(device);
 	}
 
+	instanceRingBuffer.Dispose(device);
+
 	vertexShader.Dispose(device);
 	fragmentShader.Dispose(device);
 	pipeline.Dispose(device);
+	simulationMat.Dispose(device);
 }
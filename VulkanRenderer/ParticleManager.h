@@ -2,25 +2,43 @@
 
 #include "ParticleSystem.h"
 #include "VKRenderer.h"
+#include "ComputeMaterial.h"
 
 class ParticleManager
 {
 public:
 	ParticleManager();
 
-	bool Init(VKRenderer* renderer, VkRenderPass renderPass);
-	bool AddParticleSystem(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles);
+	// maxInstances is the number of particles all the CPU systems can have alive at once
+	bool Init(VKRenderer* renderer, VkRenderPass renderPass, unsigned int maxInstances = DEFAULT_MAX_INSTANCES);
+	bool AddParticleSystem(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles, ParticleSimulation simulation = ParticleSimulation::CPU);
+	// Records the compute simulation of the GPU particle systems. Must be recorded outside a render pass and before Render
+	void RecordSimulation(VkCommandBuffer cmdBuffer);
 	void Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout);
-	void Update(VkDevice device, float dt);
+	void Update(float dt);
 	void Dispose(VkDevice device);
 
 	const std::vector<ParticleSystem>& GetParticlesystems() const { return particleSystems; }
 
 private:
+	bool CreateSimulationMaterial();
+
+private:
+	static const unsigned int DEFAULT_MAX_INSTANCES = 16384;
+
+	VKRenderer* renderer;
 	VKShader vertexShader;
 	VKShader fragmentShader;
 	VKPipeline pipeline;
+	ComputeMaterial simulationMat;
+	unsigned int numGPUSystems;
 
 	std::vector<ParticleSystem> particleSystems;
+	std::vector<unsigned int> instanceOffsets;		// Offset of each system's slice in a frame of the instance ring buffer
+
+	// Persistently mapped ring buffer with the instances of every CPU system, one region per frame in flight
+	VKBuffer instanceRingBuffer;
+	unsigned int maxInstances;
+	unsigned int numInstances;
 };
 
@@ -7,15 +7,19 @@
 ParticleSystem::ParticleSystem()
 {
 	maxParticles = 0;
-	lastUsedParticle = 0;
 	accumulator = 0.0f;
 	emission = 8.0f;
 	startLifeTime = 1.0f;
+	simulation = ParticleSimulation::CPU;
+	set = VK_NULL_HANDLE;
+	simulationSet = VK_NULL_HANDLE;
+	pushConstants = {};
 }
 
-bool ParticleSystem::Init(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles)
+bool ParticleSystem::Init(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles, ParticleSimulation simulation, VkDescriptorSetLayout simulationSetLayout)
 {
 	this->maxParticles = maxParticles;
+	this->simulation = simulation;
 
 	VKBase& base = renderer->GetBase();
 
@@ -27,9 +31,6 @@ bool ParticleSystem::Init(VKRenderer* renderer, const std::string texturePath, u
 	if (!texture.LoadFromFile(base, texturePath, textureParams))
 		return false;
 
-	instanceData.resize(maxParticles);
-	particles.resize(maxParticles);
-
 	glm::vec4 vertices[] = {
 		 glm::vec4(-1.0f, 1.0f,	0.0f, 1.0f),
 		 glm::vec4(-1.0f, -1.0f, 0.0f, 0.0f),
@@ -47,22 +48,31 @@ bool ParticleSystem::Init(VKRenderer* renderer, const std::string texturePath, u
 
 	void* mapped = vertexStagingBuffer.Map(device, 0, vertexSize);
 	memcpy(mapped, vertices, (size_t)vertexSize);
-	vertexStagingBuffer.Unmap(device);
+	vertexStagingBuffer.Flush(0, vertexSize);
 
 	vb.Create(&base, sizeof(vertices), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	base.CopyBuffer(vertexStagingBuffer, vb, vertexSize);
 	vertexStagingBuffer.Dispose(device);
 
 
-	unsigned int particlesBufferSize = maxParticles * sizeof(ParticleInstanceData);
+	if (simulation == ParticleSimulation::GPU)
+	{
+		// The instances are written by the simulation shader so the CPU never touches them
+		unsigned int particlesBufferSize = maxParticles * sizeof(ParticleInstanceData);
 
-	if (!instancingBuffer.Create(&base, particlesBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-		return false;
+		if (!instancingBuffer.Create(&base, particlesBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+			return false;
 
+		if (!InitGPUSimulation(renderer, simulationSetLayout))
+			return false;
 
-	if (particles.size() > 0)
+		pushConstants.spawnCount = 1;		// Spawn one particle so they get update initially
+	}
+	else
 	{
-		RespawnParticle(particles[0]);		// Spawn one particle so they get update initially
+		particles.Init(maxParticles);
+
+		SpawnParticle();		// Spawn one particle so they get update initially
 	}
 
 	set = renderer->AllocateUserTextureDescriptorSet();
@@ -86,106 +96,154 @@ bool ParticleSystem::Init(VKRenderer* renderer, const std::string texturePath, u
 	return true;
 }
 
+bool ParticleSystem::InitGPUSimulation(VKRenderer* renderer, VkDescriptorSetLayout simulationSetLayout)
+{
+	VKBase& base = renderer->GetBase();
+	VkDevice device = base.GetDevice();
+
+	// Start with every particle dead
+	unsigned int particleBufferSize = maxParticles * sizeof(GPUParticle);
+
+	VKBuffer stagingBuffer;
+	if (!stagingBuffer.Create(&base, particleBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+		return false;
+
+	void* mapped = stagingBuffer.Map(device, 0, particleBufferSize);
+	memset(mapped, 0, (size_t)particleBufferSize);
+	stagingBuffer.Flush(0, particleBufferSize);
+
+	if (!particleBuffer.Create(&base, particleBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+	{
+		stagingBuffer.Dispose(device);
+		return false;
+	}
+
+	base.CopyBuffer(stagingBuffer, particleBuffer, particleBufferSize);
+	stagingBuffer.Dispose(device);
+
+	// Reset every frame by RecordResetDrawArgs so it doesn't need initial data
+	if (!drawArgsBuffer.Create(&base, sizeof(VkDrawIndirectCommand) + sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+		return false;
+
+	simulationSet = renderer->AllocateSetFromLayout(simulationSetLayout);
+	if (simulationSet == VK_NULL_HANDLE)
+		return false;
+
+	VkDescriptorBufferInfo bufferInfos[3] = {};
+	bufferInfos[0].buffer = particleBuffer.GetBuffer();
+	bufferInfos[0].offset = 0;
+	bufferInfos[0].range = VK_WHOLE_SIZE;
+	bufferInfos[1].buffer = instancingBuffer.GetBuffer();
+	bufferInfos[1].offset = 0;
+	bufferInfos[1].range = VK_WHOLE_SIZE;
+	bufferInfos[2].buffer = drawArgsBuffer.GetBuffer();
+	bufferInfos[2].offset = 0;
+	bufferInfos[2].range = VK_WHOLE_SIZE;
+
+	VkWriteDescriptorSet descriptorWrite = {};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.dstArrayElement = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorWrite.descriptorCount = 3;
+	descriptorWrite.dstSet = simulationSet;
+	descriptorWrite.pBufferInfo = bufferInfos;
+
+	vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+
+	pushConstants.maxParticles = maxParticles;
+
+	return true;
+}
+
 void ParticleSystem::Update(float dt)
 {
-	for (unsigned int i = 0; i < maxParticles; i++)
+	const float lifeDecrease = dt / startLifeTime;
+
+	if (simulation == ParticleSimulation::GPU)
 	{
-		Particle& p = particles[i];
+		// Only accumulate the emission, the simulation itself is recorded with the next frame
+		pushConstants.dt = dt;
+		pushConstants.lifeDecrease = lifeDecrease;
 
-		p.life -= dt / startLifeTime;
+		accumulator += dt;
+		float denom = 1.0f / emission;
 
-		if (p.life > 0.0f)
+		while (accumulator > denom)
 		{
-			p.pos.y += 1.0f * dt;
+			pushConstants.spawnCount++;
+			accumulator -= denom;
 		}
+		return;
 	}
 
+	particles.Update(dt, lifeDecrease);
+
 	accumulator += dt;							// This line and the while are used to spawn newParticles (emission) per second and not per frame
 	float denom = 1.0f / emission;
 
 	while (accumulator > denom)
 	{
-		int unusedParticle = FirstUnusedParticle();
-		if (unusedParticle == 0 && particles[0].life <= 0.0f)		// This is used in the case that there is only one particle to let its life reach 0
-		{
-			RespawnParticle(particles[0]);
-		}
-		else if (unusedParticle > 0)
-		{
-			RespawnParticle(particles[unusedParticle]);
-		}
+		SpawnParticle();
 		accumulator -= denom;
 	}
 }
 
-void ParticleSystem::Render(VkCommandBuffer cmdBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout)
+void ParticleSystem::RecordResetDrawArgs(VkCommandBuffer cmdBuffer)
 {
-	VkBuffer vbs[] = { vb.GetBuffer(), instancingBuffer.GetBuffer() };
-	VkDeviceSize vbsOffsets[] = { 0,0 };
-
-	vkCmdBindVertexBuffers(cmdBuffer, 0, 2, vbs, vbsOffsets);
-	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, USER_TEXTURES_SET_BINDING, 1, &set, 0, nullptr);
-	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-	vkCmdDraw(cmdBuffer, 6, GetNumAliveParticles(), 0, 0);
+	// vertexCount, instanceCount, firstVertex, firstInstance and the spawn counter
+	uint32_t drawArgs[5] = { 6, 0, 0, 0, 0 };
+	vkCmdUpdateBuffer(cmdBuffer, drawArgsBuffer.GetBuffer(), 0, sizeof(drawArgs), drawArgs);
 }
 
-void ParticleSystem::RespawnParticle(Particle& p)
+void ParticleSystem::RecordSimulation(VkCommandBuffer cmdBuffer, VkPipelineLayout simulationPipelineLayout)
 {
-	p.pos.x = Random::Float();
-	p.pos.y = Random::Float(1.0f, 2.0f);
-	p.pos.z = Random::Float();
-	p.life = startLifeTime;
-	p.velocity = glm::vec3(0.0f);
-	p.color.x = Random::Float();
-	p.color.y = Random::Float();
-	p.color.z = Random::Float();
-
-	//std::cout << "Respawning\n";
+	pushConstants.seed++;
+
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, simulationPipelineLayout, 0, 1, &simulationSet, 0, nullptr);
+	vkCmdPushConstants(cmdBuffer, simulationPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ParticleSimulationPushConstants), &pushConstants);
+	vkCmdDispatch(cmdBuffer, (maxParticles + 63) / 64, 1, 1);
+
+	// The particles spawned this frame are now in the command buffer
+	pushConstants.spawnCount = 0;
 }
 
-int ParticleSystem::FirstUnusedParticle()
+void ParticleSystem::Render(VkCommandBuffer cmdBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout, VkBuffer instanceBuffer, VkDeviceSize instanceOffset)
 {
-	for (unsigned int i = lastUsedParticle; i < maxParticles; ++i)
+	if (simulation == ParticleSimulation::GPU)
 	{
-		if (particles[i].life <= 0.0f)
-		{
-			lastUsedParticle = i;
-			return i;
-		}
+		instanceBuffer = instancingBuffer.GetBuffer();
+		instanceOffset = 0;
 	}
 
-	for (int i = 0; i < lastUsedParticle; i++)
-	{
-		if (particles[i].life <= 0.0f)
-		{
-			lastUsedParticle = i;
-			return i;
-		}
-	}
+	VkBuffer vbs[] = { vb.GetBuffer(), instanceBuffer };
+	VkDeviceSize vbsOffsets[] = { 0, instanceOffset };
+
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 2, vbs, vbsOffsets);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, USER_TEXTURES_SET_BINDING, 1, &set, 0, nullptr);
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
 
-	lastUsedParticle = 0;
-	return 0;
+	if (simulation == ParticleSimulation::GPU)
+		vkCmdDrawIndirect(cmdBuffer, drawArgsBuffer.GetBuffer(), 0, 1, sizeof(VkDrawIndirectCommand));
+	else
+		vkCmdDraw(cmdBuffer, 6, GetNumAliveParticles(), 0, 0);
 }
 
-const std::vector<ParticleInstanceData>& ParticleSystem::GetInstanceData()
+void ParticleSystem::SpawnParticle()
 {
-	instanceData.clear();
+	// Don't spawn if every particle is already alive
+	if (particles.GetNumAlive() >= maxParticles)
+		return;
 
-	for (unsigned int i = 0; i < maxParticles; i++)
-	{
-		Particle& p = particles[i];
-
-		if (p.life > 0.0f)
-		{
-			ParticleInstanceData data;
-			data.pos = glm::vec4(p.pos, 0.0f);
-			data.color = p.color;
+	glm::vec3 pos = glm::vec3(Random::Float(), Random::Float(1.0f, 2.0f), Random::Float());
+	glm::vec4 color = glm::vec4(Random::Float(), Random::Float(), Random::Float(), 0.0f);
 
-			instanceData.push_back(data);
-		}
-	}
+	particles.Spawn(pos, glm::vec3(0.0f, 1.0f, 0.0f), startLifeTime, color);
+}
 
-	return instanceData;
+unsigned int ParticleSystem::GetInstanceData(ParticleInstanceData* instanceData) const
+{
+	return particles.WriteInstances(instanceData);
 }
 
 void ParticleSystem::Dispose(VkDevice device)
@@ -193,4 +251,6 @@ void ParticleSystem::Dispose(VkDevice device)
 	texture.Dispose(device);
 	vb.Dispose(device);
 	instancingBuffer.Dispose(device);
+	particleBuffer.Dispose(device);
+	drawArgsBuffer.Dispose(device);
 }
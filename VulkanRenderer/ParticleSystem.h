@@ -3,55 +3,78 @@
 #include "VKBase.h"
 #include "VKRenderer.h"
 #include "VKPipeline.h"
+#include "ParticleData.h"
 
 #include "glm/glm.hpp"
 
-struct Particle
+enum class ParticleSimulation
 {
-	glm::vec3 pos;
-	float life;
-	glm::vec4 color;
-	glm::vec3 velocity;
+	CPU,
+	GPU		// Emission, update and compaction run in a compute shader and the alive count is used by an indirect draw. Opt in, particle_sim.comp hasn't been validated on a device yet
 };
 
-struct ParticleInstanceData
+// Layout of the particles in the GPU particle buffer
+struct GPUParticle
 {
-	glm::vec4 pos;
+	glm::vec4 posLife;
+	glm::vec4 velocity;
 	glm::vec4 color;
 };
 
+struct ParticleSimulationPushConstants
+{
+	float dt;
+	float lifeDecrease;
+	unsigned int spawnCount;
+	unsigned int maxParticles;
+	unsigned int seed;
+};
+
 class ParticleSystem
 {
 public:
 	ParticleSystem();
 
-	bool Init(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles);
+	// simulationSetLayout is only used by GPU particle systems
+	bool Init(VKRenderer* renderer, const std::string texturePath, unsigned int maxParticles, ParticleSimulation simulation, VkDescriptorSetLayout simulationSetLayout);
 	void Update(float dt);
-	void Render(VkCommandBuffer cmdBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout);
-	const std::vector<ParticleInstanceData>& GetInstanceData();
+	// Must be recorded outside a render pass. Barriers are left to the caller so they can be shared by all the systems
+	void RecordResetDrawArgs(VkCommandBuffer cmdBuffer);
+	void RecordSimulation(VkCommandBuffer cmdBuffer, VkPipelineLayout simulationPipelineLayout);
+	// CPU systems draw their instances from instanceBuffer at instanceOffset. GPU systems use their own instancing buffer
+	void Render(VkCommandBuffer cmdBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout, VkBuffer instanceBuffer, VkDeviceSize instanceOffset);
+	// Writes the instance data of the alive particles to instanceData, which must fit maxParticles (eg. the system's slice of the mapped instance ring buffer). Returns the number of alive particles
+	unsigned int GetInstanceData(ParticleInstanceData* instanceData) const;
 	void Dispose(VkDevice device);
 
 	const VKTexture2D& GetTexture() const { return texture; }
 	const VKBuffer& GetQuadVertexBuffer() const { return vb; }
 	VKBuffer& GetInstancingBuffer() { return instancingBuffer; }
 	unsigned int GetMaxParticles() const { return maxParticles; }
-	unsigned int GetNumAliveParticles() const { return static_cast<unsigned int>(instanceData.size()); }
+	// Always 0 for GPU systems, the alive count only exists on the GPU
+	unsigned int GetNumAliveParticles() const { return particles.GetNumAlive(); }
+	ParticleSimulation GetSimulation() const { return simulation; }
 
 private:
-	void RespawnParticle(Particle& p);
-	int FirstUnusedParticle();
+	bool InitGPUSimulation(VKRenderer* renderer, VkDescriptorSetLayout simulationSetLayout);
+	void SpawnParticle();
 
 private:
 	VKTexture2D texture;
 	VKBuffer vb;
-	VKBuffer instancingBuffer;
+	VKBuffer instancingBuffer;			// Only used by GPU systems, CPU systems write to the particle manager's ring buffer
 	VkDescriptorSet set;
-	std::vector<Particle> particles;
-	std::vector<ParticleInstanceData> instanceData;
+	ParticleSimulation simulation;
+	ParticleData particles;
 	unsigned int maxParticles;
-	unsigned int lastUsedParticle;
 	float accumulator;
 	float emission;
 	float startLifeTime;
+
+	// GPU simulation
+	VKBuffer particleBuffer;
+	VKBuffer drawArgsBuffer;
+	VkDescriptorSet simulationSet;
+	ParticleSimulationPushConstants pushConstants;
 };
 
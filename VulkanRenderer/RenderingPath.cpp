@@ -20,6 +20,11 @@ RenderingPath::RenderingPath()
 	graphicsSemaphore = VK_NULL_HANDLE;
 
 	previousFrameView = glm::mat4(1.0f);
+
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		boundInstanceGenerations[i] = 0;
+	}
 }
 
 bool RenderingPath::Init(VKRenderer* renderer, unsigned int width, unsigned int height)
@@ -31,6 +36,9 @@ bool RenderingPath::Init(VKRenderer* renderer, unsigned int width, unsigned int
 	VKBase& base = renderer->GetBase();
 	VkDevice device = base.GetDevice();
 
+	if (!frameAllocator.Init(256 * 1024))
+		return false;
+
 	if (!CreateShadowMapPass())
 		return false;
 	if (!CreateHDRPass())
@@ -86,16 +94,16 @@ bool RenderingPath::Init(VKRenderer* renderer, unsigned int width, unsigned int
 	
 	dirLightUBO.Create(&base, sizeof(DirLightUBO), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-	// Create a large buffer which will hold the model matrices
-	instanceDataBuffer.Create(&base, sizeof(glm::mat4) * 32, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-	VkDescriptorBufferInfo bufferInfo = {};
-	bufferInfo.buffer = instanceDataBuffer.GetBuffer();
-	bufferInfo.offset = 0;
-	bufferInfo.range = VK_WHOLE_SIZE;
+	// Holds the model matrices. The buffers grow in BeginFrame when there are more transforms or instances
+	if (!instanceBuffer.Init(base, INITIAL_INSTANCE_CAPACITY, INITIAL_INSTANCE_CAPACITY))
+		return false;
 
-	renderer->UpdateGlobalBuffersSet(bufferInfo, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	for (unsigned int i = 0; i < VKRenderer::MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		BindInstanceBuffer(i);
+	}
 
+	VkDescriptorBufferInfo bufferInfo = {};
 	bufferInfo.buffer = dirLightUBO.GetBuffer();
 	bufferInfo.offset = 0;
 	bufferInfo.range = VK_WHOLE_SIZE;
@@ -113,15 +121,49 @@ bool RenderingPath::Init(VKRenderer* renderer, unsigned int width, unsigned int
 	return true;
 }
 
+bool RenderingPath::BeginFrame(ModelManager& modelManager, TransformManager& transformManager)
+{
+	unsigned int frame = renderer->GetCurrentFrame();
+
+	if (!instanceBuffer.Update(renderer->GetBase(), frame, transformManager, modelManager.GetMaxInstances()))
+		return false;
+
+	// Only this frame's set points to the recreated buffers, the other frames can still be in flight
+	if (boundInstanceGenerations[frame] != instanceBuffer.GetGeneration(frame))
+		BindInstanceBuffer(frame);
+
+	modelManager.UpdateInstanceBuffer(instanceBuffer, frame);
+
+	return true;
+}
+
+void RenderingPath::BindInstanceBuffer(unsigned int frame)
+{
+	VkDescriptorBufferInfo bufferInfo = {};
+	bufferInfo.buffer = instanceBuffer.GetTransformsBuffer(frame).GetBuffer();
+	bufferInfo.offset = 0;
+	bufferInfo.range = VK_WHOLE_SIZE;
+
+	renderer->UpdateGlobalBuffersSet(frame, bufferInfo, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+	bufferInfo.buffer = instanceBuffer.GetInstancesBuffer(frame).GetBuffer();
+
+	renderer->UpdateGlobalBuffersSet(frame, bufferInfo, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+	boundInstanceGenerations[frame] = instanceBuffer.GetGeneration(frame);
+}
+
 void RenderingPath::Update(const Camera& camera, float deltaTime)
 {
-	projectedGridWater.Update(camera, deltaTime);		// Make sure to update the grid before updating the frame data buffer otherwise the shader will get old values and will cause problems at the edge of the image when rotating the camera
+	projectedGridWater.Update(camera, deltaTime, frameAllocator);		// Make sure to update the grid before updating the frame data buffer otherwise the shader will get old values and will cause problems at the edge of the image when rotating the camera
 }
 
 void RenderingPath::EndFrame(const Camera &camera)
 {
 	volClouds.EndFrame();
 	previousFrameView = camera.GetViewMatrix();
+
+	frameAllocator.Reset();
 }
 
 void RenderingPath::Dispose()
@@ -135,8 +177,9 @@ void RenderingPath::Dispose()
 	projectedGridWater.Dispose(device);
 	hdrFB.Dispose(device);
 	shadowFB.Dispose(device);
-	instanceDataBuffer.Dispose(device);
+	instanceBuffer.Dispose(device);
 	dirLightUBO.Dispose(device);
+	frameAllocator.Dispose();
 
 	vkDestroyFence(device, computeFence, nullptr);
 	storageTexture.Dispose(device);
@@ -443,6 +486,7 @@ bool RenderingPath::SubmitCompute()
 
 	vkWaitForFences(device, 1, &computeFence, VK_TRUE, UINT64_MAX);
 	vkResetFences(device, 1, &computeFence);
+	base.GetAllocator().FlushMappedRanges();
 
 	if (vkQueueSubmit(base.GetComputeQueue(), 1, &computeSubmitInfo, computeFence) != VK_SUCCESS)
 	{
@@ -453,7 +497,14 @@ bool RenderingPath::SubmitCompute()
 	return true;
 }
 
-bool RenderingPath::PerformShadowMapPass(VkCommandBuffer cmdBuffer, ModelManager& modelManager)
+bool RenderingPath::PerformCullingPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager& modelManager, const TransformManager& transformManager)
+{
+	modelManager.RecordCulling(cmdBuffer, renderer->GetCurrentFrame(), transformManager, camera.GetFrustum(), lightSpaceCamera.GetFrustum());
+
+	return true;
+}
+
+bool RenderingPath::PerformShadowMapPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager& modelManager)
 {
 	VkPipelineLayout pipelineLayout = renderer->GetPipelineLayout();
 
@@ -471,7 +522,8 @@ bool RenderingPath::PerformShadowMapPass(VkCommandBuffer cmdBuffer, ModelManager
 	depthClearValue.depthStencil = { 1.0f, 0 };
 
 	renderer->BeginRenderPass(cmdBuffer, shadowFB, 1, &depthClearValue);
-	modelManager.Render(cmdBuffer, pipelineLayout, shadowMat.GetPipeline());
+	// The LODs are picked from the camera so the shadows are cast by the same LODs that are drawn
+	modelManager.Render(cmdBuffer, pipelineLayout, shadowMat.GetPipeline(), lightSpaceCamera.GetFrustum(), camera.GetFrustum());
 	vkCmdEndRenderPass(cmdBuffer);
 
 	return true;
@@ -484,7 +536,7 @@ bool RenderingPath::PerformVolumetricCloudsPass(VkCommandBuffer cmdBuffer)
 	return true;
 }
 
-bool RenderingPath::PerformHDRPass(VkCommandBuffer cmdBuffer, ModelManager& modelManager, ParticleManager& particleManager)
+bool RenderingPath::PerformHDRPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager& modelManager, ParticleManager& particleManager)
 {
 	VkPipelineLayout pipelineLayout = renderer->GetPipelineLayout();
 
@@ -531,13 +583,16 @@ bool RenderingPath::PerformHDRPass(VkCommandBuffer cmdBuffer, ModelManager& mode
 	}
 
 
+	// The simulation can't be recorded inside the render pass
+	particleManager.RecordSimulation(cmdBuffer);
+
 	VkClearValue clearValues[2] = {};
 	clearValues[0].color = { 0.3f, 0.3f, 0.3f, 1.0f };
 	clearValues[1].depthStencil = { 1.0f, 0 };
 
 	renderer->BeginRenderPass(cmdBuffer, hdrFB, 2, clearValues);
 
-	modelManager.Render(cmdBuffer, pipelineLayout, VK_NULL_HANDLE);
+	modelManager.Render(cmdBuffer, pipelineLayout, VK_NULL_HANDLE, camera.GetFrustum(), camera.GetFrustum());
 
 	VkBuffer vertexBuffers[] = { VK_NULL_HANDLE };
 	VkDeviceSize offsets[] = { 0 };
@@ -597,8 +652,6 @@ bool RenderingPath::PerformPostProcessPass(VkCommandBuffer cmdBuffer)
 
 void RenderingPath::UpdateBuffers(const Camera &camera, const ModelManager& modelManager, TransformManager &transformManager, float deltaTime, float timeElapsed)
 {
-	VkDevice device = renderer->GetBase().GetDevice();
-
 	const VolumetricCloudsData& volCloudsData = volClouds.GetVolumetricCloudsData();
 
 	frameData.screenRes = glm::vec2((float)width, (float)height);
@@ -637,21 +690,22 @@ void RenderingPath::UpdateBuffers(const Camera &camera, const ModelManager& mode
 	DirLightUBO dirLightData = {};
 	dirLightData.lightSpaceMatrix[0] = lightSpaceCamera.GetProjectionMatrix() * lightSpaceCamera.GetViewMatrix();
 
-	void* mapped = dirLightUBO.Map(device, 0, VK_WHOLE_SIZE);
-	memcpy(mapped, &dirLightData, sizeof(DirLightUBO));
-	dirLightUBO.Unmap(device);
+	MappedSpan<DirLightUBO> mappedDirLight = dirLightUBO.GetSpan<DirLightUBO>(0, 1);
+	if (!mappedDirLight.IsEmpty())
+	{
+		mappedDirLight[0] = dirLightData;
+		dirLightUBO.Flush(mappedDirLight);
+	}
 
-	// Update model matrices
-	const std::vector<ModelInstance>& modelInstances = modelManager.GetModelInstances();
+	// The matrices were copied by BeginFrame. Write the transform and texture of each instance in the order they were drawn so the instanced draws find them consecutively
+	const ComponentArray<RenderModel>& models = modelManager.GetModels();
+	const std::vector<unsigned int>& instanceModels = modelManager.GetInstanceModels();
 
-	mapped = instanceDataBuffer.Map(device, 0, VK_WHOLE_SIZE);
-	size_t offset = 0;
-	for (unsigned int i = 0; i < modelManager.GetNumModels(); i++)
+	unsigned int currentFrame = renderer->GetCurrentFrame();
+	glm::uvec2* instances = instanceBuffer.GetInstances(currentFrame);
+	for (size_t i = 0; i < instanceModels.size(); i++)
 	{
-		void* ptr = (char*)mapped + offset;
-		memcpy(ptr, &transformManager.GetLocalToWorld(modelInstances[i].e), sizeof(glm::mat4));
-		offset += sizeof(glm::mat4);
+		instances[i] = glm::uvec2(transformManager.GetTransformIndex(models.GetEntity(instanceModels[i])), modelManager.GetInstanceTexture(instanceModels[i]));
 	}
-
-	instanceDataBuffer.Unmap(device);
+	instanceBuffer.FlushInstances(currentFrame, static_cast<unsigned int>(instanceModels.size()));
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include "ModelManager.h"
 #include "ParticleManager.h"
 #include "TransformManager.h"
+#include "InstanceBuffer.h"
+#include "Allocator.h"
 
 class Renderer;
 
@@ -19,9 +21,13 @@ public:
 	bool Init(VKRenderer* renderer, unsigned int width, unsigned int height);
 	void Update(const Camera& camera, float deltaTime);
 	void EndFrame(const Camera& camera);
-	bool PerformShadowMapPass(VkCommandBuffer cmdBuffer, ModelManager &modelManager);
+	// Copies the modified transforms to this frame's instance buffer and grows it if needed. Must be called after the frame fences were waited on and before the commands are recorded
+	bool BeginFrame(ModelManager& modelManager, TransformManager& transformManager);
+	// Culls the models on the GPU for the shadow and HDR passes when the model manager is GPU driven
+	bool PerformCullingPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager& modelManager, const TransformManager& transformManager);
+	bool PerformShadowMapPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager &modelManager);
 	bool PerformVolumetricCloudsPass(VkCommandBuffer cmdBuffer);
-	bool PerformHDRPass(VkCommandBuffer cmdBuffer, ModelManager& modelManager, ParticleManager& particleManager);
+	bool PerformHDRPass(VkCommandBuffer cmdBuffer, const Camera& camera, ModelManager& modelManager, ParticleManager& particleManager);
 	bool PerformPostProcessPass(VkCommandBuffer cmdBuffer);
 	bool PerformComputePass();
 	bool SubmitCompute();
@@ -32,6 +38,10 @@ public:
 	const VKFramebuffer& GetHDRFramebuffer() const { return hdrFB; }
 
 	const VKTexture2D& GetStorageTexture() const { return storageTexture; }
+	const InstanceBuffer& GetInstanceBuffer() const { return instanceBuffer; }
+
+	// Memory for data that is only needed during the current frame. Reset in EndFrame
+	LinearAllocator& GetFrameAllocator() { return frameAllocator; }
 
 	VkSemaphore GetGraphicsSemaphore() const { return graphicsSemaphore; }
 	VkSemaphore GetComputeSemaphore() const { return computeSemaphore; }
@@ -41,16 +51,20 @@ private:
 	bool CreateHDRPass();
 	bool CreatePostProcessPass();
 	bool CreateComputePass();
+	void BindInstanceBuffer(unsigned int frame);
 
 private:
 	unsigned int width, height;
 	VKRenderer* renderer;
+	LinearAllocator frameAllocator;
 	FrameUBO frameData;
 	VkSemaphore computeSemaphore;
 	VkSemaphore graphicsSemaphore;
 
 	VKBuffer dirLightUBO;
-	VKBuffer instanceDataBuffer;
+	InstanceBuffer instanceBuffer;
+	unsigned int boundInstanceGenerations[VKRenderer::MAX_FRAMES_IN_FLIGHT];
+	static const unsigned int INITIAL_INSTANCE_CAPACITY = 1024;
 
 	Water projectedGridWater;
 	VolumetricClouds volClouds;
@@ -94,7 +94,7 @@ bool Skybox::Load(VKRenderer* renderer, const std::vector<std::string>& facesPat
 
 	void* mapped = vertexStagingBuffer.Map(device, 0, vertexSize);
 	memcpy(mapped, vertices, (size_t)vertexSize);
-	vertexStagingBuffer.Unmap(device);
+	vertexStagingBuffer.Flush(0, vertexSize);
 
 	vb.Create(&base, sizeof(vertices), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
@@ -153,7 +153,7 @@ bool Skybox::Load(VKRenderer* renderer, const std::vector<std::string>& facesPat
 	vertexShader.LoadShader(device, "skybox", VK_SHADER_STAGE_VERTEX_BIT);
 	fragmentShader.LoadShader(device, "skybox", VK_SHADER_STAGE_FRAGMENT_BIT);
 
-	if (!pipeline.Create(device, pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
+	if (!pipeline.Create(renderer->GetBase().GetPipelineCache(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
 		return false;
 
 	return true;
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "EntityManager.h"
+
+#include <vector>
+#include <cassert>
+
+// Maps entity ids to indices in a packed array. Removing an entity moves the last one into its slot so the indices stay contiguous
+class SparseSet
+{
+public:
+	static constexpr unsigned int INVALID_INDEX = std::numeric_limits<unsigned int>::max();
+
+	// Returns the packed index of the entity. If the entity is already in the set the existing index is returned
+	// Owners that keep packed data next to the set must remove the stale entity (see GetStale) first so its data moves with it
+	unsigned int Add(Entity e)
+	{
+		if (e.id >= sparse.size())
+			sparse.resize(e.id + 1, INVALID_INDEX);
+
+		if (sparse[e.id] != INVALID_INDEX)
+		{
+			if (dense[sparse[e.id]].generation == e.generation)
+				return sparse[e.id];
+
+			// The id belongs to a destroyed entity that was never removed
+			assert(false && "SparseSet::Add: remove the stale entity first");
+			Remove(dense[sparse[e.id]]);
+		}
+
+		unsigned int index = static_cast<unsigned int>(dense.size());
+		sparse[e.id] = index;
+		dense.push_back(e);
+
+		return index;
+	}
+
+	// Removes the entity by moving the last entity into its slot. Returns the index that was removed, which now holds the entity that was last, or INVALID_INDEX if the entity was not in the set
+	unsigned int Remove(Entity e)
+	{
+		if (!Has(e))
+			return INVALID_INDEX;
+
+		unsigned int index = sparse[e.id];
+		Entity last = dense.back();
+
+		dense[index] = last;
+		sparse[last.id] = index;
+
+		dense.pop_back();
+		sparse[e.id] = INVALID_INDEX;
+
+		return index;
+	}
+
+	void Clear()
+	{
+		sparse.clear();
+		dense.clear();
+	}
+
+	bool Has(Entity e) const { return e.id < sparse.size() && sparse[e.id] != INVALID_INDEX && dense[sparse[e.id]].generation == e.generation; }
+	// Entity of an older generation that still holds the id of e, or an invalid entity if there is none
+	Entity GetStale(Entity e) const
+	{
+		if (e.id < sparse.size() && sparse[e.id] != INVALID_INDEX && dense[sparse[e.id]].generation != e.generation)
+			return dense[sparse[e.id]];
+
+		return { std::numeric_limits<unsigned int>::max(), 0 };
+	}
+	// The entity must be in the set
+	unsigned int GetIndex(Entity e) const { return sparse[e.id]; }
+	Entity GetEntity(unsigned int index) const { return dense[index]; }
+	unsigned int GetSize() const { return static_cast<unsigned int>(dense.size()); }
+	const Entity* GetEntities() const { return dense.data(); }
+
+private:
+	std::vector<unsigned int> sparse;		// Indexed by entity id
+	std::vector<Entity> dense;
+};
+
+// Sparse set that also stores one component per entity in a packed array
+template<typename T>
+class ComponentArray
+{
+public:
+	T& Add(Entity e, const T& component)
+	{
+		// A destroyed entity with the same id still has its component
+		Entity stale = set.GetStale(e);
+		if (stale.IsValid())
+			Remove(stale);
+
+		unsigned int index = set.Add(e);
+
+		if (index == components.size())
+			components.push_back(component);
+
+		return components[index];
+	}
+
+	void Remove(Entity e)
+	{
+		unsigned int index = set.Remove(e);
+
+		if (index == SparseSet::INVALID_INDEX)
+			return;
+
+		if (index != components.size() - 1)
+			components[index] = std::move(components.back());
+
+		components.pop_back();
+	}
+
+	void Clear()
+	{
+		set.Clear();
+		components.clear();
+	}
+
+	bool Has(Entity e) const { return set.Has(e); }
+	unsigned int GetIndex(Entity e) const { return set.GetIndex(e); }
+	T& Get(Entity e) { return components[set.GetIndex(e)]; }
+	const T& Get(Entity e) const { return components[set.GetIndex(e)]; }
+
+	T& operator[](unsigned int index) { return components[index]; }
+	const T& operator[](unsigned int index) const { return components[index]; }
+
+	unsigned int GetSize() const { return set.GetSize(); }
+	Entity GetEntity(unsigned int index) const { return set.GetEntity(index); }
+	const Entity* GetEntities() const { return set.GetEntities(); }
+	T* GetData() { return components.data(); }
+	const T* GetData() const { return components.data(); }
+
+private:
+	SparseSet set;
+	std::vector<T> components;
+};
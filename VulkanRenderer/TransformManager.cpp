@@ -2,9 +2,55 @@
 
 #include "Log.h"
 #include "Allocator.h"
+#include "JobSystem.h"
 
 #include "glm/gtc/matrix_transform.hpp"
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define TRANSFORM_MANAGER_USE_SSE
+#endif
+
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static unsigned int CountTrailingZeros(unsigned int x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return static_cast<unsigned int>(index);
+#else
+	return static_cast<unsigned int>(__builtin_ctz(x));
+#endif
+}
+
+// out = a * b
+static void MultiplyMatrices(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+{
+#ifdef TRANSFORM_MANAGER_USE_SSE
+	// Use unaligned loads because the columns are only guaranteed to have the alignment of a float
+	__m128 a0 = _mm_loadu_ps(&a[0][0]);
+	__m128 a1 = _mm_loadu_ps(&a[1][0]);
+	__m128 a2 = _mm_loadu_ps(&a[2][0]);
+	__m128 a3 = _mm_loadu_ps(&a[3][0]);
+
+	for (int i = 0; i < 4; i++)
+	{
+		__m128 col = _mm_mul_ps(a0, _mm_set1_ps(b[i][0]));
+		col = _mm_add_ps(col, _mm_mul_ps(a1, _mm_set1_ps(b[i][1])));
+		col = _mm_add_ps(col, _mm_mul_ps(a2, _mm_set1_ps(b[i][2])));
+		col = _mm_add_ps(col, _mm_mul_ps(a3, _mm_set1_ps(b[i][3])));
+		_mm_storeu_ps(&out[i][0], col);
+	}
+#else
+	out = a * b;
+#endif
+}
+
 void TransformManager::Init(Allocator* allocator, unsigned int initialCapacity)
 {
 	if (isInit)
@@ -13,20 +59,8 @@ void TransformManager::Init(Allocator* allocator, unsigned int initialCapacity)
 	this->allocator = allocator;
 
 	instanceData = {};
-	//instanceData.buffer = new unsigned char[initialCapacity * (sizeof(glm::mat4) + sizeof(glm::vec3) + sizeof(glm::quat) + sizeof(glm::vec3) + sizeof(Entity) * 4 + sizeof(bool))];
-	instanceData.buffer = (unsigned char*)allocator->Allocate(initialCapacity * (sizeof(glm::mat4) + sizeof(glm::vec3) + sizeof(glm::quat) + sizeof(glm::vec3) + sizeof(Entity) * 4 + sizeof(bool)));
-	instanceData.capacity = initialCapacity;
-	instanceData.size = 0;
-
-	instanceData.localToWorld = (glm::mat4*)instanceData.buffer;
-	instanceData.localPosition = (glm::vec3*)(instanceData.localToWorld + initialCapacity);
-	instanceData.localRotation = (glm::quat*)(instanceData.localPosition + initialCapacity);
-	instanceData.localScale = (glm::vec3*)(instanceData.localRotation + initialCapacity);
-	instanceData.parent = (Entity*)(instanceData.localScale + initialCapacity);
-	instanceData.firstChild = (Entity*)(instanceData.parent + initialCapacity);
-	instanceData.prevSibling = (Entity*)(instanceData.firstChild + initialCapacity);
-	instanceData.nextSibling = (Entity*)(instanceData.prevSibling + initialCapacity);
-	instanceData.modified = (bool*)(instanceData.nextSibling + initialCapacity);
+	Allocate(initialCapacity);
+	pendingGroups = 0;
 
 	isInit = true;
 
@@ -38,51 +72,415 @@ void TransformManager::Dispose()
 	if (instanceData.buffer)
 		allocator->Free(instanceData.buffer);
 
+	instanceData = {};
+	transforms.Clear();
+	modifiedTransforms.clear();
+	modifiedRanges.clear();
+	modifiedRangesValid = false;
+	isInit = false;
+
 	//Log::Print(LogLevel::LEVEL_INFO, "Disposing Transform manager\n");
 }
 
+void TransformManager::Allocate(unsigned int newCapacity)
+{
+	const unsigned int bytesPerTransform = sizeof(glm::mat4) + sizeof(glm::vec3) + sizeof(glm::quat) + sizeof(glm::vec3) + sizeof(Entity) * 4 + sizeof(unsigned int) + sizeof(bool);
+	const unsigned int numBitWords = (newCapacity + 31) / 32;
+
+	TransformInstanceData newData = {};
+	newData.buffer = (unsigned char*)allocator->Allocate(newCapacity * bytesPerTransform + numBitWords * sizeof(unsigned int), MemoryTag::TRANSFORMS);
+	newData.capacity = newCapacity;
+	newData.size = instanceData.size;
+
+	newData.localToWorld = (glm::mat4*)newData.buffer;
+	newData.localPosition = (glm::vec3*)(newData.localToWorld + newCapacity);
+	newData.localRotation = (glm::quat*)(newData.localPosition + newCapacity);
+	newData.localScale = (glm::vec3*)(newData.localRotation + newCapacity);
+	newData.parent = (Entity*)(newData.localScale + newCapacity);
+	newData.firstChild = (Entity*)(newData.parent + newCapacity);
+	newData.prevSibling = (Entity*)(newData.firstChild + newCapacity);
+	newData.nextSibling = (Entity*)(newData.prevSibling + newCapacity);
+	newData.hierarchyOrder = (unsigned int*)(newData.nextSibling + newCapacity);
+	newData.modifiedBits = newData.hierarchyOrder + newCapacity;
+	newData.dirty = (bool*)(newData.modifiedBits + numBitWords);
+
+	memset(newData.modifiedBits, 0, numBitWords * sizeof(unsigned int));
+
+	if (instanceData.buffer)
+	{
+		unsigned int size = instanceData.size;
+
+		memcpy(newData.localToWorld, instanceData.localToWorld, size * sizeof(glm::mat4));
+		memcpy(newData.localPosition, instanceData.localPosition, size * sizeof(glm::vec3));
+		memcpy(newData.localRotation, instanceData.localRotation, size * sizeof(glm::quat));
+		memcpy(newData.localScale, instanceData.localScale, size * sizeof(glm::vec3));
+		memcpy(newData.parent, instanceData.parent, size * sizeof(Entity));
+		memcpy(newData.firstChild, instanceData.firstChild, size * sizeof(Entity));
+		memcpy(newData.prevSibling, instanceData.prevSibling, size * sizeof(Entity));
+		memcpy(newData.nextSibling, instanceData.nextSibling, size * sizeof(Entity));
+		memcpy(newData.hierarchyOrder, instanceData.hierarchyOrder, size * sizeof(unsigned int));
+		memcpy(newData.modifiedBits, instanceData.modifiedBits, ((size + 31) / 32) * sizeof(unsigned int));
+		memcpy(newData.dirty, instanceData.dirty, size * sizeof(bool));
+
+		allocator->Free(instanceData.buffer);
+	}
+
+	instanceData = newData;
+
+	// The modified transforms point into the old buffer so point them to the new one
+	for (size_t i = 0; i < modifiedTransforms.size(); i++)
+	{
+		modifiedTransforms[i].localToWorld = &instanceData.localToWorld[transforms.GetIndex(modifiedTransforms[i].e)];
+	}
+}
+
 void TransformManager::ClearModifiedTransforms()
 {
-	numModifiedTransforms = 0;
+	// Only clear the bits of the transforms in the list instead of going through every transform
+	for (size_t i = 0; i < modifiedTransforms.size(); i++)
+	{
+		SetModifiedBit(transforms.GetIndex(modifiedTransforms[i].e), false);
+	}
+
+	modifiedTransforms.clear();
+	modifiedRanges.clear();
+	modifiedRangesValid = false;
+}
+
+const std::vector<TransformRange>& TransformManager::GetModifiedRanges()
+{
+	if (modifiedRangesValid)
+		return modifiedRanges;
+
+	modifiedRanges.clear();
+	modifiedRangesValid = true;
+
+	if (modifiedTransforms.size() == 0)
+		return modifiedRanges;
+
+	// Walk the bitset so the ranges come out sorted. Words without any modified transform are skipped
+	const unsigned int numBitWords = (instanceData.size + 31) / 32;
+
+	for (unsigned int w = 0; w < numBitWords; w++)
+	{
+		unsigned int bits = instanceData.modifiedBits[w];
+
+		while (bits != 0)
+		{
+			unsigned int bit = CountTrailingZeros(bits);
+			bits &= bits - 1;
+
+			unsigned int index = w * 32 + bit;
+
+			if (modifiedRanges.size() > 0 && modifiedRanges.back().first + modifiedRanges.back().count == index)
+				modifiedRanges.back().count++;
+			else
+				modifiedRanges.push_back({ index, 1 });
+		}
+	}
+
+	return modifiedRanges;
+}
+
+unsigned int TransformManager::CopyModifiedTransforms(glm::mat4* dst)
+{
+	const std::vector<TransformRange>& ranges = GetModifiedRanges();
+
+	unsigned int numCopied = 0;
+
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		memcpy(&dst[ranges[i].first], &instanceData.localToWorld[ranges[i].first], ranges[i].count * sizeof(glm::mat4));
+		numCopied += ranges[i].count;
+	}
+
+	return numCopied;
+}
+
+void TransformManager::UpdateWorldMatrices(JobSystem* jobSystem)
+{
+	if (!anyDirty)
+		return;
+
+	if (hierarchyChanged)
+		RebuildHierarchyOrder();
+
+	if (updatedScratch.size() < instanceData.size)
+		updatedScratch.resize(instanceData.capacity);
+
+	// The updated transforms of every level are compacted to the start of the scratch buffer so we can clear their dirty flag at the end
+	unsigned int numUpdated = 0;
+
+	// Transforms in the same depth level don't depend on each other, so each level can be split across threads.
+	// The parents are all in the previous level, which is finished before the next one starts
+	for (size_t l = 0; l + 1 < levelStarts.size(); l++)
+	{
+		unsigned int levelStart = levelStarts[l];
+		unsigned int levelCount = levelStarts[l + 1] - levelStart;
+
+		if (jobSystem == nullptr || levelCount <= PARALLEL_GROUP_SIZE)
+		{
+			unsigned int count = UpdateWorldMatricesRange(levelStart, levelStart + levelCount, &updatedScratch[levelStart]);
+
+			for (unsigned int i = 0; i < count; i++)
+			{
+				unsigned int index = updatedScratch[levelStart + i];
+				AddModifiedTransform(index);
+				updatedScratch[numUpdated++] = index;
+			}
+			continue;
+		}
+
+		unsigned int groupCount = (levelCount + PARALLEL_GROUP_SIZE - 1) / PARALLEL_GROUP_SIZE;
+		groupUpdatedCounts.resize(groupCount);
+
+		jobSystem->Dispatch(levelCount, PARALLEL_GROUP_SIZE, [this, levelStart](unsigned int groupIndex, unsigned int start, unsigned int end)
+		{
+			groupUpdatedCounts[groupIndex] = UpdateWorldMatricesRange(levelStart + start, levelStart + end, &updatedScratch[levelStart + start]);
+		}, &pendingGroups);
+		jobSystem->WaitFor(pendingGroups);
+
+		// Merge the updated transforms of every group on this thread so the modified list doesn't need a lock
+		for (unsigned int g = 0; g < groupCount; g++)
+		{
+			unsigned int groupStart = levelStart + g * PARALLEL_GROUP_SIZE;
+
+			for (unsigned int i = 0; i < groupUpdatedCounts[g]; i++)
+			{
+				unsigned int index = updatedScratch[groupStart + i];
+				AddModifiedTransform(index);
+				updatedScratch[numUpdated++] = index;
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < numUpdated; i++)
+	{
+		instanceData.dirty[updatedScratch[i]] = false;
+	}
+
+	anyDirty = false;
+}
+
+unsigned int TransformManager::UpdateWorldMatricesRange(unsigned int start, unsigned int end, unsigned int* updatedOut)
+{
+	unsigned int numUpdated = 0;
+
+	for (unsigned int i = start; i < end; i++)
+	{
+		unsigned int index = instanceData.hierarchyOrder[i];
+		Entity parent = instanceData.parent[index];
+		unsigned int parentIndex = parent.IsValid() ? transforms.GetIndex(parent) : SparseSet::INVALID_INDEX;
+
+		// Parents are always before their children so a dirty parent is propagated down the whole hierarchy in this single pass
+		if (parentIndex != SparseSet::INVALID_INDEX && instanceData.dirty[parentIndex])
+			instanceData.dirty[index] = true;
+
+		if (instanceData.dirty[index] == false)
+			continue;
+
+		const glm::vec3& scale = instanceData.localScale[index];
+
+		glm::mat4 localToParent = glm::mat4_cast(instanceData.localRotation[index]);
+		localToParent[0] *= scale.x;
+		localToParent[1] *= scale.y;
+		localToParent[2] *= scale.z;
+		localToParent[3] = glm::vec4(instanceData.localPosition[index], 1.0f);
+
+		if (parentIndex != SparseSet::INVALID_INDEX)
+			MultiplyMatrices(instanceData.localToWorld[parentIndex], localToParent, instanceData.localToWorld[index]);
+		else
+			instanceData.localToWorld[index] = localToParent;
+
+		updatedOut[numUpdated] = index;
+		numUpdated++;
+	}
+
+	return numUpdated;
+}
+
+void TransformManager::UpdateSubtree(unsigned int index)
+{
+	subtreeStack.clear();
+	subtreeStack.push_back(index);
+
+	while (subtreeStack.size() > 0)
+	{
+		unsigned int i = subtreeStack.back();
+		subtreeStack.pop_back();
+
+		const glm::vec3& scale = instanceData.localScale[i];
+
+		glm::mat4 localToParent = glm::mat4_cast(instanceData.localRotation[i]);
+		localToParent[0] *= scale.x;
+		localToParent[1] *= scale.y;
+		localToParent[2] *= scale.z;
+		localToParent[3] = glm::vec4(instanceData.localPosition[i], 1.0f);
+
+		Entity parent = instanceData.parent[i];
+
+		if (parent.IsValid())
+			MultiplyMatrices(instanceData.localToWorld[transforms.GetIndex(parent)], localToParent, instanceData.localToWorld[i]);
+		else
+			instanceData.localToWorld[i] = localToParent;
+
+		// Children that were dirty are up to date too now
+		instanceData.dirty[i] = false;
+		AddModifiedTransform(i);
+
+		Entity child = instanceData.firstChild[i];
+		while (child.IsValid())
+		{
+			unsigned int childIndex = transforms.GetIndex(child);
+			subtreeStack.push_back(childIndex);
+			child = instanceData.nextSibling[childIndex];
+		}
+	}
+}
+
+void TransformManager::RebuildHierarchyOrder()
+{
+	unsigned int count = 0;
+
+	levelStarts.clear();
+	levelStarts.push_back(0);
 
-	// Try memset 0 to put everything to false
+	// Roots first
 	for (unsigned int i = 0; i < instanceData.size; i++)
 	{
-		instanceData.modified[i] = false;
+		if (instanceData.parent[i].IsValid() == false)
+		{
+			instanceData.hierarchyOrder[count] = i;
+			count++;
+		}
 	}
+
+	// Then the children of every transform already in the list, which gives us a breadth first order
+	unsigned int levelEnd = count;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		// When we reach the end of a level, all the children added so far belong to the next one
+		if (i == levelEnd)
+		{
+			levelStarts.push_back(i);
+			levelEnd = count;
+		}
+
+		Entity child = instanceData.firstChild[instanceData.hierarchyOrder[i]];
+		while (child.IsValid())
+		{
+			instanceData.hierarchyOrder[count] = transforms.GetIndex(child);
+			count++;
+			child = instanceData.nextSibling[transforms.GetIndex(child)];
+		}
+	}
+
+	levelStarts.push_back(count);
+
+	hierarchyChanged = false;
+}
+
+void TransformManager::MarkDirty(Entity e)
+{
+	instanceData.dirty[transforms.GetIndex(e)] = true;
+	anyDirty = true;
+}
+
+bool TransformManager::IsWorldMatrixStale(unsigned int index) const
+{
+	// The dirty flag is only set on the modified transform, its children are updated with it
+	while (true)
+	{
+		if (instanceData.dirty[index])
+			return true;
+
+		Entity parent = instanceData.parent[index];
+		if (!parent.IsValid())
+			return false;
+
+		index = transforms.GetIndex(parent);
+	}
+}
+
+void TransformManager::AddModifiedTransform(unsigned int index)
+{
+	if (IsModified(index))
+		return;
+
+	ModifiedTransform mt;
+	mt.e = transforms.GetEntity(index);
+	mt.localToWorld = &instanceData.localToWorld[index];
+	modifiedTransforms.push_back(mt);
+
+	SetModifiedBit(index, true);
+	modifiedRangesValid = false;
+}
+
+void TransformManager::SetModifiedBit(unsigned int index, bool modified)
+{
+	if (modified)
+		instanceData.modifiedBits[index >> 5] |= 1u << (index & 31);
+	else
+		instanceData.modifiedBits[index >> 5] &= ~(1u << (index & 31));
 }
 
 void TransformManager::AddTransform(Entity e)
 {
 	// Only one transform per entity
-	if (e.id < instanceData.size)
+	if (transforms.Has(e))
 		return;
 
+	// A destroyed entity with the same id still has its transform, remove it so the new one gets a clean slot
+	Entity stale = transforms.GetStale(e);
+	if (stale.IsValid())
+		RemoveTransform(stale);
+
 	if (instanceData.size == instanceData.capacity)
 	{
-		// resize
+		Allocate(instanceData.capacity > 0 ? instanceData.capacity * 2 : 16);
 	}
 
-	instanceData.localToWorld[instanceData.size] = glm::mat4(1.0f);
-	instanceData.localPosition[instanceData.size] = glm::vec3(0.0f);
-	instanceData.localRotation[instanceData.size] = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-	instanceData.localScale[instanceData.size] = glm::vec3(1.0f);
-	instanceData.parent[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.firstChild[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.prevSibling[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.nextSibling[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
+	unsigned int index = transforms.Add(e);
+
+	instanceData.localToWorld[index] = glm::mat4(1.0f);
+	instanceData.localPosition[index] = glm::vec3(0.0f);
+	instanceData.localRotation[index] = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+	instanceData.localScale[index] = glm::vec3(1.0f);
+	instanceData.parent[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.firstChild[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.prevSibling[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.nextSibling[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.hierarchyOrder[index] = index;
+	hierarchyChanged = true;		// New roots have to be moved to the first level of the order
+	SetModifiedBit(index, false);
+	instanceData.dirty[index] = false;
 
 	instanceData.size++;
+
+	// Copies indexed by transform index (eg. the instance buffer) still have the matrix of the transform that used this index before
+	AddModifiedTransform(index);
 }
 
 void TransformManager::DuplicateTransform(Entity e, Entity newE)
 {
+	if (transforms.Has(newE))
+		return;
+
+	Entity stale = transforms.GetStale(newE);
+	if (stale.IsValid())
+		RemoveTransform(stale);
+
+	UpdateWorldMatrices();
+
 	if (instanceData.size == instanceData.capacity)
 	{
-		// resize
+		Allocate(instanceData.capacity > 0 ? instanceData.capacity * 2 : 16);
 	}
 
-	glm::mat4 localToWorld = instanceData.localToWorld[e.id];
+	unsigned int srcIndex = transforms.GetIndex(e);
+
+	glm::mat4 localToWorld = instanceData.localToWorld[srcIndex];
 	glm::vec3 worldPos = localToWorld[3];
 	glm::vec3 worldScale = glm::vec3(glm::length(localToWorld[0]), glm::length(localToWorld[1]), glm::length(localToWorld[2]));
 
@@ -93,82 +491,85 @@ void TransformManager::DuplicateTransform(Entity e, Entity newE)
 	glm::quat worldRot = glm::quat_cast(localToWorld);
 	worldRot = glm::normalize(worldRot);
 
+	unsigned int index = transforms.Add(newE);
 
-	instanceData.localToWorld[instanceData.size] = instanceData.localToWorld[e.id];
-	/*instanceData.localPosition[instanceData.size] = instanceData.localPosition[e.id];
-	instanceData.localRotation[instanceData.size] = instanceData.localRotation[e.id];
-	instanceData.localScale[instanceData.size] = instanceData.localScale[e.id];*/
-	instanceData.localPosition[instanceData.size] = worldPos;
-	instanceData.localRotation[instanceData.size] = worldRot;
-	instanceData.localScale[instanceData.size] = worldScale;
-
-	instanceData.parent[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.firstChild[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.prevSibling[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.nextSibling[instanceData.size] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.localToWorld[index] = instanceData.localToWorld[srcIndex];
+	instanceData.localPosition[index] = worldPos;
+	instanceData.localRotation[index] = worldRot;
+	instanceData.localScale[index] = worldScale;
 
-	/*if (instanceData.modified[instanceData.size] == false)
-	{
-		ModifiedTransform &mt = modifiedTransforms[numModifiedTransforms];
-		mt.e = e;
-		mt.localToWorld = &instanceData.localToWorld[e.id];
-		numModifiedTransforms++;
-	}*/
+	instanceData.parent[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.firstChild[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.prevSibling[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.nextSibling[index] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.hierarchyOrder[index] = index;
+	hierarchyChanged = true;		// New roots have to be moved to the first level of the order
+	SetModifiedBit(index, false);
+	instanceData.dirty[index] = false;
 
 	instanceData.size++;
+
+	// Same as AddTransform, the copies may still have an old matrix at this index
+	AddModifiedTransform(index);
 }
 
 void TransformManager::SetParent(Entity e, Entity parent)
 {
-	Entity oldParent = instanceData.parent[e.id];
+	unsigned int index = transforms.GetIndex(e);
+
+	// We need the current world matrices to make the child relative to the parent. Only update when they are stale, otherwise building a hierarchy would update every transform once per SetParent
+	if (IsWorldMatrixStale(index) || IsWorldMatrixStale(transforms.GetIndex(parent)))
+		UpdateWorldMatrices();
+
+	Entity oldParent = instanceData.parent[index];
 
 	// Remove the instance from the parent children list
 	if (oldParent.IsValid())
 	{
-		Entity prevSibling = instanceData.prevSibling[e.id];
-		Entity nextSibling = instanceData.nextSibling[e.id];
+		Entity prevSibling = instanceData.prevSibling[index];
+		Entity nextSibling = instanceData.nextSibling[index];
 
-		if (instanceData.firstChild[oldParent.id].id == e.id)
-			instanceData.firstChild[oldParent.id] = nextSibling;
+		if (instanceData.firstChild[transforms.GetIndex(oldParent)].id == e.id)
+			instanceData.firstChild[transforms.GetIndex(oldParent)] = nextSibling;
 		else
 		{
 			assert(prevSibling.IsValid());
 
 			// We're going to remove the instance between prev and next. Now the next of the prev is the next sibling
-			instanceData.nextSibling[prevSibling.id] = nextSibling;
+			instanceData.nextSibling[transforms.GetIndex(prevSibling)] = nextSibling;
 		}
 
 		// If the instance had a next sibling now we also need to fix the prev sibling of the next sibling. The previous sibling will now be the previous sibling of the instance we removed.
 		if (nextSibling.IsValid())
-			instanceData.prevSibling[nextSibling.id] = prevSibling;
+			instanceData.prevSibling[transforms.GetIndex(nextSibling)] = prevSibling;
 	}
 
 	// Add the instance to the new parent children list
+	unsigned int parentIndex = transforms.GetIndex(parent);
 
-	instanceData.parent[e.id] = parent;
+	instanceData.parent[index] = parent;
 
-	Entity firstChild = instanceData.firstChild[parent.id];
+	Entity firstChild = instanceData.firstChild[parentIndex];
 
-	instanceData.firstChild[parent.id] = e;
-	instanceData.nextSibling[e.id] = firstChild;
+	instanceData.firstChild[parentIndex] = e;
+	instanceData.nextSibling[index] = firstChild;
 
 	if (firstChild.IsValid())
-		instanceData.prevSibling[firstChild.id] = e;
-
+		instanceData.prevSibling[transforms.GetIndex(firstChild)] = e;
 
-	glm::mat4 parentT = instanceData.localToWorld[parent.id];
 
 	// Update the child local position, rotation and scale to be relative to the parent
-	glm::mat4 t = glm::inverse(instanceData.localToWorld[parent.id]) * instanceData.localToWorld[e.id];
+	glm::mat4 t = glm::inverse(instanceData.localToWorld[parentIndex]) * instanceData.localToWorld[index];
 
-	instanceData.localPosition[e.id] = t[3];
-	instanceData.localScale[e.id] = glm::vec3(glm::length(t[0]), glm::length(t[1]), glm::length(t[2]));
+	instanceData.localPosition[index] = t[3];
+	instanceData.localScale[index] = glm::vec3(glm::length(t[0]), glm::length(t[1]), glm::length(t[2]));
 
-	glm::quat rotation = glm::inverse(instanceData.localRotation[parent.id]) * instanceData.localRotation[e.id];
+	glm::quat rotation = glm::inverse(instanceData.localRotation[parentIndex]) * instanceData.localRotation[index];
 	rotation = glm::normalize(rotation);
-	instanceData.localRotation[e.id] = rotation;
+	instanceData.localRotation[index] = rotation;
 
-	CalcTransform(e, parentT);
+	hierarchyChanged = true;
+	UpdateSubtree(index);
 }
 
 void TransformManager::RemoveParent(Entity e)
@@ -176,31 +577,35 @@ void TransformManager::RemoveParent(Entity e)
 	if (!HasParent(e))
 		return;
 
-	Entity parent = instanceData.parent[e.id];
-	Entity prevSibling = instanceData.prevSibling[e.id];
-	Entity nextSibling = instanceData.nextSibling[e.id];
+	UpdateWorldMatrices();
 
-	if (instanceData.firstChild[parent.id].id == e.id)
-		instanceData.firstChild[parent.id] = nextSibling;
+	unsigned int index = transforms.GetIndex(e);
+
+	Entity parent = instanceData.parent[index];
+	Entity prevSibling = instanceData.prevSibling[index];
+	Entity nextSibling = instanceData.nextSibling[index];
+
+	if (instanceData.firstChild[transforms.GetIndex(parent)].id == e.id)
+		instanceData.firstChild[transforms.GetIndex(parent)] = nextSibling;
 	else
 	{
 		assert(prevSibling.IsValid());
 
 		// We're going to remove the instance between prev and next. Now the next of the prev is the next sibling
-		instanceData.nextSibling[prevSibling.id] = nextSibling;
+		instanceData.nextSibling[transforms.GetIndex(prevSibling)] = nextSibling;
 	}
 
 	// If the instance had a next sibling now we also need to fix the prev sibling of the next sibling. The previous sibling will now be the previous sibling of the instance we removed.
 	if (nextSibling.IsValid())
-		instanceData.prevSibling[nextSibling.id] = prevSibling;
+		instanceData.prevSibling[transforms.GetIndex(nextSibling)] = prevSibling;
 
-	instanceData.parent[e.id] = { std::numeric_limits<unsigned int>::max() };
+	instanceData.parent[index] = { std::numeric_limits<unsigned int>::max() };
 
 	// When removing the child, she goes back to world space so set the new local position and rotation (which are now in world space)
-	glm::mat4 t = instanceData.localToWorld[e.id];
+	glm::mat4 t = instanceData.localToWorld[index];
 
-	instanceData.localPosition[e.id] = t[3];
-	instanceData.localScale[e.id] = glm::vec3(glm::length(t[0]), glm::length(t[1]), glm::length(t[2]));
+	instanceData.localPosition[index] = t[3];
+	instanceData.localScale[index] = glm::vec3(glm::length(t[0]), glm::length(t[1]), glm::length(t[2]));
 
 	// We need a rotation matrix to convert to quaternion
 	// There's no need to remove the translation because it's going to be casted to a 3x3 matrix so it's going to be dropped
@@ -211,189 +616,202 @@ void TransformManager::RemoveParent(Entity e)
 	glm::quat q = glm::quat_cast(t);
 	q = glm::normalize(q);
 
-	instanceData.localRotation[e.id] = q;
+	instanceData.localRotation[index] = q;
 
-	CalcTransform(e, glm::mat4(1.0f));
+	hierarchyChanged = true;
+	UpdateSubtree(index);
 }
 
 void TransformManager::SetLocalPosition(Entity e, const glm::vec3& position)
 {
-	instanceData.localPosition[e.id] = position;
-	CalcTransform(e);
+	instanceData.localPosition[transforms.GetIndex(e)] = position;
+	MarkDirty(e);
 }
 
 void TransformManager::SetLocalRotation(Entity e, const glm::quat& rotation)
 {
-	instanceData.localRotation[e.id] = rotation;
-	CalcTransform(e);
+	instanceData.localRotation[transforms.GetIndex(e)] = rotation;
+	MarkDirty(e);
 }
 
 void TransformManager::SetLocalRotationEuler(Entity e, const glm::vec3& euler)
 {
-	instanceData.localRotation[e.id] = glm::quat(glm::vec3(glm::radians(euler.x), glm::radians(euler.y), glm::radians(euler.z)));
-	CalcTransform(e);
+	instanceData.localRotation[transforms.GetIndex(e)] = glm::quat(glm::vec3(glm::radians(euler.x), glm::radians(euler.y), glm::radians(euler.z)));
+	MarkDirty(e);
 }
 
 void TransformManager::SetLocalScale(Entity e, const glm::vec3& scale)
 {
-	instanceData.localScale[e.id] = scale;
-	CalcTransform(e);
+	instanceData.localScale[transforms.GetIndex(e)] = scale;
+	MarkDirty(e);
 }
 
 void TransformManager::SetLocalToWorld(Entity e, const glm::mat4& localToWorld)
 {
-	Entity parent = instanceData.parent[e.id];
-	glm::mat4 parentT = parent.IsValid() ? instanceData.localToWorld[parent.id] : glm::mat4(1.0f);
+	unsigned int index = transforms.GetIndex(e);
+	Entity parent = instanceData.parent[index];
+
+	if (parent.IsValid())
+		UpdateWorldMatrices();
+
+	glm::mat4 parentT = parent.IsValid() ? instanceData.localToWorld[transforms.GetIndex(parent)] : glm::mat4(1.0f);
 
 	glm::mat4 m = glm::inverse(parentT) * localToWorld;
 
 	glm::quat r = glm::quat_cast(m);
 	r = glm::normalize(r);
 
-	instanceData.localPosition[e.id] = m[3];
-	instanceData.localScale[e.id] = glm::vec3(glm::length(localToWorld[0]), glm::length(localToWorld[1]), glm::length(localToWorld[2]));	// Should it be m instead of local to world?
-	instanceData.localRotation[e.id] = r;
+	instanceData.localPosition[index] = m[3];
+	instanceData.localScale[index] = glm::vec3(glm::length(localToWorld[0]), glm::length(localToWorld[1]), glm::length(localToWorld[2]));	// Should it be m instead of local to world?
+	instanceData.localRotation[index] = r;
 
-	if (instanceData.modified[e.id] == false)
-	{
-		ModifiedTransform& mt = modifiedTransforms[numModifiedTransforms];
-		mt.e = e;
-		mt.localToWorld = &instanceData.localToWorld[e.id];
-		numModifiedTransforms++;
-	}
-
-	instanceData.localToWorld[e.id] = localToWorld;
-	instanceData.modified[e.id] = true;
-
-	Entity child = instanceData.firstChild[e.id];
-	while (child.IsValid())
-	{
-		CalcTransform(child, instanceData.localToWorld[e.id]);
-		child = instanceData.nextSibling[child.id];
-	}
+	// The parent was updated above so the new matrix can be used right away
+	UpdateSubtree(index);
 }
 
 void TransformManager::SetLocalToParent(Entity e, const glm::mat4& localToParent)
 {
+	unsigned int index = transforms.GetIndex(e);
 	glm::quat r = glm::quat_cast(localToParent);
 	r = glm::normalize(r);
 
-	instanceData.localPosition[e.id] = localToParent[3];
-	instanceData.localScale[e.id] = glm::vec3(glm::length(localToParent[0]), glm::length(localToParent[1]), glm::length(localToParent[2]));
-	instanceData.localRotation[e.id] = r;
+	instanceData.localPosition[index] = localToParent[3];
+	instanceData.localScale[index] = glm::vec3(glm::length(localToParent[0]), glm::length(localToParent[1]), glm::length(localToParent[2]));
+	instanceData.localRotation[index] = r;
 
-	CalcTransform(e);
+	MarkDirty(e);
 }
 
 void TransformManager::Rotate(Entity e, const glm::vec3& rot)
 {
 	glm::quat q = glm::quat(glm::vec3(glm::radians(rot.x), glm::radians(rot.y), glm::radians(rot.z)));
 
-	instanceData.localRotation[e.id] *= q;
+	instanceData.localRotation[transforms.GetIndex(e)] *= q;
 
-	CalcTransform(e);
+	MarkDirty(e);
 }
 
 const glm::mat4& TransformManager::GetLocalToWorld(Entity e) const
 {
-	return instanceData.localToWorld[e.id];
+	return instanceData.localToWorld[transforms.GetIndex(e)];
 }
 
 bool TransformManager::HasParent(Entity e) const
 {
-	return instanceData.parent[e.id].IsValid();
+	return instanceData.parent[transforms.GetIndex(e)].IsValid();
 }
 
 bool TransformManager::HasChildren(Entity e) const
 {
-	return instanceData.firstChild[e.id].IsValid();
+	return instanceData.firstChild[transforms.GetIndex(e)].IsValid();
 }
 
 Entity TransformManager::GetParent(Entity e)
 {
-	return instanceData.parent[e.id];
+	return instanceData.parent[transforms.GetIndex(e)];
 }
 
 Entity TransformManager::GetFirstChild(Entity e)
 {
-	return instanceData.firstChild[e.id];
+	return instanceData.firstChild[transforms.GetIndex(e)];
 }
 
 Entity TransformManager::GetNextSibling(Entity e)
 {
-	return instanceData.nextSibling[e.id];
-}
-
-void TransformManager::CalcTransform(Entity e)
-{
-	Entity parent = instanceData.parent[e.id];
-	glm::mat4 parentT = parent.IsValid() ? instanceData.localToWorld[parent.id] : glm::mat4(1.0f);
-
-	CalcTransform(e, parentT);
+	return instanceData.nextSibling[transforms.GetIndex(e)];
 }
 
-void TransformManager::CalcTransform(Entity e, const glm::mat4& parent)
+void TransformManager::OnEntitiesDestroyed(const Entity* entities, unsigned int count)
 {
-	glm::mat4 localToParent = glm::mat4_cast(instanceData.localRotation[e.id]);
-	localToParent = glm::scale(localToParent, instanceData.localScale[e.id]);
-	localToParent[3] = glm::vec4(instanceData.localPosition[e.id], 1.0f);
-
-	if (instanceData.modified[e.id] == false)
+	for (unsigned int i = 0; i < count; i++)
 	{
-		ModifiedTransform& mt = modifiedTransforms[numModifiedTransforms];
-		mt.e = e;
-		mt.localToWorld = &instanceData.localToWorld[e.id];
-		numModifiedTransforms++;
-	}
-
-	instanceData.localToWorld[e.id] = parent * localToParent;
-	instanceData.modified[e.id] = true;
-
-	Entity child = instanceData.firstChild[e.id];
-	while (child.IsValid())
-	{
-		CalcTransform(child, instanceData.localToWorld[e.id]);
-		child = instanceData.nextSibling[child.id];
+		RemoveTransform(entities[i]);
 	}
 }
 
 void TransformManager::RemoveTransform(Entity e)
 {
+	if (!transforms.Has(e))
+		return;
+
+	UpdateWorldMatrices();
+
+	unsigned int index = transforms.GetIndex(e);
+
 	if (HasParent(e))
 	{
-		Entity parent = instanceData.parent[e.id];
-		Entity prevSibling = instanceData.prevSibling[e.id];
-		Entity nextSibling = instanceData.nextSibling[e.id];
+		Entity parent = instanceData.parent[index];
+		Entity prevSibling = instanceData.prevSibling[index];
+		Entity nextSibling = instanceData.nextSibling[index];
 
-		if (instanceData.firstChild[parent.id].id == e.id)
-			instanceData.firstChild[parent.id] = nextSibling;
+		if (instanceData.firstChild[transforms.GetIndex(parent)].id == e.id)
+			instanceData.firstChild[transforms.GetIndex(parent)] = nextSibling;
 		else
 		{
 			assert(prevSibling.IsValid());
 
 			// We're going to remove the transform between prev and next. Now the next of the prev is the next sibling
-			instanceData.nextSibling[prevSibling.id] = nextSibling;
+			instanceData.nextSibling[transforms.GetIndex(prevSibling)] = nextSibling;
 		}
 
 		// If the transform had a next sibling now we also need to fix the prev sibling of the next sibling. The previous sibling will now be the previous sibling of the transform we removed.
 		if (nextSibling.IsValid())
-			instanceData.prevSibling[nextSibling.id] = prevSibling;
+			instanceData.prevSibling[transforms.GetIndex(nextSibling)] = prevSibling;
 	}
 
-	Entity child = instanceData.firstChild[e.id];
+	Entity child = instanceData.firstChild[index];
 	while (child.IsValid())
 	{
 		RemoveParent(child);
-		child = instanceData.nextSibling[child.id];
+		child = instanceData.nextSibling[transforms.GetIndex(child)];
+	}
+
+	unsigned int lastIndex = instanceData.size - 1;
+
+	// The modified list is not sorted so we have to search for the removed transform and the one that is going to be moved
+	for (size_t i = 0; i < modifiedTransforms.size(); i++)
+	{
+		if (modifiedTransforms[i].e.id == e.id)
+		{
+			modifiedTransforms[i] = modifiedTransforms.back();
+			modifiedTransforms.pop_back();
+			i--;
+		}
+		else if (transforms.GetIndex(modifiedTransforms[i].e) == lastIndex)
+		{
+			modifiedTransforms[i].localToWorld = &instanceData.localToWorld[index];
+		}
+	}
+
+	// Move the last transform into the slot of the removed one so the arrays stay packed
+	if (index != lastIndex)
+	{
+		instanceData.localToWorld[index] = instanceData.localToWorld[lastIndex];
+		instanceData.localPosition[index] = instanceData.localPosition[lastIndex];
+		instanceData.localRotation[index] = instanceData.localRotation[lastIndex];
+		instanceData.localScale[index] = instanceData.localScale[lastIndex];
+		instanceData.parent[index] = instanceData.parent[lastIndex];
+		instanceData.firstChild[index] = instanceData.firstChild[lastIndex];
+		instanceData.prevSibling[index] = instanceData.prevSibling[lastIndex];
+		instanceData.nextSibling[index] = instanceData.nextSibling[lastIndex];
+		instanceData.dirty[index] = instanceData.dirty[lastIndex];
+		SetModifiedBit(index, IsModified(lastIndex));
 	}
+	else
+	{
+		SetModifiedBit(index, false);
+	}
+
+	SetModifiedBit(lastIndex, false);
+	instanceData.dirty[lastIndex] = false;
+
+	transforms.Remove(e);
+	instanceData.size--;
+
+	// The moved transform has a new index so the copies indexed by transform index have to be updated
+	if (index != lastIndex)
+		AddModifiedTransform(index);
 
-	// Reset the slot where the entity is
-	instanceData.localToWorld[e.id] = glm::mat4(1.0f);
-	instanceData.localPosition[e.id] = glm::vec3(0.0f);
-	instanceData.localRotation[e.id] = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-	instanceData.localScale[e.id] = glm::vec3(1.0f);
-	instanceData.parent[e.id] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.firstChild[e.id] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.prevSibling[e.id] = { std::numeric_limits<unsigned int>::max() };
-	instanceData.nextSibling[e.id] = { std::numeric_limits<unsigned int>::max() };
+	modifiedRangesValid = false;
+	hierarchyChanged = true;
 }
@@ -1,14 +1,18 @@
 #pragma once
 
 #include "EntityManager.h"
+#include "SparseSet.h"
 
 #include "glm/glm.hpp"
 #include "glm/gtc/quaternion.hpp"
 
 #include <unordered_map>
+#include <vector>
+#include <atomic>
 
 class Transform;
 class Allocator;
+class JobSystem;
 
 struct TransformInstanceData
 {
@@ -24,7 +28,9 @@ struct TransformInstanceData
 	Entity* firstChild;
 	Entity* prevSibling;
 	Entity* nextSibling;
-	bool* modified;
+	unsigned int* hierarchyOrder;		// Transform indices sorted breadth first so parents always come before their children
+	unsigned int* modifiedBits;			// One bit per transform, set when it's in the modified list
+	bool* dirty;
 };
 
 struct ModifiedTransform
@@ -33,16 +39,27 @@ struct ModifiedTransform
 	const glm::mat4* localToWorld;
 };
 
+struct TransformRange
+{
+	unsigned int first;
+	unsigned int count;
+};
+
 class TransformManager
 {
 public:
 	void Init(Allocator* allocator, unsigned int initialCapacity);
 	void Dispose();
 	void ClearModifiedTransforms();
+	// Rebuilds the local to world matrix of every dirty transform and its children. Should be called once per frame before the matrices are used
+	// If a job system is passed, each depth level of the hierarchy is split across the worker threads
+	void UpdateWorldMatrices(JobSystem* jobSystem = nullptr);
 
 	void AddTransform(Entity e);
 	void DuplicateTransform(Entity e, Entity newE);
 	void RemoveTransform(Entity e);
+	// Destroy listener of the entity manager, removes the transforms of the destroyed entities
+	void OnEntitiesDestroyed(const Entity* entities, unsigned int count);
 
 	void SetParent(Entity e, Entity parent);
 	void RemoveParent(Entity e);
@@ -54,35 +71,69 @@ public:
 	void SetLocalToParent(Entity e, const glm::mat4& localToParent);
 	void Rotate(Entity e, const glm::vec3& rot);
 
+	// The world matrices are only rebuilt by UpdateWorldMatrices, so after a Set* call they return the old matrix until it runs
+	// SetParent, RemoveParent, SetLocalToWorld and DuplicateTransform are the exception, the changed transform and its children are up to date when they return
 	const glm::mat4& GetLocalToWorld(Entity e) const;
 
 	bool HasParent(Entity e) const;
 	bool HasChildren(Entity e) const;
 
 	// Don't return const otherwise it will not be possible to change them through script
-	glm::vec3& GetLocalPosition(Entity e) const { return instanceData.localPosition[e.id]; }
-	glm::quat& GetLocalRotation(Entity e) const { return instanceData.localRotation[e.id]; }
-	glm::vec3& GetLocalScale(Entity e) const { return instanceData.localScale[e.id]; }
+	glm::vec3& GetLocalPosition(Entity e) const { return instanceData.localPosition[transforms.GetIndex(e)]; }
+	glm::quat& GetLocalRotation(Entity e) const { return instanceData.localRotation[transforms.GetIndex(e)]; }
+	glm::vec3& GetLocalScale(Entity e) const { return instanceData.localScale[transforms.GetIndex(e)]; }
+
+	// Same as GetLocalToWorld, stale until UpdateWorldMatrices runs
+	glm::vec3 GetWorldPosition(Entity e) const { return instanceData.localToWorld[transforms.GetIndex(e)][3]; }
 
-	glm::vec3 GetWorldPosition(Entity e) const { return instanceData.localToWorld[e.id][3]; }
+	bool HasTransform(Entity e) const { return transforms.Has(e); }
+	// Transforms are packed so the index of an entity can change when another transform is removed
+	unsigned int GetTransformIndex(Entity e) const { return transforms.GetIndex(e); }
+	unsigned int GetNumTransforms() const { return instanceData.size; }
+	// Only up to date after UpdateWorldMatrices
+	const glm::mat4* GetLocalToWorldMatrices() const { return instanceData.localToWorld; }
 
 	Entity GetParent(Entity e);
 	Entity GetFirstChild(Entity e);
 	Entity GetNextSibling(Entity e);
 
-	unsigned int GetNumModifiedTransforms() const { return numModifiedTransforms; }
-	const ModifiedTransform* GetModifiedTransforms() const { return modifiedTransforms; }
+	// New transforms and the ones moved to another index when a transform is removed also count as modified
+	unsigned int GetNumModifiedTransforms() const { return static_cast<unsigned int>(modifiedTransforms.size()); }
+	const ModifiedTransform* GetModifiedTransforms() const { return modifiedTransforms.data(); }
+	// Returns the modified transforms merged into ranges of consecutive transform indices, sorted by index
+	const std::vector<TransformRange>& GetModifiedRanges();
+	// Copies only the modified local to world matrices to dst, which must have one matrix per transform at the transform index (eg. a mapped buffer). Returns the number of matrices copied
+	unsigned int CopyModifiedTransforms(glm::mat4* dst);
+	bool IsModified(Entity e) const { return IsModified(transforms.GetIndex(e)); }
 
 private:
-	void CalcTransform(Entity e);
-	void CalcTransform(Entity e, const glm::mat4& parent);
+	void Allocate(unsigned int newCapacity);
+	void MarkDirty(Entity e);
+	// True if the transform or one of its parents is dirty
+	bool IsWorldMatrixStale(unsigned int index) const;
+	void AddModifiedTransform(unsigned int index);
+	bool IsModified(unsigned int index) const { return (instanceData.modifiedBits[index >> 5] & (1u << (index & 31))) != 0; }
+	void SetModifiedBit(unsigned int index, bool modified);
+	void RebuildHierarchyOrder();
+	unsigned int UpdateWorldMatricesRange(unsigned int start, unsigned int end, unsigned int* updatedOut);
+	// Rebuilds the world matrix of the transform and its children right away. Its parents must be up to date
+	void UpdateSubtree(unsigned int index);
 
 private:
 	Allocator* allocator;
 	bool isInit = false;
+	bool anyDirty = false;
+	bool hierarchyChanged = false;
+	SparseSet transforms;
 	TransformInstanceData instanceData;
-	static const unsigned int MAX_MODIFIED_TRANSFORMS = 4096;
-	unsigned int numModifiedTransforms = 0;
-	ModifiedTransform modifiedTransforms[MAX_MODIFIED_TRANSFORMS];
+	std::vector<unsigned int> levelStarts;				// Start of each depth level in the hierarchy order, with one extra entry for the end
+	std::vector<unsigned int> groupUpdatedCounts;
+	std::atomic<unsigned int> pendingGroups;			// Groups of the current level still running, the job system can have other jobs queued
+	std::vector<unsigned int> updatedScratch;					// Each job writes the transforms it updated to its own range of the scratch buffer
+	std::vector<unsigned int> subtreeStack;
+	static const unsigned int PARALLEL_GROUP_SIZE = 1024;
+	std::vector<ModifiedTransform> modifiedTransforms;
+	std::vector<TransformRange> modifiedRanges;
+	bool modifiedRangesValid = false;
 };
 
@@ -0,0 +1,580 @@
+#include "VKAllocator.h"
+
+#include "Log.h"
+
+#include <iostream>
+#include <algorithm>
+
+static const uint32_t INVALID_MEMORY_TYPE = ~0u;
+
+VKBuddyBlock::VKBuddyBlock()
+{
+	size = 0;
+	minAllocationSize = 0;
+	usedBytes = 0;
+	maxOrder = 0;
+}
+
+void VKBuddyBlock::Init(VkDeviceSize size, VkDeviceSize minAllocationSize)
+{
+	this->size = size;
+	this->minAllocationSize = minAllocationSize;
+	usedBytes = 0;
+
+	maxOrder = 0;
+	while ((minAllocationSize << maxOrder) < size)
+		maxOrder++;
+
+	freeLists.clear();
+	freeLists.resize(maxOrder + 1);
+
+	// The whole block starts as one free range
+	freeLists[maxOrder].insert(0);
+}
+
+bool VKBuddyBlock::Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, uint32_t& order)
+{
+	// Ranges are aligned to their size so rounding the size up to the alignment is enough
+	VkDeviceSize requiredSize = std::max(size, alignment);
+
+	order = 0;
+	while (order <= maxOrder && GetOrderSize(order) < requiredSize)
+		order++;
+
+	if (order > maxOrder)
+		return false;
+
+	// Find the smallest free range that fits
+	uint32_t freeOrder = order;
+	while (freeOrder <= maxOrder && freeLists[freeOrder].empty())
+		freeOrder++;
+
+	if (freeOrder > maxOrder)
+		return false;
+
+	auto it = freeLists[freeOrder].begin();
+	offset = *it;
+	freeLists[freeOrder].erase(it);
+
+	// Split it until it has the requested order. The second half of each split is free
+	while (freeOrder > order)
+	{
+		freeOrder--;
+		freeLists[freeOrder].insert(offset + GetOrderSize(freeOrder));
+	}
+
+	usedBytes += GetOrderSize(order);
+
+	return true;
+}
+
+void VKBuddyBlock::Free(VkDeviceSize offset, uint32_t order)
+{
+	usedBytes -= GetOrderSize(order);
+
+	// Merge with the buddy while it's free
+	while (order < maxOrder)
+	{
+		VkDeviceSize buddy = offset ^ GetOrderSize(order);
+		auto it = freeLists[order].find(buddy);
+
+		if (it == freeLists[order].end())
+			break;
+
+		freeLists[order].erase(it);
+		offset = std::min(offset, buddy);
+		order++;
+	}
+
+	freeLists[order].insert(offset);
+}
+
+VkDeviceSize VKBuddyBlock::GetLargestFreeRange() const
+{
+	for (uint32_t i = maxOrder + 1; i > 0; i--)
+	{
+		if (!freeLists[i - 1].empty())
+			return GetOrderSize(i - 1);
+	}
+
+	return 0;
+}
+
+VKAllocator::VKAllocator()
+{
+	device = VK_NULL_HANDLE;
+	memoryProperties = {};
+	bufferImageGranularity = 1;
+	nonCoherentAtomSize = 1;
+	maxMemoryAllocationCount = 0;
+	numDeviceAllocations = 0;
+	numFlushedRanges = 0;
+}
+
+void VKAllocator::Init(VkPhysicalDevice physicalDevice, VkDevice device)
+{
+	this->device = device;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+	bufferImageGranularity = properties.limits.bufferImageGranularity;
+	nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+	maxMemoryAllocationCount = properties.limits.maxMemoryAllocationCount;
+
+	pools.resize(memoryProperties.memoryTypeCount * static_cast<uint32_t>(VKResourceType::COUNT));
+
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		// Small heaps, like the 256 mib device local and host visible heap, use smaller blocks so one block doesn't take most of the heap
+		VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[i].heapIndex].size;
+		VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+
+		while (blockSize > MIN_ALLOCATION_SIZE && blockSize > heapSize / 8)
+			blockSize >>= 1;
+
+		for (uint32_t j = 0; j < static_cast<uint32_t>(VKResourceType::COUNT); j++)
+		{
+			pools[GetPoolIndex(i, static_cast<VKResourceType>(j))].blockSize = blockSize;
+		}
+	}
+
+	dedicatedBytes.assign(memoryProperties.memoryHeapCount, 0);
+	dedicatedRequestedBytes.assign(memoryProperties.memoryHeapCount, 0);
+	numDedicated.assign(memoryProperties.memoryHeapCount, 0);
+}
+
+void VKAllocator::Dispose()
+{
+	unsigned int numLeaked = 0;
+
+	for (size_t i = 0; i < pools.size(); i++)
+	{
+		for (size_t j = 0; j < pools[i].blocks.size(); j++)
+		{
+			Block& block = pools[i].blocks[j];
+
+			if (block.memory == VK_NULL_HANDLE)
+				continue;
+
+			numLeaked += block.numAllocations;
+			FreeDeviceMemory(block.memory, block.mapped != nullptr);
+		}
+	}
+
+	for (size_t i = 0; i < numDedicated.size(); i++)
+	{
+		numLeaked += numDedicated[i];
+	}
+
+	if (numLeaked > 0)
+		std::cout << "Device memory allocator disposed with " << numLeaked << " allocations still alive\n";
+
+	pools.clear();
+	dedicatedBytes.clear();
+	dedicatedRequestedBytes.clear();
+	numDedicated.clear();
+}
+
+uint32_t VKAllocator::GetPoolIndex(uint32_t memoryType, VKResourceType resourceType) const
+{
+	// If the granularity is 1 linear and optimal resources can be next to each other so they share the pool
+	if (bufferImageGranularity <= 1)
+		resourceType = VKResourceType::LINEAR;
+
+	return memoryType * static_cast<uint32_t>(VKResourceType::COUNT) + static_cast<uint32_t>(resourceType);
+}
+
+uint32_t VKAllocator::FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+{
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		if (typeBits & (1 << i) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+			return i;
+	}
+
+	return INVALID_MEMORY_TYPE;
+}
+
+bool VKAllocator::AllocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, VkDeviceMemory& memory, unsigned char*& mapped)
+{
+	if (numDeviceAllocations >= maxMemoryAllocationCount)
+	{
+		std::cout << "Failed to allocate device memory, reached maxMemoryAllocationCount\n";
+		return false;
+	}
+
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS)
+		return false;
+
+	mapped = nullptr;
+
+	// Host visible memory stays mapped for its whole life, allocations only offset the pointer
+	if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		void* data = nullptr;
+		if (vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS)
+		{
+			std::cout << "Failed to map device memory\n";
+			vkFreeMemory(device, memory, nullptr);
+			return false;
+		}
+
+		mapped = static_cast<unsigned char*>(data);
+	}
+
+	numDeviceAllocations++;
+
+	return true;
+}
+
+void VKAllocator::FreeDeviceMemory(VkDeviceMemory memory, bool mapped)
+{
+	if (mapped)
+	{
+		// The queued ranges can't be flushed once the memory is gone
+		auto it = std::remove_if(pendingFlushes.begin(), pendingFlushes.end(), [memory](const VkMappedMemoryRange& range) { return range.memory == memory; });
+		pendingFlushes.erase(it, pendingFlushes.end());
+
+		vkUnmapMemory(device, memory);
+	}
+
+	vkFreeMemory(device, memory, nullptr);
+	numDeviceAllocations--;
+}
+
+bool VKAllocator::Allocate(const VkMemoryRequirements& memReqs, VkMemoryPropertyFlags properties, VKResourceType resourceType, bool dedicated, VKAllocation& allocation)
+{
+	allocation = {};
+
+	uint32_t memoryType = FindMemoryType(memReqs.memoryTypeBits, properties);
+
+	if (memoryType == INVALID_MEMORY_TYPE)
+	{
+		std::cout << "Failed to find a suitable memory type\n";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	uint32_t poolIndex = GetPoolIndex(memoryType, resourceType);
+
+	// Allocations bigger than half a block would waste most of it
+	if (dedicated || memReqs.size > pools[poolIndex].blockSize / 2)
+		return AllocateDedicated(memoryType, memReqs, allocation);
+
+	VkDeviceSize alignment = memReqs.alignment;
+
+	// Flushes of non coherent memory must be aligned to the atom size, keep the allocations on their own atoms
+	if ((memoryProperties.memoryTypes[memoryType].propertyFlags & (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) == VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		alignment = std::max(alignment, nonCoherentAtomSize);
+
+	if (AllocateFromPool(memoryType, poolIndex, memReqs, alignment, allocation))
+		return true;
+
+	// A new block couldn't be allocated, the heap might still have space for the resource alone
+	return AllocateDedicated(memoryType, memReqs, allocation);
+}
+
+bool VKAllocator::AllocateFromPool(uint32_t memoryType, uint32_t poolIndex, const VkMemoryRequirements& memReqs, VkDeviceSize alignment, VKAllocation& allocation)
+{
+	Pool& pool = pools[poolIndex];
+
+	VkDeviceSize offset = 0;
+	uint32_t order = 0;
+	uint32_t blockIndex = 0;
+	bool found = false;
+
+	for (size_t i = 0; i < pool.blocks.size(); i++)
+	{
+		Block& block = pool.blocks[i];
+
+		if (block.memory != VK_NULL_HANDLE && block.buddy.Allocate(memReqs.size, alignment, offset, order))
+		{
+			blockIndex = static_cast<uint32_t>(i);
+			found = true;
+			break;
+		}
+	}
+
+	if (!found)
+	{
+		// Reuse the slot of a freed block if there's one
+		blockIndex = static_cast<uint32_t>(pool.blocks.size());
+		for (size_t i = 0; i < pool.blocks.size(); i++)
+		{
+			if (pool.blocks[i].memory == VK_NULL_HANDLE)
+			{
+				blockIndex = static_cast<uint32_t>(i);
+				break;
+			}
+		}
+
+		Block block = {};
+		if (!AllocateDeviceMemory(memoryType, pool.blockSize, block.memory, block.mapped))
+			return false;
+
+		block.buddy.Init(pool.blockSize, MIN_ALLOCATION_SIZE);
+
+		if (!block.buddy.Allocate(memReqs.size, alignment, offset, order))
+		{
+			FreeDeviceMemory(block.memory, block.mapped != nullptr);
+			return false;
+		}
+
+		if (blockIndex == pool.blocks.size())
+			pool.blocks.push_back(std::move(block));
+		else
+			pool.blocks[blockIndex] = std::move(block);
+	}
+
+	Block& block = pool.blocks[blockIndex];
+	block.numAllocations++;
+	block.requestedBytes += memReqs.size;
+
+	allocation.memory = block.memory;
+	allocation.offset = offset;
+	allocation.size = block.buddy.GetOrderSize(order);
+	allocation.requestedSize = memReqs.size;
+	allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+	allocation.memoryType = memoryType;
+	allocation.pool = poolIndex;
+	allocation.block = blockIndex;
+	allocation.order = order;
+	allocation.dedicated = false;
+	allocation.hostCoherent = IsHostCoherent(memoryType);
+
+	return true;
+}
+
+bool VKAllocator::AllocateDedicated(uint32_t memoryType, const VkMemoryRequirements& memReqs, VKAllocation& allocation)
+{
+	if (!AllocateDeviceMemory(memoryType, memReqs.size, allocation.memory, allocation.mapped))
+	{
+		std::cout << "Failed to allocate dedicated device memory\n";
+		return false;
+	}
+
+	uint32_t heap = memoryProperties.memoryTypes[memoryType].heapIndex;
+	dedicatedBytes[heap] += memReqs.size;
+	dedicatedRequestedBytes[heap] += memReqs.size;
+	numDedicated[heap]++;
+
+	allocation.offset = 0;
+	allocation.size = memReqs.size;
+	allocation.requestedSize = memReqs.size;
+	allocation.memoryType = memoryType;
+	allocation.dedicated = true;
+	allocation.hostCoherent = IsHostCoherent(memoryType);
+
+	return true;
+}
+
+void VKAllocator::Free(const VKAllocation& allocation)
+{
+	if (allocation.memory == VK_NULL_HANDLE)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (allocation.dedicated)
+	{
+		uint32_t heap = memoryProperties.memoryTypes[allocation.memoryType].heapIndex;
+		dedicatedBytes[heap] -= allocation.size;
+		dedicatedRequestedBytes[heap] -= allocation.requestedSize;
+		numDedicated[heap]--;
+
+		FreeDeviceMemory(allocation.memory, allocation.mapped != nullptr);
+		return;
+	}
+
+	Pool& pool = pools[allocation.pool];
+	Block& block = pool.blocks[allocation.block];
+
+	block.buddy.Free(allocation.offset, allocation.order);
+	block.numAllocations--;
+	block.requestedBytes -= allocation.requestedSize;
+
+	if (block.numAllocations > 0)
+		return;
+
+	// Keep one empty block around so a resource that is recreated every so often doesn't allocate and free a block each time
+	unsigned int numLiveBlocks = 0;
+	for (size_t i = 0; i < pool.blocks.size(); i++)
+	{
+		if (pool.blocks[i].memory != VK_NULL_HANDLE)
+			numLiveBlocks++;
+	}
+
+	if (numLiveBlocks > 1)
+	{
+		FreeDeviceMemory(block.memory, block.mapped != nullptr);
+		block.memory = VK_NULL_HANDLE;
+		block.mapped = nullptr;
+	}
+}
+
+void VKAllocator::QueueFlush(const VKAllocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+{
+	if (allocation.hostCoherent || !allocation.mapped || size == 0 || offset >= allocation.size)
+		return;
+
+	// The range has to be aligned to the atom size. The allocations of non coherent memory are aligned to it, so rounding stays inside them unless the allocation is at the end of the memory
+	VkDeviceSize start = offset & ~(nonCoherentAtomSize - 1);
+	VkDeviceSize end = std::min(offset + size, allocation.size);
+	end = (end + nonCoherentAtomSize - 1) & ~(nonCoherentAtomSize - 1);
+
+	VkMappedMemoryRange range = {};
+	range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	range.memory = allocation.memory;
+	range.offset = allocation.offset + start;
+	range.size = end > allocation.size && allocation.dedicated ? VK_WHOLE_SIZE : end - start;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Writes to consecutive ranges of the same memory, like a ring buffer, become one range
+	if (!pendingFlushes.empty())
+	{
+		VkMappedMemoryRange& last = pendingFlushes.back();
+
+		if (last.memory == range.memory && last.size != VK_WHOLE_SIZE && last.offset + last.size == range.offset)
+		{
+			last.size = range.size == VK_WHOLE_SIZE ? VK_WHOLE_SIZE : last.size + range.size;
+			return;
+		}
+	}
+
+	pendingFlushes.push_back(range);
+}
+
+void VKAllocator::FlushMappedRanges()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	numFlushedRanges = static_cast<unsigned int>(pendingFlushes.size());
+
+	if (pendingFlushes.empty())
+		return;
+
+	if (vkFlushMappedMemoryRanges(device, static_cast<uint32_t>(pendingFlushes.size()), pendingFlushes.data()) != VK_SUCCESS)
+		std::cout << "Failed to flush mapped memory ranges\n";
+
+	pendingFlushes.clear();
+}
+
+bool VKAllocator::AllocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, VKAllocation& allocation)
+{
+	VkMemoryRequirements memReqs;
+	vkGetBufferMemoryRequirements(device, buffer, &memReqs);
+
+	if (!Allocate(memReqs, properties, VKResourceType::LINEAR, false, allocation))
+		return false;
+
+	if (vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset) != VK_SUCCESS)
+	{
+		std::cout << "Failed to bind buffer memory\n";
+		Free(allocation);
+		allocation = {};
+		return false;
+	}
+
+	return true;
+}
+
+bool VKAllocator::AllocateForImage(VkImage image, VkMemoryPropertyFlags properties, bool dedicated, VKAllocation& allocation)
+{
+	VkMemoryRequirements memReqs;
+	vkGetImageMemoryRequirements(device, image, &memReqs);
+
+	// Every image in the renderer uses optimal tiling
+	if (!Allocate(memReqs, properties, VKResourceType::OPTIMAL, dedicated, allocation))
+		return false;
+
+	if (vkBindImageMemory(device, image, allocation.memory, allocation.offset) != VK_SUCCESS)
+	{
+		std::cout << "Failed to bind image memory\n";
+		Free(allocation);
+		allocation = {};
+		return false;
+	}
+
+	return true;
+}
+
+VKHeapStats VKAllocator::GetHeapStats(uint32_t heap) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	VKHeapStats stats = {};
+
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		if (memoryProperties.memoryTypes[i].heapIndex != heap)
+			continue;
+
+		for (uint32_t j = 0; j < static_cast<uint32_t>(VKResourceType::COUNT); j++)
+		{
+			uint32_t poolIndex = i * static_cast<uint32_t>(VKResourceType::COUNT) + j;
+
+			if (poolIndex >= pools.size())
+				continue;
+
+			const Pool& pool = pools[poolIndex];
+
+			for (size_t b = 0; b < pool.blocks.size(); b++)
+			{
+				const Block& block = pool.blocks[b];
+
+				if (block.memory == VK_NULL_HANDLE)
+					continue;
+
+				stats.allocatedBytes += block.buddy.GetSize();
+				stats.usedBytes += block.buddy.GetUsedBytes();
+				stats.requestedBytes += block.requestedBytes;
+				stats.freeBytes += block.buddy.GetSize() - block.buddy.GetUsedBytes();
+				stats.largestFreeRange = std::max(stats.largestFreeRange, block.buddy.GetLargestFreeRange());
+				stats.numBlocks++;
+				stats.numAllocations += block.numAllocations;
+			}
+		}
+	}
+
+	if (heap < numDedicated.size())
+	{
+		stats.allocatedBytes += dedicatedBytes[heap];
+		stats.usedBytes += dedicatedBytes[heap];
+		stats.requestedBytes += dedicatedRequestedBytes[heap];
+		stats.numDedicated = numDedicated[heap];
+		stats.numAllocations += numDedicated[heap];
+	}
+
+	if (stats.freeBytes > 0)
+		stats.fragmentation = 1.0f - (float)stats.largestFreeRange / (float)stats.freeBytes;
+
+	return stats;
+}
+
+void VKAllocator::PrintStats() const
+{
+	Log::Print(LogLevel::LEVEL_INFO, "\n");
+
+	for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+	{
+		VKHeapStats s = GetHeapStats(i);
+
+		if (s.allocatedBytes == 0)
+			continue;
+
+		Log::Print(LogLevel::LEVEL_INFO, "Heap %u: allocated %.2f mib, used %.2f mib, requested %.2f mib, free %.2f mib, fragmentation %.2f, blocks %u, dedicated %u, allocations %u\n", i,
+			(float)s.allocatedBytes / 1024.0f / 1024.0f, (float)s.usedBytes / 1024.0f / 1024.0f, (float)s.requestedBytes / 1024.0f / 1024.0f, (float)s.freeBytes / 1024.0f / 1024.0f,
+			s.fragmentation, s.numBlocks, s.numDedicated, s.numAllocations);
+	}
+
+	Log::Print(LogLevel::LEVEL_INFO, "Device memory allocations: %u of %u\n\n", numDeviceAllocations, maxMemoryAllocationCount);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+
+// Buffers and linear images can't share a page of size bufferImageGranularity with optimal images, so they are kept in different blocks
+enum class VKResourceType
+{
+	LINEAR,
+	OPTIMAL,
+	COUNT
+};
+
+struct VKAllocation
+{
+	VkDeviceMemory memory;
+	VkDeviceSize offset;
+	VkDeviceSize size;					// Size taken from the block, can be bigger than the requested size
+	VkDeviceSize requestedSize;
+	unsigned char* mapped;				// Start of the allocation in host memory. Null if the memory type is not host visible
+	uint32_t memoryType;
+	uint32_t pool;
+	uint32_t block;
+	uint32_t order;
+	bool dedicated;
+	bool hostCoherent;					// Host writes to non coherent memory have to be flushed
+};
+
+struct VKHeapStats
+{
+	VkDeviceSize allocatedBytes;		// Device memory allocated from this heap, blocks and dedicated allocations
+	VkDeviceSize usedBytes;				// Taken by the sub allocations and dedicated allocations
+	VkDeviceSize requestedBytes;		// Requested by the resources. The difference to usedBytes is lost to rounding and alignment
+	VkDeviceSize freeBytes;				// Free in the blocks
+	VkDeviceSize largestFreeRange;
+	unsigned int numBlocks;
+	unsigned int numDedicated;
+	unsigned int numAllocations;
+	float fragmentation;				// 1 - largest free range / free bytes. 0 when the free memory can be used by one allocation
+};
+
+// Buddy allocator for one block of device memory. Every allocation is rounded to a power of two and is aligned to its size
+class VKBuddyBlock
+{
+public:
+	VKBuddyBlock();
+
+	void Init(VkDeviceSize size, VkDeviceSize minAllocationSize);
+	bool Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, uint32_t& order);
+	void Free(VkDeviceSize offset, uint32_t order);
+
+	VkDeviceSize GetOrderSize(uint32_t order) const { return minAllocationSize << order; }
+	VkDeviceSize GetSize() const { return size; }
+	VkDeviceSize GetUsedBytes() const { return usedBytes; }
+	VkDeviceSize GetLargestFreeRange() const;
+	bool IsEmpty() const { return usedBytes == 0; }
+
+private:
+	std::vector<std::unordered_set<VkDeviceSize>> freeLists;		// Offsets of the free ranges of each order. Order 0 has the minimum allocation size
+	VkDeviceSize size;
+	VkDeviceSize minAllocationSize;
+	VkDeviceSize usedBytes;
+	uint32_t maxOrder;
+};
+
+// Sub allocates device memory from big blocks so the resources don't need one vkAllocateMemory each
+// Each memory type has a pool of blocks per resource type. Big allocations get their own dedicated memory
+class VKAllocator
+{
+public:
+	VKAllocator();
+
+	void Init(VkPhysicalDevice physicalDevice, VkDevice device);
+	void Dispose();
+
+	bool Allocate(const VkMemoryRequirements& memReqs, VkMemoryPropertyFlags properties, VKResourceType resourceType, bool dedicated, VKAllocation& allocation);
+	void Free(const VKAllocation& allocation);
+	// Allocates the memory and binds it to the resource. Render targets should use dedicated memory
+	bool AllocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, VKAllocation& allocation);
+	bool AllocateForImage(VkImage image, VkMemoryPropertyFlags properties, bool dedicated, VKAllocation& allocation);
+	// Queues a range of a host visible allocation that the CPU wrote to. Does nothing for coherent memory. The offset is relative to the allocation
+	void QueueFlush(const VKAllocation& allocation, VkDeviceSize offset, VkDeviceSize size);
+	// Flushes every queued range with one vkFlushMappedMemoryRanges. Must be called before the submits that read the written memory
+	void FlushMappedRanges();
+
+	VKHeapStats GetHeapStats(uint32_t heap) const;
+	uint32_t GetNumHeaps() const { return memoryProperties.memoryHeapCount; }
+	// Number of vkAllocateMemory allocations that are alive. Limited by maxMemoryAllocationCount
+	unsigned int GetNumDeviceAllocations() const { return numDeviceAllocations; }
+	// Ranges flushed by the last FlushMappedRanges
+	unsigned int GetNumFlushedRanges() const { return numFlushedRanges; }
+	void PrintStats() const;
+
+	static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+	static const VkDeviceSize MIN_ALLOCATION_SIZE = 256;
+
+private:
+	struct Block
+	{
+		VkDeviceMemory memory;
+		unsigned char* mapped;
+		VKBuddyBlock buddy;
+		VkDeviceSize requestedBytes;
+		unsigned int numAllocations;
+	};
+
+	struct Pool
+	{
+		std::vector<Block> blocks;			// Freed blocks keep their slot with a null memory so the block indices of the allocations stay valid
+		VkDeviceSize blockSize;
+	};
+
+	uint32_t FindMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+	bool AllocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, VkDeviceMemory& memory, unsigned char*& mapped);
+	void FreeDeviceMemory(VkDeviceMemory memory, bool mapped);
+	bool AllocateDedicated(uint32_t memoryType, const VkMemoryRequirements& memReqs, VKAllocation& allocation);
+	bool AllocateFromPool(uint32_t memoryType, uint32_t poolIndex, const VkMemoryRequirements& memReqs, VkDeviceSize alignment, VKAllocation& allocation);
+	uint32_t GetPoolIndex(uint32_t memoryType, VKResourceType resourceType) const;
+	bool IsHostCoherent(uint32_t memoryType) const { return (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0; }
+
+private:
+	VkDevice device;
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	VkDeviceSize bufferImageGranularity;
+	VkDeviceSize nonCoherentAtomSize;
+	uint32_t maxMemoryAllocationCount;
+	std::vector<Pool> pools;
+	std::vector<VkDeviceSize> dedicatedBytes;			// Per heap
+	std::vector<VkDeviceSize> dedicatedRequestedBytes;
+	std::vector<unsigned int> numDedicated;
+	unsigned int numDeviceAllocations;
+	std::vector<VkMappedMemoryRange> pendingFlushes;
+	unsigned int numFlushedRanges;
+	mutable std::mutex mutex;
+};
@@ -6,6 +6,7 @@
 
 #include <iostream>
 #include <set>
+#include <algorithm>
 
 VKBase::VKBase()
 {
@@ -24,6 +25,10 @@ VKBase::VKBase()
 
 	physicalDeviceMemoryProperties = {};
 	physicalDeviceProperties = {};
+	physicalDeviceFeatures = {};
+	enabledFeatures = {};
+	descriptorIndexingEnabled = false;
+	maxBindlessTextures = 0;
 
 	surfaceExtent = {};
 	surfaceFormat = {};
@@ -54,18 +59,28 @@ bool VKBase::Init(GLFWwindow* window, unsigned int width, unsigned int height, b
 		return false;
 	if (!CreateDevice(surface))
 		return false;
+
+	allocator.Init(physicalDevice, device);
+
+	if (!pipelineCache.Init(device, physicalDeviceProperties, "Data/pipeline_cache.bin"))
+		return false;
+
 	if (!CreateSwapchain(width, height))
 		return false;
 	if (!CreateGraphicsCommandPool())
 		return false;
 	if (!CreateComputeCommandPool())			// Create separate command pool because the queue family could be different from graphics
 		return false;
+	if (!uploadManager.Init(*this))
+		return false;
 
 	return true;
 }
 
 void VKBase::Dispose()
 {
+	uploadManager.Dispose();
+
 	if (graphicsCmdPool != VK_NULL_HANDLE)
 		vkDestroyCommandPool(device, graphicsCmdPool, nullptr);
 
@@ -79,6 +94,9 @@ void VKBase::Dispose()
 
 	vkDestroySwapchainKHR(device, swapchain, nullptr);
 
+	allocator.Dispose();
+	pipelineCache.Dispose();
+
 	vkDestroyDevice(device, nullptr);
 	vkDestroySurfaceKHR(instance, surface, nullptr);
 
@@ -142,6 +160,7 @@ bool VKBase::EndSingleUseCmdBuffer(VkCommandBuffer cmdBuffer)
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &cmdBuffer;
 
+	allocator.FlushMappedRanges();
 	vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
 	vkQueueWaitIdle(graphicsQueue);
 
@@ -150,7 +169,7 @@ bool VKBase::EndSingleUseCmdBuffer(VkCommandBuffer cmdBuffer)
 	return true;
 }
 
-void VKBase::CopyBuffer(const VKBuffer& srcBuffer, const VKBuffer& dstBuffer, unsigned int size)
+void VKBase::CopyBuffer(const VKBuffer& srcBuffer, const VKBuffer& dstBuffer, unsigned int size, VkDeviceSize srcOffset, VkDeviceSize dstOffset)
 {
 	VkCommandBuffer cmdBuffer = BeginSingleUseCmdBuffer();
 
@@ -161,8 +180,8 @@ void VKBase::CopyBuffer(const VKBuffer& srcBuffer, const VKBuffer& dstBuffer, un
 	}
 
 	VkBufferCopy copyRegion = {};
-	copyRegion.srcOffset = 0;
-	copyRegion.dstOffset = 0;
+	copyRegion.srcOffset = srcOffset;
+	copyRegion.dstOffset = dstOffset;
 	copyRegion.size = size;
 	vkCmdCopyBuffer(cmdBuffer, srcBuffer.GetBuffer(), dstBuffer.GetBuffer(), 1, &copyRegion);
 
@@ -465,7 +484,8 @@ bool VKBase::CreateInstance()
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	// 1.1 for vkGetPhysicalDeviceFeatures2 and maintenance3, which descriptor indexing depends on
+	appInfo.apiVersion = VK_API_VERSION_1_1;
 
 	const std::vector<const char*> requiredExtentions = vkutils::GetRequiredExtensions(enableValidationLayers);
 
@@ -565,9 +585,7 @@ bool VKBase::ChoosePhysicalDevice()
 		return false;
 	}
 
-	VkPhysicalDeviceFeatures deviceFeatures;
-
-	vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
+	vkGetPhysicalDeviceFeatures(physicalDevice, &physicalDeviceFeatures);
 	vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &physicalDeviceMemoryProperties);
 
@@ -633,15 +651,28 @@ bool VKBase::CreateDevice(VkSurfaceKHR surface)
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 
-	VkPhysicalDeviceFeatures deviceFeaturesToEnable = {};
+	// Used by the GPU driven rendering to draw several batches with one indirect draw, it falls back to one draw per batch when not supported
+	enabledFeatures.multiDrawIndirect = physicalDeviceFeatures.multiDrawIndirect;
+
+	// Used by the bindless textures, the renderer falls back to a set per texture when not supported
+	std::vector<const char*> enabledExtensions = deviceExtensions;
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {};
+	indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+
+	descriptorIndexingEnabled = QueryDescriptorIndexing(indexingFeatures);
+
+	if (descriptorIndexingEnabled)
+		enabledExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+
+	std::cout << "Descriptor indexing: " << (descriptorIndexingEnabled ? "enabled" : "not supported") << '\n';
 
 	VkDeviceCreateInfo deviceInfo = {};
 	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	deviceInfo.pQueueCreateInfos = queueCreateInfos.data();
 	deviceInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
-	deviceInfo.pEnabledFeatures = &deviceFeaturesToEnable;
-	deviceInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-	deviceInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	deviceInfo.pEnabledFeatures = &enabledFeatures;
+	deviceInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+	deviceInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
 	const std::vector<const char*> validationLayers = { "VK_LAYER_KHRONOS_validation" };
 
@@ -662,6 +693,9 @@ bool VKBase::CreateDevice(VkSurfaceKHR surface)
 
 	deviceInfo.pNext = &resetFeatures;
 
+	if (descriptorIndexingEnabled)
+		resetFeatures.pNext = &indexingFeatures;
+
 	if (vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device) != VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create Device\n";
@@ -677,6 +711,46 @@ bool VKBase::CreateDevice(VkSurfaceKHR surface)
 	return true;
 }
 
+bool VKBase::QueryDescriptorIndexing(VkPhysicalDeviceDescriptorIndexingFeaturesEXT& indexingFeatures)
+{
+	const std::vector<const char*> indexingExtension = { VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME };
+
+	if (!vkutils::CheckPhysicalDeviceExtensionSupport(physicalDevice, indexingExtension))
+		return false;
+
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported = {};
+	supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+
+	VkPhysicalDeviceFeatures2 features2 = {};
+	features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	features2.pNext = &supported;
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+
+	// Textures are added while the other frame is in flight, so the slots it doesn't use must be writable while its command buffer is pending
+	if (!supported.runtimeDescriptorArray || !supported.descriptorBindingPartiallyBound || !supported.descriptorBindingSampledImageUpdateAfterBind || !supported.descriptorBindingUpdateUnusedWhilePending || !supported.shaderSampledImageArrayNonUniformIndexing)
+		return false;
+
+	VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProperties = {};
+	indexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+
+	VkPhysicalDeviceProperties2 properties2 = {};
+	properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	properties2.pNext = &indexingProperties;
+	vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+
+	// Only enable what the bindless textures use
+	indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+	indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+	indexingFeatures.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	indexingFeatures.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+	indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+
+	maxBindlessTextures = std::min(indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages, indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages);
+	maxBindlessTextures = std::min(maxBindlessTextures, std::min(indexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers, indexingProperties.maxDescriptorSetUpdateAfterBindSamplers));
+
+	return maxBindlessTextures > 0;
+}
+
 bool VKBase::CreateSwapchain(unsigned int width, unsigned int height)
 {
 	vkutils::SwapChainSupportDetails swapChainSupport = vkutils::QuerySwapChainSupport(physicalDevice, surface);
@@ -2,6 +2,8 @@
 
 #include "VKUtils.h"
 #include "VKBuffer.h"
+#include "VKUploadManager.h"
+#include "VKPipelineCache.h"
 
 struct GLFWwindow;
 
@@ -14,7 +16,7 @@ public:
 	void Dispose();
 
 	void RecreateSwapchain(unsigned int width, unsigned int height);
-	void CopyBuffer(const VKBuffer &srcBuffer, const VKBuffer &dstBuffer, unsigned int size);
+	void CopyBuffer(const VKBuffer &srcBuffer, const VKBuffer &dstBuffer, unsigned int size, VkDeviceSize srcOffset = 0, VkDeviceSize dstOffset = 0);
 	bool CopyBufferToImage(const VKBuffer& buffer, VkImage image, unsigned int width, unsigned int height);
 	bool CopyBufferToImage3D(const VKBuffer& buffer, VkImage image, unsigned int width, unsigned int height, unsigned depth);
 	bool CopyBufferToCubemapImage(const VKBuffer& buffer, VkImage image, unsigned int width, unsigned int height);
@@ -35,7 +37,15 @@ public:
 
 	const VkPhysicalDeviceMemoryProperties &GetPhysicalDeviceMemoryProperties() const { return physicalDeviceMemoryProperties; }
 	const VkPhysicalDeviceLimits& GetPhysicalDeviceLimits() const { return physicalDeviceProperties.limits; }
+	const VkPhysicalDeviceFeatures& GetEnabledFeatures() const { return enabledFeatures; }
+	// True when VK_EXT_descriptor_indexing was enabled with partially bound, update after bind, update unused while pending and non uniform indexed sampled image arrays
+	bool IsDescriptorIndexingEnabled() const { return descriptorIndexingEnabled; }
+	// Sampled images a bindless set can hold. 0 without descriptor indexing
+	uint32_t GetMaxBindlessTextures() const { return maxBindlessTextures; }
 	const vkutils::QueueFamilyIndices& GetQueueFamilyIndices() const { return queueIndices; }
+	VKAllocator& GetAllocator() { return allocator; }
+	VKUploadManager& GetUploadManager() { return uploadManager; }
+	VKPipelineCache& GetPipelineCache() { return pipelineCache; }
 
 	VkExtent2D GetSurfaceExtent() const { return surfaceExtent; }
 	VkSurfaceFormatKHR GetSurfaceFormat() const { return surfaceFormat; }
@@ -48,6 +58,7 @@ private:
 	bool CreateSurface(GLFWwindow *window);
 	bool ChoosePhysicalDevice();
 	bool CreateDevice(VkSurfaceKHR surface);
+	bool QueryDescriptorIndexing(VkPhysicalDeviceDescriptorIndexingFeaturesEXT& indexingFeatures);
 	bool CreateSwapchain(unsigned int width, unsigned int height);
 	bool CreateGraphicsCommandPool();
 	bool CreateComputeCommandPool();
@@ -66,7 +77,11 @@ private:
 	VkDebugReportCallbackEXT debugCallback;
 	VkPhysicalDevice physicalDevice;
 	VkPhysicalDeviceProperties physicalDeviceProperties;
+	VkPhysicalDeviceFeatures physicalDeviceFeatures;
+	VkPhysicalDeviceFeatures enabledFeatures;
 	VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
+	bool descriptorIndexingEnabled;
+	uint32_t maxBindlessTextures;
 	VkDevice device;
 	vkutils::QueueFamilyIndices queueIndices;
 	VkQueue graphicsQueue;
@@ -82,4 +97,8 @@ private:
 
 	VkCommandPool graphicsCmdPool;
 	VkCommandPool computeCmdPool;
+
+	VKAllocator allocator;
+	VKUploadManager uploadManager;
+	VKPipelineCache pipelineCache;
 };
@@ -7,11 +7,11 @@
 
 VKBuffer::VKBuffer()
 {
+	allocator = nullptr;
 	buffer = VK_NULL_HANDLE;
-	bufferMemory = VK_NULL_HANDLE;
+	allocation = {};
 	memReqs = {};
 	size = 0;
-	mapped = nullptr;
 }
 
 bool VKBuffer::Create(VKBase *base, unsigned int size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryPropertyFlags)
@@ -48,19 +48,14 @@ bool VKBuffer::Create(VKBase *base, unsigned int size, VkBufferUsageFlags usage,
 
 	vkGetBufferMemoryRequirements(device, buffer, &memReqs);
 
-	VkMemoryAllocateInfo bufAllocInfo = {};
-	bufAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	bufAllocInfo.allocationSize = memReqs.size;
-	bufAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base->GetPhysicalDeviceMemoryProperties(), memReqs.memoryTypeBits, memoryPropertyFlags);
+	allocator = &base->GetAllocator();
 
-	if (vkAllocateMemory(device, &bufAllocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
+	if (!allocator->AllocateForBuffer(buffer, memoryPropertyFlags, allocation))
 	{
 		std::cout << "Failed to allocate vertex buffer memory\n";
 		return false;
 	}
 
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);
-
 	return true;
 }
 
@@ -68,22 +63,26 @@ void VKBuffer::Dispose(VkDevice device)
 {
 	if (buffer != VK_NULL_HANDLE)
 		vkDestroyBuffer(device, buffer, nullptr);
-	if (bufferMemory != VK_NULL_HANDLE)
-		vkFreeMemory(device, bufferMemory, nullptr);
+	if (allocator)
+		allocator->Free(allocation);
+
+	buffer = VK_NULL_HANDLE;
+	allocation = {};
 }
 
 void *VKBuffer::Map(VkDevice device, VkDeviceSize offset, VkDeviceSize size)
 {
-	vkMapMemory(device, bufferMemory, offset, size, 0, &mapped);
+	if (!allocation.mapped)
+	{
+		std::cout << "Failed to map buffer, memory is not host visible\n";
+		return nullptr;
+	}
 
-	return mapped;
+	return allocation.mapped + offset;
 }
 
-void VKBuffer::Unmap(VkDevice device)
+void VKBuffer::Flush(VkDeviceSize offset, VkDeviceSize size)
 {
-	if (mapped)
-	{
-		vkUnmapMemory(device, bufferMemory);
-		mapped = nullptr;
-	}
+	if (allocator && !allocation.hostCoherent)
+		allocator->QueueFlush(allocation, offset, size);
 }
@@ -1,9 +1,32 @@
 #pragma once
 
-#include <vulkan/vulkan.h>
+#include "VKAllocator.h"
+
+#include <cstddef>
 
 class VKBase;
 
+// Typed view of the mapped memory of a buffer
+template<typename T>
+class MappedSpan
+{
+public:
+	MappedSpan() : data(nullptr), count(0) {}
+	MappedSpan(T* data, size_t count) : data(data), count(count) {}
+
+	T& operator[](size_t i) const { return data[i]; }
+	T* begin() const { return data; }
+	T* end() const { return data + count; }
+	T* GetData() const { return data; }
+	size_t GetCount() const { return count; }
+	size_t GetSizeInBytes() const { return count * sizeof(T); }
+	bool IsEmpty() const { return count == 0; }
+
+private:
+	T* data;
+	size_t count;
+};
+
 class VKBuffer
 {
 public:
@@ -12,18 +35,37 @@ public:
 	bool Create(VKBase *base, unsigned int size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryPropertyFlags);
 	void Dispose(VkDevice device);
 
+	// Host visible memory is mapped once when it's allocated so this only returns the pointer to the offset. Null if the buffer is not host visible
 	void *Map(VkDevice device, VkDeviceSize offset, VkDeviceSize size);
-	void Unmap(VkDevice device);
+	// Typed view of count elements starting at offset bytes. Empty if the buffer is not host visible or the elements don't fit
+	template<typename T>
+	MappedSpan<T> GetSpan(VkDeviceSize offset, size_t count) const
+	{
+		if (!allocation.mapped || offset + count * sizeof(T) > size)
+			return MappedSpan<T>();
+
+		return MappedSpan<T>(reinterpret_cast<T*>(allocation.mapped + offset), count);
+	}
+	// Has to be called after writing to the mapped memory. Does nothing if it's coherent, otherwise the range is flushed with the others by VKAllocator::FlushMappedRanges before the next submit
+	void Flush(VkDeviceSize offset, VkDeviceSize size);
+	template<typename T>
+	void Flush(const MappedSpan<T>& span)
+	{
+		if (!span.IsEmpty())
+			Flush(static_cast<VkDeviceSize>(reinterpret_cast<const unsigned char*>(span.GetData()) - allocation.mapped), span.GetSizeInBytes());
+	}
+	bool IsHostCoherent() const { return allocation.hostCoherent; }
 
 	VkBuffer GetBuffer() const { return buffer; }
-	VkDeviceMemory GetBufferMemory() const { return bufferMemory; }
+	VkDeviceMemory GetBufferMemory() const { return allocation.memory; }
+	const VKAllocation& GetAllocation() const { return allocation; }
 	VkMemoryRequirements GetMemoryRequirements() const { return memReqs; }
 	unsigned int GetSize() const { return size; }
 
 private:
+	VKAllocator* allocator;
 	VkBuffer buffer;
-	VkDeviceMemory bufferMemory;
+	VKAllocation allocation;
 	VkMemoryRequirements memReqs;
 	unsigned int size;
-	void* mapped;
 };
\ No newline at end of file
@@ -0,0 +1,279 @@
+#include "VKDescriptorAllocator.h"
+
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+	// Descriptors of each type per set. A pool runs out of sets before it runs out of descriptors unless most sets use more than these
+	struct PoolSizeRatio
+	{
+		VkDescriptorType type;
+		unsigned int descriptorsPerSet;
+	};
+
+	const PoolSizeRatio POOL_SIZE_RATIOS[] = {
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 }
+	};
+}
+
+VKDescriptorAllocator::VKDescriptorAllocator()
+{
+	device = VK_NULL_HANDLE;
+	currentPool = VK_NULL_HANDLE;
+	nextPoolSets = 0;
+	numAllocatedSets = 0;
+}
+
+bool VKDescriptorAllocator::Init(VkDevice device, unsigned int setsPerPool)
+{
+	this->device = device;
+	nextPoolSets = std::max(setsPerPool, 1u);
+	numAllocatedSets = 0;
+
+	currentPool = GrabPool();
+
+	return currentPool != VK_NULL_HANDLE;
+}
+
+VkDescriptorSet VKDescriptorAllocator::Allocate(VkDescriptorSetLayout layout)
+{
+	if (currentPool == VK_NULL_HANDLE)
+	{
+		currentPool = GrabPool();
+		if (currentPool == VK_NULL_HANDLE)
+			return VK_NULL_HANDLE;
+	}
+
+	VkDescriptorSetAllocateInfo setAllocInfo = {};
+	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	setAllocInfo.descriptorPool = currentPool;
+	setAllocInfo.descriptorSetCount = 1;
+	setAllocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	VkResult result = vkAllocateDescriptorSets(device, &setAllocInfo, &set);
+
+	// Only the current pool is tried so allocating doesn't get slower as the pools fill up
+	if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+	{
+		currentPool = GrabPool();
+		if (currentPool == VK_NULL_HANDLE)
+			return VK_NULL_HANDLE;
+
+		setAllocInfo.descriptorPool = currentPool;
+		result = vkAllocateDescriptorSets(device, &setAllocInfo, &set);
+	}
+
+	if (result != VK_SUCCESS)
+	{
+		std::cout << "Failed to allocate descriptor set\n";
+		return VK_NULL_HANDLE;
+	}
+
+	numAllocatedSets++;
+
+	return set;
+}
+
+void VKDescriptorAllocator::Reset()
+{
+	for (size_t i = 0; i < usedPools.size(); i++)
+	{
+		vkResetDescriptorPool(device, usedPools[i], 0);
+		freePools.push_back(usedPools[i]);
+	}
+
+	usedPools.clear();
+	currentPool = VK_NULL_HANDLE;
+	numAllocatedSets = 0;
+}
+
+void VKDescriptorAllocator::Dispose()
+{
+	for (size_t i = 0; i < usedPools.size(); i++)
+	{
+		vkDestroyDescriptorPool(device, usedPools[i], nullptr);
+	}
+	for (size_t i = 0; i < freePools.size(); i++)
+	{
+		vkDestroyDescriptorPool(device, freePools[i], nullptr);
+	}
+
+	usedPools.clear();
+	freePools.clear();
+	currentPool = VK_NULL_HANDLE;
+	numAllocatedSets = 0;
+}
+
+VkDescriptorPool VKDescriptorAllocator::GrabPool()
+{
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+
+	if (!freePools.empty())
+	{
+		pool = freePools.back();
+		freePools.pop_back();
+	}
+	else
+	{
+		pool = CreatePool(nextPoolSets);
+		if (pool == VK_NULL_HANDLE)
+			return VK_NULL_HANDLE;
+
+		// Larger pools keep the number of pools low when a lot of content is loaded
+		nextPoolSets = std::min(nextPoolSets * 2, MAX_SETS_PER_POOL);
+	}
+
+	usedPools.push_back(pool);
+
+	return pool;
+}
+
+VkDescriptorPool VKDescriptorAllocator::CreatePool(unsigned int maxSets)
+{
+	const unsigned int numPoolSizes = sizeof(POOL_SIZE_RATIOS) / sizeof(POOL_SIZE_RATIOS[0]);
+	VkDescriptorPoolSize poolSizes[numPoolSizes] = {};
+
+	for (unsigned int i = 0; i < numPoolSizes; i++)
+	{
+		poolSizes[i].type = POOL_SIZE_RATIOS[i].type;
+		poolSizes[i].descriptorCount = POOL_SIZE_RATIOS[i].descriptorsPerSet * maxSets;
+	}
+
+	VkDescriptorPoolCreateInfo descPoolInfo = {};
+	descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	descPoolInfo.maxSets = maxSets;
+	descPoolInfo.poolSizeCount = numPoolSizes;
+	descPoolInfo.pPoolSizes = poolSizes;
+
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+
+	if (vkCreateDescriptorPool(device, &descPoolInfo, nullptr, &pool) != VK_SUCCESS)
+	{
+		std::cout << "Failed to create descriptor pool\n";
+		return VK_NULL_HANDLE;
+	}
+
+	return pool;
+}
+
+VKDescriptorLayoutCache::VKDescriptorLayoutCache()
+{
+	device = VK_NULL_HANDLE;
+}
+
+void VKDescriptorLayoutCache::Init(VkDevice device)
+{
+	this->device = device;
+}
+
+VkDescriptorSetLayout VKDescriptorLayoutCache::GetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings)
+{
+	return GetLayout(bindings, {}, 0);
+}
+
+VkDescriptorSetLayout VKDescriptorLayoutCache::GetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlagsEXT>& bindingFlags, VkDescriptorSetLayoutCreateFlags flags)
+{
+	// Sort the bindings and their flags together
+	std::vector<size_t> order(bindings.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	std::sort(order.begin(), order.end(), [&bindings](size_t a, size_t b) { return bindings[a].binding < bindings[b].binding; });
+
+	LayoutKey key;
+	key.flags = flags;
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const VkDescriptorSetLayoutBinding& b = bindings[order[i]];
+		key.bindings.push_back(b);
+
+		if (!bindingFlags.empty())
+			key.bindingFlags.push_back(bindingFlags[order[i]]);
+		if (b.pImmutableSamplers)
+			key.immutableSamplers.insert(key.immutableSamplers.end(), b.pImmutableSamplers, b.pImmutableSamplers + b.descriptorCount);
+	}
+
+	auto it = layouts.find(key);
+	if (it != layouts.end())
+		return it->second;
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo = {};
+	bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	bindingFlagsInfo.bindingCount = static_cast<uint32_t>(key.bindingFlags.size());
+	bindingFlagsInfo.pBindingFlags = key.bindingFlags.data();
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.pNext = key.bindingFlags.empty() ? nullptr : &bindingFlagsInfo;
+	layoutInfo.flags = flags;
+	layoutInfo.bindingCount = static_cast<uint32_t>(key.bindings.size());
+	layoutInfo.pBindings = key.bindings.data();
+
+	VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+
+	if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &layout) != VK_SUCCESS)
+	{
+		std::cout << "Failed to create descriptor set layout\n";
+		return VK_NULL_HANDLE;
+	}
+
+	layouts[key] = layout;
+
+	return layout;
+}
+
+void VKDescriptorLayoutCache::Dispose()
+{
+	for (auto it = layouts.begin(); it != layouts.end(); it++)
+	{
+		vkDestroyDescriptorSetLayout(device, it->second, nullptr);
+	}
+
+	layouts.clear();
+}
+
+bool VKDescriptorLayoutCache::LayoutKey::operator==(const LayoutKey& other) const
+{
+	if (bindings.size() != other.bindings.size() || flags != other.flags || bindingFlags != other.bindingFlags || immutableSamplers != other.immutableSamplers)
+		return false;
+
+	for (size_t i = 0; i < bindings.size(); i++)
+	{
+		const VkDescriptorSetLayoutBinding& a = bindings[i];
+		const VkDescriptorSetLayoutBinding& b = other.bindings[i];
+
+		// The pointers to the immutable samplers can't be compared, only whether the binding has them. The samplers were compared above
+		if (a.binding != b.binding || a.descriptorType != b.descriptorType || a.descriptorCount != b.descriptorCount || a.stageFlags != b.stageFlags || (a.pImmutableSamplers != nullptr) != (b.pImmutableSamplers != nullptr))
+			return false;
+	}
+
+	return true;
+}
+
+size_t VKDescriptorLayoutCache::LayoutKeyHash::operator()(const LayoutKey& key) const
+{
+	size_t hash = std::hash<size_t>()(key.bindings.size());
+
+	for (size_t i = 0; i < key.bindings.size(); i++)
+	{
+		const VkDescriptorSetLayoutBinding& b = key.bindings[i];
+
+		// Fields that don't fit in their bits only cause collisions, the keys are still compared
+		uint64_t packed = (uint64_t)b.binding | ((uint64_t)b.descriptorType << 8) | ((uint64_t)b.descriptorCount << 16) | ((uint64_t)b.stageFlags << 32);
+		hash ^= std::hash<uint64_t>()(packed) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	}
+
+	// Layouts with flags or immutable samplers are rare so they only need to hash differently from the plain ones
+	uint64_t packedExtras = ((uint64_t)key.flags << 32) | ((uint64_t)key.bindingFlags.size() << 16) | key.immutableSamplers.size();
+	hash ^= std::hash<uint64_t>()(packedExtras) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+	return hash;
+}
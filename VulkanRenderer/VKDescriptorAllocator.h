@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <unordered_map>
+
+// Allocates descriptor sets from a chain of pools. When the current pool runs out a new one is created, or a reset one reused, so allocating only fails if the device is out of memory
+// Sets can't be freed one by one, Reset frees every set at once and keeps the pools for the next allocations
+class VKDescriptorAllocator
+{
+public:
+	VKDescriptorAllocator();
+
+	// setsPerPool is the size of the first pool, the next ones are twice as large up to MAX_SETS_PER_POOL
+	bool Init(VkDevice device, unsigned int setsPerPool);
+	VkDescriptorSet Allocate(VkDescriptorSetLayout layout);
+	// The sets allocated so far must not be used by the GPU anymore
+	void Reset();
+	void Dispose();
+
+	unsigned int GetNumPools() const { return static_cast<unsigned int>(usedPools.size() + freePools.size()); }
+	// Sets allocated since the last Reset
+	unsigned int GetNumAllocatedSets() const { return numAllocatedSets; }
+
+	static const unsigned int MAX_SETS_PER_POOL = 4096;
+
+private:
+	VkDescriptorPool GrabPool();
+	VkDescriptorPool CreatePool(unsigned int maxSets);
+
+private:
+	VkDevice device;
+	VkDescriptorPool currentPool;
+	std::vector<VkDescriptorPool> usedPools;		// Full pools, including the current one
+	std::vector<VkDescriptorPool> freePools;		// Reset pools waiting to be used again
+	unsigned int nextPoolSets;
+	unsigned int numAllocatedSets;
+};
+
+// Creates a set layout once for every set of bindings so the materials that use the same bindings share the layout and their sets are compatible
+class VKDescriptorLayoutCache
+{
+public:
+	VKDescriptorLayoutCache();
+
+	void Init(VkDevice device);
+	// The bindings don't need to be sorted. Returns VK_NULL_HANDLE if the layout couldn't be created. The layout is owned by the cache
+	VkDescriptorSetLayout GetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings);
+	// bindingFlags is either empty or has the flags of every binding in the same order as bindings
+	VkDescriptorSetLayout GetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings, const std::vector<VkDescriptorBindingFlagsEXT>& bindingFlags, VkDescriptorSetLayoutCreateFlags flags);
+	void Dispose();
+
+	unsigned int GetNumLayouts() const { return static_cast<unsigned int>(layouts.size()); }
+
+private:
+	// Sorted by binding. The immutable samplers are copied since the bindings' pointers are only valid while the layout is created
+	struct LayoutKey
+	{
+		std::vector<VkDescriptorSetLayoutBinding> bindings;
+		std::vector<VkDescriptorBindingFlagsEXT> bindingFlags;
+		std::vector<VkSampler> immutableSamplers;
+		VkDescriptorSetLayoutCreateFlags flags;
+
+		bool operator==(const LayoutKey& other) const;
+	};
+
+	struct LayoutKeyHash
+	{
+		size_t operator()(const LayoutKey& key) const;
+	};
+
+private:
+	VkDevice device;
+	std::unordered_map<LayoutKey, VkDescriptorSetLayout, LayoutKeyHash> layouts;
+};
@@ -7,7 +7,7 @@ VKPipeline::VKPipeline()
 	pipeline = VK_NULL_HANDLE;
 }
 
-bool VKPipeline::Create(VkDevice device, const PipelineInfo& info, VkPipelineLayout pipelineLayout, const VKShader& vertexShader, const VKShader& fragmentShader, VkRenderPass renderPass)
+bool VKPipeline::Create(VKPipelineCache& cache, const PipelineInfo& info, VkPipelineLayout pipelineLayout, const VKShader& vertexShader, const VKShader& fragmentShader, VkRenderPass renderPass)
 {
 	VkPipelineShaderStageCreateInfo shaderStages[] = { vertexShader.GetStageInfo(), fragmentShader.GetStageInfo() };
 
@@ -29,7 +29,7 @@ bool VKPipeline::Create(VkDevice device, const PipelineInfo& info, VkPipelineLay
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 	pipelineInfo.basePipelineIndex = -1;
 
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+	if (!cache.CreateGraphicsPipeline(pipelineInfo, &pipeline))
 	{
 		std::cout << "Failed to create graphics pipeline\n";
 		return false;
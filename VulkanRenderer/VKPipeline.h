@@ -1,6 +1,7 @@
 #pragma once
 
 #include "VKShader.h"
+#include "VKPipelineCache.h"
 
 struct PipelineInfo
 {
@@ -19,7 +20,8 @@ class VKPipeline
 public:
 	VKPipeline();
 	
-	bool Create(VkDevice device, const PipelineInfo& info, VkPipelineLayout pipelineLayout, const VKShader& vertexShader, const VKShader& fragmentShader, VkRenderPass renderPass);
+	// The info is copied when the cache creates pipelines in parallel, otherwise the pipeline is created before returning
+	bool Create(VKPipelineCache& cache, const PipelineInfo& info, VkPipelineLayout pipelineLayout, const VKShader& vertexShader, const VKShader& fragmentShader, VkRenderPass renderPass);
 	void Dispose(VkDevice device);
 
 	VkPipeline GetPipeline() const { return pipeline; }
@@ -0,0 +1,359 @@
+#include "VKPipelineCache.h"
+
+#include "JobSystem.h"
+#include "Log.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <memory>
+#include <cstring>
+
+namespace
+{
+	const uint32_t CACHE_MAGIC = 0x43505256;		// VRPC
+	const uint32_t CACHE_VERSION = 1;
+
+	// Written before the driver's data. The driver's own header has no driver version so a driver update would otherwise hand it data it may not expect
+	struct CacheFileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint32_t driverVersion;
+		uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+		uint64_t dataSize;
+	};
+
+	// Size of the header the driver puts at the start of the cache data (VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+	const size_t DRIVER_HEADER_SIZE = 16 + VK_UUID_SIZE;
+
+	// Owns everything the create info points to so the pipeline can be created after the caller returned. Never copied so the pointers stay valid
+	struct GraphicsPipelineCopy
+	{
+		VkGraphicsPipelineCreateInfo info;
+		std::vector<VkPipelineShaderStageCreateInfo> stages;
+		VkPipelineVertexInputStateCreateInfo vertexInput;
+		std::vector<VkVertexInputBindingDescription> bindings;
+		std::vector<VkVertexInputAttributeDescription> attribs;
+		VkPipelineInputAssemblyStateCreateInfo inputAssembly;
+		VkPipelineTessellationStateCreateInfo tessellation;
+		VkPipelineViewportStateCreateInfo viewportState;
+		std::vector<VkViewport> viewports;
+		std::vector<VkRect2D> scissors;
+		VkPipelineRasterizationStateCreateInfo rasterizer;
+		VkPipelineMultisampleStateCreateInfo multisampling;
+		VkSampleMask sampleMask[2];		// Enough for 64 samples
+		VkPipelineDepthStencilStateCreateInfo depthStencil;
+		VkPipelineColorBlendStateCreateInfo colorBlending;
+		std::vector<VkPipelineColorBlendAttachmentState> attachments;
+		VkPipelineDynamicStateCreateInfo dynamicState;
+		std::vector<VkDynamicState> dynamicStates;
+	};
+
+	template<typename T>
+	const T* CopyArray(std::vector<T>& dst, const T* src, uint32_t count)
+	{
+		if (!src || count == 0)
+			return src;
+
+		dst.assign(src, src + count);
+		return dst.data();
+	}
+
+	// Copies the state without its pNext chain
+	template<typename T>
+	const T* CopyState(T& dst, const T* src)
+	{
+		if (!src)
+			return nullptr;
+
+		dst = *src;
+		dst.pNext = nullptr;
+		return &dst;
+	}
+
+	void CopyGraphicsInfo(const VkGraphicsPipelineCreateInfo& src, GraphicsPipelineCopy& copy)
+	{
+		copy.info = src;
+		copy.info.pNext = nullptr;
+		copy.info.pStages = CopyArray(copy.stages, src.pStages, src.stageCount);
+
+		copy.info.pVertexInputState = CopyState(copy.vertexInput, src.pVertexInputState);
+		if (src.pVertexInputState)
+		{
+			copy.vertexInput.pVertexBindingDescriptions = CopyArray(copy.bindings, src.pVertexInputState->pVertexBindingDescriptions, src.pVertexInputState->vertexBindingDescriptionCount);
+			copy.vertexInput.pVertexAttributeDescriptions = CopyArray(copy.attribs, src.pVertexInputState->pVertexAttributeDescriptions, src.pVertexInputState->vertexAttributeDescriptionCount);
+		}
+
+		copy.info.pInputAssemblyState = CopyState(copy.inputAssembly, src.pInputAssemblyState);
+		copy.info.pTessellationState = CopyState(copy.tessellation, src.pTessellationState);
+
+		copy.info.pViewportState = CopyState(copy.viewportState, src.pViewportState);
+		if (src.pViewportState)
+		{
+			// The viewports and scissors are null when they are dynamic
+			copy.viewportState.pViewports = CopyArray(copy.viewports, src.pViewportState->pViewports, src.pViewportState->viewportCount);
+			copy.viewportState.pScissors = CopyArray(copy.scissors, src.pViewportState->pScissors, src.pViewportState->scissorCount);
+		}
+
+		copy.info.pRasterizationState = CopyState(copy.rasterizer, src.pRasterizationState);
+
+		copy.info.pMultisampleState = CopyState(copy.multisampling, src.pMultisampleState);
+		if (src.pMultisampleState && src.pMultisampleState->pSampleMask)
+		{
+			uint32_t numWords = (static_cast<uint32_t>(src.pMultisampleState->rasterizationSamples) + 31) / 32;
+			memcpy(copy.sampleMask, src.pMultisampleState->pSampleMask, numWords * sizeof(VkSampleMask));
+			copy.multisampling.pSampleMask = copy.sampleMask;
+		}
+
+		copy.info.pDepthStencilState = CopyState(copy.depthStencil, src.pDepthStencilState);
+
+		copy.info.pColorBlendState = CopyState(copy.colorBlending, src.pColorBlendState);
+		if (src.pColorBlendState)
+			copy.colorBlending.pAttachments = CopyArray(copy.attachments, src.pColorBlendState->pAttachments, src.pColorBlendState->attachmentCount);
+
+		copy.info.pDynamicState = CopyState(copy.dynamicState, src.pDynamicState);
+		if (src.pDynamicState)
+			copy.dynamicState.pDynamicStates = CopyArray(copy.dynamicStates, src.pDynamicState->pDynamicStates, src.pDynamicState->dynamicStateCount);
+	}
+}
+
+VKPipelineCache::VKPipelineCache()
+{
+	device = VK_NULL_HANDLE;
+	cache = VK_NULL_HANDLE;
+	warm = false;
+	vendorID = 0;
+	deviceID = 0;
+	driverVersion = 0;
+	memset(pipelineCacheUUID, 0, sizeof(pipelineCacheUUID));
+	jobSystem = nullptr;
+	pendingPipelines = 0;
+	numCreatedPipelines = 0;
+	failed = false;
+}
+
+bool VKPipelineCache::Init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path)
+{
+	this->device = device;
+	this->path = path;
+
+	vendorID = properties.vendorID;
+	deviceID = properties.deviceID;
+	driverVersion = properties.driverVersion;
+	memcpy(pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+	std::vector<char> data;
+	warm = LoadFile(data);
+
+	VkPipelineCacheCreateInfo cacheInfo = {};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+	if (warm)
+	{
+		cacheInfo.initialDataSize = data.size();
+		cacheInfo.pInitialData = data.data();
+
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) == VK_SUCCESS)
+		{
+			Log::Print(LogLevel::LEVEL_INFO, "Loaded pipeline cache: %u bytes\n", static_cast<unsigned int>(data.size()));
+			return true;
+		}
+
+		// Start empty instead if the driver refused the data
+		warm = false;
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+	}
+
+	if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) != VK_SUCCESS)
+	{
+		std::cout << "Failed to create pipeline cache\n";
+		return false;
+	}
+
+	return true;
+}
+
+void VKPipelineCache::Dispose()
+{
+	if (cache == VK_NULL_HANDLE)
+		return;
+
+	SaveFile();
+
+	vkDestroyPipelineCache(device, cache, nullptr);
+	cache = VK_NULL_HANDLE;
+}
+
+void VKPipelineCache::BeginParallelCreation(JobSystem* jobSystem)
+{
+	this->jobSystem = jobSystem;
+	failed = false;
+}
+
+bool VKPipelineCache::EndParallelCreation()
+{
+	// Help the workers with the pipeline jobs instead of idling while they compile
+	if (jobSystem)
+		jobSystem->WaitFor(pendingPipelines);
+
+	jobSystem = nullptr;
+
+	return !failed.load();
+}
+
+bool VKPipelineCache::CreateGraphicsPipeline(const VkGraphicsPipelineCreateInfo& info, VkPipeline* pipeline)
+{
+	if (!jobSystem)
+	{
+		if (vkCreateGraphicsPipelines(device, cache, 1, &info, nullptr, pipeline) != VK_SUCCESS)
+			return false;
+
+		numCreatedPipelines++;
+		return true;
+	}
+
+	std::shared_ptr<GraphicsPipelineCopy> copy = std::make_shared<GraphicsPipelineCopy>();
+	CopyGraphicsInfo(info, *copy);
+
+	*pipeline = VK_NULL_HANDLE;
+
+	// The cache is internally synchronized so the workers can all use it
+	jobSystem->Execute([this, copy, pipeline]()
+	{
+		if (vkCreateGraphicsPipelines(device, cache, 1, &copy->info, nullptr, pipeline) == VK_SUCCESS)
+		{
+			numCreatedPipelines++;
+		}
+		else
+		{
+			std::cout << "Failed to create graphics pipeline\n";
+			failed = true;
+		}
+	}, &pendingPipelines);
+
+	return true;
+}
+
+bool VKPipelineCache::CreateComputePipeline(const VkComputePipelineCreateInfo& info, VkPipeline* pipeline)
+{
+	if (!jobSystem)
+	{
+		if (vkCreateComputePipelines(device, cache, 1, &info, nullptr, pipeline) != VK_SUCCESS)
+			return false;
+
+		numCreatedPipelines++;
+		return true;
+	}
+
+	VkComputePipelineCreateInfo copy = info;
+	copy.pNext = nullptr;
+	copy.stage.pNext = nullptr;
+
+	*pipeline = VK_NULL_HANDLE;
+
+	jobSystem->Execute([this, copy, pipeline]()
+	{
+		if (vkCreateComputePipelines(device, cache, 1, &copy, nullptr, pipeline) == VK_SUCCESS)
+		{
+			numCreatedPipelines++;
+		}
+		else
+		{
+			std::cout << "Failed to create compute pipeline\n";
+			failed = true;
+		}
+	}, &pendingPipelines);
+
+	return true;
+}
+
+bool VKPipelineCache::LoadFile(std::vector<char>& data)
+{
+	std::ifstream file(path, std::ios::ate | std::ios::binary);
+
+	// No file on the first run
+	if (!file.is_open())
+		return false;
+
+	uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+
+	if (fileSize < sizeof(CacheFileHeader))
+		return false;
+
+	CacheFileHeader header;
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(&header), sizeof(CacheFileHeader));
+
+	bool valid = file.good() && header.magic == CACHE_MAGIC && header.version == CACHE_VERSION && header.dataSize == fileSize - sizeof(CacheFileHeader) && header.dataSize >= DRIVER_HEADER_SIZE;
+	bool sameDriver = header.vendorID == vendorID && header.deviceID == deviceID && header.driverVersion == driverVersion && memcmp(header.pipelineCacheUUID, pipelineCacheUUID, VK_UUID_SIZE) == 0;
+
+	if (!valid || !sameDriver)
+	{
+		Log::Print(LogLevel::LEVEL_WARNING, "Pipeline cache %s was written by another device or driver, starting with an empty cache\n", path.c_str());
+		return false;
+	}
+
+	data.resize(static_cast<size_t>(header.dataSize));
+	file.read(data.data(), static_cast<std::streamsize>(header.dataSize));
+
+	if (!file.good())
+		return false;
+
+	// The driver also checks its own header but a mismatch there would silently give it an empty cache
+	uint32_t driverHeader[4];
+	memcpy(driverHeader, data.data(), sizeof(driverHeader));
+
+	return driverHeader[0] >= DRIVER_HEADER_SIZE && driverHeader[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE && driverHeader[2] == vendorID && driverHeader[3] == deviceID &&
+		memcmp(data.data() + 16, pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void VKPipelineCache::SaveFile()
+{
+	size_t dataSize = 0;
+	if (vkGetPipelineCacheData(device, cache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+		return;
+
+	std::vector<char> data(dataSize);
+	if (vkGetPipelineCacheData(device, cache, &dataSize, data.data()) != VK_SUCCESS)
+		return;
+
+	CacheFileHeader header = {};
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.vendorID = vendorID;
+	header.deviceID = deviceID;
+	header.driverVersion = driverVersion;
+	memcpy(header.pipelineCacheUUID, pipelineCacheUUID, VK_UUID_SIZE);
+	header.dataSize = dataSize;
+
+	// Write to a temporary file first so closing in the middle of the write never leaves a truncated cache behind
+	std::string tempPath = path + ".tmp";
+	std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+
+	if (!file.is_open())
+	{
+		std::cout << "Failed to save pipeline cache\n";
+		return;
+	}
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(CacheFileHeader));
+	file.write(data.data(), static_cast<std::streamsize>(dataSize));
+
+	bool written = file.good();
+	file.close();
+
+	std::error_code error;
+
+	if (!written)
+	{
+		std::filesystem::remove(tempPath, error);
+		std::cout << "Failed to save pipeline cache\n";
+		return;
+	}
+
+	std::filesystem::rename(tempPath, path, error);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+class JobSystem;
+
+// Pipeline cache shared by every pipeline. It's loaded from disk at startup and saved back on Dispose so the next run skips compiling the pipelines that didn't change
+// The file is only used when it was written by the same device and driver, otherwise the cache starts empty
+class VKPipelineCache
+{
+public:
+	VKPipelineCache();
+
+	bool Init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path);
+	void Dispose();
+
+	// Until EndParallelCreation the pipelines are created by the job system's threads. The create info is copied but the shader modules, their specialization info, layouts and render passes must stay alive
+	// The handle is written by a worker so it must not move and it's VK_NULL_HANDLE until EndParallelCreation returns
+	void BeginParallelCreation(JobSystem* jobSystem);
+	// Waits for the pipelines created since BeginParallelCreation. Returns false if any of them failed
+	bool EndParallelCreation();
+
+	// pNext chains are not copied when the pipeline is created in parallel
+	bool CreateGraphicsPipeline(const VkGraphicsPipelineCreateInfo& info, VkPipeline* pipeline);
+	bool CreateComputePipeline(const VkComputePipelineCreateInfo& info, VkPipeline* pipeline);
+
+	VkPipelineCache GetCache() const { return cache; }
+	// True if the cache was loaded from the file
+	bool IsWarm() const { return warm; }
+	unsigned int GetNumCreatedPipelines() const { return numCreatedPipelines.load(); }
+
+private:
+	bool LoadFile(std::vector<char>& data);
+	void SaveFile();
+
+private:
+	VkDevice device;
+	VkPipelineCache cache;
+	std::string path;
+	bool warm;
+
+	// Identifies the device and driver that wrote the file
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+
+	JobSystem* jobSystem;
+	std::atomic<unsigned int> pendingPipelines;
+	std::atomic<unsigned int> numCreatedPipelines;
+	std::atomic<bool> failed;
+};
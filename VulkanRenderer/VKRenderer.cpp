@@ -7,6 +7,7 @@
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 
 VKRenderer::VKRenderer()
 {
@@ -20,6 +21,12 @@ VKRenderer::VKRenderer()
 	singleCameraUBOAlignedSize = 0;
 	allCamerasAlignedSize = 0;
 	singleFrameUBOAlignedSize = 0;
+
+	bindlessPool = VK_NULL_HANDLE;
+	bindlessTexturesSetLayout = VK_NULL_HANDLE;
+	bindlessTexturesSet = VK_NULL_HANDLE;
+	bindlessCapacity = 0;
+	numBindlessTextures = 0;
 }
 
 bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int height)
@@ -87,36 +94,19 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 		return false;
 	}
 
-	// Descriptor pool
-
-	VkDescriptorPoolSize poolSizes[5] = {};
-	poolSizes[0].descriptorCount = 2;
-	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-
-	poolSizes[1].descriptorCount = 50;
-	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-
-	poolSizes[2].descriptorCount = 1;
-	poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-
-	poolSizes[3].descriptorCount = 2;
-	poolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	// Descriptor pools. More pools are chained when they run out
 
-	poolSizes[4].descriptorCount = 4;
-	poolSizes[4].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutCache.Init(device);
 
-	VkDescriptorPoolCreateInfo descPoolInfo = {};
-	descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	descPoolInfo.maxSets = 16;
-	descPoolInfo.poolSizeCount = 5;
-	descPoolInfo.pPoolSizes = poolSizes;
+	if (!descriptorAllocator.Init(device, INITIAL_SETS_PER_POOL))
+		return false;
 
-	if (vkCreateDescriptorPool(device, &descPoolInfo, nullptr, &descriptorPool) != VK_SUCCESS)
+	for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
-		std::cout << "Failed to create descriptor pool\n";
-		return false;
+		if (!frameDescriptorAllocators[i].Init(device, INITIAL_TRANSIENT_SETS_PER_POOL))
+			return false;
 	}
-	std::cout << "Created descriptor pool\n";
+	std::cout << "Created descriptor pools\n";
 
 	// Camera set layout
 
@@ -126,12 +116,9 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 	cameraUboBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	cameraUboBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
-	VkDescriptorSetLayoutCreateInfo camerasSetLayoutInfo = {};
-	camerasSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	camerasSetLayoutInfo.bindingCount = 1;
-	camerasSetLayoutInfo.pBindings = &cameraUboBinding;
+	camerasSetLayout = layoutCache.GetLayout({ cameraUboBinding });
 
-	if (vkCreateDescriptorSetLayout(device, &camerasSetLayoutInfo, nullptr, &camerasSetLayout) != VK_SUCCESS)
+	if (camerasSetLayout == VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create cameras set layout\n";
 		return false;
@@ -157,14 +144,15 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 	directionalLightUboBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	directionalLightUboBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
-	VkDescriptorSetLayoutBinding globalBuffersSetBindings[] = { instanceBufferBinding, frameDataUboBinding, directionalLightUboBinding };
+	VkDescriptorSetLayoutBinding instanceIndicesBinding = {};
+	instanceIndicesBinding.binding = 3;
+	instanceIndicesBinding.descriptorCount = 1;
+	instanceIndicesBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	instanceIndicesBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
-	VkDescriptorSetLayoutCreateInfo globalBuffersSetLayoutInfo = {};
-	globalBuffersSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	globalBuffersSetLayoutInfo.bindingCount = 3;
-	globalBuffersSetLayoutInfo.pBindings = globalBuffersSetBindings;
+	globalBuffersSetLayout = layoutCache.GetLayout({ instanceBufferBinding, frameDataUboBinding, directionalLightUboBinding, instanceIndicesBinding });
 
-	if (vkCreateDescriptorSetLayout(device, &globalBuffersSetLayoutInfo, nullptr, &globalBuffersSetLayout) != VK_SUCCESS)
+	if (globalBuffersSetLayout == VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create global buffers descriptor set layout\n";
 		return false;
@@ -190,14 +178,9 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 	cloudsLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	cloudsLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-	VkDescriptorSetLayoutBinding texturesSetLayoutBindings[] = { shadowMapLayoutBinding, storageImageLayoutBinding, cloudsLayoutBinding };
+	globalTexturesSetLayout = layoutCache.GetLayout({ shadowMapLayoutBinding, storageImageLayoutBinding, cloudsLayoutBinding });
 
-	VkDescriptorSetLayoutCreateInfo globalTexturesSetLayoutInfo = {};
-	globalTexturesSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	globalTexturesSetLayoutInfo.bindingCount = 3;
-	globalTexturesSetLayoutInfo.pBindings = texturesSetLayoutBindings;
-
-	if (vkCreateDescriptorSetLayout(device, &globalTexturesSetLayoutInfo, nullptr, &globalTexturesSetLayout) != VK_SUCCESS)
+	if (globalTexturesSetLayout == VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create textures descriptor set layout\n";
 		return false;
@@ -205,7 +188,7 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 
 	// User Textures
 	const unsigned int MAX_TEXTURES_IN_USER_SET = 4;
-	VkDescriptorSetLayoutBinding userTexturesSetLayoutBindings[MAX_TEXTURES_IN_USER_SET] = {};
+	std::vector<VkDescriptorSetLayoutBinding> userTexturesSetLayoutBindings(MAX_TEXTURES_IN_USER_SET);
 
 	for (unsigned int i = 0; i < MAX_TEXTURES_IN_USER_SET; i++)
 	{
@@ -218,28 +201,29 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 		userTexturesSetLayoutBindings[i] = userTextureLayoutBinding;
 	}
 
-	VkDescriptorSetLayoutCreateInfo userTexturesSetLayoutInfo = {};
-	userTexturesSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	userTexturesSetLayoutInfo.bindingCount = MAX_TEXTURES_IN_USER_SET;
-	userTexturesSetLayoutInfo.pBindings = userTexturesSetLayoutBindings;
+	userTexturesSetLayout = layoutCache.GetLayout(userTexturesSetLayoutBindings);
 
-	if (vkCreateDescriptorSetLayout(device, &userTexturesSetLayoutInfo, nullptr, &userTexturesSetLayout) != VK_SUCCESS)
+	if (userTexturesSetLayout == VK_NULL_HANDLE)
 	{
 		std::cout << "Failed to create textures descriptor set layout\n";
 		return false;
 	}
 
+	// Bindless Textures
+	if (base.IsDescriptorIndexingEnabled() && !CreateBindlessTexturesSet())
+		return false;
+
 	VkPushConstantRange pushConstantRange = {};
 	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	pushConstantRange.offset = 0;
 	pushConstantRange.size = sizeof(unsigned int);
 
-	// Create pipeline layout
-	VkDescriptorSetLayout setLayouts[] = { camerasSetLayout, globalBuffersSetLayout, globalTexturesSetLayout, userTexturesSetLayout };
+	// Create pipeline layout. The bindless set is only there when supported, the pipelines that don't use it are still compatible with the other sets
+	VkDescriptorSetLayout setLayouts[] = { camerasSetLayout, globalBuffersSetLayout, globalTexturesSetLayout, userTexturesSetLayout, bindlessTexturesSetLayout };
 
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = 4;
+	pipelineLayoutInfo.setLayoutCount = IsBindless() ? 5 : 4;
 	pipelineLayoutInfo.pSetLayouts = setLayouts;
 	pipelineLayoutInfo.pushConstantRangeCount = 1;
 	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
@@ -253,37 +237,18 @@ bool VKRenderer::Init(GLFWwindow *window, unsigned int width, unsigned int heigh
 
 
 	// Allocate the descriptor sets
-	VkDescriptorSetAllocateInfo setAllocInfo = {};
-	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	setAllocInfo.descriptorPool = descriptorPool;
-	setAllocInfo.descriptorSetCount = 1;
-	
-
 	for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
-		setAllocInfo.pSetLayouts = &globalBuffersSetLayout;
+		frameResources[i].globalBuffersSet = descriptorAllocator.Allocate(globalBuffersSetLayout);
+		frameResources[i].camerasSet = descriptorAllocator.Allocate(camerasSetLayout);
 
-		if (vkAllocateDescriptorSets(device, &setAllocInfo, &frameResources[i].globalBuffersSet) != VK_SUCCESS)
-		{
-			std::cout << "failed to allocate descriptor sets\n";
-			return 1;
-		}
-		setAllocInfo.pSetLayouts = &camerasSetLayout;
-
-		if (vkAllocateDescriptorSets(device, &setAllocInfo, &frameResources[i].camerasSet) != VK_SUCCESS)
-		{
-			std::cout << "failed to allocate descriptor sets\n";
-			return 1;
-		}
+		if (frameResources[i].globalBuffersSet == VK_NULL_HANDLE || frameResources[i].camerasSet == VK_NULL_HANDLE)
+			return false;
 	}
 
-	setAllocInfo.descriptorSetCount = 1;
-	setAllocInfo.pSetLayouts = &globalTexturesSetLayout;
-	if (vkAllocateDescriptorSets(device, &setAllocInfo, &globalTexturesSet) != VK_SUCCESS)
-	{
-		std::cout << "Failed to allocate descriptor sets\n";
-		return 1;
-	}
+	globalTexturesSet = descriptorAllocator.Allocate(globalTexturesSetLayout);
+	if (globalTexturesSet == VK_NULL_HANDLE)
+		return false;
 
 	std::cout << "Allocated descriptor sets\n";
 
@@ -368,11 +333,14 @@ void VKRenderer::Dispose()
 	cameraUBO.Dispose(device);
 	frameUBO.Dispose(device);
 
-	vkDestroyDescriptorSetLayout(device, camerasSetLayout, nullptr);
-	vkDestroyDescriptorSetLayout(device, globalBuffersSetLayout, nullptr);
-	vkDestroyDescriptorSetLayout(device, globalTexturesSetLayout, nullptr);
-	vkDestroyDescriptorSetLayout(device, userTexturesSetLayout, nullptr);
-	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	// The cache owns the layouts of the renderer and the compute materials
+	descriptorAllocator.Dispose();
+	for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		frameDescriptorAllocators[i].Dispose();
+	}
+	layoutCache.Dispose();
+	vkDestroyDescriptorPool(device, bindlessPool, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 	vkDestroyQueryPool(device, queryPool, nullptr);
 
@@ -397,6 +365,13 @@ void VKRenderer::WaitForFrameFences()
 {
 	vkWaitForFences(base.GetDevice(), 1, &frameFences[currentFrame], VK_TRUE, UINT64_MAX);
 
+	// The GPU is done with the transient sets of this frame
+	frameDescriptorAllocators[currentFrame].Reset();
+
+	// And with the bindless slots released while it was recorded. The frames recorded after the release don't use them
+	freeBindlessTextures.insert(freeBindlessTextures.end(), releasedBindlessTextures[currentFrame].begin(), releasedBindlessTextures[currentFrame].end());
+	releasedBindlessTextures[currentFrame].clear();
+
 	currentCamera = 0;
 }
 
@@ -463,6 +438,9 @@ void VKRenderer::Present(VkSemaphore graphicsSemaphore, VkSemaphore computeSemap
 
 	vkResetFences(device, 1, &frameFences[currentFrame]);
 
+	// Every write to non coherent memory this frame is flushed with a single call
+	base.GetAllocator().FlushMappedRanges();
+
 	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameFences[currentFrame]) != VK_SUCCESS)
 	{
 		std::cout << "Failed to submit draw command buffer!\n";
@@ -620,6 +598,7 @@ bool VKRenderer::EndMipMaps(VkCommandBuffer cmdBuffer)
 		std::cout << "Failed to create fence\n";
 		return false;
 	}
+	base.GetAllocator().FlushMappedRanges();
 	if (vkQueueSubmit(base.GetGraphicsQueue(), 1, &submitInfo, fence) != VK_SUCCESS)
 	{
 		std::cout << "Failed to submit\n";
@@ -640,40 +619,22 @@ bool VKRenderer::EndMipMaps(VkCommandBuffer cmdBuffer)
 
 VkDescriptorSet VKRenderer::AllocateUserTextureDescriptorSet()
 {
-	VkDescriptorSetAllocateInfo setAllocInfo = {};
-	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	setAllocInfo.descriptorPool = descriptorPool;
-	setAllocInfo.descriptorSetCount = 1;
-	setAllocInfo.pSetLayouts = &userTexturesSetLayout;
-
-	VkDescriptorSet set;
-
-	if (vkAllocateDescriptorSets(base.GetDevice(), &setAllocInfo, &set) != VK_SUCCESS)
-	{
-		std::cout << "Failed to allocate descriptor set\n";
-		return VK_NULL_HANDLE;
-	}
-
-	return set;
+	return descriptorAllocator.Allocate(userTexturesSetLayout);
 }
 
 VkDescriptorSet VKRenderer::AllocateSetFromLayout(VkDescriptorSetLayout layout)
 {
-	VkDescriptorSetAllocateInfo setAllocInfo = {};
-	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	setAllocInfo.descriptorPool = descriptorPool;
-	setAllocInfo.descriptorSetCount = 1;
-	setAllocInfo.pSetLayouts = &layout;
-
-	VkDescriptorSet set;
+	return descriptorAllocator.Allocate(layout);
+}
 
-	if (vkAllocateDescriptorSets(base.GetDevice(), &setAllocInfo, &set) != VK_SUCCESS)
-	{
-		std::cout << "Failed to allocate descriptor set\n";
-		return VK_NULL_HANDLE;
-	}
+VkDescriptorSet VKRenderer::AllocateTransientSet(VkDescriptorSetLayout layout)
+{
+	return frameDescriptorAllocators[currentFrame].Allocate(layout);
+}
 
-	return set;
+VkDescriptorSetLayout VKRenderer::GetSetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings)
+{
+	return layoutCache.GetLayout(bindings);
 }
 
 void VKRenderer::UpdateGlobalBuffersSet(const VkDescriptorBufferInfo& info, uint32_t binding, VkDescriptorType descriptorType)
@@ -681,19 +642,24 @@ void VKRenderer::UpdateGlobalBuffersSet(const VkDescriptorBufferInfo& info, uint
 	// This won't work if we want to use offsets 
 	for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
-		VkWriteDescriptorSet write = {};
-		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		write.dstSet = frameResources[i].globalBuffersSet;
-		write.dstBinding = binding;
-		write.dstArrayElement = 0;
-		write.descriptorType = descriptorType;
-		write.descriptorCount = 1;
-		write.pBufferInfo = &info;
-
-		vkUpdateDescriptorSets(base.GetDevice(), 1, &write, 0, nullptr);
+		UpdateGlobalBuffersSet(i, info, binding, descriptorType);
 	}
 }
 
+void VKRenderer::UpdateGlobalBuffersSet(unsigned int frame, const VkDescriptorBufferInfo& info, uint32_t binding, VkDescriptorType descriptorType)
+{
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = frameResources[frame].globalBuffersSet;
+	write.dstBinding = binding;
+	write.dstArrayElement = 0;
+	write.descriptorType = descriptorType;
+	write.descriptorCount = 1;
+	write.pBufferInfo = &info;
+
+	vkUpdateDescriptorSets(base.GetDevice(), 1, &write, 0, nullptr);
+}
+
 void VKRenderer::UpdateGlobalTexturesSet(const VkDescriptorImageInfo& info, uint32_t binding, VkDescriptorType descriptorType)
 {
 	VkWriteDescriptorSet write = {};
@@ -708,6 +674,116 @@ void VKRenderer::UpdateGlobalTexturesSet(const VkDescriptorImageInfo& info, uint
 	vkUpdateDescriptorSets(base.GetDevice(), 1, &write, 0, nullptr);
 }
 
+bool VKRenderer::CreateBindlessTexturesSet()
+{
+	VkDevice device = base.GetDevice();
+
+	// Leave some of the device's update after bind samplers to the other sets
+	bindlessCapacity = std::min(MAX_BINDLESS_TEXTURES, base.GetMaxBindlessTextures() / 2);
+
+	VkDescriptorSetLayoutBinding texturesBinding = {};
+	texturesBinding.binding = 0;
+	texturesBinding.descriptorCount = bindlessCapacity;
+	texturesBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	texturesBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	// Only the slots the shaders index need to be valid. New textures are written to slots the pending frames don't use
+	VkDescriptorBindingFlagsEXT bindingFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT;
+
+	bindlessTexturesSetLayout = layoutCache.GetLayout({ texturesBinding }, { bindingFlags }, VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT);
+
+	if (bindlessTexturesSetLayout == VK_NULL_HANDLE)
+	{
+		std::cout << "Failed to create bindless textures set layout\n";
+		return false;
+	}
+
+	VkDescriptorPoolSize poolSize = {};
+	poolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSize.descriptorCount = bindlessCapacity;
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+	poolInfo.maxSets = 1;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+
+	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &bindlessPool) != VK_SUCCESS)
+	{
+		std::cout << "Failed to create bindless descriptor pool\n";
+		return false;
+	}
+
+	VkDescriptorSetAllocateInfo setAllocInfo = {};
+	setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	setAllocInfo.descriptorPool = bindlessPool;
+	setAllocInfo.descriptorSetCount = 1;
+	setAllocInfo.pSetLayouts = &bindlessTexturesSetLayout;
+
+	if (vkAllocateDescriptorSets(device, &setAllocInfo, &bindlessTexturesSet) != VK_SUCCESS)
+	{
+		std::cout << "Failed to allocate bindless textures set\n";
+		bindlessTexturesSet = VK_NULL_HANDLE;
+		return false;
+	}
+
+	std::cout << "Bindless textures: " << bindlessCapacity << '\n';
+
+	return true;
+}
+
+unsigned int VKRenderer::AddBindlessTexture(const VKTexture2D& texture)
+{
+	if (!IsBindless())
+		return INVALID_BINDLESS_TEXTURE;
+
+	unsigned int index = INVALID_BINDLESS_TEXTURE;
+
+	if (!freeBindlessTextures.empty())
+	{
+		index = freeBindlessTextures.back();
+		freeBindlessTextures.pop_back();
+	}
+	else if (numBindlessTextures < bindlessCapacity)
+	{
+		index = numBindlessTextures++;
+	}
+	else
+	{
+		std::cout << "Bindless textures array is full\n";
+		return INVALID_BINDLESS_TEXTURE;
+	}
+
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = texture.GetImageView();
+	imageInfo.sampler = texture.GetSampler();
+
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = bindlessTexturesSet;
+	write.dstBinding = 0;
+	write.dstArrayElement = index;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	write.descriptorCount = 1;
+	write.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(base.GetDevice(), 1, &write, 0, nullptr);
+
+	return index;
+}
+
+void VKRenderer::RemoveBindlessTexture(unsigned int index)
+{
+	if (index >= numBindlessTextures)
+		return;
+
+	// The slot keeps the old descriptor until it's reused. It's partially bound so nothing reads it
+	// The frames in flight could still read it, so it's only reused after this frame's fence is waited on again
+	releasedBindlessTextures[currentFrame].push_back(index);
+}
+
 void VKRenderer::UpdateUserTextureSet2D(VkDescriptorSet set, const VKTexture2D& texture, unsigned int binding)
 {
 	VkDescriptorImageInfo imageInfo = {};
@@ -850,18 +926,23 @@ void VKRenderer::SetCamera(const Camera& camera)
 
 void VKRenderer::UpdateCameraUBO()
 {
-	VkDevice device = base.GetDevice();
-	void* mapped = cameraUBO.Map(device, VkDeviceSize(currentFrame * allCamerasAlignedSize), allCamerasAlignedSize);
-	memcpy(mapped, camerasData, static_cast<size_t>(currentCamera) * singleCameraUBOAlignedSize);
-	cameraUBO.Unmap(device);
+	// Only the cameras used this frame are copied
+	MappedSpan<unsigned char> mapped = cameraUBO.GetSpan<unsigned char>(VkDeviceSize(currentFrame * allCamerasAlignedSize), static_cast<size_t>(currentCamera) * singleCameraUBOAlignedSize);
+	if (mapped.IsEmpty())
+		return;
+
+	memcpy(mapped.GetData(), camerasData, mapped.GetSizeInBytes());
+	cameraUBO.Flush(mapped);
 }
 
 void VKRenderer::UpdateFrameUBO(const FrameUBO& frameData)
 {
-	VkDevice device = base.GetDevice();
-	void* mapped = frameUBO.Map(device, VkDeviceSize(currentFrame * singleFrameUBOAlignedSize), sizeof(FrameUBO));
-	memcpy(mapped, &frameData, sizeof(FrameUBO));
-	frameUBO.Unmap(device);
+	MappedSpan<FrameUBO> mapped = frameUBO.GetSpan<FrameUBO>(VkDeviceSize(currentFrame * singleFrameUBOAlignedSize), 1);
+	if (mapped.IsEmpty())
+		return;
+
+	mapped[0] = frameData;
+	frameUBO.Flush(mapped);
 }
 
 void VKRenderer::BeginCmdRecording()
@@ -875,6 +956,9 @@ void VKRenderer::BeginCmdRecording()
 	}
 
 	vkCmdResetQueryPool(cmdBuffers[currentFrame], queryPool, currentFrame * MAX_FRAMES_IN_FLIGHT, 2);
+
+	// Take ownership of the uploads that finished since the last frame
+	base.GetUploadManager().Update(cmdBuffers[currentFrame]);
 }
 
 void VKRenderer::BeginQuery()
@@ -5,11 +5,13 @@
 #include "Camera.h"
 #include "VKTexture3D.h"
 #include "UniformBufferTypes.h"
+#include "VKDescriptorAllocator.h"
 
 #define CAMERA_SET_BINDING 0
 #define GLOBAL_BUFFER_SET_BINDING 1
 #define GLOBAL_TEXTURES_SET_BINDING 2
 #define USER_TEXTURES_SET_BINDING 3
+#define BINDLESS_TEXTURES_SET_BINDING 4
 
 struct GLFWWindow;
 
@@ -27,12 +29,23 @@ public:
 	VkCommandBuffer BeginMipMaps();
 	void CreateMipMaps(VkCommandBuffer cmdBuffer, const VKTexture2D& texture);
 	bool EndMipMaps(VkCommandBuffer cmdBuffer);
+	// The sets live until the renderer is disposed. New pools are added when they run out
 	VkDescriptorSet AllocateUserTextureDescriptorSet();
 	VkDescriptorSet AllocateSetFromLayout(VkDescriptorSetLayout layout);
+	// Only valid for the current frame, the frame's pools are reset once its fence was waited on
+	VkDescriptorSet AllocateTransientSet(VkDescriptorSetLayout layout);
+	// Layouts with the same bindings are created once and owned by the renderer
+	VkDescriptorSetLayout GetSetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings);
 	void UpdateGlobalBuffersSet(const VkDescriptorBufferInfo& info, uint32_t binding, VkDescriptorType descriptorType);
+	// Only updates the set of one frame in flight. The frame's fence has to be waited on first
+	void UpdateGlobalBuffersSet(unsigned int frame, const VkDescriptorBufferInfo& info, uint32_t binding, VkDescriptorType descriptorType);
 	void UpdateGlobalTexturesSet(const VkDescriptorImageInfo& info, uint32_t binding, VkDescriptorType descriptorType);
 	void UpdateUserTextureSet2D(VkDescriptorSet set, const VKTexture2D& texture, unsigned int binding);
 	void UpdateUserTextureSet3D(VkDescriptorSet set, const VKTexture3D& texture, unsigned int binding);
+	// Writes the texture to a free slot of the bindless array and returns its index, which doesn't change while the texture is alive. INVALID_BINDLESS_TEXTURE if not bindless or full
+	unsigned int AddBindlessTexture(const VKTexture2D& texture);
+	// The slot is reused once the frames in flight when it was removed are done, MAX_FRAMES_IN_FLIGHT frames later
+	void RemoveBindlessTexture(unsigned int index);
 
 	VkCommandBuffer CreateGraphicsCommandBuffer(bool beginRecord);
 	VkCommandBuffer CreateComputeCommandBuffer(bool beginRecord);
@@ -64,17 +77,38 @@ public:
 	VkPipelineLayout GetPipelineLayout() const { return pipelineLayout; }
 	VkDescriptorSet GetGlobalBuffersSet() const { return frameResources[currentFrame].globalBuffersSet; }
 	VkDescriptorSet GetGlobalTexturesSet() const { return globalTexturesSet; }
+	// Only when the device supports descriptor indexing. The pipeline layout then has the bindless set at BINDLESS_TEXTURES_SET_BINDING
+	bool IsBindless() const { return bindlessTexturesSet != VK_NULL_HANDLE; }
+	VkDescriptorSet GetBindlessTexturesSet() const { return bindlessTexturesSet; }
+	const VKDescriptorAllocator& GetDescriptorAllocator() const { return descriptorAllocator; }
+	const VKDescriptorLayoutCache& GetDescriptorLayoutCache() const { return layoutCache; }
+	unsigned int GetNumBindlessTextures() const
+	{
+		unsigned int numFree = static_cast<unsigned int>(freeBindlessTextures.size());
+		for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+			numFree += static_cast<unsigned int>(releasedBindlessTextures[i].size());
+
+		return numBindlessTextures - numFree;
+	}
 
 	unsigned int GetWidth() const { return width; }
 	unsigned int GetHeight() const { return height; }
 
+	static const int MAX_FRAMES_IN_FLIGHT = 2;
+	// Size of the bindless texture array when the device allows that many
+	static const unsigned int MAX_BINDLESS_TEXTURES = 16384;
+	static const unsigned int INVALID_BINDLESS_TEXTURE = 0xFFFFFFFF;
+
 private:
 	bool CreateRenderPass();
 	bool CreateFramebuffers();
+	bool CreateBindlessTexturesSet();
 
 private:
-	static const int MAX_FRAMES_IN_FLIGHT = 2;
 	const unsigned int MAX_CAMERAS = 4;
+	// Sets of the first pools. The next pools double in size
+	static const unsigned int INITIAL_SETS_PER_POOL = 32;
+	static const unsigned int INITIAL_TRANSIENT_SETS_PER_POOL = 16;
 	unsigned int currentFrame;
 	unsigned int width;
 	unsigned int height;
@@ -99,7 +133,9 @@ private:
 	std::vector<VkFence> imagesInFlight;
 	std::vector<VkCommandBuffer> cmdBuffers;
 
-	VkDescriptorPool descriptorPool;
+	VKDescriptorAllocator descriptorAllocator;
+	VKDescriptorAllocator frameDescriptorAllocators[MAX_FRAMES_IN_FLIGHT];
+	VKDescriptorLayoutCache layoutCache;
 	VkDescriptorSetLayout camerasSetLayout;
 	VkDescriptorSetLayout globalBuffersSetLayout;
 	VkDescriptorSetLayout globalTexturesSetLayout;
@@ -107,6 +143,15 @@ private:
 	VkDescriptorSet globalTexturesSet;
 	VkPipelineLayout pipelineLayout;
 
+	// One partially bound array of every texture, updated after bind so textures can be added while frames are in flight
+	VkDescriptorPool bindlessPool;
+	VkDescriptorSetLayout bindlessTexturesSetLayout;
+	VkDescriptorSet bindlessTexturesSet;
+	unsigned int bindlessCapacity;
+	unsigned int numBindlessTextures;				// Slots used so far, including the free ones
+	std::vector<unsigned int> freeBindlessTextures;
+	std::vector<unsigned int> releasedBindlessTextures[MAX_FRAMES_IN_FLIGHT];		// Removed while the frame was recorded, free once its fence is waited on
+
 	VKBuffer cameraUBO;
 	glm::mat4* camerasData;
 	unsigned int currentCamera;
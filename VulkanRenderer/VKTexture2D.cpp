@@ -3,6 +3,7 @@
 #include "stb_image.h"
 
 #include <iostream>
+#include <algorithm>
 
 VKTexture2D::VKTexture2D()
 {
@@ -11,19 +12,18 @@ VKTexture2D::VKTexture2D()
 	mipLevels = 0;
 	image = VK_NULL_HANDLE;
 	imageView = VK_NULL_HANDLE;
-	memory = VK_NULL_HANDLE;
+	allocator = nullptr;
+	allocation = {};
 	sampler = VK_NULL_HANDLE;
 	params = {};
+	uploadToken = 0;
 }
 
 bool VKTexture2D::LoadFromFile(VKBase& base, const std::string& path, const TextureParams& textureParams)
 {
-	params = textureParams;
-	textureType = TextureType::TEXTURE_2D;
-
-	unsigned char* pixels = nullptr;
-	int textureWidth, textureHeight, channels;
-	pixels = stbi_load(path.c_str(), &textureWidth, &textureHeight, &channels, STBI_rgb_alpha);
+	unsigned int textureWidth = 0;
+	unsigned int textureHeight = 0;
+	unsigned char* pixels = DecodeFile(path, textureWidth, textureHeight);
 
 	if (!pixels)
 	{
@@ -31,9 +31,44 @@ bool VKTexture2D::LoadFromFile(VKBase& base, const std::string& path, const Text
 		return false;
 	}
 
+	bool loaded = LoadFromPixels(base, pixels, textureWidth, textureHeight, textureParams);
+	FreePixels(pixels);
+
+	if (!loaded)
+	{
+		std::cout << "Failed to upload texture: " << path << '\n';
+		return false;
+	}
+
+	return true;
+}
+
+unsigned char* VKTexture2D::DecodeFile(const std::string& path, unsigned int& width, unsigned int& height)
+{
+	int textureWidth, textureHeight, channels;
+	unsigned char* pixels = stbi_load(path.c_str(), &textureWidth, &textureHeight, &channels, STBI_rgb_alpha);
+
+	if (!pixels)
+		return nullptr;
+
 	width = static_cast<unsigned int>(textureWidth);
 	height = static_cast<unsigned int>(textureHeight);
 
+	return pixels;
+}
+
+void VKTexture2D::FreePixels(unsigned char* pixels)
+{
+	stbi_image_free(pixels);
+}
+
+bool VKTexture2D::LoadFromPixels(VKBase& base, const unsigned char* pixels, unsigned int width, unsigned int height, const TextureParams& textureParams)
+{
+	params = textureParams;
+	textureType = TextureType::TEXTURE_2D;
+	this->width = width;
+	this->height = height;
+
 	unsigned int textureSize = width * height * 4 * sizeof(unsigned char);
 
 	if (params.dontCreateMipMaps)
@@ -50,51 +85,45 @@ bool VKTexture2D::LoadFromFile(VKBase& base, const std::string& path, const Text
 		return false;
 	}
 
-	VKBuffer stagingBuffer;
-
 	VkDevice device = base.GetDevice();
 
-	stagingBuffer.Create(&base, textureSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-	void* data;
-	vkMapMemory(device, stagingBuffer.GetBufferMemory(), 0, static_cast<VkDeviceSize>(stagingBuffer.GetSize()), 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(stagingBuffer.GetSize()));
-	vkUnmapMemory(device, stagingBuffer.GetBufferMemory());
-
 	if (!CreateImage(device))
 		return false;
 
-	VkMemoryRequirements imageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &imageMemReqs);
+	allocator = &base.GetAllocator();
 
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), imageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = imageMemReqs.size;
-
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	if (!allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, allocation))
 	{
 		std::cout << "Failed to allocate image memory\n";
 		return false;
 	}
 
-	vkBindImageMemory(device, image, memory, 0);
+	ImageUpload upload = {};
+	upload.image = image;
+	upload.width = width;
+	upload.height = height;
+	upload.depth = 1;
+	upload.baseArrayLayer = 0;
+	upload.layerCount = 1;
 
 	if (mipLevels == 1)
 	{
-		base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-		base.CopyBufferToImage(stagingBuffer, image, textureWidth, textureHeight);
-		base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		upload.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		upload.dstAccess = VK_ACCESS_SHADER_READ_BIT;
+		upload.dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 	}
 	else
 	{
 		// Put the image ready for the image blits for mip map gen by transitioning to SRC_OPTIMAL
-		base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-		base.CopyBufferToImage(stagingBuffer, image, textureWidth, textureHeight);
-		base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+		upload.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		upload.dstAccess = VK_ACCESS_TRANSFER_READ_BIT;
+		upload.dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
 	}
 
-	stagingBuffer.Dispose(device);
+	uploadToken = base.GetUploadManager().UploadImage(upload, pixels, textureSize);
+
+	if (uploadToken == 0)
+		return false;
 
 	if (!CreateImageView(device, VK_IMAGE_ASPECT_COLOR_BIT))
 		return false;
@@ -145,54 +174,53 @@ bool VKTexture2D::LoadCubemapFromFiles(VKBase& base, const std::vector<std::stri
 	width = static_cast<unsigned int>(textureWidth);
 	height = static_cast<unsigned int>(textureHeight);
 
-	unsigned int textureSize = width * height * 4 * 6 * sizeof(unsigned char);
-
 	mipLevels = 1;
 
-	VKBuffer stagingBuffer;
-
 	VkDevice device = base.GetDevice();
 
-	stagingBuffer.Create(&base, textureSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	bool created = CreateImage(device);
 
-	void* data;
-	vkMapMemory(device, stagingBuffer.GetBufferMemory(), 0, static_cast<VkDeviceSize>(stagingBuffer.GetSize()), 0, &data);
+	allocator = &base.GetAllocator();
 
-	unsigned int offset = 0;
-	unsigned int increase = width * height * 4 * sizeof(unsigned char);		// Increase by the size of one texture every loop iteration
-	for (size_t i = 0; i < 6; i++)
+	if (created && !allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, allocation))
 	{
-		void* ptr = (char*)data + offset;
-		memcpy(ptr, facesPixels[i], static_cast<size_t>(increase));
-		offset += increase;
+		std::cout << "Failed to allocate cubemap image memory\n";
+		created = false;
 	}
 
-	vkUnmapMemory(device, stagingBuffer.GetBufferMemory());
+	ImageUpload upload = {};
+	upload.image = image;
+	upload.width = width;
+	upload.height = height;
+	upload.depth = 1;
+	upload.layerCount = 1;
+	upload.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	upload.dstAccess = VK_ACCESS_SHADER_READ_BIT;
+	upload.dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 
-	if (!CreateImage(device))
-		return false;
-
-	VkMemoryRequirements imageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &imageMemReqs);
+	unsigned int faceSize = width * height * 4 * sizeof(unsigned char);
 
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), imageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = imageMemReqs.size;
-
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	// Upload each face from its own pixels so they don't need to be packed together first
+	for (uint32_t i = 0; i < 6; i++)
 	{
-		std::cout << "Failed to allocate cubemap image memory\n";
-		return false;
-	}
-
-	vkBindImageMemory(device, image, memory, 0);
+		if (created)
+		{
+			upload.baseArrayLayer = i;
+			UploadToken token = base.GetUploadManager().UploadImage(upload, facesPixels[i], faceSize);
+
+			if (token == 0)
+			{
+				std::cout << "Failed to upload cubemap face: " << facesPath[i] << '\n';
+				created = false;
+			}
+			uploadToken = std::max(uploadToken, token);
+		}
 
-	base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 6);
-	base.CopyBufferToCubemapImage(stagingBuffer, image, textureWidth, textureHeight);
-	base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 6);
+		stbi_image_free(facesPixels[i]);
+	}
 
-	stagingBuffer.Dispose(device);
+	if (!created)
+		return false;
 
 	if (!CreateImageView(device, VK_IMAGE_ASPECT_COLOR_BIT))
 		return false;
@@ -210,8 +238,13 @@ void VKTexture2D::Dispose(VkDevice device)
 		vkDestroyImageView(device, imageView, nullptr);
 	if (sampler != VK_NULL_HANDLE)
 		vkDestroySampler(device, sampler, nullptr);
-	if (memory != VK_NULL_HANDLE)
-		vkFreeMemory(device, memory, nullptr);
+	if (allocator)
+		allocator->Free(allocation);
+
+	image = VK_NULL_HANDLE;
+	imageView = VK_NULL_HANDLE;
+	sampler = VK_NULL_HANDLE;
+	allocation = {};
 }
 
 bool VKTexture2D::CreateImage(VkDevice device)
@@ -312,7 +345,7 @@ bool VKTexture2D::CreateSampler(VkDevice device)
 	return true;
 }
 
-bool VKTexture2D::CreateDepthTexture(const VKBase& base, const TextureParams& textureParams, unsigned int width, unsigned int height, bool sampled)
+bool VKTexture2D::CreateDepthTexture(VKBase& base, const TextureParams& textureParams, unsigned int width, unsigned int height, bool sampled)
 {
 	params = textureParams;
 	textureType = TextureType::TEXTURE_2D;
@@ -347,22 +380,15 @@ bool VKTexture2D::CreateDepthTexture(const VKBase& base, const TextureParams& te
 		return false;
 	}
 
-	VkMemoryRequirements depthImageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &depthImageMemReqs);
+	// Render targets get their own memory
+	allocator = &base.GetAllocator();
 
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), depthImageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = depthImageMemReqs.size;
-
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	if (!allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, allocation))
 	{
 		std::cout << "Failed to allocate depth image memory\n";
-		return 1;
+		return false;
 	}
 
-	vkBindImageMemory(device, image, memory, 0);
-
 	VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
 	if (vkutils::FormatHasStencil(params.format))
 		aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
@@ -437,22 +463,15 @@ bool VKTexture2D::CreateColorTexture(VKBase &base, const TextureParams& textureP
 		return false;
 	}
 
-	VkMemoryRequirements imageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &imageMemReqs);
-
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), imageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = imageMemReqs.size;
+	// Render targets get their own memory
+	allocator = &base.GetAllocator();
 
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	if (!allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, allocation))
 	{
 		std::cout << "Failed to allocate image memory\n";
 		return false;
 	}
 
-	vkBindImageMemory(device, image, memory, 0);
-
 	base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
 	if (!CreateImageView(device, VK_IMAGE_ASPECT_COLOR_BIT))
@@ -531,22 +550,14 @@ bool VKTexture2D::CreateWithData(VKBase& base, const TextureParams& textureParam
 		return false;
 	}
 
-	VkMemoryRequirements imageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &imageMemReqs);
-
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), imageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = imageMemReqs.size;
+	allocator = &base.GetAllocator();
 
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	if (!allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, allocation))
 	{
 		std::cout << "Failed to allocate image memory\n";
 		return false;
 	}
 
-	vkBindImageMemory(device, image, memory, 0);
-
 	if (params.useStorage)
 		base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
 	else
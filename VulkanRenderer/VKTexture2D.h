@@ -11,8 +11,10 @@ public:
 	VKTexture2D();
 
 	bool LoadFromFile(VKBase& base, const std::string& path, const TextureParams &textureParams);
+	// The pixels are RGBA8 and are copied to the upload staging ring, so they can be freed right after
+	bool LoadFromPixels(VKBase& base, const unsigned char* pixels, unsigned int width, unsigned int height, const TextureParams& textureParams);
 	bool LoadCubemapFromFiles(VKBase& base, const std::vector<std::string>& facesPath, const TextureParams& textureParams);
-	bool CreateDepthTexture(const VKBase &base, const TextureParams& textureParams, unsigned int width, unsigned int height, bool sampled);
+	bool CreateDepthTexture(VKBase &base, const TextureParams& textureParams, unsigned int width, unsigned int height, bool sampled);
 	// Right now the function assumes the color texture will be sampled
 	bool CreateColorTexture(VKBase& base, const TextureParams& textureParams, unsigned int width, unsigned int height);
 	bool CreateWithData(VKBase& base, const TextureParams& textureParams, unsigned int width, unsigned int height, const void* data);
@@ -25,6 +27,12 @@ public:
 	unsigned int GetNumMipLevels() const { return mipLevels; }
 	unsigned int GetWidth() const { return width; }
 	unsigned int GetHeight() const { return height; }
+	// The texture can be used once the upload manager reports the token as ready
+	UploadToken GetUploadToken() const { return uploadToken; }
+
+	// Decodes the file to RGBA8 pixels without using Vulkan, so it can be called from a worker thread. Returns null if it failed
+	static unsigned char* DecodeFile(const std::string& path, unsigned int& width, unsigned int& height);
+	static void FreePixels(unsigned char* pixels);
 
 private:
 	bool CreateImage(VkDevice device);
@@ -35,10 +43,12 @@ private:
 	VkImage image;
 	VkImageView imageView;
 	VkSampler sampler;
-	VkDeviceMemory memory;
+	VKAllocator* allocator;
+	VKAllocation allocation;
 	TextureParams params;
 	unsigned int width;
 	unsigned int height;
 	unsigned int mipLevels;
 	TextureType textureType;
+	UploadToken uploadToken;
 };
@@ -10,7 +10,8 @@ VKTexture3D::VKTexture3D()
 	mipLevels = 0;
 	image = VK_NULL_HANDLE;
 	imageView = VK_NULL_HANDLE;
-	memory = VK_NULL_HANDLE;
+	allocator = nullptr;
+	allocation = {};
 	sampler = VK_NULL_HANDLE;
 	params = {};
 }
@@ -74,37 +75,32 @@ bool VKTexture3D::CreateFromData(VKBase& base, const TextureParams &params, unsi
 		return false;
 	}
 
-	VkMemoryRequirements imageMemReqs;
-	vkGetImageMemoryRequirements(device, image, &imageMemReqs);
+	allocator = &base.GetAllocator();
 
-	VkMemoryAllocateInfo imgAllocInfo = {};
-	imgAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	imgAllocInfo.memoryTypeIndex = vkutils::FindMemoryType(base.GetPhysicalDeviceMemoryProperties(), imageMemReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	imgAllocInfo.allocationSize = imageMemReqs.size;
-
-	if (vkAllocateMemory(device, &imgAllocInfo, nullptr, &memory) != VK_SUCCESS)
+	if (!allocator->AllocateForImage(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, allocation))
 	{
 		std::cout << "Failed to allocate image memory\n";
 		return false;
 	}
 
-	vkBindImageMemory(device, image, memory, 0);
-
 	unsigned int textureSize = width * height * depth * 4 * sizeof(unsigned char);
 
-	VKBuffer stagingBuffer;
-	stagingBuffer.Create(&base, textureSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-	void* mapped;
-	vkMapMemory(device, stagingBuffer.GetBufferMemory(), 0, static_cast<VkDeviceSize>(stagingBuffer.GetSize()), 0, &mapped);
-	memcpy(mapped, data, static_cast<size_t>(stagingBuffer.GetSize()));
-	vkUnmapMemory(device, stagingBuffer.GetBufferMemory());
-
-	base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-	base.CopyBufferToImage3D(stagingBuffer, image, width, height, depth);
-	base.TransitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-	stagingBuffer.Dispose(device);
+	ImageUpload upload = {};
+	upload.image = image;
+	upload.width = width;
+	upload.height = height;
+	upload.depth = depth;
+	upload.baseArrayLayer = 0;
+	upload.layerCount = 1;
+	upload.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	upload.dstAccess = VK_ACCESS_SHADER_READ_BIT;
+	upload.dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+	if (base.GetUploadManager().UploadImage(upload, data, textureSize) == 0)
+	{
+		std::cout << "Failed to upload 3D texture\n";
+		return false;
+	}
 
 	if (!CreateImageView(device, VK_IMAGE_ASPECT_COLOR_BIT))
 		return false;
@@ -122,8 +118,13 @@ void VKTexture3D::Dispose(VkDevice device)
 		vkDestroyImageView(device, imageView, nullptr);
 	if (sampler != VK_NULL_HANDLE)
 		vkDestroySampler(device, sampler, nullptr);
-	if (memory != VK_NULL_HANDLE)
-		vkFreeMemory(device, memory, nullptr);
+	if (allocator)
+		allocator->Free(allocation);
+
+	image = VK_NULL_HANDLE;
+	imageView = VK_NULL_HANDLE;
+	sampler = VK_NULL_HANDLE;
+	allocation = {};
 }
 
 bool VKTexture3D::CreateImageView(VkDevice device, VkImageAspectFlags imageAspect)
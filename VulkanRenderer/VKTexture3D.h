@@ -27,7 +27,8 @@ private:
 	VkImage image;
 	VkImageView imageView;
 	VkSampler sampler;
-	VkDeviceMemory memory;
+	VKAllocator* allocator;
+	VKAllocation allocation;
 	TextureParams params;
 	unsigned int width;
 	unsigned int height;
@@ -0,0 +1,488 @@
+#include "VKUploadManager.h"
+
+#include "VKBase.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+VKUploadManager::VKUploadManager()
+{
+	device = VK_NULL_HANDLE;
+	allocator = nullptr;
+	transferQueue = VK_NULL_HANDLE;
+	cmdPool = VK_NULL_HANDLE;
+	transferFamily = 0;
+	graphicsFamily = 0;
+	copyAlignment = 16;
+
+	mappedRing = nullptr;
+	ringSize = 0;
+	ringHead = 0;
+	ringTail = 0;
+
+	for (unsigned int i = 0; i < MAX_BATCHES; i++)
+	{
+		batches[i].cmdBuffer = VK_NULL_HANDLE;
+		batches[i].fence = VK_NULL_HANDLE;
+		batches[i].token = 0;
+		batches[i].ringEnd = 0;
+		batches[i].dstStages = 0;
+	}
+
+	currentBatch = -1;
+	lastToken = 0;
+	completedToken = 0;
+	readyToken = 0;
+	pendingDstStages = 0;
+	stats = {};
+}
+
+bool VKUploadManager::Init(VKBase& base, VkDeviceSize ringSize)
+{
+	device = base.GetDevice();
+	allocator = &base.GetAllocator();
+	transferQueue = base.GetTransferQueue();
+
+	const vkutils::QueueFamilyIndices& indices = base.GetQueueFamilyIndices();
+	transferFamily = static_cast<uint32_t>(indices.transferFamilyIndex);
+	graphicsFamily = static_cast<uint32_t>(indices.graphicsFamilyIndex);
+
+	// Buffer offsets of image copies must be a multiple of 4 and of the texel size
+	copyAlignment = std::max(copyAlignment, base.GetPhysicalDeviceLimits().optimalBufferCopyOffsetAlignment);
+
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = transferFamily;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &cmdPool) != VK_SUCCESS)
+	{
+		std::cout << "Failed to create upload command pool\n";
+		return false;
+	}
+
+	VkCommandBuffer cmdBuffers[MAX_BATCHES];
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = cmdPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = MAX_BATCHES;
+
+	if (vkAllocateCommandBuffers(device, &allocInfo, cmdBuffers) != VK_SUCCESS)
+	{
+		std::cout << "Failed to allocate upload command buffers\n";
+		return false;
+	}
+
+	VkFenceCreateInfo fenceInfo = {};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+	for (unsigned int i = 0; i < MAX_BATCHES; i++)
+	{
+		batches[i].cmdBuffer = cmdBuffers[i];
+
+		if (vkCreateFence(device, &fenceInfo, nullptr, &batches[i].fence) != VK_SUCCESS)
+		{
+			std::cout << "Failed to create upload fence\n";
+			return false;
+		}
+	}
+
+	this->ringSize = ringSize;
+
+	if (!ringBuffer.Create(&base, static_cast<unsigned int>(ringSize), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+	{
+		std::cout << "Failed to create upload staging ring\n";
+		return false;
+	}
+
+	mappedRing = static_cast<unsigned char*>(ringBuffer.Map(device, 0, VK_WHOLE_SIZE));
+
+	return mappedRing != nullptr;
+}
+
+void VKUploadManager::Dispose()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	WaitIdle();
+
+	for (unsigned int i = 0; i < MAX_BATCHES; i++)
+	{
+		if (batches[i].fence != VK_NULL_HANDLE)
+			vkDestroyFence(device, batches[i].fence, nullptr);
+
+		batches[i].fence = VK_NULL_HANDLE;
+		batches[i].cmdBuffer = VK_NULL_HANDLE;
+	}
+
+	if (cmdPool != VK_NULL_HANDLE)
+		vkDestroyCommandPool(device, cmdPool, nullptr);
+
+	ringBuffer.Dispose(device);
+
+	cmdPool = VK_NULL_HANDLE;
+	mappedRing = nullptr;
+	device = VK_NULL_HANDLE;
+}
+
+bool VKUploadManager::TryAllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+{
+	if (IsRingEmpty())
+	{
+		ringHead = 0;
+		ringTail = 0;
+	}
+
+	VkDeviceSize alignedHead = (ringHead + alignment - 1) & ~(alignment - 1);
+	bool full = ringHead == ringTail && !IsRingEmpty();
+
+	if (ringHead >= ringTail && !full)
+	{
+		// The free space is from the head to the end and from the start to the tail
+		if (alignedHead + size <= ringSize)
+		{
+			offset = alignedHead;
+			ringHead = alignedHead + size;
+			return true;
+		}
+		if (size <= ringTail)
+		{
+			offset = 0;
+			ringHead = size;
+			return true;
+		}
+	}
+	else if (!full && alignedHead + size <= ringTail)
+	{
+		offset = alignedHead;
+		ringHead = alignedHead + size;
+		return true;
+	}
+
+	return false;
+}
+
+bool VKUploadManager::AllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+{
+	if (size > ringSize)
+		return false;
+
+	while (!TryAllocateStaging(size, alignment, offset))
+	{
+		// Submit what was recorded so far so its space can be reused after it finishes
+		SubmitCurrentBatch();
+
+		if (inFlightBatches.empty())
+			return false;
+
+		RetireOldestBatch(true);
+		stats.numStalls++;
+	}
+
+	return true;
+}
+
+VKUploadManager::Batch& VKUploadManager::GetCurrentBatch()
+{
+	if (currentBatch >= 0)
+		return batches[currentBatch];
+
+	if (inFlightBatches.size() == MAX_BATCHES)
+	{
+		RetireOldestBatch(true);
+		stats.numStalls++;
+	}
+
+	// The batches are used in order so the one after the newest in flight batch is free
+	int index = inFlightBatches.empty() ? 0 : (inFlightBatches.back() + 1) % MAX_BATCHES;
+
+	Batch& batch = batches[index];
+	batch.token = ++lastToken;
+	batch.ringEnd = 0;
+	batch.bufferAcquires.clear();
+	batch.imageAcquires.clear();
+	batch.dstStages = 0;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	vkBeginCommandBuffer(batch.cmdBuffer, &beginInfo);
+
+	currentBatch = index;
+
+	return batch;
+}
+
+void VKUploadManager::Flush()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	SubmitCurrentBatch();
+}
+
+void VKUploadManager::SubmitCurrentBatch()
+{
+	if (currentBatch < 0)
+		return;
+
+	Batch& batch = batches[currentBatch];
+	batch.ringEnd = ringHead;
+
+	if (vkEndCommandBuffer(batch.cmdBuffer) != VK_SUCCESS)
+		std::cout << "Failed to end upload command buffer\n";
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.cmdBuffer;
+
+	vkResetFences(device, 1, &batch.fence);
+	allocator->FlushMappedRanges();
+
+	if (vkQueueSubmit(transferQueue, 1, &submitInfo, batch.fence) != VK_SUCCESS)
+		std::cout << "Failed to submit uploads\n";
+
+	inFlightBatches.push_back(currentBatch);
+	currentBatch = -1;
+	stats.numBatches++;
+}
+
+void VKUploadManager::RetireOldestBatch(bool wait)
+{
+	Batch& batch = batches[inFlightBatches.front()];
+
+	if (wait)
+		vkWaitForFences(device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+
+	// The acquire barriers are recorded on the next Update
+	pendingBufferAcquires.insert(pendingBufferAcquires.end(), batch.bufferAcquires.begin(), batch.bufferAcquires.end());
+	pendingImageAcquires.insert(pendingImageAcquires.end(), batch.imageAcquires.begin(), batch.imageAcquires.end());
+	pendingDstStages |= batch.dstStages;
+
+	ringTail = batch.ringEnd;
+	completedToken = batch.token;
+	inFlightBatches.pop_front();
+}
+
+UploadToken VKUploadManager::UploadBuffer(const void* data, VkDeviceSize size, VkBuffer dstBuffer, VkDeviceSize dstOffset, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage)
+{
+	if (size == 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const unsigned char* src = static_cast<const unsigned char*>(data);
+	VkDeviceSize copied = 0;
+
+	// Data bigger than the ring is copied in several chunks
+	while (copied < size)
+	{
+		VkDeviceSize chunkSize = std::min(size - copied, ringSize);
+		VkDeviceSize stagingOffset = 0;
+
+		if (!AllocateStaging(chunkSize, 4, stagingOffset))
+		{
+			std::cout << "Failed to allocate upload staging memory\n";
+			return 0;
+		}
+
+		memcpy(mappedRing + stagingOffset, src + copied, static_cast<size_t>(chunkSize));
+		ringBuffer.Flush(stagingOffset, chunkSize);
+
+		VkBufferCopy region = {};
+		region.srcOffset = stagingOffset;
+		region.dstOffset = dstOffset + copied;
+		region.size = chunkSize;
+		vkCmdCopyBuffer(GetCurrentBatch().cmdBuffer, ringBuffer.GetBuffer(), dstBuffer, 1, &region);
+
+		copied += chunkSize;
+	}
+
+	Batch& batch = GetCurrentBatch();
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.buffer = dstBuffer;
+	barrier.offset = dstOffset;
+	barrier.size = size;
+
+	if (transferFamily != graphicsFamily)
+	{
+		// Release the range to the graphics queue family
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		barrier.srcQueueFamilyIndex = transferFamily;
+		barrier.dstQueueFamilyIndex = graphicsFamily;
+		vkCmdPipelineBarrier(batch.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+		barrier.srcAccessMask = 0;
+	}
+	else
+	{
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	}
+
+	barrier.dstAccessMask = dstAccess;
+	batch.bufferAcquires.push_back(barrier);
+	batch.dstStages |= dstStage;
+
+	stats.bytesUploaded += size;
+	stats.numUploads++;
+
+	return batch.token;
+}
+
+UploadToken VKUploadManager::UploadImage(const ImageUpload& upload, const void* data, VkDeviceSize size)
+{
+	uint32_t numSlices = upload.layerCount * upload.depth;
+
+	if (size == 0 || numSlices == 0 || upload.height == 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	VkDeviceSize sliceSize = size / numSlices;
+	VkDeviceSize rowSize = sliceSize / upload.height;
+
+	if (rowSize > ringSize)
+	{
+		std::cout << "Failed to upload image, a row doesn't fit in the staging ring\n";
+		return 0;
+	}
+
+	VkImageSubresourceRange range = {};
+	range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	range.baseMipLevel = 0;
+	range.levelCount = 1;
+	range.baseArrayLayer = upload.baseArrayLayer;
+	range.layerCount = upload.layerCount;
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.image = upload.image;
+	barrier.subresourceRange = range;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	vkCmdPipelineBarrier(GetCurrentBatch().cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	const unsigned char* src = static_cast<const unsigned char*>(data);
+
+	// Images bigger than the ring are copied a few rows at a time
+	for (uint32_t slice = 0; slice < numSlices; slice++)
+	{
+		uint32_t row = 0;
+
+		while (row < upload.height)
+		{
+			uint32_t numRows = std::min(upload.height - row, static_cast<uint32_t>(ringSize / rowSize));
+			VkDeviceSize chunkSize = numRows * rowSize;
+			VkDeviceSize stagingOffset = 0;
+
+			if (!AllocateStaging(chunkSize, copyAlignment, stagingOffset))
+			{
+				std::cout << "Failed to allocate upload staging memory\n";
+				return 0;
+			}
+
+			memcpy(mappedRing + stagingOffset, src + slice * sliceSize + row * rowSize, static_cast<size_t>(chunkSize));
+			ringBuffer.Flush(stagingOffset, chunkSize);
+
+			VkBufferImageCopy region = {};
+			region.bufferOffset = stagingOffset;
+			region.bufferRowLength = 0;
+			region.bufferImageHeight = 0;
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = 0;
+			region.imageSubresource.baseArrayLayer = upload.baseArrayLayer + slice / upload.depth;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { 0, static_cast<int32_t>(row), static_cast<int32_t>(slice % upload.depth) };
+			region.imageExtent = { upload.width, numRows, 1 };
+
+			vkCmdCopyBufferToImage(GetCurrentBatch().cmdBuffer, ringBuffer.GetBuffer(), upload.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+			row += numRows;
+		}
+	}
+
+	Batch& batch = GetCurrentBatch();
+
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = upload.finalLayout;
+
+	if (transferFamily != graphicsFamily)
+	{
+		// Release the image to the graphics queue family. The acquire has to do the same layout transition
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		barrier.srcQueueFamilyIndex = transferFamily;
+		barrier.dstQueueFamilyIndex = graphicsFamily;
+		vkCmdPipelineBarrier(batch.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		barrier.srcAccessMask = 0;
+	}
+	else
+	{
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	}
+
+	barrier.dstAccessMask = upload.dstAccess;
+	batch.imageAcquires.push_back(barrier);
+	batch.dstStages |= upload.dstStage;
+
+	stats.bytesUploaded += size;
+	stats.numUploads++;
+
+	return batch.token;
+}
+
+void VKUploadManager::Update(VkCommandBuffer graphicsCmdBuffer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	SubmitCurrentBatch();
+
+	while (!inFlightBatches.empty() && vkGetFenceStatus(device, batches[inFlightBatches.front()].fence) == VK_SUCCESS)
+	{
+		RetireOldestBatch(false);
+	}
+
+	if (!pendingBufferAcquires.empty() || !pendingImageAcquires.empty())
+	{
+		// With an ownership transfer the release already waited for the copies, otherwise wait for them here. They were submitted earlier to a queue of the same family
+		VkPipelineStageFlags srcStage = transferFamily != graphicsFamily ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+		vkCmdPipelineBarrier(graphicsCmdBuffer, srcStage, pendingDstStages, 0, 0, nullptr,
+			static_cast<uint32_t>(pendingBufferAcquires.size()), pendingBufferAcquires.data(),
+			static_cast<uint32_t>(pendingImageAcquires.size()), pendingImageAcquires.data());
+
+		pendingBufferAcquires.clear();
+		pendingImageAcquires.clear();
+		pendingDstStages = 0;
+	}
+
+	readyToken = completedToken;
+}
+
+void VKUploadManager::WaitIdle()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	SubmitCurrentBatch();
+
+	while (!inFlightBatches.empty())
+	{
+		RetireOldestBatch(true);
+	}
+}
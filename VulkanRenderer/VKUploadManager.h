@@ -0,0 +1,114 @@
+#pragma once
+
+#include "VKBuffer.h"
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+class VKBase;
+
+// Increases with every batch of uploads. Token 0 is always ready
+typedef uint64_t UploadToken;
+
+struct ImageUpload
+{
+	VkImage image;
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t baseArrayLayer;
+	uint32_t layerCount;
+	VkImageLayout finalLayout;
+	VkAccessFlags dstAccess;			// How the graphics queue uses the image after the upload
+	VkPipelineStageFlags dstStage;
+};
+
+struct UploadStats
+{
+	VkDeviceSize bytesUploaded;
+	unsigned int numUploads;
+	unsigned int numBatches;
+	unsigned int numStalls;				// Times an upload had to wait for the GPU to free space in the staging ring
+};
+
+// Batches the copies of the asset uploads on the transfer queue so loading doesn't stall the graphics queue
+// The data is copied to a persistently mapped staging ring and the copies are submitted together. Each batch has a fence and the ring space is reused once it signals
+// If the transfer queue is from another family the uploads are released on the transfer queue and acquired on the graphics queue by Update
+class VKUploadManager
+{
+public:
+	VKUploadManager();
+
+	bool Init(VKBase& base, VkDeviceSize ringSize = DEFAULT_RING_SIZE);
+	void Dispose();
+
+	// The data is copied to the staging ring before returning so it can be freed right after. Returns the token to check when the upload is ready, or 0 if it failed
+	// dstAccess and dstStage are how the graphics queue uses the buffer after the upload
+	UploadToken UploadBuffer(const void* data, VkDeviceSize size, VkBuffer dstBuffer, VkDeviceSize dstOffset, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage);
+	// Copies to mip 0 of the layers. The data is tightly packed, one layer after the other
+	UploadToken UploadImage(const ImageUpload& upload, const void* data, VkDeviceSize size);
+	// Submits the copies recorded so far
+	void Flush();
+	// Submits the pending copies and records the acquire barriers of the finished batches. Must be called at the start of every graphics command buffer
+	void Update(VkCommandBuffer graphicsCmdBuffer);
+	// Blocks until every upload has finished. Update still needs to be called before they can be used
+	void WaitIdle();
+
+	// An upload is ready once its batch finished and its acquire barriers were recorded by Update
+	bool IsReady(UploadToken token) const { return token <= readyToken.load(); }
+	const UploadStats& GetStats() const { return stats; }
+
+	static const VkDeviceSize DEFAULT_RING_SIZE = 64 * 1024 * 1024;
+	static const unsigned int MAX_BATCHES = 8;
+
+private:
+	struct Batch
+	{
+		VkCommandBuffer cmdBuffer;
+		VkFence fence;
+		UploadToken token;
+		VkDeviceSize ringEnd;
+		std::vector<VkBufferMemoryBarrier> bufferAcquires;
+		std::vector<VkImageMemoryBarrier> imageAcquires;
+		VkPipelineStageFlags dstStages;
+	};
+
+	bool AllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+	bool TryAllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+	Batch& GetCurrentBatch();
+	void SubmitCurrentBatch();
+	void RetireOldestBatch(bool wait);
+	bool IsRingEmpty() const { return inFlightBatches.empty() && currentBatch < 0; }
+
+private:
+	VkDevice device;
+	VKAllocator* allocator;
+	VkQueue transferQueue;
+	VkCommandPool cmdPool;
+	uint32_t transferFamily;
+	uint32_t graphicsFamily;
+	VkDeviceSize copyAlignment;
+
+	VKBuffer ringBuffer;
+	unsigned char* mappedRing;
+	VkDeviceSize ringSize;
+	VkDeviceSize ringHead;
+	VkDeviceSize ringTail;
+
+	Batch batches[MAX_BATCHES];
+	std::deque<int> inFlightBatches;			// Oldest first
+	int currentBatch;
+	UploadToken lastToken;
+	UploadToken completedToken;
+	std::atomic<UploadToken> readyToken;
+
+	// Acquire barriers of the finished batches that still need to be recorded on the graphics queue
+	std::vector<VkBufferMemoryBarrier> pendingBufferAcquires;
+	std::vector<VkImageMemoryBarrier> pendingImageAcquires;
+	VkPipelineStageFlags pendingDstStages;
+
+	UploadStats stats;
+	std::mutex mutex;
+};
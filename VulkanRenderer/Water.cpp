@@ -12,6 +12,8 @@ Water::Water()
 	gridResolution = 128;
 	indexCount = 0;
 	set = VK_NULL_HANDLE;
+	intersectionPoints = nullptr;
+	numIntersectionPoints = 0;
 }
 
 bool Water::Load(VKRenderer* renderer, VkRenderPass renderPass)
@@ -75,11 +77,11 @@ bool Water::Load(VKRenderer* renderer, VkRenderPass renderPass)
 
 	void* mapped = vertexStagingBuffer.Map(device, 0, vertexSize);
 	memcpy(mapped, vertices.data(), (size_t)vertexSize);
-	vertexStagingBuffer.Unmap(device);
+	vertexStagingBuffer.Flush(0, vertexSize);
 
 	mapped = indexStagingBuffer.Map(device, 0, indexSize);
 	memcpy(mapped, indices.data(), (size_t)indexSize);
-	indexStagingBuffer.Unmap(device);
+	indexStagingBuffer.Flush(0, indexSize);
 
 	vb.Create(&base, vertices.size() * sizeof(glm::vec2), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	ib.Create(&base, indices.size() * sizeof(unsigned short), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
@@ -150,15 +152,20 @@ bool Water::Load(VKRenderer* renderer, VkRenderPass renderPass)
 	vertexShader.LoadShader(device, "water_disp", VK_SHADER_STAGE_VERTEX_BIT);
 	fragmentShader.LoadShader(device, "water_disp", VK_SHADER_STAGE_FRAGMENT_BIT);
 
-	if (!pipeline.Create(device, pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
+	if (!pipeline.Create(renderer->GetBase().GetPipelineCache(), pipeInfo, renderer->GetPipelineLayout(), vertexShader, fragmentShader, renderPass))
 		return false;
 
 	return true;
 }
 
-void Water::Update(const Camera& camera, float deltaTime)
+void Water::Update(const Camera& camera, float deltaTime, LinearAllocator& frameAllocator)
 {
-	intersectionPoints.clear();
+	intersectionPoints = frameAllocator.AllocateArray<glm::vec3>(MAX_INTERSECTION_POINTS, MemoryTag::RENDERING);
+	numIntersectionPoints = 0;
+
+	// Keep last frame's projector if there's no memory
+	if (!intersectionPoints)
+		return;
 
 	glm::vec3 camPos = camera.GetPosition();
 
@@ -197,7 +204,7 @@ void Water::Update(const Camera& camera, float deltaTime)
 	{
 		if (frustumCornersWorld[i].y <= waterHeight + range && frustumCornersWorld[i].y >= waterHeight - range)
 		{
-			intersectionPoints.push_back(frustumCornersWorld[i]);
+			AddIntersectionPoint(frustumCornersWorld[i]);
 		}
 	}
 
@@ -227,12 +234,12 @@ void Water::Update(const Camera& camera, float deltaTime)
 		glm::vec3 max, min;
 		if (SegmentPlaneIntersection(p0, p1, glm::vec3(0.0f, 1.0f, 0.0f), waterHeight + range, max))
 		{
-			intersectionPoints.push_back(max);
+			AddIntersectionPoint(max);
 		}
 
 		if (SegmentPlaneIntersection(p0, p1, glm::vec3(0.0f, 1.0f, 0.0f), waterHeight - range, min))
 		{
-			intersectionPoints.push_back(min);
+			AddIntersectionPoint(min);
 		}
 	}
 
@@ -247,7 +254,7 @@ void Water::Update(const Camera& camera, float deltaTime)
 	// projector screen space. The min/max x/y values
 	// are then used for the range conversion matrix.
 	// Calculate the x and y span of vVisible in projector space
-	for (size_t i = 0; i < intersectionPoints.size(); i++)
+	for (unsigned int i = 0; i < numIntersectionPoints; i++)
 	{
 		// Project the points of intersection between the frustum and the waterTop or waterBottom plane to the waterPlane
 		q.x = intersectionPoints[i].x;
@@ -371,7 +378,7 @@ void Water::IntersectFrustumEdgeWaterPlane(const glm::vec3& start, const glm::ve
 		{
 			glm::vec3 hitPos = start + dir * distance;
 
-			intersectionPoints.push_back(glm::vec3(hitPos.x, waterHeight, hitPos.z));
+			AddIntersectionPoint(glm::vec3(hitPos.x, waterHeight, hitPos.z));
 		}
 	}
 
@@ -381,11 +388,20 @@ void Water::IntersectFrustumEdgeWaterPlane(const glm::vec3& start, const glm::ve
 		{
 			glm::vec3 hitPos = start + dir * distance;
 
-			intersectionPoints.push_back(glm::vec3(hitPos.x, waterHeight, hitPos.z));
+			AddIntersectionPoint(glm::vec3(hitPos.x, waterHeight, hitPos.z));
 		}
 	}
 }
 
+void Water::AddIntersectionPoint(const glm::vec3& point)
+{
+	if (numIntersectionPoints < MAX_INTERSECTION_POINTS)
+	{
+		intersectionPoints[numIntersectionPoints] = point;
+		numIntersectionPoints++;
+	}
+}
+
 bool Water::SegmentPlaneIntersection(const glm::vec3& a, const glm::vec3& b, const glm::vec3& n, float d, glm::vec3& q)
 {
 	glm::vec3 ab = b - a;
@@ -4,6 +4,7 @@
 #include "VKShader.h"
 #include "VKPipeline.h"
 #include "Frustum.h"
+#include "Allocator.h"
 
 class Water
 {
@@ -11,7 +12,7 @@ public:
 	Water();
 
 	bool Load(VKRenderer* renderer, VkRenderPass renderPass);
-	void Update(const Camera& camera, float deltaTime);
+	void Update(const Camera& camera, float deltaTime, LinearAllocator& frameAllocator);
 	void Render(VkCommandBuffer cmdBuffer, VkPipelineLayout pipelineLayout);
 	void Dispose(VkDevice device);
 
@@ -29,6 +30,7 @@ private:
 	void IntersectFrustumWithWaterPlane(const Camera& camera);
 	void IntersectFrustumEdgeWaterPlane(const glm::vec3& start, const glm::vec3& end);
 	bool SegmentPlaneIntersection(const glm::vec3& a, const glm::vec3& b, const glm::vec3& n, float d, glm::vec3& q);
+	void AddIntersectionPoint(const glm::vec3& point);
 
 private:
 	VkDescriptorSet set;
@@ -39,7 +41,10 @@ private:
 	VKBuffer ib;
 	uint32_t indexCount;
 
-	std::vector<glm::vec3> intersectionPoints;
+	// 8 frustum corners plus the 12 frustum edges intersected with the top and bottom planes
+	static const unsigned int MAX_INTERSECTION_POINTS = 32;
+	glm::vec3* intersectionPoints;			// Allocated from the frame allocator every update
+	unsigned int numIntersectionPoints;
 	float waterHeight;
 	Plane waterTopPlane;
 	Plane waterBottomPlane;
@@ -9,13 +9,29 @@
 #include "TransformManager.h"
 #include "Allocator.h"
 #include "RenderingPath.h"
+#include "JobSystem.h"
+#include "Log.h"
+#include "Benchmark.h"
 
 #include "glm/gtc/matrix_transform.hpp"
 
 #include <iostream>
+#include <cstring>
 
-int main()
+int main(int argc, char* argv[])
 {
+	// Runs the CPU benchmarks instead of the renderer, eg. --bench transforms
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		return Benchmark::Run(argc - 2, argv + 2);
+
+	// The models are culled on the CPU unless the GPU driven path is asked for with --gpu-driven
+	bool gpuDriven = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--gpu-driven") == 0)
+			gpuDriven = true;
+	}
+
 	const unsigned int width = 960;
 	const unsigned int height = 540;
 
@@ -24,11 +40,15 @@ int main()
 	Window window;
 	window.Init(&inputManager, width, height);
 
-	Allocator allocator;
+	HeapAllocator allocator;
+	JobSystem jobSystem;
+	jobSystem.Init();
 	EntityManager entityManager;
 	TransformManager transformManager;
 	transformManager.Init(&allocator, 10);
 
+	double startupTime = glfwGetTime();
+
 	VKRenderer* renderer = new VKRenderer();
 	if (!renderer->Init(window.GetHandle(), width, height))
 	{
@@ -41,6 +61,11 @@ int main()
 	VkDevice device = base.GetDevice();
 	VkExtent2D surfaceExtent = base.GetSurfaceExtent();
 	VkSurfaceFormatKHR surfaceFormat = base.GetSurfaceFormat();
+
+	// The pipelines don't depend on each other so they are compiled by the workers while the rest is initialized. None of them is used before EndParallelCreation
+	VKPipelineCache& pipelineCache = base.GetPipelineCache();
+	double pipelinesStartTime = glfwGetTime();
+	pipelineCache.BeginParallelCreation(&jobSystem);
 	
 	RenderingPath renderingPath;
 	renderingPath.Init(renderer, width, height);
@@ -48,12 +73,19 @@ int main()
 	const VKTexture2D& storageTexture = renderingPath.GetStorageTexture();
 	
 	ModelManager modelManager;
-	if (!modelManager.Init(renderer, renderingPath.GetHDRFramebuffer().GetRenderPass()))
+	if (!modelManager.Init(renderer, renderingPath.GetHDRFramebuffer().GetRenderPass(), &jobSystem))
 	{
 		std::cout << "Failed to init model manager\n";
 		return 1;
 	}
+	if (gpuDriven && !modelManager.EnableGPUDriven(renderer))
+		std::cout << "Failed to enable GPU driven rendering, culling on the CPU\n";
 	
+	// The managers drop the components of destroyed entities and stop drawing the disabled ones
+	entityManager.AddDestroyListener<TransformManager, &TransformManager::OnEntitiesDestroyed>(&transformManager);
+	entityManager.AddDestroyListener<ModelManager, &ModelManager::OnEntitiesDestroyed>(&modelManager);
+	entityManager.AddSetEnabledListener<ModelManager, &ModelManager::OnEntitiesSetEnabled>(&modelManager);
+
 	Entity trashCanEntity = entityManager.Create();
 	Entity floorEntity = entityManager.Create();
 	transformManager.AddTransform(trashCanEntity);
@@ -61,8 +93,9 @@ int main()
 
 	transformManager.SetLocalPosition(trashCanEntity, glm::vec3(0.0f, 0.5f, 0.0f));
 
-	modelManager.AddModel(renderer, trashCanEntity, "Data/Models/trash_can.obj", "Data/Models/trash_can_d.jpg");
-	modelManager.AddModel(renderer, floorEntity, "Data/Models/floor.obj", "Data/Models/floor.jpg");
+	// The models are drawn with the placeholder until they finish loading
+	modelManager.AddModelAsync(trashCanEntity, "Data/Models/trash_can.obj", "Data/Models/trash_can_d.jpg");
+	modelManager.AddModelAsync(floorEntity, "Data/Models/floor.obj", "Data/Models/floor.jpg");
 	
 	ParticleManager particleManager;
 	if (!particleManager.Init(renderer, renderingPath.GetHDRFramebuffer().GetRenderPass()))
@@ -74,12 +107,29 @@ int main()
 		return 1;
 	}
 
+	if (!pipelineCache.EndParallelCreation())
+	{
+		std::cout << "Failed to create pipelines\n";
+		return 1;
+	}
+
+	// Compare the first run or a run after a driver update (cold) with the next ones (warm)
+	double pipelinesEndTime = glfwGetTime();
+	Log::Print(LogLevel::LEVEL_INFO, "Created %u pipelines in %.2f ms with a %s pipeline cache\n", pipelineCache.GetNumCreatedPipelines(), (pipelinesEndTime - pipelinesStartTime) * 1000.0, pipelineCache.IsWarm() ? "warm" : "cold");
+	Log::Print(LogLevel::LEVEL_INFO, "Startup took %.2f ms\n", (pipelinesEndTime - startupTime) * 1000.0);
+
 	renderingPath.PerformComputePass();
 
+	// The mip maps are generated from the uploaded images so wait for the uploads and take ownership of them first
+	VKUploadManager& uploadManager = base.GetUploadManager();
+	uploadManager.WaitIdle();
+
 	// Create mipmaps
 	VkCommandBuffer cmdBuffer = renderer->BeginMipMaps();
-	renderer->CreateMipMaps(cmdBuffer, modelManager.GetRenderModel(trashCanEntity).texture);
-	renderer->CreateMipMaps(cmdBuffer, modelManager.GetRenderModel(floorEntity).texture);
+	uploadManager.Update(cmdBuffer);
+
+	// Creates the mip maps of the model textures that are already uploaded, the others get them when they finish loading
+	modelManager.UpdateLoads(renderer, cmdBuffer);
 
 	const std::vector<ParticleSystem>& particleSystems = particleManager.GetParticlesystems();
 
@@ -91,6 +141,17 @@ int main()
 	if (!renderer->EndMipMaps(cmdBuffer))
 		return 1;
 
+	base.GetAllocator().PrintStats();
+
+	const UploadStats& uploadStats = uploadManager.GetStats();
+	Log::Print(LogLevel::LEVEL_INFO, "Uploaded %.2f mib in %u uploads, %u batches, %u stalls\n", uploadStats.bytesUploaded / (1024.0 * 1024.0), uploadStats.numUploads, uploadStats.numBatches, uploadStats.numStalls);
+
+	if (renderer->IsBindless())
+		Log::Print(LogLevel::LEVEL_INFO, "Bindless textures: %u\n", renderer->GetNumBindlessTextures());
+
+	const VKDescriptorAllocator& descriptorAllocator = renderer->GetDescriptorAllocator();
+	Log::Print(LogLevel::LEVEL_INFO, "Descriptor sets: %u in %u pools, %u set layouts\n", descriptorAllocator.GetNumAllocatedSets(), descriptorAllocator.GetNumPools(), renderer->GetDescriptorLayoutCache().GetNumLayouts());
+
 	float lastTime = 0.0f;
 	float deltaTime = 0.0f;
 
@@ -113,12 +174,18 @@ int main()
 
 		camera.Update(deltaTime, true, true);
 		renderingPath.Update(camera, deltaTime);
+		transformManager.UpdateWorldMatrices(&jobSystem);
 
 		renderer->WaitForFrameFences();
+		renderingPath.BeginFrame(modelManager, transformManager);
 		renderer->BeginCmdRecording();
 
 		unsigned int currentFrame = renderer->GetCurrentFrame();
 		VkCommandBuffer cmdBuffer = renderer->GetCurrentCmdBuffer();
+
+		// Switch the models to the assets that finished loading before their bounds are updated
+		modelManager.UpdateLoads(renderer, cmdBuffer);
+		modelManager.UpdateBounds(transformManager);
 		renderer->BeginQuery();
 
 		VkPipelineLayout pipelineLayout = renderer->GetPipelineLayout();
@@ -127,10 +194,11 @@ int main()
 		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, GLOBAL_BUFFER_SET_BINDING, 1, &globalBuffersSet, 0, nullptr);
 		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, GLOBAL_TEXTURES_SET_BINDING, 1, &globalTexturesSet, 0, nullptr);
 
-		renderingPath.PerformShadowMapPass(cmdBuffer, modelManager);
+		renderingPath.PerformCullingPass(cmdBuffer, camera, modelManager, transformManager);
+		renderingPath.PerformShadowMapPass(cmdBuffer, camera, modelManager);
 		renderer->SetCamera(camera);
 		renderingPath.PerformVolumetricCloudsPass(cmdBuffer);
-		renderingPath.PerformHDRPass(cmdBuffer, modelManager, particleManager);
+		renderingPath.PerformHDRPass(cmdBuffer, camera, modelManager, particleManager);
 		renderingPath.PerformPostProcessPass(cmdBuffer);
 		renderer->EndQuery();
 		renderer->EndCmdRecording();
@@ -138,7 +206,7 @@ int main()
 		// Update buffers
 		renderer->UpdateCameraUBO();
 		renderingPath.UpdateBuffers(camera, modelManager, transformManager, deltaTime, timeElapsed);
-		particleManager.Update(device, deltaTime);
+		particleManager.Update(deltaTime);
 
 		// Compute	
 		renderingPath.SubmitCompute();		
@@ -146,6 +214,17 @@ int main()
 		renderer->AcquireNextImage();
 		renderer->Present(renderingPath.GetGraphicsSemaphore(), renderingPath.GetComputeSemaphore());
 		renderingPath.EndFrame(camera);
+		modelManager.EndFrame();
+
+		// Print the render stats on demand, printing them every frame costs more than some of the passes
+		if (Input::WasKeyPressed(KEY_P))
+		{
+			const ModelRenderStats& modelStats = modelManager.GetStats();
+			Log::Print(LogLevel::LEVEL_INFO, "Frame time: %.3f ms\n", deltaTime * 1000.0f);
+			Log::Print(LogLevel::LEVEL_INFO, "Model draws: %u instances: %u pipeline binds: %u mesh binds: %u set binds: %u LOD instances: %u/%u/%u/%u transforms copied: %u\n", modelStats.draws, modelStats.instances, modelStats.pipelineBinds, modelStats.meshBinds, modelStats.setBinds,
+				modelStats.lodInstances[0], modelStats.lodInstances[1], modelStats.lodInstances[2], modelStats.lodInstances[3], renderingPath.GetInstanceBuffer().GetNumCopiedTransforms());
+		}
+		transformManager.ClearModifiedTransforms();
 	}
 
 	vkDeviceWaitIdle(device);
@@ -154,6 +233,7 @@ int main()
 	modelManager.Dispose(device);
 	particleManager.Dispose(device);
 	transformManager.Dispose();
+	jobSystem.Dispose();
 	renderer->Dispose();
 	delete renderer;
 